@@ -0,0 +1,102 @@
+#include <jsoncpp/json/json.h>
+
+#include "dataflow_graph.hpp"
+#include "dataflow_stages.hpp"
+#include "shutdown_coordinator.hpp"
+#include "startup_timeline.hpp"
+#include "thread_placement.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// Runs the pipeline declared in the config's "pipeline" block instead of
+// camera_stream's fixed one, and prints every stage's throughput, busy time
+// and queue fill once a second. Given a duration it stops by itself, which
+// makes it a benchmark of whatever stages are declared, e.g. a synthetic
+// source feeding a single converter into a discard stage.
+int main(int argc, char** argv) {
+  if (argc < 2 || argc > 3)
+  {
+    std::cerr << "usage: " << argv[0] << " <config-json> [seconds]\n";
+    return 1;
+  }
+  double seconds = argc > 2 ? std::stod(argv[2]) : 0.0;
+
+  Json::Value jsonConf;
+  {
+    std::ifstream fs(argv[1]);
+    if (!(fs >> jsonConf))
+    {
+      std::cerr << "Error reading config\n";
+      return 1;
+    }
+  }
+  mark_startup("config loaded");
+
+  // Blocks the signals before any thread exists, so every thread inherits the mask
+  ShutdownCoordinator shutdown;
+
+  configure_thread_placement(jsonConf["thread_placement"]);
+
+  DataflowGraph graph(jsonConf);
+  register_pipeline_stages(&graph);
+  if (!graph.build())
+  {
+    return 1;
+  }
+  mark_startup("pipeline ready");
+
+  // Capture can also end on its own, e.g. when no camera was found
+  graph.start([&shutdown]() { shutdown.request_stop(); });
+
+  std::mutex report_mutex;
+  std::condition_variable cv_report;
+  bool stopping = false;
+  std::thread report_thread([&]() {
+    auto interval = std::chrono::milliseconds(
+      std::max(100, jsonConf["pipeline"].get("report_interval_ms", 1000).asInt()));
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::duration<double>(seconds);
+
+    std::unique_lock<std::mutex> lock(report_mutex);
+    while (!cv_report.wait_for(lock, interval, [&] { return stopping; }))
+    {
+      graph.print_stats(std::cout);
+      if (seconds > 0 && std::chrono::steady_clock::now() >= deadline)
+      {
+        shutdown.request_stop();
+      }
+    }
+  });
+
+  int signum = shutdown.wait_for_stop();
+  if (signum)
+  {
+    std::cout << "Interrupt signal (" << signum << ") received.\n";
+  }
+
+  // Sources stop first, then every frame already captured goes through
+  // before the stages finish their files
+  shutdown.start_deadline(std::chrono::milliseconds(
+    jsonConf["shutdown"].get("deadline_ms", 5000).asInt()));
+
+  {
+    std::lock_guard<std::mutex> lock(report_mutex);
+    stopping = true;
+  }
+  cv_report.notify_all();
+  report_thread.join();
+
+  graph.stop();
+  graph.print_stats(std::cout);
+
+  shutdown.finished();
+  std::cout << "Shutdown complete\n";
+
+  return 0;
+}
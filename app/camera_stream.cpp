@@ -2,94 +2,459 @@
 #include <jsoncpp/json/json.h>
 
 #include "camera_capture.hpp"
-#include "pipe.hpp"
+#include "camera_frame.hpp"
+#include "control_channel.hpp"
+#include "dual_encoding.hpp"
+#include "frame_arena.hpp"
+#include "frame_metadata.hpp"
+#include "frame_source.hpp"
+#include "frame_sync.hpp"
+#include "latency_tracker.hpp"
+#include "load_shedder.hpp"
+#include "mosaic_compositor.hpp"
+#include "raw_frame_store.hpp"
+#include "shm_frame_ring.hpp"
+#include "shutdown_coordinator.hpp"
+#include "snapshot_server.hpp"
+#include "soak_monitor.hpp"
+#include "startup_timeline.hpp"
+#include "synthetic_capture.hpp"
+#include "thread_placement.hpp"
 #include "video_encoding.hpp"
 
+#include <algorithm>
 #include <chrono>
 #include <iomanip>
 #include <fstream>
 #include <iostream>
+#include <limits>
 #include <memory>
+#include <future>
 #include <atomic>
 #include <thread>
-#include <csignal>
+#include <vector>
 #include <cstdlib>
 
-PipeDataInCollection<void*>* dImageFrame;
-CameraCapture* capture;
-std::atomic<bool> capture_running = true;
+// Set once the capture thread has returned, nothing is put after that
+std::atomic<bool> capture_finished = false;
+
+// Longest the consumer sleeps without frames, bounds how late it notices the end of capture
+static const std::chrono::microseconds kIdleWait(100000);
+
+// Everything written for one camera
+struct CameraOutput {
+  std::unique_ptr<DualEncoding> video_encoder;
+  // Per-frame lines are off when the metadata is in the video and the
+  // sidecar was turned off, dropped frames are always listed
+  bool write_timestamps = true;
+  std::ofstream timestamp_log;
+  std::unique_ptr<RawFrameWriter> raw_writer;
+  // Live frames for local analysis processes
+  std::unique_ptr<ShmFrameWriter> frame_ring;
+  int64_t frame_count = 0;
+};
+
+void write_frame(CameraOutput* output,
+                 const CameraFrame& frame,
+                 int64_t set_number,
+                 cv::Mat* color_img,
+                 cv::Mat* bgra_img) {
+  bool track_latency = latency_tracking_enabled();
+  auto write_start = track_latency ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+
+  // Exposure time on the host clock, not the time the frame got here
+  int64_t timestamp_ms = frame.aligned_timestamp_us / 1000;
+
+  if (output->write_timestamps)
+  {
+    output->timestamp_log << "Frame " << output->frame_count << " timestamp: " 
+                          << timestamp_ms << " sensor: " << frame.sensor_timestamp_us
+                          << " aligned: " << frame.aligned_timestamp_us
+                          << " set: " << set_number
+                          << " frame_number: " << frame.frame_number << "\n";
+  }
+
+  color_img->data = (uchar*)frame.data;
+
+  if (output->frame_count == 0)
+  {
+    mark_startup("camera " + std::to_string(frame.camera_idx) + " first frame recorded");
+  }
 
-void signalHandler(int signum) {
-  std::cout << "Interrupt signal (" << signum << ") received.\n";
+  if (output->raw_writer)
+  {
+    output->raw_writer->write_frame(color_img->data, color_img->step, output->frame_count,
+                                    frame.aligned_timestamp_us);
+  }
 
-  capture_running = false;
+  // Cameras composed into the mosaic have no session of their own
+  if (output->video_encoder)
+  {
+    cv::cvtColor(*color_img, *bgra_img, cv::COLOR_BGR2BGRA);
 
-  if (capture) {
-    capture->stop_capture();
+    FrameMetadata metadata = make_frame_metadata(frame);
+    output->video_encoder->encode_frame(bgra_img, output->frame_count, timestamp_ms, &metadata);
   }
+  output->frame_count++;
 
-  // Put empty images to the pipe to unblock the consumer thread
-  for (int i = 0; i < dImageFrame->get_size(); i++)
+  // Flush to ensure the data is written to the file after each frame
+  if (output->write_timestamps)
   {
-    dImageFrame->put(i, nullptr);
+    output->timestamp_log.flush();
+  }
+
+  if (track_latency)
+  {
+    record_latency(LatencyStage::Consume, std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - write_start).count());
   }
 }
 
-void image_consumer(PipeDataInCollection<void*>* dImageFrame,
-                    Json::Value config) {
+// Encoder parameters that can change while recording, see DualEncoding::reconfigure
+static const char* kEncoderParams[] = {"bitrate", "encoder", "preset", "gop_size"};
+
+void image_consumer(LoadShedder* frame_queue,
+                    Json::Value config,
+                    ControlChannel* control,
+                    std::promise<void>* pipeline_ready) {
+  apply_thread_placement("consumer");
+
   int device_count = config["number_cameras"].asInt();
   int camera_width = config["image_width"].asInt();
   int camera_height = config["image_height"].asInt();
 
   Json::Value jsonVideoConf = config["video_encoding"];
-  VideoEncoding* video_encoder = new VideoEncoding(jsonVideoConf, "output", 0, -1);
+  Json::Value jsonRawConf = config["raw_recording"];
+  Json::Value jsonShmConf = config["shared_memory"];
+  int64_t publish_every = std::max(1, jsonShmConf.get("publish_every", 1).asInt());
+
+  // One encoding session per camera, or a single one for the mosaic
+  std::unique_ptr<MosaicCompositor> mosaic;
+  if (jsonVideoConf["mosaic"]["enabled"].asBool())
+  {
+    mosaic = std::make_unique<MosaicCompositor>(jsonVideoConf, device_count, camera_width, camera_height);
+  }
+
+  // Opening and warming up an encoder takes a while, sessions are brought
+  // up in parallel
+  std::vector<CameraOutput> outputs(device_count);
+  std::vector<std::thread> session_threads;
+  for (int idx = 0; idx < device_count && !mosaic; idx++)
+  {
+    session_threads.emplace_back([&outputs, &jsonVideoConf, idx]() {
+      outputs[idx].video_encoder = std::make_unique<DualEncoding>(jsonVideoConf, idx);
+    });
+  }
+  for (auto& session_thread : session_threads)
+  {
+    session_thread.join();
+  }
+
+  for (int idx = 0; idx < device_count; idx++)
+  {
+    CameraOutput& output = outputs[idx];
+    // Cameras in the mosaic have no stream of their own to carry metadata
+    output.write_timestamps = jsonVideoConf["frame_metadata"].get("timestamp_sidecar", true).asBool() ||
+                              !output.video_encoder || !output.video_encoder->embeds_metadata();
+    output.timestamp_log.open(jsonVideoConf["output_timestamp_path"].asString() + \
+                              "_session_" + std::to_string(idx) + ".txt");
+
+    if (jsonRawConf["enabled"].asBool())
+    {
+      output.raw_writer = std::make_unique<RawFrameWriter>(
+        jsonRawConf["output_path"].asString() + "_" + std::to_string(idx) + ".raw",
+        camera_width, camera_height, 3,
+        (size_t)jsonRawConf.get("write_buffer_mb", 64).asInt() * 1024 * 1024);
+      if (!output.raw_writer->open())
+      {
+        output.raw_writer.reset();
+      }
+    }
+
+    // Created here, so the ring's pages are first touched on the consumer's CPUs
+    if (jsonShmConf["enabled"].asBool())
+    {
+      output.frame_ring = std::make_unique<ShmFrameWriter>(
+        "/" + jsonShmConf.get("name_prefix", "camera_stream").asString() + "_" + std::to_string(idx),
+        idx, camera_width, camera_height, 3, jsonShmConf.get("slots", 8).asInt());
+      if (!output.frame_ring->open())
+      {
+        output.frame_ring.reset();
+      }
+    }
+  }
+
+  if (control)
+  {
+    for (const char* param : kEncoderParams)
+    {
+      control->add_handler(param, [&, param](int index, const std::string& value, std::string* error) {
+        if (mosaic)
+        {
+          return mosaic->reconfigure(param, value, error);
+        }
+        if (index >= device_count)
+        {
+          *error = "no session " + std::to_string(index);
+          return false;
+        }
+        for (int idx = 0; idx < device_count; idx++)
+        {
+          if ((index < 0 || index == idx) && !outputs[idx].video_encoder->reconfigure(param, value, error))
+          {
+            return false;
+          }
+        }
+        return true;
+      });
+    }
+  }
 
   cv::Mat color_img(camera_height, camera_width, CV_8UC3);
-  cv::Mat bgra_img(camera_height, camera_width, CV_8UC4);
+  FrameArena consumer_arena(FrameArena::get_frame_size(AV_PIX_FMT_BGRA, camera_width, camera_height) +
+                            FrameArena::kAlignment, "consumer");
+  cv::Mat bgra_img = consumer_arena.allocate_mat(camera_height, camera_width, CV_8UC4);
+
+  std::vector<ClockAligner> aligners(device_count);
+
+  // Without synchronization every camera is encoded as its frames arrive,
+  // the mosaic always needs complete sets
+  Json::Value jsonSyncConf = config["sync"];
+  std::unique_ptr<FrameSynchronizer> synchronizer;
+  if (mosaic || (jsonSyncConf["enabled"].asBool() && device_count > 1))
+  {
+    synchronizer = std::make_unique<FrameSynchronizer>(jsonSyncConf, device_count,
+                                                       (size_t)camera_width * camera_height * 3);
+  }
+
+  // Synthetic cameras number their frames by exposure, so a set mixing
+  // frame numbers was grouped wrongly
+  bool check_frame_numbers = config.get("source", "ximea").asString() == "synthetic";
+  int64_t mismatched_sets = 0;
+  auto last_report = std::chrono::steady_clock::now();
+
+  // Capture starts once everything above is ready, so the first frame is
+  // recorded right away
+  mark_startup("recording pipeline ready");
+  pipeline_ready->set_value();
+  bool timeline_printed = false;
+
+  auto write_sets = [&](int64_t now_us) {
+    FrameSet frame_set;
+    while (synchronizer->pop_set(&frame_set, now_us))
+    {
+      int64_t set_frame_number = -1;
+      bool mismatched = false;
+      for (const CameraFrame& frame : frame_set.frames)
+      {
+        if (!frame.data)
+        {
+          continue;
+        }
+        mismatched |= set_frame_number >= 0 && frame.frame_number != set_frame_number;
+        set_frame_number = frame.frame_number;
+
+        write_frame(&outputs[frame.camera_idx], frame, frame_set.set_number, &color_img, &bgra_img);
+      }
+      mismatched_sets += check_frame_numbers && mismatched;
 
-  int frame_count = 0;
-  std::ofstream timestamp_log(jsonVideoConf["output_timestamp_path"].asString() + \
-                              "_session_" + std::to_string(0) + ".txt");
+      if (mosaic)
+      {
+        mosaic->encode_set(frame_set);
+      }
+
+      synchronizer->release_set(frame_set);
+    }
+  };
+
+  // Frames shed before encoding or dropped by the synchronizer are listed
+  // in the camera's timestamp file by frame number
+  std::vector<DroppedFrame> dropped_frames;
+  auto write_dropped = [&]() {
+    frame_queue->take_dropped_frames(&dropped_frames);
+    if (synchronizer)
+    {
+      synchronizer->take_dropped_frames(&dropped_frames);
+    }
+    for (const DroppedFrame& dropped : dropped_frames)
+    {
+      outputs[dropped.camera_idx].timestamp_log << "Dropped frame_number: " << dropped.frame_number
+                                                << " reason: " << dropped.reason << "\n";
+      // Nothing else flushes the file without per-frame lines
+      if (!outputs[dropped.camera_idx].write_timestamps)
+      {
+        outputs[dropped.camera_idx].timestamp_log.flush();
+      }
+    }
+    dropped_frames.clear();
+  };
 
-  while (capture_running)
+  while (true)
   {
-    for (size_t idx = 0; idx < device_count; idx++)
+    // Read before fetching: once capture has finished, a round that finds
+    // every queue empty means all frames have been consumed
+    bool draining = capture_finished;
+    bool received = false;
+
+    // Sleeps until capture queues a frame or an incomplete set times out
+    std::chrono::microseconds timeout = kIdleWait;
+    if (synchronizer)
     {
-      void* rawData = dImageFrame->fetch(idx);
-      if (rawData == nullptr)
+      int64_t wait_us = synchronizer->get_wait_us(std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count());
+      if (wait_us >= 0)
+      {
+        timeout = std::min(timeout, std::chrono::microseconds(wait_us));
+      }
+    }
+    frame_queue->wait_for_frames(timeout);
+    for (int idx : frame_queue->get_service_order())
+    {
+      CameraFrame frame;
+      if (!frame_queue->pop(idx, &frame))
       {
-        std::cout << "Received null data, exiting consumer loop...\n";
         continue;
       }
+      received = true;
+
+      if (latency_tracking_enabled())
+      {
+        record_latency(LatencyStage::Queue, std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::system_clock::now().time_since_epoch()).count() - frame.host_timestamp_us);
+      }
+
+      frame.aligned_timestamp_us = aligners[idx].align(frame.sensor_timestamp_us,
+                                                       frame.host_timestamp_us);
+
+      // Every frame that reached the consumer, also ones the synchronizer drops
+      if (outputs[idx].frame_ring && frame.frame_number % publish_every == 0)
+      {
+        ShmFrameInfo info;
+        info.camera_idx = idx;
+        info.frame_number = frame.frame_number;
+        info.sensor_timestamp_us = frame.sensor_timestamp_us;
+        info.aligned_timestamp_us = frame.aligned_timestamp_us;
+        info.exposure_us = frame.exposure_us;
+        info.gain_db = frame.gain_db;
+        outputs[idx].frame_ring->publish((const uint8_t*)frame.data, info);
+      }
+
+      if (synchronizer)
+      {
+        synchronizer->push(frame);
+      }
+      else
+      {
+        write_frame(&outputs[idx], frame, -1, &color_img, &bgra_img);
+      }
+    }
 
-      // Sampling timestamp
-      auto now = std::chrono::system_clock::now();
-      auto epoch_time = std::chrono::duration_cast<std::chrono::milliseconds>(now.time_since_epoch()).count();
+    if (draining && !received)
+    {
+      break;
+    }
 
-      timestamp_log << "Frame " << frame_count << " timestamp: " 
-                  << epoch_time << "\n";
+    if (!timeline_printed)
+    {
+      timeline_printed = std::all_of(outputs.begin(), outputs.end(),
+                                     [](const CameraOutput& output) { return output.frame_count > 0; });
+      if (timeline_printed)
+      {
+        print_startup_timeline();
+      }
+    }
 
+    if (synchronizer)
+    {
+      write_sets(std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count());
+    }
+    write_dropped();
 
-      color_img.data = (uchar*)rawData;
-      cv::cvtColor(color_img, bgra_img, cv::COLOR_BGR2BGRA);
+    // Log every second
+    auto now = std::chrono::steady_clock::now();
+    if (now - last_report < std::chrono::seconds(1))
+    {
+      continue;
+    }
+    last_report = now;
 
-      video_encoder->encode_frame_to_file(&bgra_img, frame_count);
-      frame_count++;
+    for (int idx = 0; idx < device_count; idx++)
+    {
+      int64_t shed_frames = frame_queue->get_dropped_frames(idx);
+      if (shed_frames > 0)
+      {
+        std::cout << "Load shedding: camera " << idx << " dropped " << shed_frames << " of "
+                  << frame_queue->get_offered_frames(idx) << " frames\n";
+      }
 
-      // Flush to ensure the data is written to the file after each frame
-      timestamp_log.flush();
+      int64_t skipped_frames = frame_queue->get_skipped_frames(idx);
+      if (skipped_frames > 0)
+      {
+        std::cout << "Camera " << idx << " skipped " << skipped_frames
+                  << " frames before capture (USB bandwidth or SDK queue)\n";
+      }
+    }
 
-      // cv::imshow("frame", color_img);
-      // cv::waitKey(1);
+    if (synchronizer)
+    {
+      std::cout << "Sync: " << synchronizer->get_sets() << " sets, "
+                << synchronizer->get_partial_sets() << " partial, "
+                << synchronizer->get_dropped_frames() << " frames dropped";
+      if (check_frame_numbers)
+      {
+        std::cout << ", " << mismatched_sets << " mismatched";
+      }
+      std::cout << "\n";
+
+      for (int idx = 0; idx < device_count; idx++)
+      {
+        std::cout << "  camera " << idx << " clock offset " << (int64_t)aligners[idx].get_offset_us()
+                  << " us, drift " << aligners[idx].get_drift_ppm() << " ppm\n";
+      }
+    }
+  }
+
+  // No more frames will arrive, so pending sets are written as they are
+  // instead of waiting out max_wait_us
+  if (synchronizer)
+  {
+    write_sets(std::numeric_limits<int64_t>::max());
+  }
+  write_dropped();
+
+  // Also covers cameras that never delivered a frame
+  print_startup_timeline();
+
+  // The handlers refer to the encoders, which are finished next
+  if (control)
+  {
+    for (const char* param : kEncoderParams)
+    {
+      control->remove_handler(param);
     }
   }
-  av_write_trailer(video_encoder->get_format_ctx());
 
-  timestamp_log.close();
+  if (mosaic)
+  {
+    mosaic->finish();
+  }
 
-  std::cout << "Video session " << "0" << " finished encoding.\n";
+  for (CameraOutput& output : outputs)
+  {
+    if (output.video_encoder)
+    {
+      output.video_encoder->finish();
+    }
+
+    output.timestamp_log.close();
+
+    if (output.raw_writer)
+    {
+      output.raw_writer->close();
+    }
+  }
 
-  delete video_encoder;
 }
 
 int main(int argc, char** argv) {
@@ -107,31 +472,129 @@ int main(int argc, char** argv) {
       std::cerr << "Error reading config\n";
     }
   }
+  mark_startup("config loaded");
 
-  signal(SIGINT, signalHandler);
+  // Blocks the signals before any thread exists, so every thread inherits the mask
+  ShutdownCoordinator shutdown;
+
+  configure_thread_placement(jsonConf["thread_placement"]);
+
+  // A soak run records the whole pipeline from synthetic cameras unless
+  // "soak" names another source, and ends by itself after its duration
+  Json::Value jsonSoakConf = jsonConf["soak"];
+  bool soak = jsonSoakConf["enabled"].asBool();
+  if (soak)
+  {
+    jsonConf["source"] = jsonSoakConf.get("source", "synthetic").asString();
+  }
 
   int num_cameras = jsonConf["number_cameras"].asInt();
 
-  dImageFrame = new PipeDataInCollection<void*>(num_cameras);
+  // Capture hands frames over without waiting, backlog is shed by policy.
+  // Snapshots read the last frame the consumer is done with from its buffer.
+  Json::Value jsonSnapshotConf = jsonConf["snapshot"];
+  bool snapshots = jsonSnapshotConf["enabled"].asBool();
+  auto frame_queue = std::make_unique<LoadShedder>(jsonConf["load_shedding"], num_cameras,
+                                                   (size_t)jsonConf["image_width"].asInt() *
+                                                   jsonConf["image_height"].asInt() * 3,
+                                                   snapshots);
+
+  std::unique_ptr<SnapshotServer> snapshot_server;
+  if (snapshots)
+  {
+    snapshot_server = std::make_unique<SnapshotServer>(jsonSnapshotConf, frame_queue.get(), num_cameras);
+  }
+
+  // Camera parameters go to the capture threads, encoder parameters are
+  // registered by the consumer once its sessions exist
+  std::unique_ptr<ControlChannel> control;
+  Json::Value jsonControlConf = jsonConf["control"];
+  if (jsonControlConf["enabled"].asBool())
+  {
+    control = std::make_unique<ControlChannel>(
+      jsonControlConf.get("socket_path", "/tmp/camera_stream.sock").asString());
+  }
+
+  // Encoders and muxers are opened while the cameras are being opened and
+  // configured, acquisition starts once both are done
+  std::promise<void> pipeline_ready;
+  std::thread consumer_thread = std::thread(&image_consumer, frame_queue.get(), jsonConf,
+                                            control.get(), &pipeline_ready);
+
+  std::unique_ptr<FrameSource> capture;
+  if (jsonConf.get("source", "ximea").asString() == "synthetic")
+  {
+    capture = std::make_unique<SyntheticCapture>(frame_queue.get(), jsonConf);
+  }
+  else
+  {
+    capture = std::make_unique<CameraCapture>(frame_queue.get(), jsonConf);
+  }
+  mark_startup("capture ready");
+
+  if (control)
+  {
+    for (const char* param : {"exposure", "gain", "offset_x", "offset_y"})
+    {
+      control->add_handler(param, [capture = capture.get(), param](int index, const std::string& value, std::string* error) {
+        return capture->set_param(index, param, value, error);
+      });
+    }
+  }
 
-  capture = new CameraCapture(dImageFrame, jsonConf);
+  pipeline_ready.get_future().wait();
 
-  std::thread capture_thread = std::thread(&CameraCapture::start_capture, capture);
+  // Capture can also end on its own, e.g. when no camera was found
+  std::unique_ptr<SoakMonitor> soak_monitor;
+  if (soak)
+  {
+    soak_monitor = std::make_unique<SoakMonitor>(jsonSoakConf, [&shutdown]() { shutdown.request_stop(); });
+  }
 
-  std::thread consumer_thread = std::thread(&image_consumer, dImageFrame, jsonConf);
+  std::thread capture_thread = std::thread([capture = capture.get(), &shutdown]() {
+    capture->start_capture();
+    shutdown.request_stop();
+  });
 
-  if (capture_thread.joinable())
+  int signum = shutdown.wait_for_stop();
+  if (signum)
   {
-    capture_thread.join();
+    std::cout << "Interrupt signal (" << signum << ") received.\n";
   }
 
-  if (consumer_thread.joinable())
+  // Draining and finalizing the files is not part of the steady state
+  if (soak_monitor)
   {
-    consumer_thread.join();
+    soak_monitor->stop();
   }
 
-  delete dImageFrame;
-  delete capture;
+  // Stop capture first, then let the consumer drain the pipes and the
+  // encoders before the files are finalized. A second signal or a missed
+  // deadline exits without waiting.
+  shutdown.start_deadline(std::chrono::milliseconds(
+    jsonConf["shutdown"].get("deadline_ms", 5000).asInt()));
+
+  capture->stop_capture();
+  capture_thread.join();
+
+  capture_finished = true;
+  consumer_thread.join();
+
+  // The camera handlers refer to the capture, snapshots to the frame buffers
+  control.reset();
+  snapshot_server.reset();
+
+  // The capture refers to the frame queue
+  capture.reset();
+  frame_queue.reset();
+
+  shutdown.finished();
+  std::cout << "Shutdown complete\n";
+
+  if (soak_monitor && !soak_monitor->evaluate())
+  {
+    return 1;
+  }
 
   return 0;
 }
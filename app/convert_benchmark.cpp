@@ -0,0 +1,205 @@
+#include <opencv2/opencv.hpp>
+#include <libyuv.h>
+
+#include "pixel_convert.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+// Checks every conversion kernel against libyuv (OpenCV for Bayer) and
+// times each instruction set variant next to it. Kernels without a
+// reference are checked against their baseline variant.
+struct ConversionCase {
+  PixelFormat src;
+  PixelFormat dst;
+  // Largest difference per sample accepted, libyuv rounds differently in
+  // its vector code
+  int tolerance;
+  // Pixels next to the border excluded from the comparison
+  int border;
+  std::function<void(const Image& src, const Image& dst)> reference;
+};
+
+std::vector<uint8_t> make_input(PixelFormat format, int width, int height, std::mt19937* rng) {
+  std::vector<uint8_t> data(image_size(format, width, height));
+  for (uint8_t& value : data)
+  {
+    value = (*rng)();
+  }
+
+  // Significant bits only: 12 at the bottom for RAW16, 10 at the top for P010
+  uint16_t* samples = (uint16_t*)data.data();
+  for (size_t i = 0; i < data.size() / 2; i++)
+  {
+    if (format == PixelFormat::RAW16)
+    {
+      samples[i] &= 0x0fff;
+    }
+    else if (format == PixelFormat::P010)
+    {
+      samples[i] &= 0xffc0;
+    }
+  }
+  return data;
+}
+
+// Largest difference between two converted images, border pixels of packed
+// images excluded
+int max_difference(const Image& a, const Image& b, int border) {
+  int bytes_per_pixel = a.format == PixelFormat::BGRA ? 4 : 3;
+  bool yuv420 = a.format == PixelFormat::NV12 || a.format == PixelFormat::I420;
+
+  int difference = 0;
+  auto compare_plane = [&](int plane, int rows, int first_byte, int last_byte) {
+    for (int y = 0; y < rows; y++)
+    {
+      const uint8_t* row_a = a.planes[plane] + (size_t)y * a.strides[plane];
+      const uint8_t* row_b = b.planes[plane] + (size_t)y * b.strides[plane];
+      for (int x = first_byte; x < last_byte; x++)
+      {
+        difference = std::max(difference, std::abs(row_a[x] - row_b[x]));
+      }
+    }
+  };
+
+  if (!yuv420)
+  {
+    for (int y = border; y < a.height - border; y++)
+    {
+      const uint8_t* row_a = a.planes[0] + (size_t)y * a.strides[0];
+      const uint8_t* row_b = b.planes[0] + (size_t)y * b.strides[0];
+      for (int x = border * bytes_per_pixel; x < (a.width - border) * bytes_per_pixel; x++)
+      {
+        difference = std::max(difference, std::abs(row_a[x] - row_b[x]));
+      }
+    }
+    return difference;
+  }
+
+  int chroma_width = (a.width + 1) / 2;
+  int chroma_height = (a.height + 1) / 2;
+  compare_plane(0, a.height, 0, a.width);
+  if (a.format == PixelFormat::NV12)
+  {
+    compare_plane(1, chroma_height, 0, chroma_width * 2);
+  }
+  else
+  {
+    compare_plane(1, chroma_height, 0, chroma_width);
+    compare_plane(2, chroma_height, 0, chroma_width);
+  }
+  return difference;
+}
+
+double time_ms(const std::function<void()>& run, int iterations) {
+  auto start = std::chrono::high_resolution_clock::now();
+  for (int i = 0; i < iterations; i++)
+  {
+    run();
+  }
+  std::chrono::duration<double, std::milli> elapsed = std::chrono::high_resolution_clock::now() - start;
+  return elapsed.count() / iterations;
+}
+
+int main(int argc, char** argv) {
+  int width = argc > 1 ? std::stoi(argv[1]) : 1920;
+  int height = argc > 2 ? std::stoi(argv[2]) : 1080;
+  int iterations = argc > 3 ? std::stoi(argv[3]) : 100;
+
+  using PF = PixelFormat;
+  std::vector<ConversionCase> cases = {
+    {PF::RGB24, PF::BGR24, 0, 0, [](const Image& s, const Image& d) {
+      libyuv::RAWToRGB24(s.planes[0], s.strides[0], d.planes[0], d.strides[0], s.width, s.height); }},
+    {PF::BGRA, PF::BGR24, 0, 0, [](const Image& s, const Image& d) {
+      libyuv::ARGBToRGB24(s.planes[0], s.strides[0], d.planes[0], d.strides[0], s.width, s.height); }},
+    {PF::BGR24, PF::BGRA, 0, 0, [](const Image& s, const Image& d) {
+      libyuv::RGB24ToARGB(s.planes[0], s.strides[0], d.planes[0], d.strides[0], s.width, s.height); }},
+    {PF::NV12, PF::BGR24, 3, 0, [](const Image& s, const Image& d) {
+      libyuv::NV12ToRGB24(s.planes[0], s.strides[0], s.planes[1], s.strides[1],
+                          d.planes[0], d.strides[0], s.width, s.height); }},
+    {PF::NV12, PF::BGRA, 3, 0, [](const Image& s, const Image& d) {
+      libyuv::NV12ToARGB(s.planes[0], s.strides[0], s.planes[1], s.strides[1],
+                         d.planes[0], d.strides[0], s.width, s.height); }},
+    {PF::I420, PF::BGR24, 3, 0, [](const Image& s, const Image& d) {
+      libyuv::I420ToRGB24(s.planes[0], s.strides[0], s.planes[1], s.strides[1], s.planes[2], s.strides[2],
+                          d.planes[0], d.strides[0], s.width, s.height); }},
+    {PF::I420, PF::BGRA, 3, 0, [](const Image& s, const Image& d) {
+      libyuv::I420ToARGB(s.planes[0], s.strides[0], s.planes[1], s.strides[1], s.planes[2], s.strides[2],
+                         d.planes[0], d.strides[0], s.width, s.height); }},
+    {PF::BGRA, PF::NV12, 2, 0, [](const Image& s, const Image& d) {
+      libyuv::ARGBToNV12(s.planes[0], s.strides[0], d.planes[0], d.strides[0],
+                         d.planes[1], d.strides[1], s.width, s.height); }},
+    {PF::BGRA, PF::I420, 2, 0, [](const Image& s, const Image& d) {
+      libyuv::ARGBToI420(s.planes[0], s.strides[0], d.planes[0], d.strides[0], d.planes[1], d.strides[1],
+                         d.planes[2], d.strides[2], s.width, s.height); }},
+    {PF::NV12, PF::I420, 0, 0, [](const Image& s, const Image& d) {
+      libyuv::NV12ToI420(s.planes[0], s.strides[0], s.planes[1], s.strides[1], d.planes[0], d.strides[0],
+                         d.planes[1], d.strides[1], d.planes[2], d.strides[2], s.width, s.height); }},
+    {PF::I420, PF::NV12, 0, 0, [](const Image& s, const Image& d) {
+      libyuv::I420ToNV12(s.planes[0], s.strides[0], s.planes[1], s.strides[1], s.planes[2], s.strides[2],
+                         d.planes[0], d.strides[0], d.planes[1], d.strides[1], s.width, s.height); }},
+    // OpenCV names Bayer patterns by their second row, RGGB is its BayerBG.
+    // Borders are filled differently.
+    {PF::RAW8, PF::BGR24, 1, 1, [](const Image& s, const Image& d) {
+      cv::Mat bayer(s.height, s.width, CV_8UC1, s.planes[0], s.strides[0]);
+      cv::Mat bgr(d.height, d.width, CV_8UC3, d.planes[0], d.strides[0]);
+      cv::cvtColor(bayer, bgr, cv::COLOR_BayerBG2BGR); }},
+    {PF::RAW16, PF::BGR24, 0, 0, nullptr},
+    {PF::P010, PF::BGR24, 0, 0, nullptr},
+    {PF::P010, PF::NV12, 0, 0, nullptr},
+    {PF::BGR24, PF::NV12, 0, 0, nullptr},
+  };
+
+  std::cout << width << "x" << height << ", " << iterations << " iterations, CPU supports "
+            << simd_level_name(detect_simd_level()) << "\n\n";
+
+  std::mt19937 rng(1);
+  bool all_passed = true;
+  for (const ConversionCase& test : cases)
+  {
+    std::vector<uint8_t> input = make_input(test.src, width, height, &rng);
+    Image src = make_image(test.src, width, height, input.data());
+
+    std::vector<uint8_t> expected_data(image_size(test.dst, width, height));
+    Image expected = make_image(test.dst, width, height, expected_data.data());
+
+    std::cout << pixel_format_name(test.src) << " -> " << pixel_format_name(test.dst) << "\n";
+    if (test.reference)
+    {
+      double reference_ms = time_ms([&] { test.reference(src, expected); }, iterations);
+      std::cout << "  " << std::left << std::setw(11) << "reference" << reference_ms << " ms\n";
+    }
+    else
+    {
+      ConversionKernel(test.src, test.dst, SimdLevel::Baseline).convert(src, expected);
+    }
+
+    for (int level = (int)SimdLevel::Baseline; level <= (int)detect_simd_level(); level++)
+    {
+      ConversionKernel kernel(test.src, test.dst, (SimdLevel)level);
+      if (kernel.get_level() != (SimdLevel)level)
+      {
+        continue;
+      }
+
+      std::vector<uint8_t> output_data(expected_data.size());
+      Image output = make_image(test.dst, width, height, output_data.data());
+      double kernel_ms = time_ms([&] { kernel.convert(src, output); }, iterations);
+
+      int difference = max_difference(expected, output, test.border);
+      bool passed = difference <= test.tolerance;
+      all_passed &= passed;
+      std::cout << "  " << std::left << std::setw(11) << simd_level_name(kernel.get_level()) << kernel_ms << " ms, max difference " << difference << (passed ? "" : "  FAILED") << "\n";
+    }
+  }
+
+  std::cout << (all_passed ? "\nAll kernels match\n" : "\nSome kernels do not match\n");
+  return all_passed ? 0 : 1;
+}
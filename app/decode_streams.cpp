@@ -0,0 +1,128 @@
+extern "C" {
+  #include <libavcodec/avcodec.h>
+  #include <libavformat/avformat.h>
+}
+
+#include <jsoncpp/json/json.h>
+
+#include "decode_pool.hpp"
+#include "video_decoding.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Decodes several recordings at once on one shared decode pool, the load of
+// a review station playing back every camera of a session
+struct Stream {
+  std::string video_file;
+  AVFormatContext* format_ctx = nullptr;
+  int stream_idx = -1;
+  std::unique_ptr<VideoDecoding> decoder;
+  std::atomic<int64_t> frames = 0;
+};
+
+// Demuxes on its own thread, submit_packet() blocks while the decoder is
+// max_queued_packets behind
+void read_stream(Stream* stream) {
+  AVPacket* pkt = av_packet_alloc();
+  while (av_read_frame(stream->format_ctx, pkt) == 0)
+  {
+    if (pkt->stream_index == stream->stream_idx)
+    {
+      stream->decoder->submit_packet(pkt);
+    }
+    av_packet_unref(pkt);
+  }
+  av_packet_free(&pkt);
+
+  stream->decoder->submit_packet(NULL);
+  stream->decoder->wait_finished();
+}
+
+int main(int argc, char** argv) {
+  if (argc < 3)
+  {
+    std::cerr << "usage: " << argv[0] << " <config-json> <video-file>...\n";
+    return 1;
+  }
+
+  Json::Value jsonConf;
+  {
+    std::ifstream fs(argv[1]);
+    if (!(fs >> jsonConf))
+    {
+      std::cerr << "Error reading config\n";
+      return 1;
+    }
+  }
+
+  int num_streams = argc - 2;
+  DecodePool pool(jsonConf["decode_pool"], num_streams);
+
+  std::vector<std::unique_ptr<Stream>> streams;
+  for (int idx = 0; idx < num_streams; idx++)
+  {
+    auto stream = std::make_unique<Stream>();
+    stream->video_file = argv[idx + 2];
+
+    if (avformat_open_input(&stream->format_ctx, stream->video_file.c_str(), NULL, NULL) < 0 ||
+        avformat_find_stream_info(stream->format_ctx, NULL) < 0)
+    {
+      std::cerr << "Could not open " << stream->video_file << std::endl;
+      return 1;
+    }
+
+    stream->stream_idx = av_find_best_stream(stream->format_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    if (stream->stream_idx < 0)
+    {
+      std::cerr << "No video stream in " << stream->video_file << std::endl;
+      return 1;
+    }
+
+    Stream* counted = stream.get();
+    stream->decoder = std::make_unique<VideoDecoding>(
+      jsonConf["video_encoding"], stream->format_ctx->streams[stream->stream_idx]->codecpar, idx, &pool,
+      [counted](const AVFrame*) { counted->frames++; });
+    if (!stream->decoder->is_open())
+    {
+      std::cerr << "No decoder for " << stream->video_file << std::endl;
+      return 1;
+    }
+    streams.push_back(std::move(stream));
+  }
+
+  auto start = std::chrono::high_resolution_clock::now();
+
+  std::vector<std::thread> readers;
+  for (auto& stream : streams)
+  {
+    readers.emplace_back(read_stream, stream.get());
+  }
+  for (auto& reader : readers)
+  {
+    reader.join();
+  }
+
+  std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+
+  int64_t total_frames = 0;
+  for (auto& stream : streams)
+  {
+    std::cout << stream->video_file << ": " << stream->frames << " frames with "
+              << stream->decoder->get_decoder_name() << ", "
+              << stream->frames / elapsed.count() << " fps\n";
+    total_frames += stream->frames;
+    stream->decoder.reset();
+    avformat_close_input(&stream->format_ctx);
+  }
+  std::cout << num_streams << " streams, " << total_frames / elapsed.count() << " fps in total on "
+            << pool.get_workers() << " workers\n";
+
+  return 0;
+}
@@ -0,0 +1,125 @@
+#include <opencv2/opencv.hpp>
+#include <jsoncpp/json/json.h>
+
+#include "video_encoding.hpp"
+
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+
+// Draws a moving gradient with a bright square so that consecutive frames
+// differ in a way that resembles a static rig with a small moving region
+void generate_frame(cv::Mat* bgra, int64_t frame_idx) {
+  for (int y = 0; y < bgra->rows; y++)
+  {
+    uint8_t* row = bgra->ptr<uint8_t>(y);
+    for (int x = 0; x < bgra->cols; x++)
+    {
+      row[4 * x + 0] = (uint8_t)(x + frame_idx);
+      row[4 * x + 1] = (uint8_t)(y);
+      row[4 * x + 2] = (uint8_t)(x ^ y);
+      row[4 * x + 3] = 255;
+    }
+  }
+
+  int box = bgra->rows / 8;
+  int box_x = (frame_idx * 4) % (bgra->cols - box);
+  int box_y = bgra->rows / 2 - box / 2;
+  for (int y = box_y; y < box_y + box; y++)
+  {
+    uint8_t* row = bgra->ptr<uint8_t>(y);
+    for (int x = box_x; x < box_x + box; x++)
+    {
+      row[4 * x + 0] = 255;
+      row[4 * x + 1] = 255;
+      row[4 * x + 2] = 255;
+    }
+  }
+}
+
+void run_benchmark(const std::string& label,
+                   Json::Value jsonVideoConf,
+                   const std::vector<cv::Mat>& frames,
+                   int num_frames) {
+  jsonVideoConf["output_video_path"] = jsonVideoConf["output_video_path"].asString() + "_bench_" + label;
+
+  std::unique_ptr<VideoEncoding> video_encoder =
+    std::make_unique<VideoEncoding>(jsonVideoConf, "output", 0, -1);
+  if (!video_encoder->is_open())
+  {
+    fprintf(stderr, "Could not open encoder %s\n", jsonVideoConf["encoder"].asString().c_str());
+    exit(1);
+  }
+
+  int width = video_encoder->get_width();
+  int height = video_encoder->get_height();
+
+  auto start = std::chrono::high_resolution_clock::now();
+
+  for (int64_t frame_count = 0; frame_count < num_frames; frame_count++)
+  {
+    cv::Mat frame = frames[frame_count % frames.size()];
+    video_encoder->encode_frame_to_file(&frame, frame_count);
+  }
+  video_encoder->finish_file();
+
+  std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+
+  int64_t output_bytes = std::filesystem::file_size(video_encoder->get_output_file());
+  double raw_bytes = (double)width * height * 3 * num_frames;
+
+  std::cout << "[" << label << "] "
+            << num_frames << " frames in " << elapsed.count() << " s, "
+            << num_frames / elapsed.count() << " fps, "
+            << raw_bytes / elapsed.count() / (1024 * 1024) << " MB/s input, "
+            << output_bytes / (1024.0 * 1024.0) << " MB output, "
+            << "compression ratio " << raw_bytes / output_bytes << std::endl;
+}
+
+int main(int argc, char** argv) {
+  if (argc < 2)
+  {
+    std::cerr << "usage: " << argv[0] << " <config-json> [num-frames]\n";
+    return 1;
+  }
+
+  Json::Value jsonConf;
+  {
+    std::ifstream fs(argv[1]);
+    if (!(fs >> jsonConf))
+    {
+      std::cerr << "Error reading config\n";
+      return 1;
+    }
+  }
+
+  int num_frames = argc > 2 ? std::stoi(argv[2]) : 1200;
+
+  Json::Value jsonVideoConf = jsonConf["video_encoding"];
+  int width = jsonVideoConf["stream_width"].asInt();
+  int height = jsonVideoConf["stream_height"].asInt();
+
+  // Pre-render a second worth of frames so frame generation is not measured
+  std::vector<cv::Mat> frames;
+  for (int i = 0; i < jsonVideoConf["frame_rate"].asInt(); i++)
+  {
+    cv::Mat bgra(height, width, CV_8UC4);
+    generate_frame(&bgra, i);
+    frames.push_back(bgra);
+  }
+
+  std::cout << "Target capture rate: " << jsonVideoConf["frame_rate"].asInt() << " fps\n";
+
+  Json::Value jsonLossyConf = jsonVideoConf;
+  jsonLossyConf["lossless"]["enabled"] = false;
+  run_benchmark("lossy", jsonLossyConf, frames, num_frames);
+
+  Json::Value jsonLosslessConf = jsonVideoConf;
+  jsonLosslessConf["lossless"]["enabled"] = true;
+  run_benchmark("lossless", jsonLosslessConf, frames, num_frames);
+
+  return 0;
+}
@@ -0,0 +1,210 @@
+#include <jsoncpp/json/json.h>
+
+#include "network_connection.hpp"
+#include "rate_controller.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+// Exercises RateController over a loopback TCP connection whose receiver
+// reads at a throttled rate, so congestion can be simulated without tc.
+
+struct LinkPhase {
+  double rate_mbps;
+  double duration_s;
+};
+
+std::atomic<double> link_rate_mbps = 0.0;
+std::atomic<bool> running = true;
+
+void throttled_receiver(NetworkConnection* connection) {
+  if (!connection->accept_client())
+  {
+    return;
+  }
+  int socket = connection->get_client_socket();
+
+  // Small receive buffer so a slow reader shows up in the sender's queue quickly
+  int rcvbuf = 64 * 1024;
+  setsockopt(socket, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+  std::vector<char> buffer(64 * 1024);
+  int64_t packet_seq = 0;
+  auto last_refill = std::chrono::steady_clock::now();
+  double tokens = 0.0;
+
+  while (running)
+  {
+    int packet_size = 0;
+    if (receive_all(socket, (char*)&packet_size, sizeof(packet_size)) <= 0)
+    {
+      break;
+    }
+
+    // Token bucket in bytes, refilled at the current link rate
+    int remaining = packet_size;
+    while (remaining > 0 && running)
+    {
+      auto now = std::chrono::steady_clock::now();
+      tokens += std::chrono::duration<double>(now - last_refill).count() * link_rate_mbps * 1024 * 1024 / 8;
+      tokens = std::min(tokens, 64.0 * 1024);
+      last_refill = now;
+
+      int chunk = std::min<int>({remaining, (int)buffer.size(), (int)tokens});
+      if (chunk <= 0)
+      {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        continue;
+      }
+      if (receive_all(socket, buffer.data(), chunk) <= 0)
+      {
+        return;
+      }
+      tokens -= chunk;
+      remaining -= chunk;
+    }
+
+    ControlMessage ack = {CONTROL_FRAME_ACK, 0, packet_seq++};
+    if (send_all(socket, &ack, sizeof(ack)) < 0)
+    {
+      return;
+    }
+  }
+}
+
+int main(int argc, char** argv) {
+  Json::Value jsonConf;
+  if (argc > 1)
+  {
+    std::ifstream fs(argv[1]);
+    if (!(fs >> jsonConf))
+    {
+      std::cerr << "Error reading config\n";
+      return 1;
+    }
+  }
+
+  Json::Value jsonVideoConf = jsonConf["video_encoding"];
+  Json::Value jsonRateConf = jsonVideoConf["rate_control"];
+  int frame_rate = jsonVideoConf.get("frame_rate", 120).asInt();
+  int64_t bitrate = jsonVideoConf.get("bitrate", 10).asInt() * 1024 * 1024;
+  double target_latency_ms = jsonRateConf.get("target_latency_ms", 100).asDouble();
+  int port = 9100;
+
+  std::vector<LinkPhase> phases = {{16.0, 5.0}, {4.0, 5.0}, {1.0, 5.0}, {16.0, 5.0}};
+  link_rate_mbps = phases[0].rate_mbps;
+
+  NetworkConnection server("", port, false);
+  std::thread receiver_thread(&throttled_receiver, &server);
+
+  NetworkConnection client("127.0.0.1", port);
+  int socket = client.get_server_socket();
+  int sndbuf = 256 * 1024;
+  setsockopt(socket, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+
+  RateController rate_controller(jsonRateConf, bitrate, frame_rate, socket);
+
+  std::vector<char> payload(8 * 1024 * 1024, 0x5a);
+  std::vector<uint8_t> control_buffer;
+  int64_t frame_count = 0;
+  int64_t packets_sent = 0;
+  int64_t frames_dropped = 0;
+  double worst_steady_latency_ms = 0.0;
+
+  auto frame_period = std::chrono::microseconds(1000000 / frame_rate);
+  auto start = std::chrono::steady_clock::now();
+  auto next_frame = start;
+  auto next_report = start + std::chrono::seconds(1);
+  auto phase_start = start;
+  size_t phase_idx = 0;
+
+  while (phase_idx < phases.size())
+  {
+    auto now = std::chrono::steady_clock::now();
+    if (std::chrono::duration<double>(now - phase_start).count() >= phases[phase_idx].duration_s)
+    {
+      phase_idx++;
+      phase_start = now;
+      if (phase_idx < phases.size())
+      {
+        link_rate_mbps = phases[phase_idx].rate_mbps;
+        std::cout << "Link rate now " << link_rate_mbps << " Mbit/s\n";
+      }
+      continue;
+    }
+
+    // Drain acks without blocking, as VideoEncoding does
+    uint8_t buffer[256];
+    ssize_t received;
+    while ((received = recv(socket, buffer, sizeof(buffer), MSG_DONTWAIT)) > 0)
+    {
+      control_buffer.insert(control_buffer.end(), buffer, buffer + received);
+    }
+    size_t num_messages = control_buffer.size() / sizeof(ControlMessage);
+    for (size_t i = 0; i < num_messages; i++)
+    {
+      ControlMessage message;
+      memcpy(&message, control_buffer.data() + i * sizeof(ControlMessage), sizeof(message));
+      rate_controller.on_ack(message.frame_count);
+    }
+    control_buffer.erase(control_buffer.begin(), control_buffer.begin() + num_messages * sizeof(ControlMessage));
+
+    RateDecision decision = rate_controller.on_frame(frame_count);
+    if (decision.drop_frame)
+    {
+      frames_dropped++;
+    }
+    else
+    {
+      // Synthetic encoder: packet size follows the requested bitrate
+      int packet_size = std::min<int64_t>(payload.size(), decision.bitrate / 8 / frame_rate);
+      if (send_all(socket, &packet_size, sizeof(packet_size)) < 0 ||
+          send_all(socket, payload.data(), packet_size) < 0)
+      {
+        std::cerr << "Receiver gone\n";
+        break;
+      }
+      rate_controller.on_packet_sent(packets_sent++, packet_size);
+    }
+    frame_count++;
+
+    if (now >= next_report)
+    {
+      double latency_ms = std::max(rate_controller.get_ack_latency_ms(), rate_controller.get_queue_delay_ms());
+
+      // Allow two seconds to converge after every link change
+      if (std::chrono::duration<double>(now - phase_start).count() > 2.0)
+      {
+        worst_steady_latency_ms = std::max(worst_steady_latency_ms, latency_ms);
+      }
+
+      std::cout << "link " << link_rate_mbps << " Mbit/s, bitrate "
+                << decision.bitrate / (1024 * 1024.0) << " Mbit/s, 1/" << decision.frame_interval
+                << " frames, delivered " << rate_controller.get_delivery_rate() / (1024 * 1024.0)
+                << " Mbit/s, ack latency " << rate_controller.get_ack_latency_ms()
+                << " ms, queue " << rate_controller.get_send_queue_bytes() << " B, dropped "
+                << frames_dropped << "/" << frame_count << std::endl;
+      next_report += std::chrono::seconds(1);
+    }
+
+    next_frame += frame_period;
+    std::this_thread::sleep_until(next_frame);
+  }
+
+  running = false;
+  client.shutdown_connection();
+  server.shutdown_connection();
+  receiver_thread.join();
+
+  bool passed = worst_steady_latency_ms <= 2 * target_latency_ms;
+  std::cout << "Worst steady-state latency " << worst_steady_latency_ms << " ms (target "
+            << target_latency_ms << " ms): " << (passed ? "PASS" : "FAIL") << std::endl;
+
+  return passed ? 0 : 1;
+}
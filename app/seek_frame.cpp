@@ -0,0 +1,136 @@
+extern "C" {
+  #include <libavcodec/avcodec.h>
+  #include <libavformat/avformat.h>
+}
+
+#include <opencv2/opencv.hpp>
+
+#include "keyframe_index.hpp"
+#include "pixel_convert.hpp"
+
+#include <chrono>
+#include <iostream>
+#include <string>
+
+// Converts a decoded frame to a BGRA image regardless of which decoder produced it
+bool convert_to_bgra(const AVFrame* frame, cv::Mat* bgra) {
+  Image decoded;
+  if (!wrap_av_frame(frame, &decoded))
+  {
+    std::cerr << "Unsupported decoded pixel format " << frame->format << std::endl;
+    return false;
+  }
+
+  ConversionKernel kernel(decoded.format, PixelFormat::BGRA);
+  Image out = make_image(PixelFormat::BGRA, frame->width, frame->height, bgra->data, bgra->step);
+  return kernel.convert(decoded, out);
+}
+
+int main(int argc, char** argv) {
+  if (argc != 4)
+  {
+    std::cerr << "usage: " << argv[0] << " <video-file> <timestamp-ms> <output-image>\n";
+    return 1;
+  }
+
+  std::string video_file = argv[1];
+  int64_t timestamp_ms = std::stoll(argv[2]);
+
+  auto start = std::chrono::high_resolution_clock::now();
+
+  KeyframeIndexReader index(video_file + ".idx");
+  if (!index.load())
+  {
+    return 1;
+  }
+
+  const KeyframeIndexEntry* target = index.seek_timestamp(timestamp_ms);
+  const KeyframeIndexEntry* keyframe = index.get_keyframe(target);
+  if (!target || !keyframe)
+  {
+    std::cerr << "Timestamp " << timestamp_ms << " is not in the recording\n";
+    return 1;
+  }
+
+  std::cout << "Frame " << target->frame_number << " captured at " << target->timestamp_ms
+            << ", decoding from keyframe " << keyframe->frame_number << std::endl;
+
+  AVFormatContext* format_ctx = nullptr;
+  if (avformat_open_input(&format_ctx, video_file.c_str(), NULL, NULL) < 0 ||
+      avformat_find_stream_info(format_ctx, NULL) < 0)
+  {
+    std::cerr << "Could not open " << video_file << std::endl;
+    return 1;
+  }
+
+  int stream_idx = av_find_best_stream(format_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+  if (stream_idx < 0)
+  {
+    std::cerr << "No video stream in " << video_file << std::endl;
+    return 1;
+  }
+  AVStream* stream = format_ctx->streams[stream_idx];
+
+  const AVCodec* codec = avcodec_find_decoder(stream->codecpar->codec_id);
+  AVCodecContext* codec_ctx = avcodec_alloc_context3(codec);
+  avcodec_parameters_to_context(codec_ctx, stream->codecpar);
+  codec_ctx->thread_count = 0;
+  if (avcodec_open2(codec_ctx, codec, NULL) < 0)
+  {
+    std::cerr << "Could not open decoder\n";
+    return 1;
+  }
+
+  // Index frame numbers are in encoder time base (one tick per frame)
+  AVRational frame_time_base = av_inv_q(stream->avg_frame_rate);
+  int64_t seek_ts = av_rescale_q(keyframe->frame_number, frame_time_base, stream->time_base);
+  if (av_seek_frame(format_ctx, stream_idx, seek_ts, AVSEEK_FLAG_BACKWARD) < 0)
+  {
+    std::cerr << "Seek failed\n";
+    return 1;
+  }
+
+  AVPacket* pkt = av_packet_alloc();
+  AVFrame* frame = av_frame_alloc();
+  bool found = false;
+  int decoded_frames = 0;
+
+  auto receive_frames = [&]() {
+    while (!found && avcodec_receive_frame(codec_ctx, frame) == 0)
+    {
+      decoded_frames++;
+      int64_t frame_number = av_rescale_q(frame->pts, stream->time_base, frame_time_base);
+      if (frame_number >= target->frame_number)
+      {
+        cv::Mat bgra(frame->height, frame->width, CV_8UC4);
+        found = convert_to_bgra(frame, &bgra) && cv::imwrite(argv[3], bgra);
+      }
+    }
+  };
+
+  while (!found && av_read_frame(format_ctx, pkt) == 0)
+  {
+    if (pkt->stream_index == stream_idx && avcodec_send_packet(codec_ctx, pkt) == 0)
+    {
+      receive_frames();
+    }
+    av_packet_unref(pkt);
+  }
+
+  // Target near the end of the file may still be buffered in the decoder
+  if (!found && avcodec_send_packet(codec_ctx, NULL) == 0)
+  {
+    receive_frames();
+  }
+
+  std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+  std::cout << (found ? "Wrote " : "Failed to write ") << argv[3] << " after decoding "
+            << decoded_frames << " frames in " << elapsed.count() * 1000 << " ms\n";
+
+  av_frame_free(&frame);
+  av_packet_free(&pkt);
+  avcodec_free_context(&codec_ctx);
+  avformat_close_input(&format_ctx);
+
+  return found ? 0 : 1;
+}
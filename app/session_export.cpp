@@ -0,0 +1,603 @@
+extern "C" {
+  #include <libavcodec/avcodec.h>
+  #include <libavformat/avformat.h>
+}
+
+#include <jsoncpp/json/json.h>
+#include <libyuv.h>
+
+#include "decode_pool.hpp"
+#include "pixel_convert.hpp"
+#include "video_decoding.hpp"
+#include "video_encoding.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+// Exports recordings, or time ranges of them, to every configured output
+// profile (e.g. downscaled H.264 for sharing) in one decoding pass. Each
+// range is split at keyframes into chunks that are transcoded in parallel,
+// and the chunk files of a profile are joined without re-encoding.
+struct Profile {
+  std::string name;
+  int width = 0;
+  int height = 0;
+  // video_encoding with the profile's settings on top
+  Json::Value conf;
+};
+
+struct ExportJob {
+  std::string video_file;
+  int64_t start_ms = 0;
+  int64_t end_ms = -1;
+  // Output files are <output_stem>_<profile>.mp4
+  std::string output_stem;
+
+  AVRational frame_rate = {0, 1};
+  int width = 0;
+  int height = 0;
+  std::vector<int> chunks;
+};
+
+// Timestamps are in the stream's time base
+struct Chunk {
+  int job_idx = 0;
+  int part = 0;
+  int64_t seek_pts = 0;   // Keyframe decoding starts from
+  int64_t start_pts = 0;  // First frame exported
+  int64_t end_pts = std::numeric_limits<int64_t>::max();
+  int64_t frames = 0;
+  bool ok = false;
+};
+
+// <file> or <file>@<start-ms>-<end-ms>, times from the start of the file
+bool parse_input(const std::string& arg, ExportJob* job) {
+  size_t at = arg.rfind('@');
+  job->video_file = arg.substr(0, at);
+  if (at == std::string::npos)
+  {
+    return true;
+  }
+
+  std::string range = arg.substr(at + 1);
+  size_t dash = range.find('-');
+  if (dash == std::string::npos)
+  {
+    return false;
+  }
+  try
+  {
+    job->start_ms = std::stoll(range.substr(0, dash));
+    job->end_ms = std::stoll(range.substr(dash + 1));
+  }
+  catch (const std::exception&)
+  {
+    return false;
+  }
+  return job->start_ms >= 0 && job->end_ms > job->start_ms;
+}
+
+std::vector<Profile> load_profiles(Json::Value jsonExportConf, Json::Value jsonVideoConf) {
+  // Exports are written to files only and need none of the live features
+  jsonVideoConf["lossless"]["enabled"] = false;
+  jsonVideoConf["motion"]["enabled"] = false;
+  jsonVideoConf["keyframe_policy"]["mode"] = "gop";
+  jsonVideoConf["seek_index"] = false;
+  jsonVideoConf["segment"] = 0;
+
+  std::vector<Profile> profiles;
+  for (const Json::Value& jsonProfileConf : jsonExportConf["profiles"])
+  {
+    Profile profile;
+    profile.name = jsonProfileConf.get("name", "export").asString();
+    profile.width = jsonProfileConf.get("width", 0).asInt();
+    profile.height = jsonProfileConf.get("height", 0).asInt();
+    profile.conf = jsonVideoConf;
+    for (const char* key : {"encoder", "preset", "tune", "bitrate", "gop_size"})
+    {
+      if (jsonProfileConf.isMember(key))
+      {
+        profile.conf[key] = jsonProfileConf[key];
+      }
+    }
+    profiles.push_back(profile);
+  }
+  return profiles;
+}
+
+// Keyframe timestamps from the demuxer's index, which MP4 and MKV build
+// when the file is opened, or from the packets if there is none. Recordings
+// have no B-frames, so index and packet decoding times are presentation times.
+std::vector<int64_t> find_keyframes(AVFormatContext* format_ctx, int stream_idx) {
+  AVStream* stream = format_ctx->streams[stream_idx];
+  std::vector<int64_t> keyframes;
+  for (int i = 0; i < avformat_index_get_entries_count(stream); i++)
+  {
+    const AVIndexEntry* entry = avformat_index_get_entry(stream, i);
+    if (entry->flags & AVINDEX_KEYFRAME)
+    {
+      keyframes.push_back(entry->timestamp);
+    }
+  }
+
+  if (keyframes.empty())
+  {
+    AVPacket* pkt = av_packet_alloc();
+    while (av_read_frame(format_ctx, pkt) == 0)
+    {
+      if (pkt->stream_index == stream_idx && (pkt->flags & AV_PKT_FLAG_KEY))
+      {
+        keyframes.push_back(pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts);
+      }
+      av_packet_unref(pkt);
+    }
+    av_packet_free(&pkt);
+  }
+
+  std::sort(keyframes.begin(), keyframes.end());
+  return keyframes;
+}
+
+int open_video(const std::string& video_file, AVFormatContext** format_ctx) {
+  if (avformat_open_input(format_ctx, video_file.c_str(), NULL, NULL) < 0 ||
+      avformat_find_stream_info(*format_ctx, NULL) < 0)
+  {
+    std::cerr << "Could not open " << video_file << std::endl;
+    return -1;
+  }
+
+  int stream_idx = av_find_best_stream(*format_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+  if (stream_idx < 0)
+  {
+    std::cerr << "No video stream in " << video_file << std::endl;
+  }
+  return stream_idx;
+}
+
+// Splits the job's range into chunks of at least min_chunk_ms that start at
+// keyframes, except the first one when the range starts between keyframes
+bool plan_job(int job_idx, ExportJob* job, int64_t min_chunk_ms, std::vector<Chunk>* chunks) {
+  AVFormatContext* format_ctx = nullptr;
+  int stream_idx = open_video(job->video_file, &format_ctx);
+  if (stream_idx < 0)
+  {
+    avformat_close_input(&format_ctx);
+    return false;
+  }
+
+  AVStream* stream = format_ctx->streams[stream_idx];
+  job->frame_rate = stream->avg_frame_rate.num > 0 ? stream->avg_frame_rate : stream->r_frame_rate;
+  job->width = stream->codecpar->width;
+  job->height = stream->codecpar->height;
+
+  AVRational ms = {1, 1000};
+  int64_t first_pts = stream->start_time != AV_NOPTS_VALUE ? stream->start_time : 0;
+  int64_t start_pts = first_pts + av_rescale_q(job->start_ms, ms, stream->time_base);
+  int64_t end_pts = job->end_ms < 0 ? std::numeric_limits<int64_t>::max()
+                                    : first_pts + av_rescale_q(job->end_ms, ms, stream->time_base);
+  int64_t min_chunk_pts = av_rescale_q(min_chunk_ms, ms, stream->time_base);
+
+  std::vector<int64_t> keyframes = find_keyframes(format_ctx, stream_idx);
+  avformat_close_input(&format_ctx);
+
+  Chunk chunk;
+  chunk.job_idx = job_idx;
+  chunk.start_pts = start_pts;
+  chunk.seek_pts = keyframes.empty() ? start_pts : keyframes.front();
+  for (int64_t keyframe : keyframes)
+  {
+    if (keyframe <= start_pts)
+    {
+      chunk.seek_pts = keyframe;
+      continue;
+    }
+    if (keyframe >= end_pts)
+    {
+      break;
+    }
+    if (keyframe - chunk.start_pts >= min_chunk_pts)
+    {
+      chunk.end_pts = keyframe;
+      job->chunks.push_back(chunks->size());
+      chunks->push_back(chunk);
+
+      chunk.part++;
+      chunk.seek_pts = keyframe;
+      chunk.start_pts = keyframe;
+    }
+  }
+  chunk.end_pts = end_pts;
+  job->chunks.push_back(chunks->size());
+  chunks->push_back(chunk);
+  return true;
+}
+
+std::string part_file(const ExportJob& job, const Profile& profile, int part) {
+  return job.output_stem + "_" + profile.name + "_part_" + std::to_string(part) + ".mp4";
+}
+
+// The profile's encoder settings for the job's source. Never upscaled,
+// sizes must be even for 4:2:0, a profile without a height keeps the
+// aspect ratio.
+Json::Value encode_conf(const ExportJob& job, const Profile& profile, int codec_threads) {
+  int width = profile.width > 0 ? std::min(profile.width, job.width) : job.width;
+  int height = profile.height > 0 ? profile.height
+                                  : (int)((int64_t)job.height * width / std::max(1, job.width));
+  Json::Value jsonEncodeConf = profile.conf;
+  jsonEncodeConf["stream_width"] = width & ~1;
+  jsonEncodeConf["stream_height"] = height & ~1;
+  jsonEncodeConf["frame_rate"] = std::max(1, (int)(av_q2d(job.frame_rate) + 0.5));
+  jsonEncodeConf["encoder_threads"] = codec_threads;
+  // Profiles have a fixed bitrate, and chunks are too short to tune one
+  jsonEncodeConf["quality"]["enabled"] = false;
+  return jsonEncodeConf;
+}
+
+// Opens every profile's encoder once before any chunk runs, so a bad
+// profile fails the export up front instead of on the workers
+bool check_profiles(const ExportJob& job, const std::vector<Profile>& profiles,
+                    const std::filesystem::path& output_dir) {
+  for (const Profile& profile : profiles)
+  {
+    Json::Value jsonEncodeConf = encode_conf(job, profile, 1);
+    jsonEncodeConf["output_video_path"] = (output_dir / (profile.name + "_check")).string();
+    VideoEncoding encoder(jsonEncodeConf, "output", 0, -1);
+    if (!encoder.is_open())
+    {
+      std::cerr << "Export profile " << profile.name << " cannot be encoded with "
+                << jsonEncodeConf["encoder"].asString() << std::endl;
+      return false;
+    }
+    encoder.finish_file();
+    std::filesystem::remove(encoder.get_output_file());
+  }
+  return true;
+}
+
+// Decodes the chunk once and encodes every decoded frame for each profile.
+// Codecs get codec_threads each, the chunks already keep the workers busy.
+void export_chunk(const ExportJob& job, Chunk* chunk, const std::vector<Profile>& profiles,
+                  Json::Value jsonVideoConf, int codec_threads) {
+  AVFormatContext* format_ctx = nullptr;
+  int stream_idx = open_video(job.video_file, &format_ctx);
+  if (stream_idx < 0)
+  {
+    avformat_close_input(&format_ctx);
+    return;
+  }
+  AVStream* stream = format_ctx->streams[stream_idx];
+
+  std::vector<std::unique_ptr<VideoEncoding>> encoders;
+  for (const Profile& profile : profiles)
+  {
+    Json::Value jsonEncodeConf = encode_conf(job, profile, codec_threads);
+    jsonEncodeConf["output_video_path"] = job.output_stem + "_" + profile.name + "_part";
+    encoders.push_back(std::make_unique<VideoEncoding>(jsonEncodeConf, "output", chunk->part, -1));
+    if (!encoders.back()->is_open())
+    {
+      // Fails the job only, its part files are removed with the others
+      std::cerr << "Could not open the encoder of profile " << profile.name << " for "
+                << job.video_file << std::endl;
+      encoders.pop_back();
+      for (auto& encoder : encoders)
+      {
+        encoder->finish_file();
+      }
+      avformat_close_input(&format_ctx);
+      return;
+    }
+  }
+
+  // Decoders hand out NV12, I420 or P010, every profile scales from NV12
+  AVFrame* source_nv12 = nullptr;
+  ConversionKernel to_nv12;
+  bool done = false;
+  // Capture metadata embedded in the source is carried over to every profile
+  VideoDecoding* source_decoder = nullptr;
+  FrameMetadata metadata;
+
+  auto encode_frame = [&](const AVFrame* frame) {
+    int64_t pts = frame->best_effort_timestamp;
+    if (done || pts < chunk->start_pts)
+    {
+      return;
+    }
+    if (pts >= chunk->end_pts)
+    {
+      done = true;
+      return;
+    }
+
+    const AVFrame* nv12 = frame;
+    if (frame->format != AV_PIX_FMT_NV12)
+    {
+      Image decoded;
+      if (!wrap_av_frame(frame, &decoded))
+      {
+        std::cerr << "Unsupported decoded pixel format " << frame->format << std::endl;
+        done = true;
+        return;
+      }
+      if (!source_nv12)
+      {
+        to_nv12 = ConversionKernel(decoded.format, PixelFormat::NV12);
+        source_nv12 = av_frame_alloc();
+        source_nv12->format = AV_PIX_FMT_NV12;
+        source_nv12->width = frame->width;
+        source_nv12->height = frame->height;
+        av_frame_get_buffer(source_nv12, 0);
+      }
+      Image converted;
+      wrap_av_frame(source_nv12, &converted);
+      to_nv12.convert(decoded, converted);
+      nv12 = source_nv12;
+    }
+
+    const FrameMetadata* frame_metadata = source_decoder->get_frame_metadata(&metadata) ? &metadata : nullptr;
+    for (auto& encoder : encoders)
+    {
+      if (encoder->get_width() == nv12->width && encoder->get_height() == nv12->height)
+      {
+        encoder->encode_nv12_to_file(nv12, chunk->frames, -1, frame_metadata);
+        continue;
+      }
+
+      AVFrame* scaled = encoder->frame_nv12;
+      libyuv::NV12Scale(nv12->data[0], nv12->linesize[0],
+                        nv12->data[1], nv12->linesize[1],
+                        nv12->width, nv12->height,
+                        scaled->data[0], scaled->linesize[0],
+                        scaled->data[1], scaled->linesize[1],
+                        encoder->get_width(), encoder->get_height(),
+                        libyuv::kFilterBox);
+      encoder->encode_nv12_to_file(scaled, chunk->frames, -1, frame_metadata);
+    }
+    chunk->frames++;
+  };
+
+  Json::Value jsonDecodeConf = jsonVideoConf;
+  jsonDecodeConf["decoder_threads"] = codec_threads;
+  VideoDecoding decoder(jsonDecodeConf, stream->codecpar, chunk->part, nullptr, encode_frame);
+  source_decoder = &decoder;
+
+  if (decoder.is_open() && av_seek_frame(format_ctx, stream_idx, chunk->seek_pts, AVSEEK_FLAG_BACKWARD) >= 0)
+  {
+    AVPacket* pkt = av_packet_alloc();
+    while (!done && av_read_frame(format_ctx, pkt) == 0)
+    {
+      if (pkt->stream_index == stream_idx)
+      {
+        decoder.submit_packet(pkt);
+      }
+      av_packet_unref(pkt);
+    }
+    av_packet_free(&pkt);
+
+    decoder.submit_packet(NULL);
+    chunk->ok = true;
+  }
+  else
+  {
+    std::cerr << "Could not decode " << job.video_file << " from " << chunk->seek_pts << std::endl;
+  }
+
+  for (auto& encoder : encoders)
+  {
+    encoder->finish_file();
+  }
+  av_frame_free(&source_nv12);
+  avformat_close_input(&format_ctx);
+}
+
+// Appends the parts one after another, each starts with a keyframe and all
+// come from the same encoder settings
+bool join_parts(const std::vector<std::string>& parts, const std::string& output_file, AVRational frame_rate) {
+  AVFormatContext* output_ctx = nullptr;
+  avformat_alloc_output_context2(&output_ctx, NULL, NULL, output_file.c_str());
+  if (!output_ctx)
+  {
+    std::cerr << "Could not allocate output format context for " << output_file << std::endl;
+    return false;
+  }
+
+  AVStream* output_stream = nullptr;
+  AVPacket* pkt = av_packet_alloc();
+  int64_t offset = 0;
+  int64_t frame_duration = 1;
+  bool ok = true;
+
+  for (const std::string& part : parts)
+  {
+    AVFormatContext* input_ctx = nullptr;
+    int stream_idx = open_video(part, &input_ctx);
+    if (stream_idx < 0)
+    {
+      avformat_close_input(&input_ctx);
+      ok = false;
+      break;
+    }
+    AVStream* input_stream = input_ctx->streams[stream_idx];
+
+    if (!output_stream)
+    {
+      output_stream = avformat_new_stream(output_ctx, NULL);
+      avcodec_parameters_copy(output_stream->codecpar, input_stream->codecpar);
+      output_stream->codecpar->codec_tag = 0;
+      output_stream->time_base = input_stream->time_base;
+      if (avio_open(&output_ctx->pb, output_file.c_str(), AVIO_FLAG_WRITE) < 0 ||
+          avformat_write_header(output_ctx, NULL) < 0)
+      {
+        std::cerr << "Could not write " << output_file << std::endl;
+        avformat_close_input(&input_ctx);
+        ok = false;
+        break;
+      }
+      // The muxer may have picked another time base
+      frame_duration = std::max<int64_t>(1, av_rescale_q(1, av_inv_q(frame_rate), output_stream->time_base));
+    }
+
+    int64_t next_offset = offset;
+    while (av_read_frame(input_ctx, pkt) == 0)
+    {
+      if (pkt->stream_index == stream_idx)
+      {
+        av_packet_rescale_ts(pkt, input_stream->time_base, output_stream->time_base);
+        pkt->pts += offset;
+        pkt->dts += offset;
+        pkt->stream_index = output_stream->index;
+        next_offset = std::max(next_offset, pkt->pts + std::max(pkt->duration, frame_duration));
+        av_interleaved_write_frame(output_ctx, pkt);
+      }
+      av_packet_unref(pkt);
+    }
+    offset = next_offset;
+    avformat_close_input(&input_ctx);
+  }
+
+  if (output_stream && output_ctx->pb)
+  {
+    av_write_trailer(output_ctx);
+    avio_closep(&output_ctx->pb);
+  }
+  av_packet_free(&pkt);
+  avformat_free_context(output_ctx);
+  return ok;
+}
+
+int main(int argc, char** argv) {
+  if (argc < 3)
+  {
+    std::cerr << "usage: " << argv[0] << " <config-json> <video-file>[@<start-ms>-<end-ms>]...\n";
+    return 1;
+  }
+
+  Json::Value jsonConf;
+  {
+    std::ifstream fs(argv[1]);
+    if (!(fs >> jsonConf))
+    {
+      std::cerr << "Error reading config\n";
+      return 1;
+    }
+  }
+
+  Json::Value jsonExportConf = jsonConf["export"];
+  Json::Value jsonVideoConf = jsonConf["video_encoding"];
+  std::vector<Profile> profiles = load_profiles(jsonExportConf, jsonVideoConf);
+  if (profiles.empty())
+  {
+    std::cerr << "No export profiles configured\n";
+    return 1;
+  }
+
+  std::filesystem::path output_dir = jsonExportConf.get("output_dir", "../export").asString();
+  std::filesystem::create_directories(output_dir);
+  int64_t min_chunk_ms = jsonExportConf.get("min_chunk_ms", 10000).asInt64();
+
+  std::vector<ExportJob> jobs(argc - 2);
+  std::vector<Chunk> chunks;
+  std::set<std::string> output_stems;
+  for (size_t job_idx = 0; job_idx < jobs.size(); job_idx++)
+  {
+    ExportJob& job = jobs[job_idx];
+    if (!parse_input(argv[job_idx + 2], &job))
+    {
+      std::cerr << "Invalid input " << argv[job_idx + 2] << ", expected <file>@<start-ms>-<end-ms>\n";
+      return 1;
+    }
+
+    std::string stem = std::filesystem::path(job.video_file).stem().string();
+    if (job.end_ms >= 0)
+    {
+      stem += "_" + std::to_string(job.start_ms) + "-" + std::to_string(job.end_ms);
+    }
+    // Recordings from different directories share their names
+    while (!output_stems.insert(stem).second)
+    {
+      stem += "_" + std::to_string(job_idx);
+    }
+    job.output_stem = (output_dir / stem).string();
+
+    if (!plan_job(job_idx, &job, min_chunk_ms, &chunks))
+    {
+      return 1;
+    }
+  }
+
+  if (!check_profiles(jobs.front(), profiles, output_dir))
+  {
+    return 1;
+  }
+
+  auto start = std::chrono::high_resolution_clock::now();
+
+  // Chunks are the unit of parallelism, the pool's codec threads give short
+  // exports with fewer chunks than workers threaded codecs instead
+  std::atomic<int> finished_chunks = 0;
+  {
+    DecodePool pool(jsonExportConf, chunks.size());
+    int codec_threads = pool.get_codec_threads();
+    std::cout << jobs.size() << " exports in " << chunks.size() << " chunks, "
+              << profiles.size() << " profiles each" << std::endl;
+
+    for (Chunk& chunk : chunks)
+    {
+      Chunk* scheduled = &chunk;
+      pool.schedule([&, scheduled] {
+        export_chunk(jobs[scheduled->job_idx], scheduled, profiles, jsonVideoConf, codec_threads);
+        std::cout << "Chunk " << ++finished_chunks << "/" << chunks.size() << " done, "
+                  << scheduled->frames << " frames" << std::endl;
+      });
+    }
+    // Destroying the pool runs every scheduled chunk first
+  }
+
+  bool all_exported = true;
+  int64_t total_frames = 0;
+  for (const ExportJob& job : jobs)
+  {
+    int64_t job_frames = 0;
+    bool job_ok = true;
+    for (int chunk_idx : job.chunks)
+    {
+      job_frames += chunks[chunk_idx].frames;
+      job_ok &= chunks[chunk_idx].ok;
+    }
+    total_frames += job_frames;
+
+    for (const Profile& profile : profiles)
+    {
+      std::vector<std::string> parts;
+      for (int chunk_idx : job.chunks)
+      {
+        parts.push_back(part_file(job, profile, chunks[chunk_idx].part));
+      }
+
+      std::string output_file = job.output_stem + "_" + profile.name + ".mp4";
+      bool joined = job_ok && join_parts(parts, output_file, job.frame_rate);
+      for (const std::string& part : parts)
+      {
+        std::filesystem::remove(part);
+      }
+
+      all_exported &= joined;
+      std::cout << (joined ? "Wrote " : "Failed to write ") << output_file << ", " << job_frames << " frames\n";
+    }
+  }
+
+  std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+  std::cout << total_frames << " frames exported to " << profiles.size() << " profiles in "
+            << elapsed.count() << " s, " << total_frames / elapsed.count() << " fps\n";
+
+  return all_exported ? 0 : 1;
+}
@@ -0,0 +1,180 @@
+#include "shm_frame_ring.hpp"
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+// How far readers of a shared memory frame ring fall behind the writer.
+// Publishes synthetic frames at a fixed rate to reader processes that each
+// sum every byte of every frame in place, or attaches to a ring of a
+// running camera_stream. Reports per reader the publish to read latency,
+// frames lost to overruns and frames overwritten while being read.
+struct ReaderStats {
+  std::vector<int64_t> lag_ns;
+  uint64_t frames = 0;
+  uint64_t torn = 0;
+};
+
+// Work of a simple analysis step, reads the whole frame once
+static uint64_t sum_frame(const uint8_t* data, size_t size) {
+  uint64_t sum = 0;
+  for (size_t i = 0; i < size; i++)
+  {
+    sum += data[i];
+  }
+  return sum;
+}
+
+static void print_stats(const std::string& label, ReaderStats* stats, uint64_t lost) {
+  std::sort(stats->lag_ns.begin(), stats->lag_ns.end());
+  auto percentile_us = [&](double p) {
+    if (stats->lag_ns.empty())
+    {
+      return 0.0;
+    }
+    return stats->lag_ns[std::min(stats->lag_ns.size() - 1, (size_t)(p * stats->lag_ns.size()))] / 1000.0;
+  };
+
+  std::cout << std::fixed << std::setprecision(1) << label << ": " << stats->frames << " frames, lag p50 "
+            << percentile_us(0.5) << " us, p99 " << percentile_us(0.99) << " us, max "
+            << percentile_us(1.0) << " us, " << lost << " lost, " << stats->torn << " torn" << std::endl;
+}
+
+static ReaderStats read_ring(ShmFrameReader* reader, double seconds) {
+  ReaderStats stats;
+  size_t frame_size = reader->get_header()->frame_size;
+  uint64_t checksum = 0;
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::duration<double>(seconds);
+
+  while (std::chrono::steady_clock::now() < deadline)
+  {
+    ShmFrameView view;
+    if (!reader->read_next(&view))
+    {
+      if (reader->is_writer_closed())
+      {
+        break;
+      }
+      std::this_thread::sleep_for(std::chrono::microseconds(100));
+      continue;
+    }
+
+    int64_t lag = shm_monotonic_ns() - view.publish_time_ns;
+    checksum += sum_frame(view.data, frame_size);
+    if (!reader->validate(view))
+    {
+      stats.torn++;
+      continue;
+    }
+    stats.lag_ns.push_back(lag);
+    stats.frames++;
+  }
+
+  // Keeps the summing from being optimized away
+  if (checksum == 1)
+  {
+    std::cout << "";
+  }
+  return stats;
+}
+
+int main(int argc, char** argv) {
+  if (argc > 1 && std::string(argv[1]) == "attach")
+  {
+    if (argc < 3)
+    {
+      std::cerr << "usage: " << argv[0] << " attach <shm-name> [seconds]\n";
+      return 1;
+    }
+    ShmFrameReader reader(argv[2]);
+    if (!reader.open())
+    {
+      return 1;
+    }
+    reader.skip_to_latest();
+    ReaderStats stats = read_ring(&reader, argc > 3 ? std::stod(argv[3]) : 10.0);
+    print_stats(argv[2], &stats, reader.get_lost_frames());
+    return 0;
+  }
+
+  int num_readers = argc > 1 ? std::stoi(argv[1]) : 4;
+  int frame_rate = argc > 2 ? std::stoi(argv[2]) : 120;
+  double seconds = argc > 3 ? std::stod(argv[3]) : 5.0;
+  int width = argc > 4 ? std::stoi(argv[4]) : 1920;
+  int height = argc > 5 ? std::stoi(argv[5]) : 1080;
+  int slots = 8;
+
+  std::string name = "/shm_reader_benchmark_" + std::to_string(getpid());
+  auto writer = std::make_unique<ShmFrameWriter>(name, 0, width, height, 3, slots);
+  if (!writer->open())
+  {
+    return 1;
+  }
+
+  std::cout << num_readers << " readers, " << width << "x" << height << " at " << frame_rate
+            << " fps for " << seconds << " s, " << slots << " slots" << std::endl;
+
+  std::vector<pid_t> children;
+  for (int i = 0; i < num_readers; i++)
+  {
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+      ShmFrameReader reader(name);
+      if (!reader.open())
+      {
+        _exit(1);
+      }
+      ReaderStats stats = read_ring(&reader, seconds + 1.0);
+      print_stats("reader " + std::to_string(i), &stats, reader.get_lost_frames());
+      _exit(0);
+    }
+    children.push_back(pid);
+  }
+
+  std::vector<uint8_t> frame((size_t)width * height * 3);
+  std::vector<int64_t> publish_ns;
+  auto period = std::chrono::nanoseconds(1000000000 / frame_rate);
+  auto next = std::chrono::steady_clock::now();
+  int64_t num_frames = std::max<int64_t>(1, seconds * frame_rate);
+  for (int64_t frame_number = 0; frame_number < num_frames; frame_number++)
+  {
+    std::fill(frame.begin(), frame.begin() + width * 3, (uint8_t)frame_number);
+
+    ShmFrameInfo info;
+    info.camera_idx = 0;
+    info.frame_number = frame_number;
+    int64_t start = shm_monotonic_ns();
+    writer->publish(frame.data(), info);
+    publish_ns.push_back(shm_monotonic_ns() - start);
+
+    next += period;
+    std::this_thread::sleep_until(next);
+  }
+
+  // Readers see the ring closed once the writer is gone
+  std::sort(publish_ns.begin(), publish_ns.end());
+  std::cout << std::fixed << std::setprecision(1) << "writer: " << num_frames << " frames, publish p50 "
+            << publish_ns[publish_ns.size() / 2] / 1000.0 << " us, max " << publish_ns.back() / 1000.0
+            << " us" << std::endl;
+  writer.reset();
+
+  bool all_read = true;
+  for (pid_t child : children)
+  {
+    int status = 0;
+    waitpid(child, &status, 0);
+    all_read &= WIFEXITED(status) && WEXITSTATUS(status) == 0;
+  }
+  return all_read ? 0 : 1;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <jsoncpp/json/json.h>
+
+#include <string>
+#include <vector>
+
+// What a camera puts on the bus
+struct CameraLink {
+  int controller = 0;
+  int width = 0;
+  int height = 0;
+  // Bytes per pixel on the wire, RGB24 is debayered on the host from 8 bit RAW
+  double bytes_per_pixel = 1.0;
+  double frame_rate = 0.0;
+  // XI_PRM_AVAILABLE_BANDWIDTH of the camera in Mbit/s, 0 if unknown
+  double available_mbps = 0.0;
+};
+
+struct LinkPlan {
+  double required_mbps = 0.0;
+  // 0 leaves the camera unlimited
+  double limit_mbps = 0.0;
+  // Highest rate that fits, lower than requested when the controller cannot
+  // carry every camera
+  double frame_rate = 0.0;
+  int queue_size = 0;
+  // 0 leaves the SDK default
+  int transport_buffer_bytes = 0;
+};
+
+// Shares the bandwidth of each USB controller between the cameras on it.
+// Every camera is limited to its share of the controller. A camera whose
+// share is below what it needs is planned with the highest frame rate that
+// fits, so an oversubscribed rig is caught before it loses random frames in
+// transport. Configured by "bandwidth":
+//
+//   controllers       controller of each camera, all on controller 0 if omitted
+//   controller_mbps   usable Mbit/s per controller, 0 measures it with the
+//                     lowest XI_PRM_AVAILABLE_BANDWIDTH of its cameras
+//   headroom          fraction of the controller given out
+//   protocol_overhead added to the pixel data rate of every camera
+//   queue_ms          frames the SDK buffers, in time at the camera's rate
+//   transport_frames  transport buffer size in frames, 0 for the SDK default
+class BandwidthPlanner {
+public:
+  BandwidthPlanner(Json::Value jsonBandwidthConf);
+
+  int get_controller(int camera_idx);
+
+  std::vector<LinkPlan> plan(const std::vector<CameraLink>& links);
+
+  static std::string describe(int camera_idx, const CameraLink& link, const LinkPlan& plan);
+
+private:
+  Json::Value controllers_;
+  double controller_mbps_ = 0.0;
+  double headroom_ = 0.9;
+  double protocol_overhead_ = 0.1;
+  int queue_ms_ = 100;
+  int transport_frames_ = 0;
+};
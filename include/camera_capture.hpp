@@ -3,30 +3,62 @@
 #include <opencv2/opencv.hpp>
 #include <jsoncpp/json/json.h>
 
-#include "pipe.hpp"
+#include "bandwidth_planner.hpp"
+#include "camera_frame.hpp"
+#include "frame_source.hpp"
+#include "load_shedder.hpp"
 #include <m3api/xiApi.h>
 
 #include <memory>
 #include <atomic>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
 
-class CameraCapture {
+class CameraCapture : public FrameSource {
 public:
-  CameraCapture(PipeDataInCollection<void*>* dImageFrame,
+  CameraCapture(LoadShedder* frame_queue,
                 Json::Value config);
 
   ~CameraCapture();
 
-  void set_camera_param();
+  void set_camera_param(size_t idx);
 
-  void query_camera_param();
+  void query_camera_param(size_t idx);
 
-  void start_capture();
+  // Runs one acquisition thread per device and returns once all have
+  // stopped, right away if the bandwidth plan does not fit
+  void start_capture() override;
 
-  void stop_capture();
+  // Only asks the acquisition threads to stop, each one stops its own
+  // device within capture_timeout_ms. Devices are closed in the destructor.
+  void stop_capture() override;
 
+  // exposure (us), gain (dB), offset_x and offset_y. Setting exposure or
+  // gain turns auto exposure off. The ROI size and frame rate cannot change
+  // while running, every buffer and encoder downstream is sized and timed
+  // from them.
+  bool set_param(int idx,
+                 const std::string& param,
+                 const std::string& value,
+                 std::string* error) override;
 
 private:
-  PipeDataInCollection<void*>* dImageFrame_;
+  // Opens, configures and queries one device, called in parallel
+  void open_device(size_t idx);
+
+  // Shares the USB bandwidth between the opened devices, see BandwidthPlanner
+  void plan_bandwidth();
+
+  void apply_link_plan(size_t idx, const LinkPlan& plan);
+
+  void capture_device(size_t idx);
+
+  // Called by the acquisition thread of the device between two frames
+  void apply_pending_params(size_t idx);
+
+  LoadShedder* frame_queue_;
   Json::Value config_;
 
   int num_devices_ = -1;
@@ -36,8 +68,19 @@ private:
   int img_width_ = -1;
   int img_height_ = -1;
 
-  HANDLE* hDevice_ = nullptr;
-  XI_IMG* image = nullptr;
+  double frame_rate_ = 120.0;
+
+  // Capture does not start if the planned rate is below frame_rate_
+  bool bandwidth_exceeded_ = false;
+
+  int capture_timeout_ms_ = 100;
+
+  std::vector<HANDLE> hDevices_;
+  std::vector<XI_IMG> images_;
+
+  // Changes queued by set_param() per device, in request order
+  std::mutex params_mutex_;
+  std::vector<std::vector<std::pair<std::string, double>>> pending_params_;
 
   XI_RETURN stat = XI_OK;
 };
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstdint>
+
+// One captured image and its acquisition metadata as passed between stages.
+// data is owned by the source and only valid until the source produces the
+// next frame for the same camera.
+struct CameraFrame {
+  void* data = nullptr;
+  int camera_idx = -1;
+  int width = 0;
+  int height = 0;
+
+  int64_t frame_number = -1;          // Sensor frame counter (XI_IMG::nframe)
+  int64_t sensor_timestamp_us = -1;   // Sensor clock at exposure
+  int64_t host_timestamp_us = -1;     // Host epoch clock when the frame was fetched
+  int64_t aligned_timestamp_us = -1;  // Sensor timestamp mapped to the host epoch clock
+
+  int exposure_us = 0;
+  float gain_db = 0.0f;
+};
+
+// A frame that was captured but deliberately not recorded
+struct DroppedFrame {
+  int camera_idx = -1;
+  int64_t frame_number = -1;
+  const char* reason = "";
+};
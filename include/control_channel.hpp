@@ -0,0 +1,45 @@
+#pragma once
+
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// Local control socket for changing parameters of a running pipeline, e.g.
+//   echo "set exposure 5000 0" | socat - UNIX-CONNECT:/tmp/camera_stream.sock
+// One command per line, each answered with "ok" or "error <reason>":
+//   set <param> <value> [index]   index is a camera or session, all if omitted
+//   list                          names of the parameters that can be set
+// Handlers run on the channel thread and only queue the change, the owner
+// applies it at its next frame boundary.
+class ControlChannel {
+public:
+  // index is -1 for all cameras or sessions
+  using Handler = std::function<bool(int index, const std::string& value, std::string* error)>;
+
+  ControlChannel(const std::string& socket_path);
+
+  ~ControlChannel();
+
+  bool is_open();
+
+  void add_handler(const std::string& param, Handler handler);
+
+  // Once this returns the handler is not running and will not be called again
+  void remove_handler(const std::string& param);
+
+private:
+  void serve_loop();
+
+  std::string handle_command(const std::string& line);
+
+  std::string socket_path_;
+  int listen_fd_ = -1;
+  int wake_fd_ = -1;
+
+  std::mutex handlers_mutex_;
+  std::map<std::string, Handler> handlers_;
+
+  std::thread serve_thread_;
+};
@@ -0,0 +1,382 @@
+#pragma once
+
+#include <jsoncpp/json/json.h>
+
+#include "camera_frame.hpp"
+#include "frame_arena.hpp"
+#include "pixel_convert.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// A pipeline declared in the "pipeline" block instead of being written out
+// in C++. Stages are connected by bounded queues and run on a shared
+// work-stealing pool:
+//
+//   workers          pool threads, 0 for one per CPU
+//   queue_capacity   default frames per edge
+//   stages           [{"name", "type", "inputs", "per_camera", "concurrency", ...}]
+//
+// Each input is a stage name or {"from", "capacity", "when_full"}. An edge
+// that is full either holds its producer back ("wait", the default) or
+// drops the frame ("drop", for taps that must never slow the rest down). A
+// stage with per_camera is instantiated once per camera as <name>/<camera>
+// and only gets that camera's frames; per-camera instances feed the
+// matching instance downstream, or all of them fan in to a shared stage.
+// Stages run on up to "concurrency" workers at once where the stage type
+// allows it, and emit their frames in input order either way.
+
+class FramePool;
+
+// A pooled image and the capture metadata it came with. meta.data points
+// at the first plane. Frames are shared between all consumers of a stage,
+// only the stage that acquired one writes to it.
+struct VideoFrame {
+  CameraFrame meta;
+  Image image;
+  // Frames of the camera dropped since its previous frame, for the sidecars
+  std::vector<DroppedFrame> dropped;
+
+private:
+  friend class FrameRef;
+  friend class FramePool;
+
+  std::atomic<int> refs_ = 0;
+  FramePool* pool_ = nullptr;
+  uint8_t* buffer_ = nullptr;
+};
+
+// Reference to a pooled frame, the frame goes back to its pool with the last one
+class FrameRef {
+public:
+  FrameRef() = default;
+
+  FrameRef(const FrameRef& other);
+
+  FrameRef(FrameRef&& other) noexcept;
+
+  FrameRef& operator=(const FrameRef& other);
+
+  FrameRef& operator=(FrameRef&& other) noexcept;
+
+  ~FrameRef();
+
+  VideoFrame* get() const { return this->frame_; }
+
+  VideoFrame* operator->() const { return this->frame_; }
+
+  explicit operator bool() const { return this->frame_ != nullptr; }
+
+  void reset();
+
+private:
+  friend class FramePool;
+
+  explicit FrameRef(VideoFrame* frame);
+
+  VideoFrame* frame_ = nullptr;
+};
+
+// A fixed number of frames of one format and size, carved from an arena.
+// Must outlive every FrameRef it handed out.
+class FramePool {
+public:
+  FramePool(PixelFormat format, int width, int height, int count, const std::string& name);
+
+  // Empty when every frame is in use
+  FrameRef acquire();
+
+  int get_count();
+
+private:
+  friend class FrameRef;
+
+  void release(VideoFrame* frame);
+
+  std::unique_ptr<FrameArena> arena_;
+  std::unique_ptr<VideoFrame[]> frames_;
+  int count_ = 0;
+
+  std::mutex mutex_;
+  std::vector<VideoFrame*> free_frames_;
+};
+
+// Fixed-size ring of items between two stages, never blocks
+template <typename T>
+class BoundedQueue {
+public:
+  explicit BoundedQueue(size_t capacity) : slots_(capacity) {}
+
+  bool try_push(T item) {
+    std::lock_guard<std::mutex> lock(this->mutex_);
+    if (this->count_ == this->slots_.size())
+    {
+      return false;
+    }
+    this->slots_[(this->head_ + this->count_) % this->slots_.size()] = std::move(item);
+    this->count_++;
+    return true;
+  }
+
+  bool try_pop(T* item) {
+    std::lock_guard<std::mutex> lock(this->mutex_);
+    if (this->count_ == 0)
+    {
+      return false;
+    }
+    *item = std::move(this->slots_[this->head_]);
+    this->slots_[this->head_] = T();
+    this->head_ = (this->head_ + 1) % this->slots_.size();
+    this->count_--;
+    return true;
+  }
+
+  size_t size() {
+    std::lock_guard<std::mutex> lock(this->mutex_);
+    return this->count_;
+  }
+
+  size_t capacity() const {
+    return this->slots_.size();
+  }
+
+private:
+  std::mutex mutex_;
+  std::vector<T> slots_;
+  size_t head_ = 0;
+  size_t count_ = 0;
+};
+
+// Worker threads with one task deque each. A worker runs its own newest
+// task first, which keeps a frame's data in cache as it moves to the next
+// stage, and steals the oldest task of another worker when it runs dry.
+class WorkStealingPool {
+public:
+  WorkStealingPool(int workers);
+
+  // Runs the tasks still queued, then stops the workers
+  ~WorkStealingPool();
+
+  int get_workers();
+
+  // From a worker the task goes to its own deque, otherwise round robin
+  void submit(std::function<void()> task);
+
+  // Queued behind the worker's other tasks and the first to be stolen, for
+  // a task that gives the others a turn
+  void defer(std::function<void()> task);
+
+  uint64_t get_steals();
+
+private:
+  struct Worker {
+    std::mutex mutex;
+    std::deque<std::function<void()>> tasks;
+  };
+
+  bool take_task(int self, std::function<void()>* task);
+
+  void worker_loop(int self);
+
+  std::vector<std::unique_ptr<Worker>> workers_;
+  std::vector<std::thread> threads_;
+
+  std::atomic<int> queued_ = 0;
+  std::atomic<uint64_t> next_worker_ = 0;
+  std::atomic<uint64_t> steals_ = 0;
+
+  std::mutex sleep_mutex_;
+  std::condition_variable cv_tasks_;
+  bool stopping_ = false;
+};
+
+// What flows along an edge, checked when the graph is built
+struct StreamType {
+  bool valid = false;
+  PixelFormat format = PixelFormat::BGR24;
+  int width = 0;
+  int height = 0;
+};
+
+std::string stream_type_name(const StreamType& type);
+
+// Where a source stage puts its frames
+class FrameOutput {
+public:
+  virtual ~FrameOutput() = default;
+
+  // Whether every waiting edge can take another frame
+  virtual bool has_room() = 0;
+
+  virtual void emit(FrameRef frame) = 0;
+};
+
+// Everything a stage type gets to build one instance
+struct StageContext {
+  std::string name;
+  Json::Value jsonStageConf;
+  // The whole configuration, for the blocks stages share with camera_stream
+  Json::Value config;
+  // The instance's camera, -1 for a stage that sees every camera
+  int camera = -1;
+  std::vector<int> cameras;
+};
+
+class Stage {
+public:
+  virtual ~Stage() = default;
+
+  // Checks the input type (invalid for sources) and sets the output type,
+  // which stays invalid for sinks
+  virtual bool configure(const StreamType& input, StreamType* output, std::string* error) = 0;
+
+  // Called once the graph is connected, frames_in_flight is the most frames
+  // of this stage's output that can exist at once
+  virtual bool open(int frames_in_flight) { return true; }
+
+  // Workers the stage can use at once, stages with state keep 1
+  virtual int get_max_concurrency() { return 1; }
+
+  // Handles one input frame and returns the output frame, if any
+  virtual FrameRef process(const FrameRef& input) { return FrameRef(); }
+
+  virtual bool is_source() { return false; }
+
+  // Sources run on a thread of their own until stop_source(), and must keep
+  // emitting until everything they captured is out
+  virtual void run_source(FrameOutput* output) {}
+
+  virtual void stop_source() {}
+
+  // Called once after the last frame was processed
+  virtual void finish() {}
+
+  // Appended to the stage's line of the periodic report
+  virtual void report(std::ostream& out) {}
+};
+
+using StageFactory = std::function<std::unique_ptr<Stage>(const StageContext& context)>;
+
+class DataflowGraph {
+public:
+  DataflowGraph(Json::Value config);
+
+  ~DataflowGraph();
+
+  void register_stage_type(const std::string& type, StageFactory factory);
+
+  // Instantiates, type checks and opens every stage of the pipeline block
+  bool build();
+
+  // Starts the sources, on_sources_done runs once all of them have returned
+  void start(std::function<void()> on_sources_done);
+
+  // Stops the sources and returns once every frame has gone through
+  void stop();
+
+  // Per stage frames per second, busy time and queue fill since the last call
+  void print_stats(std::ostream& out);
+
+private:
+  struct Node;
+
+  struct Edge {
+    Node* from = nullptr;
+    Node* to = nullptr;
+    // Only frames of this camera pass, -1 for all
+    int camera = -1;
+    bool drop_when_full = false;
+    std::unique_ptr<BoundedQueue<FrameRef>> queue;
+    std::atomic<int64_t> dropped = 0;
+  };
+
+  struct Node : public FrameOutput {
+    std::string name;
+    std::string type;
+    Json::Value jsonStageConf;
+    int camera = -1;
+    std::unique_ptr<Stage> stage;
+    StreamType output_type;
+    int concurrency = 1;
+
+    DataflowGraph* graph = nullptr;
+    std::vector<Edge*> inputs;
+    std::vector<Edge*> outputs;
+    bool is_source = false;
+
+    // Workers on the node, and whether it may have work they have not seen
+    std::atomic<int> active = 0;
+    std::atomic<bool> pending = false;
+    // Set while the node waits for room downstream
+    std::atomic<bool> blocked = false;
+    bool finished = false;
+
+    // Frames are taken in ticket order and emitted in the same order
+    std::mutex mutex;
+    size_t next_input = 0;
+    uint64_t next_ticket = 0;
+    uint64_t next_commit = 0;
+    int in_flight = 0;
+    std::vector<FrameRef> results;
+    std::vector<bool> done;
+
+    std::atomic<int64_t> processed = 0;
+    std::atomic<int64_t> busy_ns = 0;
+    int64_t reported_processed = 0;
+    int64_t reported_busy_ns = 0;
+
+    bool has_room() override;
+
+    void emit(FrameRef frame) override;
+
+    bool has_room_locked(int extra);
+
+    // Pushes to every matching output edge and wakes the consumers
+    void push_outputs(const FrameRef& frame);
+  };
+
+  bool instantiate(const Json::Value& jsonStages);
+
+  bool connect(const Json::Value& jsonStages);
+
+  bool sort_nodes();
+
+  // Runs the node if it has a free worker slot
+  void schedule(Node* node);
+
+  void run_node(Node* node);
+
+  // Processes one frame, false if there was none or no room for its output
+  bool step(Node* node);
+
+  bool is_drained(Node* node);
+
+  Json::Value config_;
+  Json::Value jsonPipelineConf_;
+  int num_cameras_ = 1;
+
+  std::map<std::string, StageFactory> factories_;
+  // Instances of every declared stage, by declared name
+  std::map<std::string, std::vector<Node*>> instances_;
+  std::vector<std::unique_ptr<Edge>> edges_;
+  std::vector<std::unique_ptr<Node>> nodes_;
+  // Topological order, sources first
+  std::vector<Node*> order_;
+
+  std::unique_ptr<WorkStealingPool> pool_;
+  std::vector<std::thread> source_threads_;
+  std::atomic<int> running_sources_ = 0;
+  std::chrono::steady_clock::time_point last_report_;
+  bool stopped_ = false;
+};
@@ -0,0 +1,21 @@
+#pragma once
+
+#include "dataflow_graph.hpp"
+
+// Stage types built from the recording pipeline's parts. Blocks shared with
+// camera_stream ("load_shedding", "video_encoding", "shared_memory",
+// "raw_recording") are the defaults, keys given in the stage override them.
+//
+//   capture        source: the cameras of "source" (ximea or synthetic)
+//                  behind the load shedder, BGR24 with aligned timestamps
+//   convert        to "format" (bgr24, rgb24, bgra, nv12, i420), scaled
+//                  down to "width" and/or "height" if given, parallel
+//   encode         records each camera like camera_stream, "video_encoding"
+//                  in the stage overrides the block; NV12, BGRA if lossless
+//   stream         serves each camera on "port" + camera once a viewer
+//                  connects, skipping frames until then; NV12
+//   timestamp_log  the per-camera timestamp files, with dropped frames
+//   shm            shared memory frame rings, packed RGB formats
+//   raw            raw frame recording, packed RGB formats
+//   discard        consumes frames, for benchmarking the stages before it
+void register_pipeline_stages(DataflowGraph* graph);
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <jsoncpp/json/json.h>
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of worker threads shared by many decode sessions. Sessions
+// schedule themselves when they have packets queued and are never run on
+// two workers at once, so N streams are decoded by "workers" threads plus
+// each decoder's own codec threads, which are sized so that the total stays
+// close to the worker count. Configured by "decode_pool":
+//
+//   workers              worker threads, 0 for one per CPU
+//   max_queued_packets   packets a session buffers before submit blocks
+class DecodePool {
+public:
+  DecodePool(Json::Value jsonPoolConf, int num_sessions);
+
+  // Waits for the scheduled sessions to run
+  ~DecodePool();
+
+  int get_workers();
+
+  // FFmpeg thread_count for each session's decoder, the workers' share per
+  // session: with more streams than CPUs, streams run in parallel instead
+  int get_codec_threads();
+
+  int get_max_queued_packets();
+
+  void schedule(std::function<void()> task);
+
+private:
+  void worker_loop();
+
+  int workers_ = 1;
+  int codec_threads_ = 1;
+  int max_queued_packets_ = 16;
+
+  std::mutex mutex_;
+  std::condition_variable cv_tasks_;
+  std::deque<std::function<void()>> tasks_;
+  bool stopping_ = false;
+
+  std::vector<std::thread> threads_;
+};
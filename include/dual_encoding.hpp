@@ -0,0 +1,133 @@
+#pragma once
+
+extern "C" {
+  #include <libavcodec/avcodec.h>
+  #include <libavutil/imgutils.h>
+}
+
+#include <jsoncpp/json/json.h>
+#include <opencv2/opencv.hpp>
+
+#include "frame_arena.hpp"
+#include "network_connection.hpp"
+#include "pipe.hpp"
+#include "video_encoding.hpp"
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Drives a full-resolution recording encoder and an optional low-bitrate
+// preview stream encoder from one capture feed. The BGRA to NV12 conversion
+// and the preview downscale are done once on the calling thread, each
+// encoder runs on its own thread.
+class DualEncoding {
+public:
+  DualEncoding(Json::Value jsonVideoConf,
+               int session_idx);
+
+  ~DualEncoding();
+
+  // metadata goes into the recording and the preview, see VideoEncoding
+  void encode_frame(const cv::Mat* bgra,
+                    int64_t frame_count,
+                    int64_t timestamp_ms,
+                    const FrameMetadata* metadata = nullptr);
+
+  // Drains both encoders and finalizes the recording
+  void finish();
+
+  // Queues a change of the recording's bitrate (Mbit/s), encoder, preset or
+  // gop_size, applied by the record thread before its next frame. The bitrate
+  // changes in place where the encoder supports it. Anything else opens a new
+  // encoder next to the running one and switches to it, and to the next file
+  // segment, once it is open; the new segment starts with a keyframe and no
+  // frame is dropped. If it cannot be opened, the failure is logged and the
+  // running encoder keeps recording. Safe to call from any thread.
+  bool reconfigure(const std::string& param,
+                   const std::string& value,
+                   std::string* error);
+
+  // Replaced when the recording switches to a new encoder
+  VideoEncoding* get_record_encoder();
+
+  bool embeds_metadata();
+
+private:
+  struct PendingChange {
+    std::string param;
+    std::string value;
+    int number = 0;  // bitrate and gop_size, parsed by reconfigure()
+  };
+
+  struct FrameRef {
+    int slot = -1;
+    int64_t frame_count = 0;
+    int64_t timestamp_ms = -1;
+    bool has_metadata = false;
+    FrameMetadata metadata;
+  };
+
+  void record_loop();
+
+  void preview_loop();
+
+  void apply_reconfiguration(int64_t frame_count);
+
+  void open_next_encoder(Json::Value jsonRecordConf);
+
+  AVFrame* allocate_nv12_frame(int width, int height);
+
+  Json::Value jsonVideoConf_;
+  Json::Value jsonPreviewConf_;
+  int session_idx_ = -1;
+
+  std::unique_ptr<FrameArena> arena_;
+
+  std::unique_ptr<VideoEncoding> record_encoder_;
+  std::unique_ptr<VideoEncoding> preview_encoder_;
+
+  // put() returns once the record thread has fetched the previous frame,
+  // which only proves the one before that was encoded, hence three slots
+  static const int kRecordSlots = 3;
+  AVFrame* record_frames_[kRecordSlots] = {nullptr, nullptr, nullptr};
+  int next_slot_ = 0;
+  PipeDataIn<FrameRef> record_pipe_;
+  std::thread record_thread_;
+  bool record_lossless_ = false;
+
+  // Runtime changes, queued by reconfigure() and applied on the record thread.
+  // Every change that needs a new encoder bumps config_version_.
+  std::mutex reconfigure_mutex_;
+  std::vector<PendingChange> pending_changes_;
+  Json::Value jsonRecordConf_;
+  int config_version_ = 0;
+  int encoder_version_ = 0;
+  int segment_ = 0;
+
+  // The next encoder is opened on its own thread, the retired one drains on
+  // another. A next encoder that fails to open is left null.
+  std::thread open_thread_;
+  int opening_version_ = 0;
+  Json::Value jsonOpeningConf_;
+  Json::Value jsonActiveConf_;
+  std::atomic<bool> next_encoder_ready_ = false;
+  std::unique_ptr<VideoEncoding> next_encoder_;
+  std::thread retire_thread_;
+  std::unique_ptr<VideoEncoding> retired_encoder_;
+
+  // The preview only takes a frame when idle, so it never holds back recording
+  bool preview_enabled_ = false;
+  AVFrame* preview_frame_ = nullptr;
+  cv::Mat preview_bgra_;
+  std::atomic<bool> preview_idle_ = false;
+  std::unique_ptr<NetworkConnection> preview_connection_;
+  PipeDataIn<FrameRef> preview_pipe_;
+  std::thread preview_thread_;
+
+  bool finished_ = false;
+};
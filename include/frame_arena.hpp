@@ -0,0 +1,66 @@
+#pragma once
+
+extern "C" {
+  #include <libavutil/buffer.h>
+  #include <libavutil/frame.h>
+  #include <libavutil/pixfmt.h>
+}
+
+#include <opencv2/opencv.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+// Bump allocator over one mapping for the long-lived frame buffers of a
+// pipeline stage. The mapping uses 2 MB huge pages when they are reserved
+// (MAP_HUGETLB), transparent huge pages (MADV_HUGEPAGE) otherwise, and every
+// page is faulted in by the constructing thread, so buffers carved from the
+// arena are NUMA-local to it and never fault in steady state. Blocks are
+// only released together with the arena.
+class FrameArena {
+public:
+  static const size_t kAlignment = 64;
+  static const size_t kHugePageSize = 2 * 1024 * 1024;
+
+  FrameArena(size_t capacity,
+             const std::string& name);
+
+  ~FrameArena();
+
+  // Returns nullptr once the arena is full. Thread-safe, buffer pools
+  // allocate from whichever thread first needs a new buffer.
+  uint8_t* allocate(size_t size, size_t alignment = kAlignment);
+
+  // Falls back to a heap-backed Mat once the arena is full
+  cv::Mat allocate_mat(int rows, int cols, int type);
+
+  // Plain (not reference counted) frame over arena memory, free with av_frame_free
+  AVFrame* allocate_frame(enum AVPixelFormat format, int width, int height);
+
+  // Reference counted buffers of a fixed size, recycled by FFmpeg's buffer
+  // pool. preallocate buffers are carved up front, later ones come from the
+  // arena while it has room and from the heap after that.
+  AVBufferPool* create_buffer_pool(size_t size, int preallocate);
+
+  size_t get_capacity();
+
+  size_t get_used();
+
+  bool is_huge_page_backed();
+
+  // Bytes of one frame laid out with kAlignment strides
+  static size_t get_frame_size(enum AVPixelFormat format, int width, int height);
+
+private:
+  static AVBufferRef* pool_alloc(void* opaque, size_t size);
+
+  std::string name_;
+  std::mutex mutex_;
+  uint8_t* base_ = nullptr;
+  size_t capacity_ = 0;
+  size_t used_ = 0;
+  bool huge_pages_ = false;
+  bool exhausted_ = false;
+};
@@ -0,0 +1,42 @@
+#pragma once
+
+extern "C" {
+  #include <libavcodec/avcodec.h>
+}
+
+#include "camera_frame.hpp"
+
+#include <cstddef>
+#include <cstdint>
+
+// Capture metadata carried inside the bitstream, one user data unregistered
+// SEI message (payload type 5) per frame, so it cannot drift from the video
+// and reaches stream receivers too. The payload is a fixed UUID followed by
+// the fields below, little-endian.
+struct FrameMetadata {
+  int32_t camera_idx = -1;
+  int64_t frame_number = -1;
+  int64_t sensor_timestamp_us = -1;
+  int64_t host_timestamp_us = -1;
+  int64_t aligned_timestamp_us = -1;
+  int32_t exposure_us = 0;
+  float gain_db = 0.0f;
+};
+
+// UUID and fields
+static const size_t kFrameMetadataSize = 64;
+
+FrameMetadata make_frame_metadata(const CameraFrame& frame);
+
+// Whether FFmpeg's encoders and decoders for the codec can carry the SEI
+bool codec_supports_frame_metadata(AVCodecID codec_id);
+
+// Writes the kFrameMetadataSize payload of the SEI message
+void write_frame_metadata(const FrameMetadata& metadata, uint8_t* payload);
+
+// Reads a payload written by write_frame_metadata(), false for other user data
+bool read_frame_metadata(const uint8_t* payload, size_t size, FrameMetadata* metadata);
+
+// Finds the metadata SEI in an H.264 or HEVC packet, Annex B or length
+// prefixed as in MP4. Reads the packet in place.
+bool find_packet_metadata(AVCodecID codec_id, const uint8_t* data, size_t size, FrameMetadata* metadata);
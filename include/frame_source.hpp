@@ -0,0 +1,25 @@
+#pragma once
+
+#include "camera_frame.hpp"
+
+#include <string>
+
+// Anything that produces CameraFrames for the consumer
+class FrameSource {
+public:
+  virtual ~FrameSource() = default;
+
+  virtual void start_capture() = 0;
+
+  virtual void stop_capture() = 0;
+
+  // Queues a parameter change for camera idx (-1 for all), applied between
+  // two frames of that camera. Returns false with the reason if rejected.
+  virtual bool set_param(int idx,
+                         const std::string& param,
+                         const std::string& value,
+                         std::string* error) {
+    *error = "not supported by this source";
+    return false;
+  }
+};
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <jsoncpp/json/json.h>
+
+#include "camera_frame.hpp"
+#include "frame_arena.hpp"
+
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <utility>
+#include <vector>
+
+// Maps one camera's sensor clock onto the host epoch clock. Host timestamps
+// are the sensor time plus an unknown offset plus a transport delay that is
+// never negative, so the lower envelope of (host - sensor) tracks the offset.
+// The minimum of every window is kept and a least squares line through the
+// recent minima gives offset and drift.
+class ClockAligner {
+public:
+  ClockAligner(int64_t window_us = 1000000,
+               size_t max_windows = 30);
+
+  // Feeds one sample and returns the sensor timestamp on the host clock
+  int64_t align(int64_t sensor_us, int64_t host_us);
+
+  // Host minus sensor time at the last aligned frame
+  double get_offset_us();
+
+  // Positive when the sensor clock runs faster than the host clock
+  double get_drift_ppm();
+
+private:
+  void reset(int64_t sensor_us);
+
+  void fit();
+
+  int64_t window_us_ = 1000000;
+  size_t max_windows_ = 30;
+
+  // Sensor times are kept relative to the first sample, offsets relative to
+  // the first offset, so the fit stays well inside double precision
+  int64_t base_sensor_us_ = -1;
+  int64_t base_offset_us_ = 0;
+  int64_t last_sensor_us_ = -1;
+
+  int64_t window_start_us_ = -1;
+  int64_t window_min_offset_us_ = 0;
+  int64_t window_min_sensor_us_ = 0;
+
+  std::deque<std::pair<double, double>> minima_;
+  bool has_fit_ = false;
+  double intercept_us_ = 0.0;
+  double slope_ = 0.0;
+
+  double offset_us_ = 0.0;
+};
+
+struct FrameSet {
+  int64_t set_number = -1;
+  int64_t timestamp_us = -1;        // Mean aligned timestamp of the frames present
+  std::vector<CameraFrame> frames;  // One per camera, data is null if it missed the set
+  int num_frames = 0;
+};
+
+// Groups aligned frames of all cameras into sets whose timestamps lie within
+// tolerance_us of each other. A set is emitted as soon as every camera has
+// contributed, or with the cameras present once max_wait_us has passed on
+// the host clock, so a late or stalled camera never holds back the others.
+// Frames that arrive after their set was emitted are dropped.
+//
+// Sources reuse their buffers, so push() copies the image into a pool owned
+// by the synchronizer. tolerance_us must stay below half the frame period.
+class FrameSynchronizer {
+public:
+  FrameSynchronizer(Json::Value jsonSyncConf,
+                    int num_cameras,
+                    size_t frame_bytes);
+
+  // frame.aligned_timestamp_us must be set
+  void push(const CameraFrame& frame);
+
+  // Returns true and fills set if one is ready, call release_set() when done
+  bool pop_set(FrameSet* set, int64_t now_us);
+
+  void release_set(const FrameSet& set);
+
+  // Microseconds until the oldest pending set is emitted without the missing
+  // cameras, -1 if no frame is pending
+  int64_t get_wait_us(int64_t now_us);
+
+  int64_t get_sets();
+
+  int64_t get_partial_sets();
+
+  int64_t get_dropped_frames();
+
+  // Appends the frames dropped since the last call
+  void take_dropped_frames(std::vector<DroppedFrame>* dropped);
+
+private:
+  void drop_oldest(int camera_idx);
+
+  void record_drop(const CameraFrame& frame, const char* reason);
+
+  int num_cameras_ = 0;
+  size_t frame_bytes_ = 0;
+  int64_t tolerance_us_ = 2000;
+  int64_t max_wait_us_ = 20000;
+  size_t max_pending_ = 4;
+
+  std::unique_ptr<FrameArena> arena_;
+  std::vector<uint8_t*> free_buffers_;
+  std::vector<std::deque<CameraFrame>> pending_;
+
+  int64_t last_anchor_us_ = INT64_MIN;
+  int64_t sets_ = 0;
+  int64_t partial_sets_ = 0;
+  int64_t dropped_frames_ = 0;
+  std::vector<DroppedFrame> dropped_log_;
+};
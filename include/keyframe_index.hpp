@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// Sidecar written next to a recording (<video>.idx) with one fixed-size
+// record per encoded frame, so review tools can map a capture timestamp to
+// the frame and the keyframe decoding has to start from. Readers seek by
+// frame number (pts), container byte offsets are not recorded.
+
+static constexpr char KEYFRAME_INDEX_MAGIC[8] = {'P', 'D', 'C', 'I', 'D', 'X', '0', '2'};
+
+struct KeyframeIndexEntry {
+  int64_t frame_number;
+  int64_t timestamp_ms;     // Capture timestamp, -1 if unknown
+  int64_t packet_size;
+  int64_t keyframe_number;  // Nearest keyframe at or before this frame
+};
+
+class KeyframeIndexWriter {
+public:
+  KeyframeIndexWriter(const std::string& index_file);
+
+  ~KeyframeIndexWriter();
+
+  bool is_open();
+
+  void add_entry(int64_t frame_number, int64_t timestamp_ms, int64_t packet_size, bool keyframe);
+
+private:
+  std::ofstream index_log_;
+  int64_t last_keyframe_ = -1;
+};
+
+class KeyframeIndexReader {
+public:
+  KeyframeIndexReader(const std::string& index_file);
+
+  bool load();
+
+  size_t get_size() const;
+
+  // Entry of the first frame captured at or after timestamp_ms
+  const KeyframeIndexEntry* seek_timestamp(int64_t timestamp_ms) const;
+
+  const KeyframeIndexEntry* seek_frame(int64_t frame_number) const;
+
+  const KeyframeIndexEntry* get_keyframe(const KeyframeIndexEntry* entry) const;
+
+private:
+  std::string index_file_;
+  std::vector<KeyframeIndexEntry> entries_;
+};
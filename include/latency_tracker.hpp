@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+// Process-wide latency histograms of the recording path, for soak runs.
+// Recording is one relaxed atomic increment into a log-linear bucket (1 us
+// resolution up to 64 us, then 16 buckets per power of two) and does
+// nothing until tracking is enabled, so the hooks stay in production code.
+enum class LatencyStage {
+  Queue,     // Capture to the consumer popping the frame
+  Consume,   // The consumer writing one frame
+  Encode,    // One record encode and mux
+  EndToEnd,  // Exposure to the frame being muxed
+  Count
+};
+
+const char* latency_stage_name(LatencyStage stage);
+
+void enable_latency_tracking();
+
+bool latency_tracking_enabled();
+
+void record_latency(LatencyStage stage, int64_t latency_us);
+
+// Bucket counts of a stage, two of them give the samples in between
+struct LatencyCounts {
+  std::vector<uint64_t> buckets;
+  uint64_t total = 0;
+};
+
+void read_latency_counts(LatencyStage stage, LatencyCounts* counts);
+
+// Upper bound of the bucket holding the p-th percentile (0-100) of the
+// samples recorded between the two reads, -1 if there were none
+int64_t latency_percentile(const LatencyCounts& before, const LatencyCounts& after, double p);
@@ -0,0 +1,137 @@
+#pragma once
+
+#include <jsoncpp/json/json.h>
+
+#include "camera_frame.hpp"
+#include "frame_arena.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Bounded per-camera frame queues between capture and encode. Capture never
+// waits on the consumer: when a queue is full the policy decides which frame
+// is dropped, and every dropped frame number is recorded so the timestamp
+// sidecar lists exactly what is missing. Configured by "load_shedding":
+//
+//   queue_depth      frames queued per camera
+//   policy           drop_oldest, drop_newest, or keep_every_nth (once a
+//                    queue is half full only frame numbers divisible by
+//                    keep_every are queued, a full queue drops the oldest)
+//   protect_every    frame numbers divisible by it are dropped last, e.g.
+//                    the GOP length so keyframe candidates survive
+//   max_backlog      frames queued over all cameras, beyond it cameras with
+//                    a lower camera_priority lose their frames first
+//
+// Frames are copied into buffers owned by the shedder, as the SDK reuses
+// its buffer on the next xiGetImage. Gaps in a camera's frame numbers are
+// frames skipped before they reached the host, they are recorded as
+// "skipped" next to the frames shed here. A jump of the frame number that
+// the sensor clock does not follow is a reset counter and not counted.
+//
+// With keep_latest, the last frame the consumer finished with stays
+// available to take_latest() in a lock-free slot instead of going straight
+// back to the free buffers, so snapshots need no copy on the recording path.
+class LoadShedder {
+public:
+  LoadShedder(Json::Value jsonSheddingConf,
+              int num_cameras,
+              size_t frame_bytes,
+              bool keep_latest = false);
+
+  // Called by the capture thread of frame.camera_idx, never blocks
+  void offer(const CameraFrame& frame);
+
+  // Takes the oldest queued frame of the camera. Its data stays valid until
+  // the next pop() for the same camera.
+  bool pop(int idx, CameraFrame* frame);
+
+  // Returns once any camera has a frame queued or the timeout passed
+  void wait_for_frames(std::chrono::microseconds timeout);
+
+  // Cameras by descending priority, the order the consumer serves them in
+  const std::vector<int>& get_service_order();
+
+  // Takes the latest consumed frame of the camera, false if there is none or
+  // another take holds it. The data stays valid until return_latest(). One
+  // thread takes and returns, and holds at most one frame per camera.
+  bool take_latest(int idx, CameraFrame* frame);
+
+  void return_latest(int idx, const CameraFrame& frame);
+
+  // Appends the frames dropped since the last call
+  void take_dropped_frames(std::vector<DroppedFrame>* dropped);
+
+  int64_t get_offered_frames(int idx);
+
+  int64_t get_dropped_frames(int idx);
+
+  // Frames missing from the numbering the camera delivered
+  int64_t get_skipped_frames(int idx);
+
+private:
+  struct CameraQueue {
+    int priority = 0;
+    std::deque<CameraFrame> queued;
+    std::vector<uint8_t*> free_buffers;
+    uint8_t* popped = nullptr;
+    CameraFrame popped_frame;
+    // Every buffer of the camera and the frame it last held, indexed like
+    // the latest and returned slots
+    std::vector<uint8_t*> buffers;
+    std::vector<CameraFrame> buffer_frames;
+    int64_t offered = 0;
+    int64_t dropped = 0;
+    int64_t skipped = 0;
+    int64_t last_frame_number = -1;
+    // Sensor clock of the last frame and between two consecutive frames,
+    // tells a stall from a reset frame counter
+    int64_t last_timestamp_us = -1;
+    int64_t frame_interval_us = 0;
+  };
+
+  bool is_protected(const CameraFrame& frame);
+
+  // Drops the oldest unprotected queued frame, or the oldest if all are protected
+  bool evict(int idx, const char* reason);
+
+  // Lowest priority camera, at most max_priority, that has a frame to drop
+  int find_victim(int max_priority);
+
+  void record_drop(const CameraFrame& frame, const char* reason);
+
+  void record_skipped(const CameraFrame& frame);
+
+  int buffer_index(const CameraQueue& camera, const void* data);
+
+  // Called by pop() for the frame the consumer is done with
+  void publish_latest(int idx);
+
+  size_t frame_bytes_ = 0;
+  size_t queue_depth_ = 4;
+  std::string policy_ = "drop_oldest";
+  int64_t keep_every_ = 2;
+  int64_t protect_every_ = 0;
+  size_t max_backlog_ = 0;
+
+  std::unique_ptr<FrameArena> arena_;
+
+  // Per camera, buffer indices or -1: the latest consumed frame, and a
+  // frame handed back after a newer one took the slot, which pop() recycles
+  bool keep_latest_ = false;
+  std::unique_ptr<std::atomic<int>[]> latest_;
+  std::unique_ptr<std::atomic<int>[]> returned_;
+
+  std::mutex mutex_;
+  std::condition_variable cv_frames_;
+  std::vector<CameraQueue> cameras_;
+  std::vector<int> service_order_;
+  size_t total_queued_ = 0;
+  std::vector<DroppedFrame> dropped_log_;
+};
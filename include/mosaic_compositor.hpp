@@ -0,0 +1,99 @@
+#pragma once
+
+extern "C" {
+  #include <libavcodec/avcodec.h>
+  #include <libavutil/imgutils.h>
+}
+
+#include <jsoncpp/json/json.h>
+#include <opencv2/opencv.hpp>
+
+#include "frame_arena.hpp"
+#include "frame_sync.hpp"
+#include "pipe.hpp"
+#include "video_encoding.hpp"
+
+#include <atomic>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Tiles every synchronized frame set into one NV12 canvas and records it
+// with a single VideoEncoding session instead of one session per camera.
+// The canvas is an input frame from the encoder's own pool, so it is handed
+// to the encoder without a copy, and the next set is composed while the
+// previous one is encoded. Each camera is converted and scaled with libyuv
+// in per-tile scratch buffers and written into its tile, tiles are processed
+// in parallel.
+class MosaicCompositor {
+public:
+  MosaicCompositor(Json::Value jsonVideoConf,
+                   int num_cameras,
+                   int camera_width,
+                   int camera_height);
+
+  ~MosaicCompositor();
+
+  // Tiles of cameras missing from the set keep their previous image
+  void encode_set(const FrameSet& frame_set);
+
+  // Drains the encoder and finalizes the recording
+  void finish();
+
+  // Only the bitrate (Mbit/s) can change, in place, on encoders that support
+  // it. Applied by the encode thread before its next canvas.
+  bool reconfigure(const std::string& param,
+                   const std::string& value,
+                   std::string* error);
+
+private:
+  struct Rect {
+    int x = 0;
+    int y = 0;
+    int width = 0;
+    int height = 0;
+  };
+
+  struct Tile {
+    Rect rect;
+    uint8_t* camera_argb = nullptr;  // Full camera size, only when scaling
+    uint8_t* argb = nullptr;         // Tile size
+  };
+
+  struct CanvasRef {
+    AVFrame* canvas = nullptr;
+    int64_t frame_count = 0;
+    int64_t timestamp_ms = -1;
+  };
+
+  void compose_tile(const CameraFrame& frame, AVFrame* canvas);
+
+  // Fills a region of the canvas with black
+  void clear_rect(AVFrame* canvas, const Rect& rect);
+
+  void encode_loop();
+
+  int num_cameras_ = 0;
+  int camera_width_ = 0;
+  int camera_height_ = 0;
+
+  std::unique_ptr<FrameArena> arena_;
+  std::vector<Tile> tiles_;
+  // Unused grid cells and margins, pooled canvases may hold anything there
+  std::vector<Rect> blank_rects_;
+
+  std::unique_ptr<VideoEncoding> encoder_;
+  std::atomic<int64_t> pending_bitrate_ = 0;
+  std::ofstream timestamp_log_;
+  int64_t frame_count_ = 0;
+
+  // The last composed canvas, tiles of missing cameras are copied from it.
+  // The encoder only reads it, so both can hold a reference.
+  AVFrame* previous_ = nullptr;
+  PipeDataIn<CanvasRef> encode_pipe_;
+  std::thread encode_thread_;
+
+  bool finished_ = false;
+};
@@ -0,0 +1,60 @@
+#pragma once
+
+extern "C" {
+  #include <libavutil/frame.h>
+}
+
+#include <jsoncpp/json/json.h>
+#include <opencv2/opencv.hpp>
+
+#include <vector>
+
+// Per-block motion estimate on the NV12 luma plane, computed as the mean
+// absolute difference against the last encoded frame. Used to give moving
+// blocks a lower QP than the static background (AVRegionOfInterest side
+// data) and to skip frames in which nothing changed.
+class MotionMap {
+public:
+  MotionMap(Json::Value jsonMotionConf,
+            int width,
+            int height);
+
+  // Compares the frame against the reference, does not modify either
+  void analyze(const AVFrame* nv12);
+
+  bool should_skip();
+
+  // Replaces any ROI side data on the frame with the current motion map
+  void apply_roi(AVFrame* frame);
+
+  // Makes the frame the new reference, call once it is sent to the encoder
+  void commit(const AVFrame* nv12);
+
+  double get_moving_fraction();
+
+  int64_t get_skipped_frames();
+
+private:
+  int width_ = 0;
+  int height_ = 0;
+  int block_size_ = 32;
+  int grid_cols_ = 0;
+  int grid_rows_ = 0;
+
+  double threshold_ = 6.0;
+  double static_qoffset_ = 0.4;
+  double motion_qoffset_ = -0.2;
+  double skip_fraction_ = 0.0;
+  int max_skipped_ = 0;
+
+  cv::Mat reference_luma_;
+  cv::Mat diff_;
+  cv::Mat block_diff_;
+  bool has_reference_ = false;
+
+  std::vector<uint8_t> moving_;
+  int moving_blocks_ = 0;
+
+  int consecutive_skipped_ = 0;
+  int64_t skipped_frames_ = 0;
+};
@@ -9,28 +9,49 @@
 
 class NetworkConnection {
 public:
-  NetworkConnection(const std::string& ip_address, int port);
+  // With auto_connect the constructor blocks until connected/accepted,
+  // otherwise call connect_server() or accept_client() explicitly
+  NetworkConnection(const std::string& ip_address, int port, bool auto_connect = true);
 
   ~NetworkConnection();
 
   bool connect_server();
 
+  // Can be called again for the next client once the last one is gone
   bool accept_client();
 
   int get_server_socket() const;
 
   int get_client_socket() const;
 
+  // Unblocks a pending accept() or connect() from another thread
+  void shutdown_connection();
+
 private:
   std::string ip_address_;
   int port_;
 
-  int socket_;
-  int client_socket_;
+  int socket_ = -1;
+  int client_socket_ = -1;
+  bool listening_ = false;
   struct sockaddr_in server_addr_;
   struct sockaddr_in client_addr_;
 };
 
+// Messages sent from the receiver back to the encoder over the stream socket
+enum ControlMessageType : int32_t {
+  CONTROL_KEYFRAME_REQUEST = 1,
+  CONTROL_FRAME_ACK = 2,        // frame_count holds the index of the received packet
+};
+
+struct ControlMessage {
+  int32_t type;
+  int32_t value;
+  int64_t frame_count;
+};
+
+// Both return -1 unless every byte went through, after a failure the
+// stream is out of step and the connection has to be dropped
 ssize_t send_all(int socket, const void* buffer, size_t length);
 
 ssize_t receive_all(int socket, char* buffer, size_t length);
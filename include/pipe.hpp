@@ -3,7 +3,9 @@
 #include <condition_variable>
 #include <exception>
 #include <iostream>
+#include <memory>
 #include <mutex>
+#include <stdexcept>
 #include <vector>
 
 class InTerminatedException : public std::exception
@@ -55,6 +57,12 @@ public:
       cvPutData.wait(lock);
     }
 
+    // terminate() only marks data present to wake fetchers, there is nothing to return
+    if (isTerminated)
+    {
+      throw InTerminatedException();
+    }
+
     TIn outData = std::move(readyInData);
 
     isDataPresent = false;
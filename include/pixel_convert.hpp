@@ -0,0 +1,87 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+struct AVFrame;
+
+// Formats are named by their byte order in memory: RGB24 is R, G, B and
+// BGR24 is B, G, R (what XIMEA delivers as XI_RGB24 and OpenCV uses), BGRA
+// is FFmpeg's BGRA/BGR0 and libyuv's ARGB. RAW8/RAW16 are Bayer mosaics,
+// P010 is NV12 with 16 bit samples holding 10 bits at the top.
+enum class PixelFormat { RGB24, BGR24, BGRA, RAW8, RAW16, NV12, I420, P010 };
+
+// Baseline is the architecture's default vector unit: SSE2 on x86-64, NEON
+// on AArch64
+enum class SimdLevel { Baseline, SSE4, AVX2, AVX512 };
+
+struct Image {
+  PixelFormat format = PixelFormat::BGR24;
+  int width = 0;
+  int height = 0;
+  uint8_t* planes[3] = {nullptr, nullptr, nullptr};
+  // Bytes per row of each plane
+  int strides[3] = {0, 0, 0};
+  // RAW16: significant bits per sample
+  int bits = 8;
+  // Bayer: position of the red sample in the 2x2 pattern, (0, 0) for RGGB
+  int red_x = 0;
+  int red_y = 0;
+};
+
+// A single buffer holding the planes one after another. stride is the
+// first plane's, 0 for tightly packed rows.
+Image make_image(PixelFormat format, int width, int height, uint8_t* data, int stride = 0);
+
+size_t image_size(PixelFormat format, int width, int height);
+
+// Wraps the planes of a decoded frame, false for formats without a kernel
+bool wrap_av_frame(const AVFrame* frame, Image* image);
+
+bool pixel_format_from_av(int av_pix_fmt, PixelFormat* format);
+
+const char* pixel_format_name(PixelFormat format);
+
+// Highest level the CPU supports, detected once
+SimdLevel detect_simd_level();
+
+const char* simd_level_name(SimdLevel level);
+
+// A conversion between two formats, specialized at compile time for each
+// pair and compiled once per instruction set. Look it up once per session,
+// not per frame. Supported pairs:
+//
+//   RGB24, BGR24, BGRA      to each other and themselves (BGRA sets alpha)
+//   NV12, I420, P010        to RGB24, BGR24, BGRA, and NV12 or I420 other
+//                           than themselves
+//   RGB24, BGR24, BGRA      to NV12 and I420
+//   RAW8, RAW16             to RGB24, BGR24 and BGRA (bilinear demosaic)
+//
+// Colors use the BT.601 limited range matrix of libyuv and the encoders.
+class ConversionKernel {
+public:
+  using Function = void (*)(const Image& src, const Image& dst, int first_row, int last_row);
+
+  ConversionKernel() = default;
+
+  // Uses the best variant up to max_level that the CPU supports
+  ConversionKernel(PixelFormat src, PixelFormat dst, SimdLevel max_level = SimdLevel::AVX512);
+
+  bool is_valid() const;
+
+  SimdLevel get_level() const;
+
+  // src and dst must have the kernel's formats and the same size. Converting
+  // in place works between packed formats of the same pixel size.
+  bool convert(const Image& src, const Image& dst) const;
+
+  // Rows [first_row, last_row), to split a frame between threads. Rows of
+  // 4:2:0 destinations are converted in pairs, first_row must be even.
+  void convert_rows(const Image& src, const Image& dst, int first_row, int last_row) const;
+
+private:
+  PixelFormat src_ = PixelFormat::BGR24;
+  PixelFormat dst_ = PixelFormat::BGR24;
+  SimdLevel level_ = SimdLevel::Baseline;
+  Function function_ = nullptr;
+};
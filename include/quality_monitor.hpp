@@ -0,0 +1,140 @@
+#pragma once
+
+extern "C" {
+  #include <libavcodec/avcodec.h>
+}
+
+#include <jsoncpp/json/json.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Measures the quality a recording actually gets and steers its bitrate to
+// hold a target with the fewest bytes. Configured by video_encoding.quality:
+//
+//   metric              "ssim" or "psnr" (dB), both over luma
+//   target, tolerance   quality band; above it the bitrate is multiplied by
+//                       decrease_factor, below it by increase_factor
+//   min_bitrate, max_bitrate
+//                       Mbit/s, like video_encoding.bitrate
+//   sample_interval_s   time between measurements
+//   samples             frames compared per measurement, every
+//                       sample_every-th frame after a keyframe
+//   decoder             decodes the samples, the codec's default if empty
+//
+// A measurement starts at the next keyframe, forcing one if none came
+// within two seconds. From there the encoded packets are copied until the
+// last sampled frame is out, along with the luma of the sampled inputs, and
+// the monitor's thread decodes and compares them. The encode thread only
+// copies and never waits; while a measurement is being decoded no new one
+// starts. Every measurement is a line of <output>.quality.csv.
+class QualityMonitor {
+public:
+  // codec_ctx must be open. Without adjust_bitrate quality is only measured.
+  QualityMonitor(Json::Value jsonQualityConf,
+                 const AVCodecContext* codec_ctx,
+                 bool adjust_bitrate,
+                 const std::string& log_file,
+                 int session_idx);
+
+  // Prints the average quality and bitrate of the session
+  ~QualityMonitor();
+
+  // Encode thread, each input frame right before it is sent to the encoder
+  void on_frame(const AVFrame* input_frame);
+
+  // Encode thread, each packet the encoder returned, pts in the codec time base
+  void on_packet(const AVPacket* pkt);
+
+  // Encode thread, true once when a measurement needs a keyframe to start
+  bool take_keyframe_request();
+
+  int64_t get_target_bitrate();
+
+  // The bitrate was changed from elsewhere, the next adjustment starts from it
+  void set_bitrate(int64_t bitrate);
+
+private:
+  using Clock = std::chrono::steady_clock;
+
+  enum class State { Idle, WaitingKeyframe, Capturing };
+
+  struct Packet {
+    std::vector<uint8_t> data;
+    int size = 0;
+    int64_t pts = 0;
+    int flags = 0;
+  };
+
+  struct Source {
+    std::vector<uint8_t> luma;
+    int64_t pts = -1;
+  };
+
+  void monitor_loop();
+
+  bool open_decoder();
+
+  // Decodes the captured packets and compares the sampled frames
+  void measure();
+
+  int session_idx_ = -1;
+  int width_ = 0;
+  int height_ = 0;
+  int frame_rate_ = 0;
+  AVCodecID codec_id_ = AV_CODEC_ID_NONE;
+  std::vector<uint8_t> extradata_;
+
+  bool use_ssim_ = true;
+  double target_ = 0.96;
+  double tolerance_ = 0.005;
+  int64_t min_bitrate_ = 0;
+  int64_t max_bitrate_ = 0;
+  double increase_factor_ = 1.25;
+  double decrease_factor_ = 0.9;
+  bool adjust_bitrate_ = true;
+  Clock::duration sample_interval_;
+  int samples_ = 4;
+  int sample_every_ = 8;
+  std::string decoder_name_;
+
+  std::atomic<int64_t> target_bitrate_ = 0;
+  std::atomic<int64_t> bytes_ = 0;
+
+  // Encode thread only, or the monitor's while measuring_ is set
+  State state_ = State::Idle;
+  Clock::time_point next_start_;
+  int frames_waited_ = 0;
+  int frames_since_keyframe_ = 0;
+  bool keyframe_requested_ = false;
+  std::vector<Source> sources_;
+  int sources_taken_ = 0;
+  std::vector<Packet> packets_;
+  int packets_taken_ = 0;
+  std::atomic<bool> measuring_ = false;
+
+  // Monitor thread only
+  AVCodecContext* decoder_ctx_ = nullptr;
+  AVPacket* decode_pkt_ = nullptr;
+  AVFrame* decoded_ = nullptr;
+  bool decoder_failed_ = false;
+  Clock::time_point last_measured_;
+  int64_t last_bytes_ = 0;
+  std::ofstream log_;
+  int measurements_ = 0;
+  double psnr_sum_ = 0.0;
+  double ssim_sum_ = 0.0;
+
+  Clock::time_point start_;
+  std::mutex mutex_;
+  std::condition_variable cv_measure_;
+  bool stopping_ = false;
+  std::thread monitor_thread_;
+};
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <jsoncpp/json/json.h>
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+
+struct RateDecision {
+  int64_t bitrate = 0;        // Encoder bitrate in bit/s
+  int frame_interval = 1;     // Encode every Nth frame
+  bool drop_frame = false;    // Skip encoding this frame entirely
+};
+
+// Congestion-aware rate control for streaming sessions. Estimates the
+// sender-side queueing delay from the socket send queue (SIOCOUTQ) and the
+// end-to-end delay from receiver acks, then lowers the bitrate, then the
+// frame rate, to keep latency under the target. The bytes acked per interval
+// give the rate the link delivers, which bounds the bitrate under congestion.
+// Recovers additively once the link has been clear for increase_interval_ms.
+class RateController {
+public:
+  RateController(Json::Value jsonRateConf,
+                 int64_t initial_bitrate,
+                 int frame_rate,
+                 int socket);
+
+  // Called once per captured frame before encoding
+  RateDecision on_frame(int64_t frame_count);
+
+  void on_packet_sent(int64_t packet_seq, size_t bytes);
+
+  void on_ack(int64_t packet_seq);
+
+  int get_send_queue_bytes();
+
+  double get_queue_delay_ms();
+
+  double get_ack_latency_ms();
+
+  // Bit/s acked by the receiver, 0 until measured
+  int64_t get_delivery_rate();
+
+private:
+  using Clock = std::chrono::steady_clock;
+
+  int socket_ = -1;
+  int frame_rate_ = 0;
+
+  double target_latency_ms_ = 100.0;
+  int64_t min_bitrate_ = 0;
+  int64_t max_bitrate_ = 0;
+  double decrease_factor_ = 0.8;
+  int64_t increase_step_ = 0;
+  double increase_interval_ms_ = 500.0;
+  int max_frame_interval_ = 4;
+
+  RateDecision decision_;
+
+  Clock::time_point last_change_;
+  Clock::time_point last_congestion_;
+
+  struct InFlight {
+    int64_t packet_seq;
+    Clock::time_point sent;
+    size_t bytes;
+  };
+
+  // Every packet not acked yet, in send order
+  std::deque<InFlight> in_flight_;
+  double ack_latency_ms_ = 0.0;
+  bool has_ack_ = false;
+
+  // Bytes acked since delivery_start_, turned into delivery_rate_ per interval
+  Clock::time_point delivery_start_;
+  size_t delivered_bytes_ = 0;
+  double delivery_rate_ = 0.0;
+};
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// On-disk layout of a raw recording:
+//   [header page][frame 0 slot][frame 1 slot]...[frame N-1 slot]
+// Every slot is page aligned and has the same size, so frame i lives at
+// header_size + i * slot_size. Each slot holds the frame followed by its
+// RawFrameIndexEntry at info_offset, so a file whose writer was killed keeps
+// the timestamps of every complete slot.
+
+static constexpr char RAW_FRAME_MAGIC[8] = {'P', 'D', 'C', 'R', 'A', 'W', '0', '2'};
+static constexpr uint32_t RAW_FRAME_VERSION = 2;
+static constexpr uint32_t RAW_FRAME_HEADER_SIZE = 4096;
+
+struct RawFrameFileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t header_size;
+  uint32_t width;
+  uint32_t height;
+  uint32_t channels;
+  uint32_t stride;
+  uint64_t frame_size;
+  uint64_t slot_size;
+  uint64_t frame_count;    // 0 if the writer was not closed cleanly
+  uint64_t info_offset;    // Offset of the RawFrameIndexEntry within a slot
+};
+
+struct RawFrameIndexEntry {
+  uint64_t frame_number;
+  int64_t timestamp_us;
+};
+
+class RawFrameWriter {
+public:
+  RawFrameWriter(const std::string& output_file,
+                 int width,
+                 int height,
+                 int channels,
+                 size_t write_buffer_size);
+
+  ~RawFrameWriter();
+
+  bool open();
+
+  bool write_frame(const uint8_t* data, int stride,
+                   uint64_t frame_number, int64_t timestamp_us);
+
+  bool close();
+
+  uint64_t get_frame_count() const;
+
+private:
+  bool flush_buffer();
+
+  std::string output_file_;
+  int fd_ = -1;
+
+  RawFrameFileHeader header_ = {};
+
+  // Frames are staged here and written with one large sequential write
+  uint8_t* write_buffer_ = nullptr;
+  size_t write_buffer_size_ = 0;
+  size_t write_buffer_used_ = 0;
+};
+
+class RawFrameReader {
+public:
+  RawFrameReader(const std::string& input_file);
+
+  ~RawFrameReader();
+
+  bool open();
+
+  void close();
+
+  uint64_t get_frame_count() const;
+
+  const RawFrameFileHeader& get_header() const;
+
+  // Pointer into the mapped file, valid until close()
+  const uint8_t* get_frame(uint64_t idx) const;
+
+  // Read from the frame's slot
+  const RawFrameIndexEntry& get_index_entry(uint64_t idx) const;
+
+  // First frame captured at or after timestamp_us, get_frame_count() if
+  // none was. False if the recording has no capture timestamps.
+  bool find_frame_by_timestamp(int64_t timestamp_us, uint64_t* idx) const;
+
+private:
+  std::string input_file_;
+  int fd_ = -1;
+
+  uint8_t* mapped_ = nullptr;
+  size_t mapped_size_ = 0;
+
+  RawFrameFileHeader header_ = {};
+};
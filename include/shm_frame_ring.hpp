@@ -0,0 +1,162 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Live frames for local analysis processes, one POSIX shared memory object
+// per camera (/dev/shm/<name_prefix>_<camera>):
+//   [header page][slot 0]...[slot N-1]
+// Slot s holds the frame with sequence number s + k * N, each slot is a
+// page aligned ShmSlotHeader followed by the image. The writer never waits
+// for readers: every slot carries a seqlock version that is odd while the
+// slot is written, and a reader checks after using a frame in place that
+// the version did not change. Readers that fall more than N frames behind
+// lose the oldest ones.
+//
+// Only this header and shm_frame_ring.cpp are needed to read the ring.
+
+static constexpr char SHM_RING_MAGIC[8] = {'P', 'D', 'C', 'S', 'H', 'M', '0', '1'};
+static constexpr uint32_t SHM_RING_VERSION = 1;
+static constexpr uint32_t SHM_RING_HEADER_SIZE = 4096;
+
+struct ShmRingHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t header_size;
+  uint32_t camera_idx;
+  uint32_t width;
+  uint32_t height;
+  uint32_t channels;
+  uint32_t stride;
+  uint32_t slot_count;
+  uint64_t frame_size;
+  uint64_t slot_size;
+  uint32_t writer_pid;
+  // Set once the writer has stopped, the ring is not written again
+  std::atomic<uint32_t> closed;
+  // Sequence number of the last complete frame, 0 before the first
+  std::atomic<uint64_t> write_sequence;
+};
+
+struct ShmSlotHeader {
+  // 2 * sequence - 1 while the frame is written, 2 * sequence once complete
+  std::atomic<uint64_t> version;
+  int64_t frame_number;
+  int64_t sensor_timestamp_us;
+  int64_t aligned_timestamp_us;
+  // CLOCK_MONOTONIC when the frame was published, for measuring reader lag
+  int64_t publish_time_ns;
+  int32_t exposure_us;
+  float gain_db;
+};
+
+static constexpr size_t SHM_SLOT_HEADER_SIZE = 64;
+static_assert(sizeof(ShmSlotHeader) <= SHM_SLOT_HEADER_SIZE, "slot header grew");
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "shared atomics must be lock-free");
+
+// Metadata of a published frame
+struct ShmFrameInfo {
+  int camera_idx = -1;
+  int64_t frame_number = -1;
+  int64_t sensor_timestamp_us = -1;
+  int64_t aligned_timestamp_us = -1;
+  int exposure_us = 0;
+  float gain_db = 0.0f;
+};
+
+int64_t shm_monotonic_ns();
+
+// Writer side, owned by camera_stream. Creating a ring replaces one left
+// behind by a previous run, the object is unlinked again on destruction.
+class ShmFrameWriter {
+public:
+  ShmFrameWriter(const std::string& name,
+                 int camera_idx,
+                 int width,
+                 int height,
+                 int channels,
+                 int slot_count);
+
+  ~ShmFrameWriter();
+
+  bool open();
+
+  // Copies the frame into the next slot, never waits
+  void publish(const uint8_t* data, const ShmFrameInfo& info);
+
+  uint64_t get_sequence();
+
+private:
+  std::string name_;
+  int camera_idx_ = -1;
+  int width_ = 0;
+  int height_ = 0;
+  int channels_ = 3;
+  int slot_count_ = 0;
+  size_t frame_size_ = 0;
+  size_t slot_size_ = 0;
+
+  ShmRingHeader* header_ = nullptr;
+  uint8_t* base_ = nullptr;
+  size_t mapped_size_ = 0;
+  uint64_t sequence_ = 0;
+};
+
+// A frame used in place, only valid while ShmFrameReader::validate() says so
+struct ShmFrameView {
+  uint64_t sequence = 0;
+  const uint8_t* data = nullptr;
+  int64_t publish_time_ns = 0;
+  ShmFrameInfo info;
+};
+
+// Reader side, for analysis processes. Maps the ring read-only, so a reader
+// can never disturb the writer or the other readers.
+class ShmFrameReader {
+public:
+  ShmFrameReader(const std::string& name);
+
+  ~ShmFrameReader();
+
+  bool open();
+
+  const ShmRingHeader* get_header();
+
+  uint64_t get_latest_sequence();
+
+  bool is_writer_closed();
+
+  // Frame with the given sequence number, false if it is not published yet
+  // or was already overwritten
+  bool acquire(uint64_t sequence, ShmFrameView* view);
+
+  // True if the frame was not overwritten since acquire(), check after
+  // using view.data and discard the results otherwise
+  bool validate(const ShmFrameView& view);
+
+  // The frame after the last one read, skipping frames that were overwritten
+  // before they could be read. False if there is no new frame.
+  bool read_next(ShmFrameView* view);
+
+  // Starts read_next() at the latest frame instead of the oldest one kept
+  void skip_to_latest();
+
+  // Copies the latest complete frame, retrying while it is overwritten
+  bool copy_latest(std::vector<uint8_t>* data, ShmFrameView* view);
+
+  // Frames read_next() skipped because they were overwritten
+  uint64_t get_lost_frames();
+
+private:
+  const ShmSlotHeader* get_slot(uint64_t sequence);
+
+  std::string name_;
+  const ShmRingHeader* header_ = nullptr;
+  const uint8_t* base_ = nullptr;
+  size_t mapped_size_ = 0;
+  uint64_t next_sequence_ = 1;
+  uint64_t lost_frames_ = 0;
+};
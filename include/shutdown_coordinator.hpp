@@ -0,0 +1,44 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+// Turns SIGINT/SIGTERM into an ordinary event for the main thread. Must be
+// constructed before any other thread is started: the signals are blocked
+// in every thread and read from a signalfd instead, so no pipeline code
+// runs in signal context.
+//
+// Once shutdown begins, a watchdog ends the process if the pipeline has not
+// drained within the deadline, or right away on a second signal.
+class ShutdownCoordinator {
+public:
+  ShutdownCoordinator();
+
+  ~ShutdownCoordinator();
+
+  // Blocks until a signal arrives or request_stop() is called. Returns the
+  // signal number, or 0 for request_stop().
+  int wait_for_stop();
+
+  // Lets any thread end the pipeline as if a signal arrived
+  void request_stop();
+
+  bool stop_requested();
+
+  // Starts the watchdog, call when shutdown begins
+  void start_deadline(std::chrono::milliseconds deadline);
+
+  // Everything has drained, disarms the watchdog
+  void finished();
+
+private:
+  void watchdog_loop(std::chrono::milliseconds deadline);
+
+  int signal_fd_ = -1;
+  int stop_fd_ = -1;
+  int finished_fd_ = -1;
+
+  std::atomic<bool> stop_requested_ = false;
+  std::thread watchdog_thread_;
+};
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <jsoncpp/json/json.h>
+
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+
+class LoadShedder;
+
+// Latest image of each camera on a local socket, e.g.
+//   echo "get 0" | socat -t 2 - UNIX-CONNECT:/tmp/camera_snapshot.sock | tail -n +2 > cam0.jpg
+// A request "get <camera>" is answered with a line
+//   ok <bytes> <frame_number> <aligned_timestamp_us>
+// followed by the encoded image, or with "error <reason>". Frames come from
+// the load shedder's latest slot without a copy; encoding, downscaling and
+// serving happen on this thread only. An image is encoded once per frame,
+// requests before the next frame arrives get the cached one.
+class SnapshotServer {
+public:
+  SnapshotServer(Json::Value jsonSnapshotConf, LoadShedder* frames, int num_cameras);
+
+  ~SnapshotServer();
+
+  bool is_open();
+
+private:
+  struct Snapshot {
+    int64_t frame_number = -1;
+    int64_t timestamp_us = -1;
+    std::vector<uint8_t> encoded;
+  };
+
+  void serve_loop();
+
+  // Fills reply with the header line and the image
+  void handle_request(const std::string& line, std::string* reply);
+
+  // Encodes the latest frame if it is newer than the cached image
+  void refresh(int idx);
+
+  LoadShedder* frames_;
+  std::vector<Snapshot> snapshots_;
+
+  std::string socket_path_;
+  int max_width_ = 640;
+  std::string extension_ = ".jpg";
+  std::vector<int> encode_params_;
+
+  int listen_fd_ = -1;
+  int wake_fd_ = -1;
+  std::thread serve_thread_;
+};
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <jsoncpp/json/json.h>
+
+#include "latency_tracker.hpp"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Heap operations through operator new/delete since the process started,
+// counted by allocation_counter.cpp which every soak_monitor user links
+void get_allocation_counts(uint64_t* allocations, uint64_t* deallocations);
+
+// Samples the process while a soak run records, and judges at the end
+// whether anything drifted. Configured by "soak":
+//
+//   duration_s          run length, on_duration_reached is called after it
+//   sample_interval_s   time between samples, each one a line of output_path
+//   warmup_s            samples before this are not judged (encoder and
+//                       muxer buffers, first-touch page faults)
+//   drift_windows       samples in the baseline and in the final window,
+//                       each compared by their median
+//   max_rss_growth_mb, max_heap_growth_mb, max_live_allocation_growth,
+//   max_fd_growth, max_thread_growth
+//                       allowed growth from the baseline to the final window
+//   max_latency_ratio, latency_slack_us
+//                       a stage's p99 fails when it grew by both
+//   min_throughput_ratio
+//                       frames per second the final window must keep
+class SoakMonitor {
+public:
+  SoakMonitor(Json::Value jsonSoakConf, std::function<void()> on_duration_reached);
+
+  ~SoakMonitor();
+
+  // Takes a last sample and stops sampling, call once recording stopped
+  void stop();
+
+  // Prints the baseline and final values, false if any of them drifted
+  bool evaluate();
+
+private:
+  struct Sample {
+    double elapsed_s = 0.0;
+    int64_t rss_kb = 0;
+    int64_t heap_kb = 0;
+    int64_t live_allocations = 0;
+    double allocations_per_s = 0.0;
+    double allocations_per_frame = 0.0;
+    int64_t fds = 0;
+    int64_t threads = 0;
+    double fps = 0.0;
+    int64_t p50_us[(int)LatencyStage::Count] = {};
+    int64_t p99_us[(int)LatencyStage::Count] = {};
+    int64_t max_us[(int)LatencyStage::Count] = {};
+  };
+
+  void sample_loop();
+
+  void take_sample();
+
+  // Median of a field over samples [first, last)
+  double median(size_t first, size_t last, const std::function<double(const Sample&)>& field);
+
+  double duration_s_ = 43200.0;
+  double sample_interval_s_ = 10.0;
+  double warmup_s_ = 120.0;
+  int drift_windows_ = 6;
+  double max_rss_growth_mb_ = 32.0;
+  double max_heap_growth_mb_ = 16.0;
+  double max_live_allocation_growth_ = 1000.0;
+  double max_fd_growth_ = 0.0;
+  double max_thread_growth_ = 0.0;
+  double max_latency_ratio_ = 1.5;
+  double latency_slack_us_ = 500.0;
+  double min_throughput_ratio_ = 0.95;
+
+  std::function<void()> on_duration_reached_;
+  std::ofstream csv_;
+
+  std::chrono::steady_clock::time_point start_;
+  std::chrono::steady_clock::time_point last_time_;
+  uint64_t last_allocations_ = 0;
+  LatencyCounts last_counts_[(int)LatencyStage::Count];
+
+  std::vector<Sample> samples_;
+
+  std::mutex mutex_;
+  std::condition_variable cv_stop_;
+  bool stopping_ = false;
+  bool duration_reached_ = false;
+  std::thread sample_thread_;
+};
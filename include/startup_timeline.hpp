@@ -0,0 +1,10 @@
+#pragma once
+
+#include <string>
+
+// Milestones of the startup sequence (devices opened, encoders warmed up,
+// first frame recorded), timed from process start so slow steps stand out.
+// Safe to call from any thread; the report is printed once.
+void mark_startup(const std::string& event);
+
+void print_startup_timeline();
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+#include <jsoncpp/json/json.h>
+
+#include "camera_frame.hpp"
+#include "frame_arena.hpp"
+#include "frame_source.hpp"
+#include "load_shedder.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Generates frames for number_cameras virtual cameras without hardware.
+// Every camera has its own sensor clock with an injected offset and drift
+// against the host clock, plus a random delivery delay, so the clock
+// alignment and frame synchronization can be exercised deterministically.
+// All cameras expose at the same instants (plus phase_us); the image shows a
+// bar whose position depends only on the exposure time.
+class SyntheticCapture : public FrameSource {
+public:
+  SyntheticCapture(LoadShedder* frame_queue,
+                   Json::Value config);
+
+  void start_capture() override;
+
+  void stop_capture() override;
+
+private:
+  struct VirtualCamera {
+    int64_t clock_offset_us = 0;
+    double clock_drift_ppm = 0.0;
+    int64_t phase_us = 0;
+    int64_t delivery_delay_us = 0;
+    int64_t delivery_jitter_us = 0;
+    double drop_rate = 0.0;
+    std::unique_ptr<FrameArena> arena;
+    cv::Mat buffers[2];
+  };
+
+  void capture_device(size_t idx);
+
+  LoadShedder* frame_queue_;
+
+  int img_width_ = -1;
+  int img_height_ = -1;
+  int frame_rate_ = 120;
+
+  std::vector<VirtualCamera> cameras_;
+  int64_t start_us_ = 0;
+
+  std::atomic<bool> keepRunning_ = true;
+};
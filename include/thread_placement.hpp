@@ -0,0 +1,45 @@
+#pragma once
+
+#include <jsoncpp/json/json.h>
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <cstddef>
+#include <string>
+
+// Per-stage CPU affinity and scheduling for the pipeline threads, configured
+// once from the "thread_placement" block:
+//
+//   "capture": {"cpus": "0-1", "sched_fifo_priority": 50}
+//
+// Threads started by a placed thread (FFmpeg's codec workers, created in
+// avcodec_open2) inherit its CPU set and policy. Frame buffers get NUMA-local
+// pages by being first touched on the pinned thread that uses them.
+void configure_thread_placement(Json::Value jsonPlacementConf);
+
+// Applies the stage's placement to the calling thread. Stages without an
+// entry, or placement being disabled, leave the thread as it is.
+bool apply_thread_placement(const std::string& stage);
+
+// Faults in every page of the buffer from the calling thread
+void touch_pages(void* data, size_t size);
+
+// Parses "0-3,8,10-11"
+bool parse_cpu_list(const std::string& cpu_list, cpu_set_t* cpu_set);
+
+// Applies a stage for the lifetime of the object, then restores the previous
+// placement. Used around encoder creation so codec threads land on the
+// encode CPUs even when the encoder is opened from another stage.
+class ScopedThreadPlacement {
+public:
+  ScopedThreadPlacement(const std::string& stage);
+
+  ~ScopedThreadPlacement();
+
+private:
+  bool saved_ = false;
+  cpu_set_t cpu_set_;
+  int policy_ = SCHED_OTHER;
+  struct sched_param param_;
+};
@@ -10,6 +10,14 @@ extern "C" {
 #include <jsoncpp/json/json.h>
 #include <opencv2/opencv.hpp>
 
+#include "decode_pool.hpp"
+#include "frame_metadata.hpp"
+#include "pixel_convert.hpp"
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
 #include <string>
 #include <vector>
 
@@ -18,38 +26,104 @@ extern "C" {
 #include <arpa/inet.h>
 #include <unistd.h>
 
+// Decodes one stream, either packets read from a streaming socket with
+// decode_frame(), or packets submitted by a demuxer and decoded on a shared
+// DecodePool. The configured "decoder" is tried first, then the
+// "decoder_fallbacks" for the same codec, then FFmpeg's default decoder for
+// it, so a machine without NVDEC falls back to software HEVC or AV1.
+// "decoder_threads" (0 for the pool's share, or FFmpeg's choice without a
+// pool) and "decoder_thread_type" ("frame", "slice" or "frame+slice")
+// configure software decoders; live sessions default to slice threading,
+// as frame threading delays every frame by a frame per thread.
 class VideoDecoding {
 public:
+  using FrameCallback = std::function<void(const AVFrame* frame)>;
+
   VideoDecoding(Json::Value jsonVideoConf,
                 const std::string& output_file, 
                 int session_idx,
                 int socket);
 
+  // A demuxed stream decoded on the pool, frames are handed to on_frame on
+  // a pool worker. Without a pool, submit_packet() decodes on the caller's
+  // thread and calls on_frame before it returns.
+  VideoDecoding(Json::Value jsonVideoConf,
+                const AVCodecParameters* codecpar,
+                int session_idx,
+                DecodePool* pool,
+                FrameCallback on_frame);
+
   ~VideoDecoding();
 
-  void initialize_ffmpeg_decoder();
+  // False if no decoder could be opened
+  bool is_open();
+
+  bool initialize_ffmpeg_decoder(const AVCodecParameters* codecpar);
 
-  void decode_frame(cv::Mat* decoded_frame);
+  bool decode_frame(cv::Mat* decoded_frame);
+
+  // Queues the packet for the pool, waiting while max_queued_packets are
+  // queued. NULL flushes the decoder, wait_finished() returns after it.
+  bool submit_packet(const AVPacket* packet);
+
+  void wait_finished();
 
   AVCodecContext* get_codec_ctx();
 
   AVFormatContext* get_format_ctx();
 
+  const std::string& get_decoder_name();
+
+  int64_t get_frames_decoded();
+
+  // Capture metadata the encoder embedded in the frame handed out last, by
+  // decode_frame() or during on_frame. False if the frame carried none.
+  bool get_frame_metadata(FrameMetadata* metadata);
+
   void swapRGBToBGR(cv::Mat* image);
 
-  void convertNV12ToBGR(const AVFrame* frame_nv12, cv::Mat* bgr);
+  // NV12 from hardware decoders, I420 or P010 from software ones
+  bool convertToBGR(const AVFrame* frame, cv::Mat* bgr);
+
+  // Asks the encoder on the other end of the socket for a new keyframe
+  void request_keyframe();
 
 private:
+  void load_config(Json::Value jsonVideoConf, const std::string& default_thread_type);
+
+  // Decoders to try for the codec, in order
+  std::vector<const AVCodec*> find_decoders(AVCodecID codec_id);
+
+  // Sends one packet (NULL to flush) and hands out every frame it completes
+  bool decode_packet(const AVPacket* packet);
+
+  // Pool task: decodes a batch of queued packets, then yields the worker
+  void run_queued_packets();
+
+  // Read from the packet itself, as hardware decoders do not export SEI,
+  // and matched to the frame by pts
+  void store_packet_metadata(const AVPacket* packet);
+
+  void take_frame_metadata(const AVFrame* frame);
+
   const AVCodec* codec_ = nullptr;
   AVCodecContext* codec_ctx_ = nullptr;
   AVFormatContext* format_ctx_ = nullptr;
 
   std::string decoder_name_;
+  std::vector<std::string> decoder_fallbacks_;
+  std::string default_codec_ = "hevc";
+  int decoder_threads_ = 0;
+  int decoder_thread_type_ = FF_THREAD_SLICE;
 
   AVPacket* pkt_ = nullptr;
 
   AVFrame* frame_nv12_ = nullptr;
-  std::vector<uint8_t>* buffer_ = nullptr;
+
+  // Selected once per session, by the format the decoder outputs
+  ConversionKernel to_bgr_kernel_;
+  int to_bgr_format_ = -1;
+  ConversionKernel swap_kernel_;
 
   int session_idx_ = -1;
 
@@ -61,4 +135,24 @@ private:
   std::string output_file_;
 
   int socket_ = -1;
+
+  int64_t frames_decoded_ = 0;
+  int64_t packets_received_ = 0;
+
+  // More than the frames any decoder holds back
+  static const int kPendingMetadata = 32;
+  int64_t pending_metadata_pts_[kPendingMetadata];
+  FrameMetadata pending_metadata_[kPendingMetadata];
+  bool has_frame_metadata_ = false;
+  FrameMetadata frame_metadata_;
+
+  DecodePool* pool_ = nullptr;
+  FrameCallback on_frame_;
+
+  // Packets waiting for the pool, NULL entries flush
+  std::mutex queue_mutex_;
+  std::condition_variable cv_queue_;
+  std::deque<AVPacket*> queued_packets_;
+  bool scheduled_ = false;
+  bool finished_ = false;
 };
@@ -10,8 +10,19 @@ extern "C" {
 #include <jsoncpp/json/json.h>
 #include <opencv2/opencv.hpp>
 
+#include "frame_arena.hpp"
+#include "frame_metadata.hpp"
+#include "keyframe_index.hpp"
+#include "motion_map.hpp"
+#include "quality_monitor.hpp"
+#include "rate_controller.hpp"
+
+#include <atomic>
+#include <deque>
+#include <memory>
 #include <string>
 #include <thread>
+#include <utility>
 #include <vector>
 
 // Socket streaming
@@ -30,15 +41,49 @@ public:
 
   ~VideoEncoding();
 
-  void initialize_ffmpeg_encoder(bool write_to_file);
+  // False if the encoder could not be opened, nothing can be encoded then
+  bool is_open();
 
+  bool initialize_ffmpeg_encoder(bool write_to_file);
+
+  // metadata, if given, is embedded in the frame's SEI when enabled
   void encode_frame_to_file(cv::Mat* frame,
-                            int64_t frame_count);
+                            int64_t frame_count,
+                            int64_t timestamp_ms = -1,
+                            const FrameMetadata* metadata = nullptr);
 
   void convertBGRAtoNV12(const cv::Mat* bgra);
 
   void encode_frame_to_stream(cv::Mat* frame,
-                              int64_t frame_count);
+                              int64_t frame_count,
+                              const FrameMetadata* metadata = nullptr);
+
+  // Encode an NV12 frame converted by the caller, the frame is only read
+  void encode_nv12_to_file(const AVFrame* nv12,
+                           int64_t frame_count,
+                           int64_t timestamp_ms = -1,
+                           const FrameMetadata* metadata = nullptr);
+
+  // An input frame from the encoder's pool for callers that write the
+  // picture themselves, so it is never copied. Thread-safe. The caller owns
+  // the frame and frees it after encode_input_frame_to_file().
+  AVFrame* allocate_input_frame();
+
+  void encode_input_frame_to_file(const AVFrame* input_frame,
+                                  int64_t frame_count,
+                                  int64_t timestamp_ms = -1);
+
+  // Encodes and discards one black frame so the first real frame does not
+  // pay for the encoder's lazy initialization. Call before the first frame.
+  void warm_up();
+
+  // Drains the frames still queued in the encoder, writes the trailer and
+  // closes the file. Nothing can be encoded afterwards.
+  void finish_file();
+
+  void encode_nv12_to_stream(const AVFrame* nv12,
+                             int64_t frame_count,
+                             const FrameMetadata* metadata = nullptr);
 
   AVCodecContext* get_codec_ctx();
 
@@ -48,7 +93,62 @@ public:
 
   int get_height();
 
+  const std::string& get_output_file();
+
+  bool is_lossless();
+
+  // Whether frames carry their capture metadata as SEI ("frame_metadata.embed_sei")
+  bool embeds_metadata();
+
+  // Whether the stream receiver went away, later frames are dropped
+  bool is_stream_closed();
+
+  // Forces the next encoded frame to be an IDR frame, safe to call from any thread
+  void request_keyframe();
+
+  // Applied from the next frame on, must be called from the encoding thread
+  void set_bitrate(int64_t bitrate);
+
+  int64_t get_bitrate();
+
+  // Whether set_bitrate() takes effect without reopening the encoder
+  bool supports_live_bitrate();
+
 private:
+  AVFrame* prepare_input_frame(const cv::Mat* bgra);
+
+  AVFrame* wrap_nv12_frame(const AVFrame* nv12);
+
+  // Next input frame from the arena-backed pool. Reference counted frames
+  // are taken over by the encoder as they are, without FFmpeg copying them
+  // into a freshly allocated buffer.
+  AVFrame* get_input_frame();
+
+  void convert_bgra_to_nv12(const cv::Mat* bgra, AVFrame* nv12);
+
+  static int get_packet_buffer(AVCodecContext* codec_ctx, AVPacket* pkt, int flags);
+
+  void encode_input_to_file(AVFrame* input_frame,
+                            int64_t frame_count,
+                            int64_t timestamp_ms,
+                            const FrameMetadata* metadata);
+
+  void write_packets_to_file();
+
+  void encode_input_to_stream(AVFrame* input_frame,
+                              int64_t frame_count,
+                              const FrameMetadata* metadata);
+
+  void apply_keyframe_request(AVFrame* input_frame);
+
+  // Adds the SEI side data, the input frame's next unref drops it
+  void attach_metadata(AVFrame* input_frame, const FrameMetadata* metadata);
+
+  // Returns false if the frame is unchanged and should not be encoded
+  bool apply_motion_map(AVFrame* input_frame);
+
+  void poll_control_messages();
+
   const AVCodec* codec_ = nullptr;
   AVCodecContext* codec_ctx_ = nullptr;
   AVFormatContext* format_ctx_ = nullptr;
@@ -59,6 +159,32 @@ private:
   std::string tune_;
   std::string split_encode_mode_;
 
+  // Lossless archival mode (FFV1 by default, encoded straight from BGRA)
+  bool lossless_ = false;
+  int encoder_threads_ = 0;
+  int slices_ = 0;
+  std::string container_ = "mp4";
+
+  // Keyframe placement and the fast-seek sidecar (<output>.idx)
+  std::string keyframe_mode_ = "gop";
+  int keyframe_interval_ms_ = 0;
+  bool write_seek_index_ = false;
+  std::unique_ptr<KeyframeIndexWriter> seek_index_;
+  std::deque<std::pair<int64_t, int64_t>> pending_timestamps_;
+
+  std::atomic<bool> keyframe_requested_ = false;
+  std::vector<uint8_t> control_buffer_;
+
+  // Adapts bitrate and frame rate to the link in streaming mode
+  std::unique_ptr<RateController> rate_controller_;
+  int64_t packets_sent_ = 0;
+
+  // ROI QP offsets and static frame skipping driven by the luma difference
+  std::unique_ptr<MotionMap> motion_map_;
+
+  // Sampled decode-and-compare of recordings, steers the bitrate
+  std::unique_ptr<QualityMonitor> quality_monitor_;
+
   int session_idx_ = -1;
 
   std::vector<std::thread> encoding_threads_;
@@ -71,4 +197,19 @@ private:
   std::string output_file_;
 
   int socket_ = -1;
+  bool stream_closed_ = false;
+  bool file_finished_ = false;
+  bool open_ = false;
+
+  // Input frames and packets come from preallocated huge-page memory
+  std::unique_ptr<FrameArena> arena_;
+  AVBufferPool* input_pool_ = nullptr;
+  AVBufferPool* packet_pool_ = nullptr;
+  // SEI payloads, recycled like the input frames
+  bool embed_metadata_ = false;
+  AVBufferPool* metadata_pool_ = nullptr;
+  size_t packet_buffer_size_ = 0;
+  int pool_input_frames_ = 4;
+  int pool_packets_ = 8;
+  AVFrame* frame_input_ = nullptr;
 };
@@ -0,0 +1,88 @@
+#include "soak_monitor.hpp"
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+// Replaces the global allocation functions, which is legal in any one
+// translation unit of the program. Linked in by get_allocation_counts(), so
+// only programs with soak support pay the two relaxed increments.
+
+namespace {
+
+std::atomic<uint64_t> allocations = 0;
+std::atomic<uint64_t> deallocations = 0;
+
+void* counted_malloc(std::size_t size) {
+  void* ptr = std::malloc(size ? size : 1);
+  if (ptr)
+  {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+  }
+  return ptr;
+}
+
+void counted_free(void* ptr) {
+  if (ptr)
+  {
+    deallocations.fetch_add(1, std::memory_order_relaxed);
+    std::free(ptr);
+  }
+}
+
+}
+
+void get_allocation_counts(uint64_t* allocated, uint64_t* deallocated) {
+  *allocated = allocations.load(std::memory_order_relaxed);
+  *deallocated = deallocations.load(std::memory_order_relaxed);
+}
+
+void* operator new(std::size_t size) {
+  void* ptr = counted_malloc(size);
+  if (!ptr)
+  {
+    throw std::bad_alloc();
+  }
+  return ptr;
+}
+
+void* operator new[](std::size_t size) {
+  void* ptr = counted_malloc(size);
+  if (!ptr)
+  {
+    throw std::bad_alloc();
+  }
+  return ptr;
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept {
+  return counted_malloc(size);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept {
+  return counted_malloc(size);
+}
+
+void operator delete(void* ptr) noexcept {
+  counted_free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+  counted_free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept {
+  counted_free(ptr);
+}
+
+void operator delete[](void* ptr, std::size_t) noexcept {
+  counted_free(ptr);
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept {
+  counted_free(ptr);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept {
+  counted_free(ptr);
+}
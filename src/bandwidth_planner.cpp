@@ -0,0 +1,97 @@
+#include "bandwidth_planner.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <sstream>
+
+// The SDK needs a few buffers to keep acquiring while one is handed out
+static const int kMinQueueSize = 4;
+
+BandwidthPlanner::BandwidthPlanner(Json::Value jsonBandwidthConf) {
+  this->controllers_ = jsonBandwidthConf["controllers"];
+  this->controller_mbps_ = std::max(0.0, jsonBandwidthConf.get("controller_mbps", 0.0).asDouble());
+  this->headroom_ = std::clamp(jsonBandwidthConf.get("headroom", 0.9).asDouble(), 0.1, 1.0);
+  this->protocol_overhead_ = std::max(0.0, jsonBandwidthConf.get("protocol_overhead", 0.1).asDouble());
+  this->queue_ms_ = std::max(1, jsonBandwidthConf.get("queue_ms", 100).asInt());
+  this->transport_frames_ = std::max(0, jsonBandwidthConf.get("transport_frames", 0).asInt());
+}
+
+int BandwidthPlanner::get_controller(int camera_idx) {
+  return this->controllers_.get(camera_idx, 0).asInt();
+}
+
+std::vector<LinkPlan> BandwidthPlanner::plan(const std::vector<CameraLink>& links) {
+  std::vector<LinkPlan> plans(links.size());
+  std::map<int, double> required_per_controller;
+  std::map<int, double> capacity_per_controller;
+
+  for (size_t idx = 0; idx < links.size(); idx++)
+  {
+    const CameraLink& link = links[idx];
+    double frame_bits = (double)link.width * link.height * link.bytes_per_pixel * 8;
+    plans[idx].required_mbps = frame_bits * link.frame_rate * (1.0 + this->protocol_overhead_) / 1e6;
+    plans[idx].frame_rate = link.frame_rate;
+
+    plans[idx].queue_size = std::max(kMinQueueSize, (int)std::ceil(link.frame_rate * this->queue_ms_ / 1000.0));
+    if (this->transport_frames_ > 0)
+    {
+      plans[idx].transport_buffer_bytes = (int)(frame_bits / 8) * this->transport_frames_;
+    }
+
+    required_per_controller[link.controller] += plans[idx].required_mbps;
+
+    // A controller carries no more than its slowest camera measured
+    double& capacity = capacity_per_controller[link.controller];
+    if (this->controller_mbps_ > 0)
+    {
+      capacity = this->controller_mbps_;
+    }
+    else if (link.available_mbps > 0 && (capacity == 0 || link.available_mbps < capacity))
+    {
+      capacity = link.available_mbps;
+    }
+  }
+
+  for (size_t idx = 0; idx < links.size(); idx++)
+  {
+    double capacity = capacity_per_controller[links[idx].controller];
+    double required = required_per_controller[links[idx].controller];
+    if (capacity <= 0 || required <= 0)
+    {
+      continue;
+    }
+
+    // Spare bandwidth is shared out too, a camera limited to exactly its
+    // average rate would lose frames to bursts
+    LinkPlan& plan = plans[idx];
+    plan.limit_mbps = capacity * this->headroom_ * plan.required_mbps / required;
+    if (plan.limit_mbps < plan.required_mbps)
+    {
+      plan.frame_rate = std::floor(links[idx].frame_rate * plan.limit_mbps / plan.required_mbps * 10) / 10;
+    }
+  }
+
+  return plans;
+}
+
+std::string BandwidthPlanner::describe(int camera_idx, const CameraLink& link, const LinkPlan& plan) {
+  std::ostringstream text;
+  text << "Camera " << camera_idx << " on controller " << link.controller << ": needs "
+       << (int)plan.required_mbps << " Mbit/s, ";
+  if (plan.limit_mbps > 0)
+  {
+    text << "limited to " << (int)plan.limit_mbps << " Mbit/s, ";
+  }
+  else
+  {
+    text << "unlimited, ";
+  }
+  text << plan.queue_size << " buffers queued";
+  if (plan.frame_rate < link.frame_rate)
+  {
+    text << ", controller oversubscribed: " << link.frame_rate << " fps requested, "
+         << plan.frame_rate << " fit";
+  }
+  return text.str();
+}
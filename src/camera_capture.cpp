@@ -1,132 +1,326 @@
 #include "camera_capture.hpp"
+#include "startup_timeline.hpp"
+#include "thread_placement.hpp"
 
 #include <opencv2/opencv.hpp>
 #include <jsoncpp/json/json.h>
 
 #include <m3api/xiApi.h>
 
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
 #include <memory>
 #include <iostream>
+#include <sstream>
+#include <thread>
 
 #define HandleResult(res,place) if (res!=XI_OK) {printf("Error after %s (%d)\n",place,res);}
 
-CameraCapture::CameraCapture(PipeDataInCollection<void*>* dImageFrame,
+CameraCapture::CameraCapture(LoadShedder* frame_queue,
                               Json::Value config) {
-  this->dImageFrame_ = dImageFrame;
+  this->frame_queue_ = frame_queue;
   this->config_ = config;
   this->num_devices_ = this->config_["number_cameras"].asInt();
 
   this->img_width_ = this->config_["image_width"].asInt();
   this->img_height_ = this->config_["image_height"].asInt();
+  this->frame_rate_ = this->config_.get("frame_rate", 120.0).asDouble();
 
-  DWORD *pNumberDevices = new DWORD;
-  this->stat = xiGetNumberDevices(pNumberDevices);
-  std::cout << "Number of devices: " << *pNumberDevices << std::endl;
+  // Bounds how long a stop request waits on a camera that delivers nothing
+  this->capture_timeout_ms_ = this->config_.get("capture_timeout_ms", 100).asInt();
 
-  if (*pNumberDevices == 0) 
+  DWORD number_devices = 0;
+  this->stat = xiGetNumberDevices(&number_devices);
+  std::cout << "Number of devices: " << number_devices << std::endl;
+
+  if (number_devices == 0) 
   {
     std::cerr << "No cameras found\n";
+    this->num_devices_ = 0;
     return;
   }
 
-  this->hDevice_= new HANDLE;
-  this->stat = xiOpenDevice(0, this->hDevice_);
-  HandleResult(this->stat,"xiOpenDevice");
+  if (this->num_devices_ > (int)number_devices)
+  {
+    std::cerr << "Configured " << this->num_devices_ << " cameras, only "
+              << number_devices << " found\n";
+    this->num_devices_ = number_devices;
+  }
+
+  this->hDevices_.assign(this->num_devices_, nullptr);
+  this->images_.resize(this->num_devices_);
+  this->pending_params_.resize(this->num_devices_);
+
+  // Opening and configuring a camera takes a while and does not depend on
+  // the others, so every device is brought up on its own thread
+  std::vector<std::thread> open_threads;
+  for (size_t idx = 0; idx < this->hDevices_.size(); idx++)
+  {
+    open_threads.emplace_back(&CameraCapture::open_device, this, idx);
+  }
+  for (auto& open_thread : open_threads)
+  {
+    open_thread.join();
+  }
+
+  plan_bandwidth();
+}
+
+void CameraCapture::open_device(size_t idx) {
+  XI_RETURN stat = xiOpenDevice(idx, &this->hDevices_[idx]);
+  HandleResult(stat,"xiOpenDevice");
+  mark_startup("camera " + std::to_string(idx) + " opened");
 
-  this->image = new XI_IMG;
+  // xiGetImage requires the structure size to be set by the caller
+  memset(&this->images_[idx], 0, sizeof(XI_IMG));
+  this->images_[idx].size = sizeof(XI_IMG);
 
-  this->set_camera_param();
+  this->set_camera_param(idx);
 
-  this->query_camera_param();
+  this->query_camera_param(idx);
+  mark_startup("camera " + std::to_string(idx) + " configured");
 }
 
 CameraCapture::~CameraCapture() {
-  
+  for (HANDLE hDevice : this->hDevices_)
+  {
+    this->stat = xiCloseDevice(hDevice);
+    HandleResult(this->stat,"xiCloseDevice");
+  }
 }
 
-void CameraCapture::set_camera_param() {
-  // this->stat = xiSetParamInt(*this->hDevice_, XI_PRM_EXPOSURE, 10000);
-  // HandleResult(this->stat,"xiSetParam (exposure set)");
+void CameraCapture::set_camera_param(size_t idx) {
+  HANDLE hDevice = this->hDevices_[idx];
+  XI_RETURN stat = XI_OK;
+
+  // stat = xiSetParamInt(hDevice, XI_PRM_EXPOSURE, 10000);
+  // HandleResult(stat,"xiSetParam (exposure set)");
 
   // Sensor configuration
-  this->stat = xiSetParamInt(*this->hDevice_, XI_PRM_IMAGE_DATA_FORMAT, XI_RGB24);
-  HandleResult(this->stat,"xiSetParam (XI_PRM_IMAGE_DATA_FORMAT set)");
-  this->stat = xiSetParamInt(*this->hDevice_, XI_PRM_AUTO_WB, XI_ON);
-  HandleResult(this->stat,"xiSetParam (XI_PRM_AUTO_WB set)");
-  this->stat = xiSetParamInt(*this->hDevice_, XI_PRM_AEAG, XI_ON);
-  HandleResult(this->stat,"xiSetParam (XI_PRM_AEAG set)");
-
-  this->stat = xiSetParamInt(*this->hDevice_, XI_PRM_AE_MAX_LIMIT, 200000);
-  HandleResult(this->stat,"xiSetParam (XI_PRM_AE_MAX_LIMIT set)");
-  this->stat = xiSetParamInt(*this->hDevice_, XI_PRM_AG_MAX_LIMIT, 20);
-  HandleResult(this->stat,"xiSetParam (XI_PRM_AG_MAX_LIMIT set)");
+  stat = xiSetParamInt(hDevice, XI_PRM_IMAGE_DATA_FORMAT, XI_RGB24);
+  HandleResult(stat,"xiSetParam (XI_PRM_IMAGE_DATA_FORMAT set)");
+  stat = xiSetParamInt(hDevice, XI_PRM_AUTO_WB, XI_ON);
+  HandleResult(stat,"xiSetParam (XI_PRM_AUTO_WB set)");
+  stat = xiSetParamInt(hDevice, XI_PRM_AEAG, XI_ON);
+  HandleResult(stat,"xiSetParam (XI_PRM_AEAG set)");
+
+  stat = xiSetParamInt(hDevice, XI_PRM_AE_MAX_LIMIT, 200000);
+  HandleResult(stat,"xiSetParam (XI_PRM_AE_MAX_LIMIT set)");
+  stat = xiSetParamInt(hDevice, XI_PRM_AG_MAX_LIMIT, 20);
+  HandleResult(stat,"xiSetParam (XI_PRM_AG_MAX_LIMIT set)");
   
 
   // Image configuration
-  this->stat = xiSetParamInt(*this->hDevice_, XI_PRM_WIDTH, this->img_width_);
-  HandleResult(this->stat,"xiSetParam (XI_PRM_WIDTH set)");
-  this->stat = xiSetParamInt(*this->hDevice_, XI_PRM_HEIGHT, this->img_height_);
-  HandleResult(this->stat,"xiSetParam (XI_PRM_HEIGHT set)");
+  stat = xiSetParamInt(hDevice, XI_PRM_WIDTH, this->img_width_);
+  HandleResult(stat,"xiSetParam (XI_PRM_WIDTH set)");
+  stat = xiSetParamInt(hDevice, XI_PRM_HEIGHT, this->img_height_);
+  HandleResult(stat,"xiSetParam (XI_PRM_HEIGHT set)");
 
   // TODO:
   // Temporary disable high frame rate configuration
   // High frame rate configuration
-  this->stat = xiSetParamInt(*this->hDevice_, XI_PRM_SENSOR_FEATURE_SELECTOR, XI_SENSOR_FEATURE_ZEROROT_ENABLE);
-  HandleResult(this->stat,"xiSetParam (XI_PRM_SENSOR_FEATURE_SELECTOR set)");
-  this->stat = xiSetParamInt(*this->hDevice_, XI_PRM_SENSOR_FEATURE_VALUE, XI_ON);
-  HandleResult(this->stat,"xiSetParam (XI_PRM_SENSOR_FEATURE_VALUE set)");
-  this->stat = xiSetParamInt(*this->hDevice_, XI_PRM_DOWNSAMPLING, XI_DWN_2x2);
-  HandleResult(this->stat,"xiSetParam (XI_PRM_DOWNSAMPLING set)");
-  this->stat = xiSetParamInt(*this->hDevice_, XI_PRM_DOWNSAMPLING_TYPE, XI_SKIPPING);
-  HandleResult(this->stat,"xiSetParam (XI_PRM_DOWNSAMPLING_TYPE set)");
-
-  this->stat = xiSetParamInt(*this->hDevice_, XI_PRM_ACQ_TIMING_MODE, XI_ACQ_TIMING_MODE_FRAME_RATE);
-  HandleResult(this->stat,"xiSetParam (XI_PRM_ACQ_TIMING_MODE set)");
-  this->stat = xiSetParamFloat(*this->hDevice_, XI_PRM_FRAMERATE, 120);
-  HandleResult(this->stat,"xiSetParam (XI_PRM_FRAMERATE set)");
+  stat = xiSetParamInt(hDevice, XI_PRM_SENSOR_FEATURE_SELECTOR, XI_SENSOR_FEATURE_ZEROROT_ENABLE);
+  HandleResult(stat,"xiSetParam (XI_PRM_SENSOR_FEATURE_SELECTOR set)");
+  stat = xiSetParamInt(hDevice, XI_PRM_SENSOR_FEATURE_VALUE, XI_ON);
+  HandleResult(stat,"xiSetParam (XI_PRM_SENSOR_FEATURE_VALUE set)");
+  stat = xiSetParamInt(hDevice, XI_PRM_DOWNSAMPLING, XI_DWN_2x2);
+  HandleResult(stat,"xiSetParam (XI_PRM_DOWNSAMPLING set)");
+  stat = xiSetParamInt(hDevice, XI_PRM_DOWNSAMPLING_TYPE, XI_SKIPPING);
+  HandleResult(stat,"xiSetParam (XI_PRM_DOWNSAMPLING_TYPE set)");
+
+  stat = xiSetParamInt(hDevice, XI_PRM_ACQ_TIMING_MODE, XI_ACQ_TIMING_MODE_FRAME_RATE);
+  HandleResult(stat,"xiSetParam (XI_PRM_ACQ_TIMING_MODE set)");
+  stat = xiSetParamFloat(hDevice, XI_PRM_FRAMERATE, this->frame_rate_);
+  HandleResult(stat,"xiSetParam (XI_PRM_FRAMERATE set)");
 }
 
-void CameraCapture::query_camera_param() {
+void CameraCapture::plan_bandwidth() {
+  BandwidthPlanner planner(this->config_["bandwidth"]);
+  bool measure = this->config_["bandwidth"].get("controller_mbps", 0.0).asDouble() <= 0;
+
+  std::vector<CameraLink> links(this->hDevices_.size());
+  for (size_t idx = 0; idx < this->hDevices_.size(); idx++)
+  {
+    CameraLink& link = links[idx];
+    link.controller = planner.get_controller(idx);
+    link.width = this->img_width_;
+    link.height = this->img_height_;
+    // RGB24 is debayered on the host, the camera sends 8 bit RAW
+    link.bytes_per_pixel = 1.0;
+    link.frame_rate = this->frame_rate_;
+
+    // Measured one camera at a time, cameras measuring together share the bus
+    if (measure)
+    {
+      int available_mbps = 0;
+      XI_RETURN stat = xiGetParamInt(this->hDevices_[idx], XI_PRM_AVAILABLE_BANDWIDTH, &available_mbps);
+      HandleResult(stat, "xiGetParam (XI_PRM_AVAILABLE_BANDWIDTH)");
+      link.available_mbps = stat == XI_OK ? available_mbps : 0;
+    }
+  }
+
+  std::vector<LinkPlan> plans = planner.plan(links);
+  double planned_rate = this->frame_rate_;
+  for (size_t idx = 0; idx < this->hDevices_.size(); idx++)
+  {
+    apply_link_plan(idx, plans[idx]);
+    std::cout << BandwidthPlanner::describe(idx, links[idx], plans[idx]) << std::endl;
+    planned_rate = std::min(planned_rate, plans[idx].frame_rate);
+  }
+  mark_startup("bandwidth planned");
+
+  // The encoders are opened at the configured rate in the meantime, a camera
+  // running slower would record video that plays back too fast
+  if (planned_rate < this->frame_rate_)
+  {
+    std::cerr << "The USB controllers cannot carry every camera at " << this->frame_rate_
+              << " fps, set frame_rate to at most " << planned_rate
+              << ", lower the ROI or spread the cameras over more controllers\n";
+    this->bandwidth_exceeded_ = true;
+  }
+}
+
+void CameraCapture::apply_link_plan(size_t idx, const LinkPlan& plan) {
+  HANDLE hDevice = this->hDevices_[idx];
+  XI_RETURN stat = XI_OK;
+
+  if (plan.limit_mbps > 0)
+  {
+    stat = xiSetParamInt(hDevice, XI_PRM_LIMIT_BANDWIDTH_MODE, XI_ON);
+    HandleResult(stat,"xiSetParam (XI_PRM_LIMIT_BANDWIDTH_MODE set)");
+    stat = xiSetParamInt(hDevice, XI_PRM_LIMIT_BANDWIDTH, (int)plan.limit_mbps);
+    HandleResult(stat,"xiSetParam (XI_PRM_LIMIT_BANDWIDTH set)");
+  }
+
+  // Both only take effect when set before the acquisition starts
+  int max_queue_size = plan.queue_size;
+  xiGetParamInt(hDevice, XI_PRM_BUFFERS_QUEUE_SIZE XI_PRM_INFO_MAX, &max_queue_size);
+  stat = xiSetParamInt(hDevice, XI_PRM_BUFFERS_QUEUE_SIZE, std::min(plan.queue_size, max_queue_size));
+  HandleResult(stat,"xiSetParam (XI_PRM_BUFFERS_QUEUE_SIZE set)");
+
+  if (plan.transport_buffer_bytes > 0)
+  {
+    int max_bytes = plan.transport_buffer_bytes;
+    int increment = 1;
+    xiGetParamInt(hDevice, XI_PRM_ACQ_TRANSPORT_BUFFER_SIZE XI_PRM_INFO_MAX, &max_bytes);
+    xiGetParamInt(hDevice, XI_PRM_ACQ_TRANSPORT_BUFFER_SIZE XI_PRM_INFO_INCREMENT, &increment);
+    int bytes = std::min(plan.transport_buffer_bytes, max_bytes);
+    bytes -= bytes % std::max(1, increment);
+    stat = xiSetParamInt(hDevice, XI_PRM_ACQ_TRANSPORT_BUFFER_SIZE, bytes);
+    HandleResult(stat,"xiSetParam (XI_PRM_ACQ_TRANSPORT_BUFFER_SIZE set)");
+  }
+}
+
+void CameraCapture::query_camera_param(size_t idx) {
+  HANDLE hDevice = this->hDevices_[idx];
+  XI_RETURN stat = XI_OK;
   int query_result = -1;
 
-  this->stat = xiGetParamInt(*this->hDevice_, XI_PRM_EXPOSURE, &query_result);
-  std::cout << "XI_PRM_EXPOSURE: " << query_result << std::endl;
+  // Printed in one piece, cameras are queried in parallel
+  std::ostringstream report;
+  report << "Camera " << idx << std::endl;
+
+  stat = xiGetParamInt(hDevice, XI_PRM_EXPOSURE, &query_result);
+  HandleResult(stat,"xiGetParam (XI_PRM_EXPOSURE get)");
+  report << "XI_PRM_EXPOSURE: " << query_result << std::endl;
 
-  this->stat = xiGetParamInt(*this->hDevice_, XI_PRM_AUTO_WB, &query_result);
-  std::cout << "XI_PRM_AUTO_WB: " << query_result << std::endl;
+  stat = xiGetParamInt(hDevice, XI_PRM_AUTO_WB, &query_result);
+  HandleResult(stat,"xiGetParam (XI_PRM_AUTO_WB get)");
+  report << "XI_PRM_AUTO_WB: " << query_result << std::endl;
 
-  this->stat = xiGetParamInt(*this->hDevice_, XI_PRM_AEAG, &query_result);
-  std::cout << "XI_PRM_AEAG: " << query_result << std::endl;
+  stat = xiGetParamInt(hDevice, XI_PRM_AEAG, &query_result);
+  HandleResult(stat,"xiGetParam (XI_PRM_AEAG get)");
+  report << "XI_PRM_AEAG: " << query_result << std::endl;
 
-  this->stat = xiGetParamInt(*this->hDevice_, XI_PRM_AE_MAX_LIMIT, &query_result);
-  std::cout << "XI_PRM_AE_MAX_LIMIT: " << query_result << std::endl;
+  stat = xiGetParamInt(hDevice, XI_PRM_AE_MAX_LIMIT, &query_result);
+  HandleResult(stat,"xiGetParam (XI_PRM_AE_MAX_LIMIT get)");
+  report << "XI_PRM_AE_MAX_LIMIT: " << query_result << std::endl;
 
-  this->stat = xiGetParamInt(*this->hDevice_, XI_PRM_AG_MAX_LIMIT, &query_result);
-  std::cout << "XI_PRM_AG_MAX_LIMIT: " << query_result << std::endl;
+  stat = xiGetParamInt(hDevice, XI_PRM_AG_MAX_LIMIT, &query_result);
+  HandleResult(stat,"xiGetParam (XI_PRM_AG_MAX_LIMIT get)");
+  report << "XI_PRM_AG_MAX_LIMIT: " << query_result << std::endl;
+
+  std::cout << report.str();
 }
 
 void CameraCapture::start_capture() {
-  this->stat = xiStartAcquisition(*this->hDevice_);
-  HandleResult(this->stat, "xiStartAcquisition");
+  if (this->bandwidth_exceeded_)
+  {
+    return;
+  }
+
+  // A stalled camera must not hold back the others, so each device
+  // blocks in xiGetImage on its own thread
+  std::vector<std::thread> device_threads;
+  for (size_t idx = 0; idx < this->hDevices_.size(); idx++)
+  {
+    device_threads.emplace_back(&CameraCapture::capture_device, this, idx);
+  }
+
+  for (auto& device_thread : device_threads)
+  {
+    device_thread.join();
+  }
+}
+
+void CameraCapture::capture_device(size_t idx) {
+  apply_thread_placement("capture");
+
+  HANDLE hDevice = this->hDevices_[idx];
+  XI_IMG* image = &this->images_[idx];
+
+  XI_RETURN stat = xiStartAcquisition(hDevice);
+  HandleResult(stat, "xiStartAcquisition");
+  mark_startup("camera " + std::to_string(idx) + " acquisition started");
 
   auto lastTime = std::chrono::high_resolution_clock::now();
   int frameCount = 0;
   double fps = 0.0;
+  bool first_frame = true;
   
   while (this->keepRunning_)
   {
-    this->stat = xiGetImage(*this->hDevice_, 5000, this->image);
-    HandleResult(stat, "xiGetImage");
+    apply_pending_params(idx);
 
-    // std::cout << "Image resolution: " << this->image->width << 
-      // "x" << this->image->height << std::endl;
+    // A short timeout keeps the stop flag responsive on an idle camera
+    stat = xiGetImage(hDevice, this->capture_timeout_ms_, image);
+    if (stat == XI_TIMEOUT)
+    {
+      continue;
+    }
+    HandleResult(stat, "xiGetImage");
+    if (stat != XI_OK)
+    {
+      continue;
+    }
 
+    // Host time is taken as soon as the frame is handed over, before any
+    // pipe or queueing delay, so it is as close to the sensor time as possible
     auto currentTime = std::chrono::high_resolution_clock::now();
     std::chrono::duration<double> elapsed = currentTime - lastTime;
 
-    for (size_t idx = 0; idx < this->num_devices_; idx++)
+    CameraFrame frame;
+    frame.data = image->bp;
+    frame.camera_idx = idx;
+    frame.width = image->width;
+    frame.height = image->height;
+    frame.frame_number = image->nframe;
+    frame.sensor_timestamp_us = (int64_t)image->tsSec * 1000000 + image->tsUSec;
+    frame.host_timestamp_us = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::system_clock::now().time_since_epoch()).count();
+    frame.exposure_us = image->exposure_time_us;
+    frame.gain_db = image->gain_db;
+
+    // Never waits on the consumer, a backlog is shed by policy instead of
+    // piling up in the SDK's buffer queue
+    this->frame_queue_->offer(frame);
+
+    if (first_frame)
     {
-      this->dImageFrame_->put(idx, (void*)this->image->bp);
+      mark_startup("camera " + std::to_string(idx) + " first frame captured");
+      first_frame = false;
     }
 
     // Log every second
@@ -137,19 +331,101 @@ void CameraCapture::start_capture() {
       frameCount = 0;
       lastTime = currentTime;
 
-      std::cout << "FPS: " << fps << std::endl;
+      std::cout << "Camera " << idx << " FPS: " << fps << std::endl;
     }
   }
+
+  // Stopped on the thread that reads the device, never under a pending xiGetImage
+  stat = xiStopAcquisition(hDevice);
+  HandleResult(stat, "xiStopAcquisition");
 }
 
-void CameraCapture::stop_capture() {
-  this->keepRunning_ = false;
+bool CameraCapture::set_param(int idx,
+                              const std::string& param,
+                              const std::string& value,
+                              std::string* error) {
+  if (param != "exposure" && param != "gain" && param != "offset_x" && param != "offset_y")
+  {
+    *error = "unknown camera parameter " + param;
+    return false;
+  }
+  if (idx >= (int)this->hDevices_.size())
+  {
+    *error = "no camera " + std::to_string(idx);
+    return false;
+  }
 
-  this->stat = xiStopAcquisition(*this->hDevice_);
-  HandleResult(this->stat,"xiStopAcquisition");
+  char* end = nullptr;
+  double number = strtod(value.c_str(), &end);
+  if (*end != '\0' || number < 0)
+  {
+    *error = param + " must be a non-negative number";
+    return false;
+  }
 
-  this->stat = xiCloseDevice(*this->hDevice_);
-  HandleResult(this->stat,"xiCloseDevice");
+  std::lock_guard<std::mutex> lock(this->params_mutex_);
+  for (size_t device = 0; device < this->hDevices_.size(); device++)
+  {
+    if (idx < 0 || (size_t)idx == device)
+    {
+      this->pending_params_[device].emplace_back(param, number);
+    }
+  }
+  return true;
+}
+
+void CameraCapture::apply_pending_params(size_t idx) {
+  std::vector<std::pair<std::string, double>> params;
+  {
+    std::lock_guard<std::mutex> lock(this->params_mutex_);
+    if (this->pending_params_[idx].empty())
+    {
+      return;
+    }
+    params.swap(this->pending_params_[idx]);
+  }
+
+  HANDLE hDevice = this->hDevices_[idx];
+  for (const auto& [param, value] : params)
+  {
+    XI_RETURN stat = XI_OK;
+    if (param == "exposure" || param == "gain")
+    {
+      // Auto exposure would overwrite the value on the next frame
+      stat = xiSetParamInt(hDevice, XI_PRM_AEAG, XI_OFF);
+      HandleResult(stat, "xiSetParam (XI_PRM_AEAG set)");
+
+      if (param == "exposure")
+      {
+        stat = xiSetParamInt(hDevice, XI_PRM_EXPOSURE, (int)value);
+        HandleResult(stat, "xiSetParam (XI_PRM_EXPOSURE set)");
+      }
+      else
+      {
+        stat = xiSetParamFloat(hDevice, XI_PRM_GAIN, (float)value);
+        HandleResult(stat, "xiSetParam (XI_PRM_GAIN set)");
+      }
+    }
+    else if (param == "offset_x")
+    {
+      stat = xiSetParamInt(hDevice, XI_PRM_OFFSET_X, (int)value);
+      HandleResult(stat, "xiSetParam (XI_PRM_OFFSET_X set)");
+    }
+    else if (param == "offset_y")
+    {
+      stat = xiSetParamInt(hDevice, XI_PRM_OFFSET_Y, (int)value);
+      HandleResult(stat, "xiSetParam (XI_PRM_OFFSET_Y set)");
+    }
+
+    if (stat == XI_OK)
+    {
+      std::cout << "Camera " << idx << " " << param << " set to " << value << std::endl;
+    }
+  }
+}
+
+void CameraCapture::stop_capture() {
+  this->keepRunning_ = false;
 
-  std::cout << "Camera capture stopped\n";
+  std::cout << "Camera capture stopping\n";
 }
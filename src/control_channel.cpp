@@ -0,0 +1,246 @@
+#include "control_channel.hpp"
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <vector>
+
+// Commands are short, a longer line is a client that is not speaking the protocol
+static const size_t kMaxLineLength = 1024;
+
+ControlChannel::ControlChannel(const std::string& socket_path) {
+  this->socket_path_ = socket_path;
+
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (socket_path.size() >= sizeof(address.sun_path))
+  {
+    std::cerr << "Control socket path too long: " << socket_path << std::endl;
+    return;
+  }
+  strncpy(address.sun_path, socket_path.c_str(), sizeof(address.sun_path) - 1);
+
+  this->listen_fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (this->listen_fd_ < 0)
+  {
+    perror("control socket");
+    return;
+  }
+
+  // A socket file left behind by a previous run would make bind fail
+  unlink(socket_path.c_str());
+  if (bind(this->listen_fd_, (struct sockaddr*)&address, sizeof(address)) < 0 ||
+      listen(this->listen_fd_, 4) < 0)
+  {
+    perror("control socket bind");
+    close(this->listen_fd_);
+    this->listen_fd_ = -1;
+    return;
+  }
+
+  this->wake_fd_ = eventfd(0, EFD_CLOEXEC);
+  this->serve_thread_ = std::thread(&ControlChannel::serve_loop, this);
+
+  std::cout << "Control channel listening on " << socket_path << std::endl;
+}
+
+ControlChannel::~ControlChannel() {
+  if (this->serve_thread_.joinable())
+  {
+    uint64_t one = 1;
+    if (write(this->wake_fd_, &one, sizeof(one)) < 0)
+    {
+      perror("eventfd write");
+    }
+    this->serve_thread_.join();
+  }
+
+  if (this->listen_fd_ >= 0)
+  {
+    close(this->listen_fd_);
+    unlink(this->socket_path_.c_str());
+  }
+  if (this->wake_fd_ >= 0)
+  {
+    close(this->wake_fd_);
+  }
+}
+
+bool ControlChannel::is_open() {
+  return this->listen_fd_ >= 0;
+}
+
+void ControlChannel::add_handler(const std::string& param, Handler handler) {
+  std::lock_guard<std::mutex> lock(this->handlers_mutex_);
+  this->handlers_[param] = handler;
+}
+
+void ControlChannel::remove_handler(const std::string& param) {
+  std::lock_guard<std::mutex> lock(this->handlers_mutex_);
+  this->handlers_.erase(param);
+}
+
+void ControlChannel::serve_loop() {
+  struct Client {
+    int fd;
+    std::string buffer;
+  };
+  std::vector<Client> clients;
+
+  while (true)
+  {
+    std::vector<struct pollfd> fds = {{this->wake_fd_, POLLIN, 0}, {this->listen_fd_, POLLIN, 0}};
+    for (const Client& client : clients)
+    {
+      fds.push_back({client.fd, POLLIN, 0});
+    }
+
+    if (poll(fds.data(), fds.size(), -1) < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      perror("control poll");
+      break;
+    }
+
+    if (fds[0].revents & POLLIN)
+    {
+      break;
+    }
+
+    if (fds[1].revents & POLLIN)
+    {
+      int client_fd = accept4(this->listen_fd_, NULL, NULL, SOCK_CLOEXEC);
+      if (client_fd >= 0)
+      {
+        clients.push_back({client_fd, ""});
+      }
+    }
+
+    // Clients accepted above were not polled yet and are skipped this round
+    for (size_t i = 0; i + 2 < fds.size(); i++)
+    {
+      Client& client = clients[i];
+      if (!(fds[i + 2].revents & (POLLIN | POLLHUP | POLLERR)))
+      {
+        continue;
+      }
+
+      char buffer[256];
+      ssize_t received = recv(client.fd, buffer, sizeof(buffer), 0);
+      if (received <= 0)
+      {
+        close(client.fd);
+        client.fd = -1;
+        continue;
+      }
+      client.buffer.append(buffer, received);
+
+      size_t line_end;
+      while ((line_end = client.buffer.find('\n')) != std::string::npos)
+      {
+        std::string reply = handle_command(client.buffer.substr(0, line_end)) + "\n";
+        client.buffer.erase(0, line_end + 1);
+
+        // A client that went away must not take the process down with SIGPIPE
+        send(client.fd, reply.data(), reply.size(), MSG_NOSIGNAL);
+      }
+
+      if (client.buffer.size() > kMaxLineLength)
+      {
+        close(client.fd);
+        client.fd = -1;
+      }
+    }
+
+    std::vector<Client> open_clients;
+    for (Client& client : clients)
+    {
+      if (client.fd >= 0)
+      {
+        open_clients.push_back(client);
+      }
+    }
+    clients.swap(open_clients);
+  }
+
+  for (const Client& client : clients)
+  {
+    close(client.fd);
+  }
+}
+
+std::string ControlChannel::handle_command(const std::string& line) {
+  std::istringstream tokens(line);
+  std::string command;
+  tokens >> command;
+
+  if (command.empty())
+  {
+    return "error empty command";
+  }
+
+  std::lock_guard<std::mutex> lock(this->handlers_mutex_);
+
+  if (command == "list")
+  {
+    std::string params;
+    for (const auto& entry : this->handlers_)
+    {
+      params += (params.empty() ? "" : " ") + entry.first;
+    }
+    return "ok " + params;
+  }
+
+  if (command != "set")
+  {
+    return "error unknown command " + command;
+  }
+
+  std::string param, value, index_token;
+  if (!(tokens >> param >> value))
+  {
+    return "error usage: set <param> <value> [index]";
+  }
+
+  int index = -1;
+  if (tokens >> index_token)
+  {
+    char* end = nullptr;
+    index = strtol(index_token.c_str(), &end, 10);
+    if (*end != '\0' || index < 0)
+    {
+      return "error index must be a camera or session number";
+    }
+  }
+
+  auto handler = this->handlers_.find(param);
+  if (handler == this->handlers_.end())
+  {
+    return "error unknown parameter " + param;
+  }
+
+  // Called under the lock, so remove_handler() never returns while it runs
+  std::string error;
+  if (!handler->second(index, value, &error))
+  {
+    return "error " + error;
+  }
+
+  std::cout << "Control: " << param << " = " << value
+            << (index >= 0 ? " (" + std::to_string(index) + ")" : "") << std::endl;
+  return "ok";
+}
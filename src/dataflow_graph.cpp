@@ -0,0 +1,794 @@
+#include "dataflow_graph.hpp"
+
+#include "thread_placement.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <set>
+
+// Frames a worker processes for one stage before the other stages get a turn
+static const int kBatchFrames = 8;
+
+FrameRef::FrameRef(VideoFrame* frame) {
+  this->frame_ = frame;
+  this->frame_->refs_.store(1, std::memory_order_relaxed);
+}
+
+FrameRef::FrameRef(const FrameRef& other) {
+  this->frame_ = other.frame_;
+  if (this->frame_)
+  {
+    this->frame_->refs_.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+FrameRef::FrameRef(FrameRef&& other) noexcept {
+  this->frame_ = other.frame_;
+  other.frame_ = nullptr;
+}
+
+FrameRef& FrameRef::operator=(const FrameRef& other) {
+  if (this != &other)
+  {
+    reset();
+    this->frame_ = other.frame_;
+    if (this->frame_)
+    {
+      this->frame_->refs_.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+  return *this;
+}
+
+FrameRef& FrameRef::operator=(FrameRef&& other) noexcept {
+  if (this != &other)
+  {
+    reset();
+    this->frame_ = other.frame_;
+    other.frame_ = nullptr;
+  }
+  return *this;
+}
+
+FrameRef::~FrameRef() {
+  reset();
+}
+
+void FrameRef::reset() {
+  if (this->frame_ && this->frame_->refs_.fetch_sub(1, std::memory_order_acq_rel) == 1)
+  {
+    this->frame_->pool_->release(this->frame_);
+  }
+  this->frame_ = nullptr;
+}
+
+FramePool::FramePool(PixelFormat format, int width, int height, int count, const std::string& name) {
+  this->count_ = std::max(1, count);
+  size_t frame_size = image_size(format, width, height);
+  this->arena_ = std::make_unique<FrameArena>(this->count_ * (frame_size + FrameArena::kAlignment), name);
+  this->frames_ = std::make_unique<VideoFrame[]>(this->count_);
+
+  for (int i = 0; i < this->count_; i++)
+  {
+    VideoFrame* frame = &this->frames_[i];
+    frame->buffer_ = this->arena_->allocate(frame_size);
+    if (!frame->buffer_)
+    {
+      fprintf(stderr, "Could not allocate %s frames\n", name.c_str());
+      exit(1);
+    }
+    frame->pool_ = this;
+    frame->image = make_image(format, width, height, frame->buffer_);
+    frame->meta.width = width;
+    frame->meta.height = height;
+    frame->meta.data = frame->buffer_;
+    this->free_frames_.push_back(frame);
+  }
+}
+
+FrameRef FramePool::acquire() {
+  std::lock_guard<std::mutex> lock(this->mutex_);
+  if (this->free_frames_.empty())
+  {
+    return FrameRef();
+  }
+  VideoFrame* frame = this->free_frames_.back();
+  this->free_frames_.pop_back();
+  return FrameRef(frame);
+}
+
+int FramePool::get_count() {
+  return this->count_;
+}
+
+void FramePool::release(VideoFrame* frame) {
+  // Keeps the capacity, so carrying dropped frames allocates nothing in steady state
+  frame->dropped.clear();
+  std::lock_guard<std::mutex> lock(this->mutex_);
+  this->free_frames_.push_back(frame);
+}
+
+// The pool and deque index of the calling worker thread
+static thread_local WorkStealingPool* current_pool = nullptr;
+static thread_local int current_worker = -1;
+
+WorkStealingPool::WorkStealingPool(int workers) {
+  if (workers <= 0)
+  {
+    workers = std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  for (int i = 0; i < workers; i++)
+  {
+    this->workers_.push_back(std::make_unique<Worker>());
+  }
+  for (int i = 0; i < workers; i++)
+  {
+    this->threads_.emplace_back(&WorkStealingPool::worker_loop, this, i);
+  }
+}
+
+WorkStealingPool::~WorkStealingPool() {
+  {
+    std::lock_guard<std::mutex> lock(this->sleep_mutex_);
+    this->stopping_ = true;
+  }
+  this->cv_tasks_.notify_all();
+
+  for (auto& thread : this->threads_)
+  {
+    thread.join();
+  }
+}
+
+int WorkStealingPool::get_workers() {
+  return this->workers_.size();
+}
+
+void WorkStealingPool::submit(std::function<void()> task) {
+  int target = current_pool == this ? current_worker : this->next_worker_++ % this->workers_.size();
+
+  // Counted first, a worker that sees the task must not find the count at zero
+  this->queued_++;
+  {
+    std::lock_guard<std::mutex> lock(this->workers_[target]->mutex);
+    this->workers_[target]->tasks.push_back(std::move(task));
+  }
+  {
+    std::lock_guard<std::mutex> lock(this->sleep_mutex_);
+  }
+  this->cv_tasks_.notify_one();
+}
+
+void WorkStealingPool::defer(std::function<void()> task) {
+  int target = current_pool == this ? current_worker : this->next_worker_++ % this->workers_.size();
+
+  this->queued_++;
+  {
+    std::lock_guard<std::mutex> lock(this->workers_[target]->mutex);
+    this->workers_[target]->tasks.push_front(std::move(task));
+  }
+  {
+    std::lock_guard<std::mutex> lock(this->sleep_mutex_);
+  }
+  this->cv_tasks_.notify_one();
+}
+
+uint64_t WorkStealingPool::get_steals() {
+  return this->steals_;
+}
+
+bool WorkStealingPool::take_task(int self, std::function<void()>* task) {
+  {
+    Worker* worker = this->workers_[self].get();
+    std::lock_guard<std::mutex> lock(worker->mutex);
+    if (!worker->tasks.empty())
+    {
+      *task = std::move(worker->tasks.back());
+      worker->tasks.pop_back();
+      this->queued_--;
+      return true;
+    }
+  }
+
+  int num_workers = this->workers_.size();
+  for (int i = 1; i < num_workers; i++)
+  {
+    Worker* victim = this->workers_[(self + i) % num_workers].get();
+    std::lock_guard<std::mutex> lock(victim->mutex);
+    if (!victim->tasks.empty())
+    {
+      *task = std::move(victim->tasks.front());
+      victim->tasks.pop_front();
+      this->queued_--;
+      this->steals_++;
+      return true;
+    }
+  }
+  return false;
+}
+
+void WorkStealingPool::worker_loop(int self) {
+  apply_thread_placement("pipeline");
+  current_pool = this;
+  current_worker = self;
+
+  while (true)
+  {
+    std::function<void()> task;
+    if (take_task(self, &task))
+    {
+      task();
+      continue;
+    }
+
+    // Tasks still queued run before the workers stop
+    std::unique_lock<std::mutex> lock(this->sleep_mutex_);
+    this->cv_tasks_.wait(lock, [this] { return this->stopping_ || this->queued_ > 0; });
+    if (this->stopping_ && this->queued_ == 0)
+    {
+      return;
+    }
+  }
+}
+
+std::string stream_type_name(const StreamType& type) {
+  if (!type.valid)
+  {
+    return "nothing";
+  }
+  return std::string(pixel_format_name(type.format)) + " " + std::to_string(type.width) + "x" +
+         std::to_string(type.height);
+}
+
+bool DataflowGraph::Node::has_room_locked(int extra) {
+  for (Edge* edge : this->outputs)
+  {
+    if (!edge->drop_when_full && edge->queue->size() + extra > edge->queue->capacity())
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool DataflowGraph::Node::has_room() {
+  std::lock_guard<std::mutex> lock(this->mutex);
+  return has_room_locked(1);
+}
+
+void DataflowGraph::Node::emit(FrameRef frame) {
+  std::lock_guard<std::mutex> lock(this->mutex);
+  this->processed++;
+  push_outputs(frame);
+}
+
+void DataflowGraph::Node::push_outputs(const FrameRef& frame) {
+  for (Edge* edge : this->outputs)
+  {
+    if (edge->camera >= 0 && frame->meta.camera_idx != edge->camera)
+    {
+      continue;
+    }
+    if (!edge->queue->try_push(frame))
+    {
+      edge->dropped++;
+      continue;
+    }
+    this->graph->schedule(edge->to);
+  }
+}
+
+DataflowGraph::DataflowGraph(Json::Value config) {
+  this->config_ = config;
+  this->jsonPipelineConf_ = config["pipeline"];
+  this->num_cameras_ = std::max(1, config["number_cameras"].asInt());
+}
+
+DataflowGraph::~DataflowGraph() {
+  stop();
+
+  // Queued frames go back to the pools of the stages that made them,
+  // before any stage and its pool is destroyed
+  this->pool_.reset();
+  this->edges_.clear();
+  for (auto& node : this->nodes_)
+  {
+    node->results.clear();
+  }
+  this->order_.clear();
+  this->nodes_.clear();
+}
+
+void DataflowGraph::register_stage_type(const std::string& type, StageFactory factory) {
+  this->factories_[type] = std::move(factory);
+}
+
+bool DataflowGraph::build() {
+  const Json::Value& jsonStages = this->jsonPipelineConf_["stages"];
+  if (!jsonStages.isArray() || jsonStages.empty())
+  {
+    std::cerr << "Pipeline: no stages configured" << std::endl;
+    return false;
+  }
+
+  if (!instantiate(jsonStages) || !connect(jsonStages) || !sort_nodes())
+  {
+    return false;
+  }
+
+  // Types flow from the sources down
+  bool has_source = false;
+  for (Node* node : this->order_)
+  {
+    StreamType input;
+    for (Edge* edge : node->inputs)
+    {
+      const StreamType& type = edge->from->output_type;
+      if (!type.valid)
+      {
+        std::cerr << "Pipeline: " << edge->from->name << " has no output for " << node->name << std::endl;
+        return false;
+      }
+      if (input.valid && (type.format != input.format || type.width != input.width || type.height != input.height))
+      {
+        std::cerr << "Pipeline: inputs of " << node->name << " differ, " << stream_type_name(input) << " and "
+                  << stream_type_name(type) << std::endl;
+        return false;
+      }
+      input = type;
+    }
+
+    if (node->is_source != node->inputs.empty())
+    {
+      std::cerr << "Pipeline: " << node->name << (node->is_source ? " is a source and takes no inputs"
+                                                                   : " needs an input") << std::endl;
+      return false;
+    }
+    has_source |= node->is_source;
+
+    std::string error;
+    if (!node->stage->configure(input, &node->output_type, &error))
+    {
+      std::cerr << "Pipeline: " << node->name << ": " << error << std::endl;
+      return false;
+    }
+
+    node->concurrency = std::clamp(node->jsonStageConf.get("concurrency", 1).asInt(),
+                                   1, std::max(1, node->stage->get_max_concurrency()));
+    node->results.resize(node->concurrency);
+    node->done.resize(node->concurrency, false);
+  }
+
+  if (!has_source)
+  {
+    std::cerr << "Pipeline: no source stage" << std::endl;
+    return false;
+  }
+
+  std::cout << "Pipeline:" << std::endl;
+  for (Node* node : this->order_)
+  {
+    // Frames in the stage's own hands, queued on every edge and being
+    // processed by every consumer, plus one being filled
+    int frames_in_flight = node->concurrency + 1;
+    std::cout << "  " << node->name << " (" << node->type << ", " << stream_type_name(node->output_type);
+    if (node->concurrency > 1)
+    {
+      std::cout << ", " << node->concurrency << " workers";
+    }
+    std::cout << ")";
+    for (Edge* edge : node->outputs)
+    {
+      frames_in_flight += edge->queue->capacity() + edge->to->concurrency;
+      std::cout << (edge == node->outputs.front() ? " -> " : ", ") << edge->to->name
+                << (edge->drop_when_full ? " (drop)" : "");
+    }
+    std::cout << std::endl;
+
+    if (!node->stage->open(frames_in_flight))
+    {
+      std::cerr << "Pipeline: could not open " << node->name << std::endl;
+      return false;
+    }
+  }
+
+  this->pool_ = std::make_unique<WorkStealingPool>(this->jsonPipelineConf_.get("workers", 0).asInt());
+  std::cout << "Pipeline: " << this->nodes_.size() << " stages on " << this->pool_->get_workers()
+            << " workers" << std::endl;
+  return true;
+}
+
+bool DataflowGraph::instantiate(const Json::Value& jsonStages) {
+  for (const Json::Value& jsonStageConf : jsonStages)
+  {
+    std::string name = jsonStageConf["name"].asString();
+    std::string type = jsonStageConf["type"].asString();
+    if (name.empty() || this->instances_.count(name))
+    {
+      std::cerr << "Pipeline: stage names must be unique and not empty: \"" << name << "\"" << std::endl;
+      return false;
+    }
+
+    auto factory = this->factories_.find(type);
+    if (factory == this->factories_.end())
+    {
+      std::cerr << "Pipeline: unknown stage type \"" << type << "\" for " << name << std::endl;
+      return false;
+    }
+
+    std::vector<int> all_cameras;
+    for (int idx = 0; idx < this->num_cameras_; idx++)
+    {
+      all_cameras.push_back(idx);
+    }
+
+    bool per_camera = jsonStageConf["per_camera"].asBool();
+    std::vector<Node*>& instances = this->instances_[name];
+    for (int idx = 0; idx < (per_camera ? this->num_cameras_ : 1); idx++)
+    {
+      StageContext context;
+      context.name = per_camera ? name + "/" + std::to_string(idx) : name;
+      context.jsonStageConf = jsonStageConf;
+      context.config = this->config_;
+      context.camera = per_camera ? idx : -1;
+      context.cameras = per_camera ? std::vector<int>{idx} : all_cameras;
+
+      auto node = std::make_unique<Node>();
+      node->name = context.name;
+      node->type = type;
+      node->jsonStageConf = jsonStageConf;
+      node->camera = context.camera;
+      node->graph = this;
+      node->stage = factory->second(context);
+      if (!node->stage)
+      {
+        std::cerr << "Pipeline: could not create " << context.name << std::endl;
+        return false;
+      }
+      node->is_source = node->stage->is_source();
+
+      instances.push_back(node.get());
+      this->nodes_.push_back(std::move(node));
+    }
+  }
+  return true;
+}
+
+bool DataflowGraph::connect(const Json::Value& jsonStages) {
+  int default_capacity = std::max(1, this->jsonPipelineConf_.get("queue_capacity", 4).asInt());
+
+  for (const Json::Value& jsonStageConf : jsonStages)
+  {
+    std::string name = jsonStageConf["name"].asString();
+    for (const Json::Value& jsonInput : jsonStageConf["inputs"])
+    {
+      std::string from = jsonInput.isString() ? jsonInput.asString() : jsonInput["from"].asString();
+      int capacity = default_capacity;
+      std::string when_full = "wait";
+      if (jsonInput.isObject())
+      {
+        capacity = std::max(1, jsonInput.get("capacity", default_capacity).asInt());
+        when_full = jsonInput.get("when_full", "wait").asString();
+      }
+
+      if (!this->instances_.count(from))
+      {
+        std::cerr << "Pipeline: " << name << " takes input from unknown stage \"" << from << "\"" << std::endl;
+        return false;
+      }
+      if (when_full != "wait" && when_full != "drop")
+      {
+        std::cerr << "Pipeline: when_full must be wait or drop, not \"" << when_full << "\"" << std::endl;
+        return false;
+      }
+
+      for (Node* to_node : this->instances_[name])
+      {
+        for (Node* from_node : this->instances_[from])
+        {
+          // Per-camera instances only connect to their own camera
+          if (from_node->camera >= 0 && to_node->camera >= 0 && from_node->camera != to_node->camera)
+          {
+            continue;
+          }
+
+          auto edge = std::make_unique<Edge>();
+          edge->from = from_node;
+          edge->to = to_node;
+          edge->camera = from_node->camera < 0 ? to_node->camera : -1;
+          edge->drop_when_full = when_full == "drop";
+          edge->queue = std::make_unique<BoundedQueue<FrameRef>>(capacity);
+
+          from_node->outputs.push_back(edge.get());
+          to_node->inputs.push_back(edge.get());
+          this->edges_.push_back(std::move(edge));
+        }
+      }
+    }
+  }
+  return true;
+}
+
+bool DataflowGraph::sort_nodes() {
+  std::map<Node*, int> missing_inputs;
+  std::vector<Node*> ready;
+  for (auto& node : this->nodes_)
+  {
+    std::set<Node*> producers;
+    for (Edge* edge : node->inputs)
+    {
+      producers.insert(edge->from);
+    }
+    missing_inputs[node.get()] = producers.size();
+    if (producers.empty())
+    {
+      ready.push_back(node.get());
+    }
+  }
+
+  while (!ready.empty())
+  {
+    Node* node = ready.front();
+    ready.erase(ready.begin());
+    this->order_.push_back(node);
+
+    std::set<Node*> consumers;
+    for (Edge* edge : node->outputs)
+    {
+      consumers.insert(edge->to);
+    }
+    for (Node* consumer : consumers)
+    {
+      if (--missing_inputs[consumer] == 0)
+      {
+        ready.push_back(consumer);
+      }
+    }
+  }
+
+  if (this->order_.size() != this->nodes_.size())
+  {
+    std::cerr << "Pipeline: the stages form a cycle" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+void DataflowGraph::start(std::function<void()> on_sources_done) {
+  this->last_report_ = std::chrono::steady_clock::now();
+
+  for (Node* node : this->order_)
+  {
+    if (node->is_source)
+    {
+      this->running_sources_++;
+    }
+  }
+
+  for (Node* node : this->order_)
+  {
+    if (node->is_source)
+    {
+      this->source_threads_.emplace_back([this, node, on_sources_done]() {
+        node->stage->run_source(node);
+        if (--this->running_sources_ == 0)
+        {
+          on_sources_done();
+        }
+      });
+    }
+  }
+}
+
+void DataflowGraph::schedule(Node* node) {
+  if (node->is_source)
+  {
+    return;
+  }
+
+  // A worker on the node that is about to stop sees this and goes on
+  node->pending = true;
+  int active = node->active;
+  while (active < node->concurrency)
+  {
+    if (node->active.compare_exchange_weak(active, active + 1))
+    {
+      this->pool_->submit([this, node]() { run_node(node); });
+      return;
+    }
+  }
+}
+
+void DataflowGraph::run_node(Node* node) {
+  for (int i = 0; i < kBatchFrames; i++)
+  {
+    node->pending = false;
+    if (!step(node))
+    {
+      node->active--;
+      if (node->pending)
+      {
+        schedule(node);
+      }
+      return;
+    }
+  }
+
+  // Keeps its worker slot, but lets the other stages run first
+  this->pool_->defer([this, node]() { run_node(node); });
+}
+
+bool DataflowGraph::step(Node* node) {
+  FrameRef input;
+  Edge* input_edge = nullptr;
+  uint64_t ticket = 0;
+  {
+    std::lock_guard<std::mutex> lock(node->mutex);
+    if (node->in_flight >= node->concurrency)
+    {
+      return false;
+    }
+
+    // Set before looking, so a consumer that frees a slot right after wakes us
+    node->blocked = true;
+    if (!node->has_room_locked(node->in_flight + 1))
+    {
+      return false;
+    }
+    node->blocked = false;
+
+    size_t num_inputs = node->inputs.size();
+    for (size_t i = 0; i < num_inputs && !input_edge; i++)
+    {
+      Edge* edge = node->inputs[(node->next_input + i) % num_inputs];
+      if (edge->queue->try_pop(&input))
+      {
+        input_edge = edge;
+        node->next_input = (node->next_input + i + 1) % num_inputs;
+      }
+    }
+    if (!input_edge)
+    {
+      return false;
+    }
+
+    ticket = node->next_ticket++;
+    node->in_flight++;
+  }
+
+  // The producer may be waiting for the slot that just freed up
+  if (input_edge->from->blocked.exchange(false))
+  {
+    schedule(input_edge->from);
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  FrameRef output = node->stage->process(input);
+  input.reset();
+  node->busy_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now() - start).count();
+  node->processed++;
+
+  bool committed = false;
+  {
+    std::lock_guard<std::mutex> lock(node->mutex);
+    int slot = ticket % node->concurrency;
+    node->results[slot] = std::move(output);
+    node->done[slot] = true;
+
+    // Frames finished out of order wait for the ones taken before them
+    while (node->done[node->next_commit % node->concurrency])
+    {
+      slot = node->next_commit % node->concurrency;
+      FrameRef frame = std::move(node->results[slot]);
+      node->done[slot] = false;
+      node->next_commit++;
+      node->in_flight--;
+      committed = true;
+      if (frame)
+      {
+        node->push_outputs(frame);
+      }
+    }
+  }
+
+  // Workers that found every slot taken have stopped, bring them back
+  if (committed && node->concurrency > 1)
+  {
+    schedule(node);
+  }
+  return true;
+}
+
+bool DataflowGraph::is_drained(Node* node) {
+  for (Edge* edge : node->inputs)
+  {
+    if (!edge->from->finished || edge->queue->size() > 0)
+    {
+      return false;
+    }
+  }
+  std::lock_guard<std::mutex> lock(node->mutex);
+  return node->active == 0 && node->in_flight == 0;
+}
+
+void DataflowGraph::stop() {
+  if (this->stopped_ || !this->pool_)
+  {
+    return;
+  }
+  this->stopped_ = true;
+
+  for (Node* node : this->order_)
+  {
+    if (node->is_source)
+    {
+      node->stage->stop_source();
+    }
+  }
+  for (auto& thread : this->source_threads_)
+  {
+    thread.join();
+  }
+
+  // Stages finish in topological order, each once everything upstream has
+  // finished and its own queues are empty
+  for (Node* node : this->order_)
+  {
+    while (!is_drained(node))
+    {
+      schedule(node);
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    node->stage->finish();
+    node->finished = true;
+  }
+}
+
+void DataflowGraph::print_stats(std::ostream& out) {
+  auto now = std::chrono::steady_clock::now();
+  double seconds = std::max(1e-6, std::chrono::duration<double>(now - this->last_report_).count());
+  this->last_report_ = now;
+
+  out << std::fixed << std::setprecision(1) << "Pipeline (" << this->pool_->get_steals() << " steals):\n";
+  for (Node* node : this->order_)
+  {
+    int64_t processed = node->processed;
+    int64_t busy_ns = node->busy_ns;
+    out << "  " << node->name << ": " << (processed - node->reported_processed) / seconds << " fps";
+    if (!node->is_source)
+    {
+      // Over 100% when the stage runs on several workers
+      out << ", busy " << (busy_ns - node->reported_busy_ns) / (seconds * 1e7) << "%";
+    }
+    node->reported_processed = processed;
+    node->reported_busy_ns = busy_ns;
+
+    size_t queued = 0;
+    size_t capacity = 0;
+    int64_t dropped = 0;
+    for (Edge* edge : node->inputs)
+    {
+      queued += edge->queue->size();
+      capacity += edge->queue->capacity();
+    }
+    for (Edge* edge : node->outputs)
+    {
+      dropped += edge->dropped;
+    }
+    if (capacity > 0)
+    {
+      out << ", queued " << queued << "/" << capacity;
+    }
+    if (dropped > 0)
+    {
+      out << ", " << dropped << " dropped downstream";
+    }
+    node->stage->report(out);
+    out << "\n";
+  }
+}
@@ -0,0 +1,811 @@
+#include "dataflow_stages.hpp"
+
+#include "camera_capture.hpp"
+#include "frame_metadata.hpp"
+#include "frame_sync.hpp"
+#include "load_shedder.hpp"
+#include "network_connection.hpp"
+#include "raw_frame_store.hpp"
+#include "shm_frame_ring.hpp"
+#include "synthetic_capture.hpp"
+#include "thread_placement.hpp"
+#include "video_encoding.hpp"
+
+#include <opencv2/opencv.hpp>
+#include <libyuv.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <thread>
+
+namespace {
+
+// Most workers a stateless stage is run on at once
+const int kMaxParallel = 64;
+
+Json::Value merge_conf(Json::Value base, const Json::Value& overrides) {
+  for (const std::string& key : overrides.getMemberNames())
+  {
+    base[key] = overrides[key];
+  }
+  return base;
+}
+
+bool parse_pixel_format(std::string name, PixelFormat* format) {
+  std::transform(name.begin(), name.end(), name.begin(), [](unsigned char c) { return std::toupper(c); });
+  for (PixelFormat candidate : {PixelFormat::BGR24, PixelFormat::RGB24, PixelFormat::BGRA,
+                                PixelFormat::NV12, PixelFormat::I420})
+  {
+    if (name == pixel_format_name(candidate))
+    {
+      *format = candidate;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Bytes per pixel of the formats stored as they are, 0 for the others
+int packed_channels(PixelFormat format) {
+  switch (format)
+  {
+    case PixelFormat::BGR24:
+    case PixelFormat::RGB24:
+      return 3;
+    case PixelFormat::BGRA:
+      return 4;
+    default:
+      return 0;
+  }
+}
+
+class CaptureStage : public Stage {
+public:
+  CaptureStage(const StageContext& context) {
+    this->config_ = context.config;
+    this->num_cameras_ = std::max(1, context.config["number_cameras"].asInt());
+    this->width_ = context.config["image_width"].asInt();
+    this->height_ = context.config["image_height"].asInt();
+  }
+
+  bool configure(const StreamType& input, StreamType* output, std::string* error) override {
+    if (this->width_ <= 0 || this->height_ <= 0)
+    {
+      *error = "image_width and image_height must be set";
+      return false;
+    }
+    output->valid = true;
+    output->format = PixelFormat::BGR24;
+    output->width = this->width_;
+    output->height = this->height_;
+    return true;
+  }
+
+  bool open(int frames_in_flight) override {
+    this->frame_queue_ = std::make_unique<LoadShedder>(this->config_["load_shedding"], this->num_cameras_,
+                                                       (size_t)this->width_ * this->height_ * 3);
+    this->pool_ = std::make_unique<FramePool>(PixelFormat::BGR24, this->width_, this->height_,
+                                              frames_in_flight, "capture");
+    this->aligners_.resize(this->num_cameras_);
+    this->pending_dropped_.resize(this->num_cameras_);
+
+    if (this->config_.get("source", "ximea").asString() == "synthetic")
+    {
+      this->source_ = std::make_unique<SyntheticCapture>(this->frame_queue_.get(), this->config_);
+    }
+    else
+    {
+      this->source_ = std::make_unique<CameraCapture>(this->frame_queue_.get(), this->config_);
+    }
+    return true;
+  }
+
+  bool is_source() override {
+    return true;
+  }
+
+  // Frames only leave the load shedder when the graph has room for them,
+  // so a slow pipeline is shed by its policy like in camera_stream
+  void run_source(FrameOutput* output) override {
+    std::thread capture_thread([this]() {
+      this->source_->start_capture();
+      this->capture_done_ = true;
+    });
+    apply_thread_placement("consumer");
+
+    size_t frame_bytes = (size_t)this->width_ * this->height_ * 3;
+    std::vector<DroppedFrame> dropped;
+    while (true)
+    {
+      bool draining = this->capture_done_;
+      bool received = false;
+      bool held_back = false;
+
+      this->frame_queue_->wait_for_frames(std::chrono::milliseconds(1));
+
+      // Each frame carries the frames of its camera shed before it
+      this->frame_queue_->take_dropped_frames(&dropped);
+      for (const DroppedFrame& frame : dropped)
+      {
+        this->pending_dropped_[frame.camera_idx].push_back(frame);
+      }
+      dropped.clear();
+
+      for (int idx : this->frame_queue_->get_service_order())
+      {
+        if (!output->has_room())
+        {
+          held_back = true;
+          break;
+        }
+        FrameRef frame = this->pool_->acquire();
+        if (!frame)
+        {
+          held_back = true;
+          break;
+        }
+
+        CameraFrame camera_frame;
+        if (!this->frame_queue_->pop(idx, &camera_frame))
+        {
+          continue;
+        }
+        received = true;
+
+        memcpy(frame->image.planes[0], camera_frame.data, frame_bytes);
+        camera_frame.aligned_timestamp_us = this->aligners_[idx].align(camera_frame.sensor_timestamp_us,
+                                                                       camera_frame.host_timestamp_us);
+        camera_frame.data = frame->image.planes[0];
+        frame->meta = camera_frame;
+        frame->dropped.swap(this->pending_dropped_[idx]);
+        output->emit(std::move(frame));
+      }
+
+      if (draining && !received && !held_back)
+      {
+        break;
+      }
+      // Queued frames wake wait_for_frames() right away
+      if (held_back && !received)
+      {
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+      }
+    }
+
+    capture_thread.join();
+  }
+
+  void stop_source() override {
+    this->source_->stop_capture();
+  }
+
+  void report(std::ostream& out) override {
+    int64_t offered = 0;
+    int64_t shed = 0;
+    int64_t skipped = 0;
+    for (int idx = 0; idx < this->num_cameras_; idx++)
+    {
+      offered += this->frame_queue_->get_offered_frames(idx);
+      shed += this->frame_queue_->get_dropped_frames(idx);
+      skipped += this->frame_queue_->get_skipped_frames(idx);
+    }
+    if (shed > 0)
+    {
+      out << ", shed " << shed << " of " << offered;
+    }
+    if (skipped > 0)
+    {
+      out << ", " << skipped << " skipped before capture";
+    }
+  }
+
+private:
+  Json::Value config_;
+  int num_cameras_ = 1;
+  int width_ = 0;
+  int height_ = 0;
+
+  std::unique_ptr<LoadShedder> frame_queue_;
+  std::unique_ptr<FrameSource> source_;
+  std::atomic<bool> capture_done_ = false;
+
+  std::unique_ptr<FramePool> pool_;
+  std::vector<ClockAligner> aligners_;
+  std::vector<std::vector<DroppedFrame>> pending_dropped_;
+};
+
+class ConvertStage : public Stage {
+public:
+  ConvertStage(const StageContext& context) {
+    this->name_ = context.name;
+    this->jsonStageConf_ = context.jsonStageConf;
+  }
+
+  bool configure(const StreamType& input, StreamType* output, std::string* error) override {
+    std::string format_name = this->jsonStageConf_.get("format", "nv12").asString();
+    if (!parse_pixel_format(format_name, &this->format_))
+    {
+      *error = "unknown format " + format_name;
+      return false;
+    }
+
+    // One side alone keeps the aspect ratio, and nothing is scaled up
+    int width = this->jsonStageConf_.get("width", 0).asInt();
+    int height = this->jsonStageConf_.get("height", 0).asInt();
+    if (width > 0 && height <= 0)
+    {
+      height = (int)((int64_t)input.height * width / input.width);
+    }
+    else if (height > 0 && width <= 0)
+    {
+      width = (int)((int64_t)input.width * height / input.height);
+    }
+    else if (width <= 0 && height <= 0)
+    {
+      width = input.width;
+      height = input.height;
+    }
+    if (width > input.width || height > input.height)
+    {
+      *error = "cannot scale " + stream_type_name(input) + " up";
+      return false;
+    }
+    if (!packed_channels(this->format_))
+    {
+      width = std::max(2, width & ~1);
+      height = std::max(2, height & ~1);
+    }
+
+    if (input.format != this->format_)
+    {
+      this->kernel_ = ConversionKernel(input.format, this->format_);
+      if (!this->kernel_.is_valid())
+      {
+        *error = std::string("no conversion from ") + pixel_format_name(input.format) + " to " +
+                 pixel_format_name(this->format_);
+        return false;
+      }
+    }
+
+    this->input_ = input;
+    this->scale_ = width != input.width || height != input.height;
+    if (this->scale_ && this->format_ != PixelFormat::NV12 && this->format_ != PixelFormat::I420 &&
+        this->format_ != PixelFormat::BGRA)
+    {
+      *error = "scaling needs nv12, i420 or bgra";
+      return false;
+    }
+
+    output->valid = true;
+    output->format = this->format_;
+    output->width = width;
+    output->height = height;
+    this->output_ = *output;
+    return true;
+  }
+
+  bool open(int frames_in_flight) override {
+    this->pool_ = std::make_unique<FramePool>(this->format_, this->output_.width, this->output_.height,
+                                              frames_in_flight, this->name_);
+
+    // Converted at full size first, one frame per worker
+    if (this->scale_ && this->kernel_.is_valid())
+    {
+      this->scratch_pool_ = std::make_unique<FramePool>(
+        this->format_, this->input_.width, this->input_.height,
+        std::clamp(this->jsonStageConf_.get("concurrency", 1).asInt(), 1, kMaxParallel), this->name_ + " scratch");
+    }
+    return true;
+  }
+
+  int get_max_concurrency() override {
+    return kMaxParallel;
+  }
+
+  FrameRef process(const FrameRef& input) override {
+    FrameRef output = this->pool_->acquire();
+    FrameRef scratch;
+    if (this->scratch_pool_)
+    {
+      scratch = this->scratch_pool_->acquire();
+    }
+    if (!output || (this->scratch_pool_ && !scratch))
+    {
+      this->no_buffer_++;
+      return FrameRef();
+    }
+
+    const Image* src = &input->image;
+    if (this->kernel_.is_valid())
+    {
+      const Image* dst = scratch ? &scratch->image : &output->image;
+      this->kernel_.convert(*src, *dst);
+      src = dst;
+    }
+    if (this->scale_)
+    {
+      scale(*src, output->image);
+    }
+
+    output->meta = input->meta;
+    output->meta.width = this->output_.width;
+    output->meta.height = this->output_.height;
+    output->meta.data = output->image.planes[0];
+    output->dropped = input->dropped;
+    return output;
+  }
+
+  void report(std::ostream& out) override {
+    if (this->no_buffer_ > 0)
+    {
+      out << ", " << this->no_buffer_ << " without a buffer";
+    }
+  }
+
+private:
+  void scale(const Image& src, const Image& dst) {
+    switch (this->format_)
+    {
+      case PixelFormat::NV12:
+        libyuv::NV12Scale(src.planes[0], src.strides[0], src.planes[1], src.strides[1], src.width, src.height,
+                          dst.planes[0], dst.strides[0], dst.planes[1], dst.strides[1], dst.width, dst.height,
+                          libyuv::kFilterBox);
+        break;
+      case PixelFormat::I420:
+        libyuv::I420Scale(src.planes[0], src.strides[0], src.planes[1], src.strides[1],
+                          src.planes[2], src.strides[2], src.width, src.height,
+                          dst.planes[0], dst.strides[0], dst.planes[1], dst.strides[1],
+                          dst.planes[2], dst.strides[2], dst.width, dst.height, libyuv::kFilterBox);
+        break;
+      default:
+        libyuv::ARGBScale(src.planes[0], src.strides[0], src.width, src.height,
+                          dst.planes[0], dst.strides[0], dst.width, dst.height, libyuv::kFilterBox);
+        break;
+    }
+  }
+
+  std::string name_;
+  Json::Value jsonStageConf_;
+  PixelFormat format_ = PixelFormat::NV12;
+  StreamType input_;
+  StreamType output_;
+  bool scale_ = false;
+  ConversionKernel kernel_;
+
+  std::unique_ptr<FramePool> pool_;
+  std::unique_ptr<FramePool> scratch_pool_;
+  std::atomic<int64_t> no_buffer_ = 0;
+};
+
+// Points an AVFrame at an NV12 image, for the encoders' NV12 entry points
+void wrap_nv12(const VideoFrame& frame, AVFrame* view) {
+  view->format = AV_PIX_FMT_NV12;
+  view->width = frame.image.width;
+  view->height = frame.image.height;
+  for (int plane = 0; plane < 2; plane++)
+  {
+    view->data[plane] = frame.image.planes[plane];
+    view->linesize[plane] = frame.image.strides[plane];
+  }
+}
+
+class EncodeStage : public Stage {
+public:
+  EncodeStage(const StageContext& context) {
+    this->name_ = context.name;
+    this->cameras_ = context.cameras;
+    this->jsonVideoConf_ = merge_conf(context.config["video_encoding"], context.jsonStageConf["video_encoding"]);
+    this->lossless_ = this->jsonVideoConf_["lossless"]["enabled"].asBool();
+  }
+
+  ~EncodeStage() {
+    av_frame_free(&this->view_);
+  }
+
+  bool configure(const StreamType& input, StreamType* output, std::string* error) override {
+    PixelFormat needed = this->lossless_ ? PixelFormat::BGRA : PixelFormat::NV12;
+    if (input.format != needed)
+    {
+      *error = std::string("needs ") + pixel_format_name(needed) + ", gets " + stream_type_name(input);
+      return false;
+    }
+    this->jsonVideoConf_["stream_width"] = input.width;
+    this->jsonVideoConf_["stream_height"] = input.height;
+    return true;
+  }
+
+  bool open(int frames_in_flight) override {
+    // Codec worker threads are created when the encoder is opened
+    ScopedThreadPlacement placement("encode");
+    for (int camera : this->cameras_)
+    {
+      this->encoders_[camera] = std::make_unique<VideoEncoding>(this->jsonVideoConf_, "output", camera, -1);
+      if (!this->encoders_[camera]->is_open())
+      {
+        std::cerr << "Could not open the encoder of camera " << camera << std::endl;
+        return false;
+      }
+      this->encoders_[camera]->warm_up();
+      this->frame_counts_[camera] = 0;
+    }
+    this->view_ = av_frame_alloc();
+    return this->view_ != nullptr;
+  }
+
+  FrameRef process(const FrameRef& input) override {
+    auto encoder = this->encoders_.find(input->meta.camera_idx);
+    if (encoder == this->encoders_.end())
+    {
+      return FrameRef();
+    }
+
+    int64_t& frame_count = this->frame_counts_[input->meta.camera_idx];
+    int64_t timestamp_ms = input->meta.aligned_timestamp_us / 1000;
+    FrameMetadata metadata = make_frame_metadata(input->meta);
+    if (this->lossless_)
+    {
+      cv::Mat bgra(input->image.height, input->image.width, CV_8UC4, input->image.planes[0],
+                   input->image.strides[0]);
+      encoder->second->encode_frame_to_file(&bgra, frame_count, timestamp_ms, &metadata);
+    }
+    else
+    {
+      wrap_nv12(*input.get(), this->view_);
+      encoder->second->encode_nv12_to_file(this->view_, frame_count, timestamp_ms, &metadata);
+    }
+    frame_count++;
+    return FrameRef();
+  }
+
+  void finish() override {
+    for (auto& [camera, encoder] : this->encoders_)
+    {
+      encoder->finish_file();
+    }
+    std::cout << "Pipeline: " << this->name_ << " finished encoding" << std::endl;
+  }
+
+private:
+  std::string name_;
+  std::vector<int> cameras_;
+  Json::Value jsonVideoConf_;
+  bool lossless_ = false;
+
+  std::map<int, std::unique_ptr<VideoEncoding>> encoders_;
+  std::map<int, int64_t> frame_counts_;
+  AVFrame* view_ = nullptr;
+};
+
+class StreamStage : public Stage {
+public:
+  StreamStage(const StageContext& context) {
+    this->cameras_ = context.cameras;
+    this->port_ = context.jsonStageConf.get("port", 9000).asInt();
+    this->jsonVideoConf_ = merge_conf(context.config["video_encoding"], context.jsonStageConf["video_encoding"]);
+    this->jsonVideoConf_["lossless"]["enabled"] = false;
+    this->jsonVideoConf_["seek_index"] = false;
+  }
+
+  ~StreamStage() {
+    finish();
+    av_frame_free(&this->view_);
+  }
+
+  bool configure(const StreamType& input, StreamType* output, std::string* error) override {
+    if (input.format != PixelFormat::NV12)
+    {
+      *error = "needs NV12, gets " + stream_type_name(input);
+      return false;
+    }
+    this->jsonVideoConf_["stream_width"] = input.width;
+    this->jsonVideoConf_["stream_height"] = input.height;
+    return true;
+  }
+
+  bool open(int frames_in_flight) override {
+    this->view_ = av_frame_alloc();
+    for (int camera : this->cameras_)
+    {
+      auto viewer = std::make_unique<Viewer>();
+      viewer->connection = std::make_unique<NetworkConnection>("", this->port_ + camera, false);
+      viewer->accept_thread = std::thread(&StreamStage::accept_viewer, this, viewer.get(), camera);
+      this->viewers_[camera] = std::move(viewer);
+    }
+    return this->view_ != nullptr;
+  }
+
+  FrameRef process(const FrameRef& input) override {
+    auto viewer = this->viewers_.find(input->meta.camera_idx);
+    if (viewer == this->viewers_.end() || !viewer->second->ready)
+    {
+      return FrameRef();
+    }
+
+    wrap_nv12(*input.get(), this->view_);
+    FrameMetadata metadata = make_frame_metadata(input->meta);
+    viewer->second->encoder->encode_nv12_to_stream(this->view_, viewer->second->frame_count++, &metadata);
+    return FrameRef();
+  }
+
+  void finish() override {
+    for (auto& [camera, viewer] : this->viewers_)
+    {
+      viewer->connection->shutdown_connection();
+      if (viewer->accept_thread.joinable())
+      {
+        viewer->accept_thread.join();
+      }
+      if (viewer->encoder)
+      {
+        viewer->encoder.reset();
+        close(viewer->connection->get_client_socket());
+      }
+    }
+  }
+
+private:
+  struct Viewer {
+    std::unique_ptr<NetworkConnection> connection;
+    std::thread accept_thread;
+    std::unique_ptr<VideoEncoding> encoder;
+    std::atomic<bool> ready = false;
+    int64_t frame_count = 0;
+  };
+
+  // Blocks until a viewer connects, frames are skipped in the meantime
+  void accept_viewer(Viewer* viewer, int camera) {
+    apply_thread_placement("preview");
+    if (!viewer->connection->accept_client())
+    {
+      return;
+    }
+    viewer->encoder = std::make_unique<VideoEncoding>(this->jsonVideoConf_, "preview", camera,
+                                                      viewer->connection->get_client_socket());
+    if (!viewer->encoder->is_open())
+    {
+      std::cerr << "Could not open the stream encoder of camera " << camera << std::endl;
+      viewer->encoder.reset();
+      close(viewer->connection->get_client_socket());
+      return;
+    }
+    viewer->encoder->request_keyframe();
+    viewer->ready = true;
+  }
+
+  std::vector<int> cameras_;
+  int port_ = 9000;
+  Json::Value jsonVideoConf_;
+  std::map<int, std::unique_ptr<Viewer>> viewers_;
+  AVFrame* view_ = nullptr;
+};
+
+class TimestampLogStage : public Stage {
+public:
+  TimestampLogStage(const StageContext& context) {
+    this->cameras_ = context.cameras;
+    this->path_ = context.jsonStageConf.get("path", context.config["video_encoding"]["output_timestamp_path"])
+                    .asString();
+  }
+
+  bool configure(const StreamType& input, StreamType* output, std::string* error) override {
+    return true;
+  }
+
+  bool open(int frames_in_flight) override {
+    for (int camera : this->cameras_)
+    {
+      std::string path = this->path_ + "_session_" + std::to_string(camera) + ".txt";
+      this->logs_[camera].open(path);
+      if (!this->logs_[camera].is_open())
+      {
+        std::cerr << "Could not open " << path << std::endl;
+        return false;
+      }
+      this->frame_counts_[camera] = 0;
+    }
+    return true;
+  }
+
+  FrameRef process(const FrameRef& input) override {
+    auto log = this->logs_.find(input->meta.camera_idx);
+    if (log == this->logs_.end())
+    {
+      return FrameRef();
+    }
+
+    for (const DroppedFrame& dropped : input->dropped)
+    {
+      log->second << "Dropped frame_number: " << dropped.frame_number << " reason: " << dropped.reason << "\n";
+    }
+
+    const CameraFrame& frame = input->meta;
+    log->second << "Frame " << this->frame_counts_[frame.camera_idx]++ << " timestamp: "
+                << frame.aligned_timestamp_us / 1000 << " sensor: " << frame.sensor_timestamp_us
+                << " aligned: " << frame.aligned_timestamp_us << " set: -1"
+                << " frame_number: " << frame.frame_number << "\n";
+    log->second.flush();
+    return FrameRef();
+  }
+
+  void finish() override {
+    for (auto& [camera, log] : this->logs_)
+    {
+      log.close();
+    }
+  }
+
+private:
+  std::vector<int> cameras_;
+  std::string path_;
+  std::map<int, std::ofstream> logs_;
+  std::map<int, int64_t> frame_counts_;
+};
+
+class ShmStage : public Stage {
+public:
+  ShmStage(const StageContext& context) {
+    this->cameras_ = context.cameras;
+    this->jsonShmConf_ = merge_conf(context.config["shared_memory"], context.jsonStageConf);
+  }
+
+  bool configure(const StreamType& input, StreamType* output, std::string* error) override {
+    this->channels_ = packed_channels(input.format);
+    if (!this->channels_)
+    {
+      *error = "needs BGR24, RGB24 or BGRA, gets " + stream_type_name(input);
+      return false;
+    }
+    this->input_ = input;
+    return true;
+  }
+
+  bool open(int frames_in_flight) override {
+    for (int camera : this->cameras_)
+    {
+      auto writer = std::make_unique<ShmFrameWriter>(
+        "/" + this->jsonShmConf_.get("name_prefix", "camera_stream").asString() + "_" + std::to_string(camera),
+        camera, this->input_.width, this->input_.height, this->channels_, this->jsonShmConf_.get("slots", 8).asInt());
+      if (!writer->open())
+      {
+        return false;
+      }
+      this->writers_[camera] = std::move(writer);
+    }
+    return true;
+  }
+
+  FrameRef process(const FrameRef& input) override {
+    auto writer = this->writers_.find(input->meta.camera_idx);
+    if (writer == this->writers_.end())
+    {
+      return FrameRef();
+    }
+
+    ShmFrameInfo info;
+    info.camera_idx = input->meta.camera_idx;
+    info.frame_number = input->meta.frame_number;
+    info.sensor_timestamp_us = input->meta.sensor_timestamp_us;
+    info.aligned_timestamp_us = input->meta.aligned_timestamp_us;
+    info.exposure_us = input->meta.exposure_us;
+    info.gain_db = input->meta.gain_db;
+    writer->second->publish(input->image.planes[0], info);
+    return FrameRef();
+  }
+
+private:
+  std::vector<int> cameras_;
+  Json::Value jsonShmConf_;
+  StreamType input_;
+  int channels_ = 3;
+  std::map<int, std::unique_ptr<ShmFrameWriter>> writers_;
+};
+
+class RawStage : public Stage {
+public:
+  RawStage(const StageContext& context) {
+    this->cameras_ = context.cameras;
+    this->jsonRawConf_ = merge_conf(context.config["raw_recording"], context.jsonStageConf);
+  }
+
+  bool configure(const StreamType& input, StreamType* output, std::string* error) override {
+    this->channels_ = packed_channels(input.format);
+    if (!this->channels_)
+    {
+      *error = "needs BGR24, RGB24 or BGRA, gets " + stream_type_name(input);
+      return false;
+    }
+    this->input_ = input;
+    return true;
+  }
+
+  bool open(int frames_in_flight) override {
+    for (int camera : this->cameras_)
+    {
+      auto writer = std::make_unique<RawFrameWriter>(
+        this->jsonRawConf_["output_path"].asString() + "_" + std::to_string(camera) + ".raw",
+        this->input_.width, this->input_.height, this->channels_,
+        (size_t)this->jsonRawConf_.get("write_buffer_mb", 64).asInt() * 1024 * 1024);
+      if (!writer->open())
+      {
+        return false;
+      }
+      this->writers_[camera] = std::move(writer);
+      this->frame_counts_[camera] = 0;
+    }
+    return true;
+  }
+
+  FrameRef process(const FrameRef& input) override {
+    auto writer = this->writers_.find(input->meta.camera_idx);
+    if (writer != this->writers_.end())
+    {
+      writer->second->write_frame(input->image.planes[0], input->image.strides[0],
+                                  this->frame_counts_[input->meta.camera_idx]++,
+                                  input->meta.aligned_timestamp_us);
+    }
+    return FrameRef();
+  }
+
+  void finish() override {
+    for (auto& [camera, writer] : this->writers_)
+    {
+      writer->close();
+    }
+  }
+
+private:
+  std::vector<int> cameras_;
+  Json::Value jsonRawConf_;
+  StreamType input_;
+  int channels_ = 3;
+  std::map<int, std::unique_ptr<RawFrameWriter>> writers_;
+  std::map<int, int64_t> frame_counts_;
+};
+
+class DiscardStage : public Stage {
+public:
+  bool configure(const StreamType& input, StreamType* output, std::string* error) override {
+    return true;
+  }
+
+  int get_max_concurrency() override {
+    return kMaxParallel;
+  }
+
+  FrameRef process(const FrameRef& input) override {
+    return FrameRef();
+  }
+};
+
+}  // namespace
+
+void register_pipeline_stages(DataflowGraph* graph) {
+  graph->register_stage_type("capture", [](const StageContext& context) {
+    return std::make_unique<CaptureStage>(context);
+  });
+  graph->register_stage_type("convert", [](const StageContext& context) {
+    return std::make_unique<ConvertStage>(context);
+  });
+  graph->register_stage_type("encode", [](const StageContext& context) {
+    return std::make_unique<EncodeStage>(context);
+  });
+  graph->register_stage_type("stream", [](const StageContext& context) {
+    return std::make_unique<StreamStage>(context);
+  });
+  graph->register_stage_type("timestamp_log", [](const StageContext& context) {
+    return std::make_unique<TimestampLogStage>(context);
+  });
+  graph->register_stage_type("shm", [](const StageContext& context) {
+    return std::make_unique<ShmStage>(context);
+  });
+  graph->register_stage_type("raw", [](const StageContext& context) {
+    return std::make_unique<RawStage>(context);
+  });
+  graph->register_stage_type("discard", [](const StageContext& context) {
+    return std::make_unique<DiscardStage>();
+  });
+}
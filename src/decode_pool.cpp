@@ -0,0 +1,75 @@
+#include "decode_pool.hpp"
+
+#include <algorithm>
+#include <iostream>
+
+DecodePool::DecodePool(Json::Value jsonPoolConf, int num_sessions) {
+  this->workers_ = jsonPoolConf.get("workers", 0).asInt();
+  if (this->workers_ <= 0)
+  {
+    this->workers_ = std::max(1u, std::thread::hardware_concurrency());
+  }
+  this->max_queued_packets_ = std::max(1, jsonPoolConf.get("max_queued_packets", 16).asInt());
+  this->codec_threads_ = std::max(1, this->workers_ / std::max(1, num_sessions));
+
+  for (int i = 0; i < this->workers_; i++)
+  {
+    this->threads_.emplace_back(&DecodePool::worker_loop, this);
+  }
+
+  std::cout << "Decode pool: " << this->workers_ << " workers, " << this->codec_threads_
+            << " codec threads per session" << std::endl;
+}
+
+DecodePool::~DecodePool() {
+  {
+    std::lock_guard<std::mutex> lock(this->mutex_);
+    this->stopping_ = true;
+  }
+  this->cv_tasks_.notify_all();
+
+  for (auto& thread : this->threads_)
+  {
+    thread.join();
+  }
+}
+
+int DecodePool::get_workers() {
+  return this->workers_;
+}
+
+int DecodePool::get_codec_threads() {
+  return this->codec_threads_;
+}
+
+int DecodePool::get_max_queued_packets() {
+  return this->max_queued_packets_;
+}
+
+void DecodePool::schedule(std::function<void()> task) {
+  {
+    std::lock_guard<std::mutex> lock(this->mutex_);
+    this->tasks_.push_back(std::move(task));
+  }
+  this->cv_tasks_.notify_one();
+}
+
+void DecodePool::worker_loop() {
+  while (true)
+  {
+    std::function<void()> task;
+    {
+      std::unique_lock<std::mutex> lock(this->mutex_);
+      this->cv_tasks_.wait(lock, [this] { return this->stopping_ || !this->tasks_.empty(); });
+
+      // Sessions left scheduled still run, so none is left waiting on a flush
+      if (this->tasks_.empty())
+      {
+        return;
+      }
+      task = std::move(this->tasks_.front());
+      this->tasks_.pop_front();
+    }
+    task();
+  }
+}
@@ -0,0 +1,494 @@
+#include "dual_encoding.hpp"
+#include "latency_tracker.hpp"
+#include "network_connection.hpp"
+#include "startup_timeline.hpp"
+#include "thread_placement.hpp"
+
+#include <jsoncpp/json/json.h>
+#include <opencv2/opencv.hpp>
+#include <libyuv.h>
+
+#include <chrono>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+
+DualEncoding::DualEncoding(Json::Value jsonVideoConf,
+                           int session_idx) {
+  this->jsonVideoConf_ = jsonVideoConf;
+  this->jsonRecordConf_ = jsonVideoConf;
+  this->jsonActiveConf_ = jsonVideoConf;
+  this->session_idx_ = session_idx;
+
+  {
+    // Codec worker threads are created when the encoder is opened
+    ScopedThreadPlacement placement("encode");
+    this->record_encoder_ = std::make_unique<VideoEncoding>(jsonVideoConf, "output", session_idx, -1);
+    if (!this->record_encoder_->is_open())
+    {
+      fprintf(stderr, "Could not open the encoder of session %d\n", session_idx);
+      exit(1);
+    }
+    this->record_encoder_->warm_up();
+  }
+  mark_startup("session " + std::to_string(session_idx) + " encoder ready");
+  this->record_lossless_ = this->record_encoder_->is_lossless();
+
+  Json::Value jsonPreviewBlock = jsonVideoConf["preview"];
+  this->preview_enabled_ = jsonPreviewBlock["enabled"].asBool();
+  int preview_width = jsonPreviewBlock.get("stream_width", jsonVideoConf["stream_width"]).asInt();
+  int preview_height = jsonPreviewBlock.get("stream_height", jsonVideoConf["stream_height"]).asInt();
+
+  // Conversion buffers are allocated once, from huge pages
+  size_t arena_size = 0;
+  if (!this->record_encoder_->is_lossless())
+  {
+    arena_size += kRecordSlots * (FrameArena::get_frame_size(AV_PIX_FMT_NV12,
+                                                             this->record_encoder_->get_width(),
+                                                             this->record_encoder_->get_height()) +
+                                  FrameArena::kAlignment);
+  }
+  if (this->preview_enabled_)
+  {
+    arena_size += FrameArena::get_frame_size(AV_PIX_FMT_NV12, preview_width, preview_height) +
+                  FrameArena::get_frame_size(AV_PIX_FMT_BGRA, preview_width, preview_height) +
+                  2 * FrameArena::kAlignment;
+  }
+  if (arena_size > 0)
+  {
+    this->arena_ = std::make_unique<FrameArena>(arena_size, "session " + std::to_string(session_idx));
+  }
+
+  if (!this->record_encoder_->is_lossless())
+  {
+    for (int slot = 0; slot < kRecordSlots; slot++)
+    {
+      this->record_frames_[slot] = allocate_nv12_frame(this->record_encoder_->get_width(),
+                                                       this->record_encoder_->get_height());
+    }
+    this->record_thread_ = std::thread(&DualEncoding::record_loop, this);
+  }
+
+  // The preview inherits the recording settings, overridden by the preview block
+  if (this->preview_enabled_)
+  {
+    this->jsonPreviewConf_ = jsonVideoConf;
+    for (const std::string& key : jsonPreviewBlock.getMemberNames())
+    {
+      this->jsonPreviewConf_[key] = jsonPreviewBlock[key];
+    }
+    this->jsonPreviewConf_["lossless"]["enabled"] = false;
+    this->jsonPreviewConf_["seek_index"] = false;
+    this->jsonPreviewConf_["keyframe_policy"]["mode"] = "intra_refresh";
+    this->jsonPreviewConf_["keyframe_policy"]["interval_ms"] =
+      jsonPreviewBlock.get("refresh_interval_ms", 500).asInt();
+
+    this->preview_frame_ = allocate_nv12_frame(preview_width, preview_height);
+    if (this->record_encoder_->is_lossless())
+    {
+      this->preview_bgra_ = this->arena_->allocate_mat(preview_height, preview_width, CV_8UC4);
+    }
+    // One preview port per session, so every camera can be watched
+    this->preview_connection_ = std::make_unique<NetworkConnection>(
+      "", jsonPreviewBlock.get("port", 9000).asInt() + session_idx, false);
+    this->preview_thread_ = std::thread(&DualEncoding::preview_loop, this);
+  }
+}
+
+DualEncoding::~DualEncoding() {
+  finish();
+
+  for (int slot = 0; slot < kRecordSlots; slot++)
+  {
+    if (this->record_frames_[slot])
+    {
+      av_frame_free(&this->record_frames_[slot]);
+    }
+  }
+  if (this->preview_frame_)
+  {
+    av_frame_free(&this->preview_frame_);
+  }
+}
+
+AVFrame* DualEncoding::allocate_nv12_frame(int width, int height) {
+  AVFrame* frame = this->arena_->allocate_frame(AV_PIX_FMT_NV12, width, height);
+  if (!frame)
+  {
+    fprintf(stderr, "Could not allocate AVFrame for YUV\n");
+    exit(1);
+  }
+  return frame;
+}
+
+void DualEncoding::encode_frame(const cv::Mat* bgra,
+                                int64_t frame_count,
+                                int64_t timestamp_ms,
+                                const FrameMetadata* metadata) {
+  AVFrame* nv12 = nullptr;
+
+  if (this->record_encoder_->is_lossless())
+  {
+    // Lossless recording codes the BGRA buffer itself, which the caller reuses
+    // for the next frame, so it cannot be handed to another thread
+    this->record_encoder_->encode_frame_to_file(const_cast<cv::Mat*>(bgra), frame_count, timestamp_ms, metadata);
+  }
+  else
+  {
+    nv12 = this->record_frames_[this->next_slot_];
+    int ret = libyuv::ARGBToNV12(bgra->data, bgra->step,
+                                 nv12->data[0], nv12->linesize[0],
+                                 nv12->data[1], nv12->linesize[1],
+                                 bgra->cols, bgra->rows);
+    if (ret != 0)
+    {
+      std::cerr << "libyuv ARGBToNV12 failed with error code: " << ret << std::endl;
+    }
+
+    FrameRef frame_ref;
+    frame_ref.slot = this->next_slot_;
+    frame_ref.frame_count = frame_count;
+    frame_ref.timestamp_ms = timestamp_ms;
+    if (metadata)
+    {
+      frame_ref.has_metadata = true;
+      frame_ref.metadata = *metadata;
+    }
+    this->record_pipe_.put(frame_ref);
+    this->next_slot_ = (this->next_slot_ + 1) % kRecordSlots;
+  }
+
+  if (this->preview_enabled_ && this->preview_idle_.exchange(false))
+  {
+    if (nv12)
+    {
+      libyuv::NV12Scale(nv12->data[0], nv12->linesize[0],
+                        nv12->data[1], nv12->linesize[1],
+                        nv12->width, nv12->height,
+                        this->preview_frame_->data[0], this->preview_frame_->linesize[0],
+                        this->preview_frame_->data[1], this->preview_frame_->linesize[1],
+                        this->preview_frame_->width, this->preview_frame_->height,
+                        libyuv::kFilterBilinear);
+    }
+    else
+    {
+      cv::resize(*bgra, this->preview_bgra_,
+                 cv::Size(this->preview_frame_->width, this->preview_frame_->height),
+                 0, 0, cv::INTER_AREA);
+      libyuv::ARGBToNV12(this->preview_bgra_.data, this->preview_bgra_.step,
+                         this->preview_frame_->data[0], this->preview_frame_->linesize[0],
+                         this->preview_frame_->data[1], this->preview_frame_->linesize[1],
+                         this->preview_bgra_.cols, this->preview_bgra_.rows);
+    }
+
+    FrameRef frame_ref;
+    frame_ref.frame_count = frame_count;
+    frame_ref.timestamp_ms = timestamp_ms;
+    if (metadata)
+    {
+      frame_ref.has_metadata = true;
+      frame_ref.metadata = *metadata;
+    }
+    this->preview_pipe_.put(frame_ref);
+  }
+}
+
+void DualEncoding::record_loop() {
+  apply_thread_placement("encode");
+
+  while (true)
+  {
+    FrameRef frame_ref;
+    try
+    {
+      frame_ref = this->record_pipe_.fetch();
+    }
+    catch (const InTerminatedException&)
+    {
+      break;
+    }
+
+    apply_reconfiguration(frame_ref.frame_count);
+
+    bool track_latency = latency_tracking_enabled();
+    auto encode_start = track_latency ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+
+    this->record_encoder_->encode_nv12_to_file(this->record_frames_[frame_ref.slot],
+                                               frame_ref.frame_count,
+                                               frame_ref.timestamp_ms,
+                                               frame_ref.has_metadata ? &frame_ref.metadata : nullptr);
+
+    if (track_latency)
+    {
+      auto now = std::chrono::steady_clock::now();
+      record_latency(LatencyStage::Encode,
+                     std::chrono::duration_cast<std::chrono::microseconds>(now - encode_start).count());
+      // The timestamp is the exposure on the host epoch clock
+      record_latency(LatencyStage::EndToEnd, std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count() - frame_ref.timestamp_ms * 1000);
+    }
+  }
+}
+
+void DualEncoding::preview_loop() {
+  apply_thread_placement("preview");
+
+  while (true)
+  {
+    // Blocks until a viewer connects, recording continues in the meantime
+    if (!this->preview_connection_->accept_client())
+    {
+      return;
+    }
+    int client_socket = this->preview_connection_->get_client_socket();
+
+    // Each viewer gets a new stream, starting with a keyframe
+    this->preview_encoder_ = std::make_unique<VideoEncoding>(this->jsonPreviewConf_, "preview",
+                                                             this->session_idx_, client_socket);
+    if (!this->preview_encoder_->is_open())
+    {
+      // Recording goes on, the viewer is turned away
+      std::cerr << "Could not open the preview encoder of session " << this->session_idx_ << std::endl;
+      this->preview_encoder_.reset();
+      close(client_socket);
+      continue;
+    }
+    this->preview_encoder_->request_keyframe();
+    this->preview_idle_ = true;
+
+    bool terminated = false;
+    try
+    {
+      while (!this->preview_encoder_->is_stream_closed())
+      {
+        FrameRef frame_ref = this->preview_pipe_.fetch();
+        this->preview_encoder_->encode_nv12_to_stream(this->preview_frame_, frame_ref.frame_count,
+                                                      frame_ref.has_metadata ? &frame_ref.metadata : nullptr);
+        this->preview_idle_ = true;
+      }
+
+      // Stop taking frames until the next viewer, one already handed over is discarded
+      if (!this->preview_idle_.exchange(false))
+      {
+        this->preview_pipe_.fetch();
+      }
+    }
+    catch (const InTerminatedException&)
+    {
+      terminated = true;
+    }
+
+    this->preview_encoder_.reset();
+    close(client_socket);
+    if (terminated)
+    {
+      return;
+    }
+    std::cout << "Preview viewer of session " << this->session_idx_ << " disconnected.\n";
+  }
+}
+
+void DualEncoding::finish() {
+  if (this->finished_)
+  {
+    return;
+  }
+  this->finished_ = true;
+
+  this->record_pipe_.terminate();
+  if (this->record_thread_.joinable())
+  {
+    this->record_thread_.join();
+  }
+
+  // An encoder that was opened but never switched to has no frames
+  if (this->open_thread_.joinable())
+  {
+    this->open_thread_.join();
+  }
+  if (this->next_encoder_)
+  {
+    std::string unused_file = this->next_encoder_->get_output_file();
+    this->next_encoder_.reset();
+    std::remove(unused_file.c_str());
+    // Along with its seek index, if one was written
+    std::remove((unused_file + ".idx").c_str());
+  }
+
+  this->record_encoder_->finish_file();
+  if (this->retire_thread_.joinable())
+  {
+    this->retire_thread_.join();
+  }
+  this->retired_encoder_.reset();
+
+  if (this->preview_connection_)
+  {
+    this->preview_connection_->shutdown_connection();
+  }
+  this->preview_pipe_.terminate();
+  if (this->preview_thread_.joinable())
+  {
+    this->preview_thread_.join();
+  }
+
+  std::cout << "Video session " << this->session_idx_ << " finished encoding.\n";
+}
+
+bool DualEncoding::reconfigure(const std::string& param,
+                               const std::string& value,
+                               std::string* error) {
+  if (this->record_lossless_)
+  {
+    *error = "lossless recordings cannot be reconfigured";
+    return false;
+  }
+
+  PendingChange change;
+  change.param = param;
+  change.value = value;
+  if (param == "bitrate" || param == "gop_size")
+  {
+    // Parsed once here, the record thread must not fail on it
+    char* end = nullptr;
+    long number = strtol(value.c_str(), &end, 10);
+    if (*end != '\0' || number <= 0 || number > INT_MAX)
+    {
+      *error = param + " must be a positive integer";
+      return false;
+    }
+    change.number = (int)number;
+  }
+  else if (param == "encoder")
+  {
+    if (!avcodec_find_encoder_by_name(value.c_str()))
+    {
+      *error = "encoder " + value + " not found";
+      return false;
+    }
+  }
+  else if (param != "preset")
+  {
+    *error = "unknown encoder parameter " + param;
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lock(this->reconfigure_mutex_);
+  this->pending_changes_.push_back(change);
+  return true;
+}
+
+void DualEncoding::apply_reconfiguration(int64_t frame_count) {
+  std::vector<PendingChange> changes;
+  {
+    std::lock_guard<std::mutex> lock(this->reconfigure_mutex_);
+    changes.swap(this->pending_changes_);
+  }
+
+  for (const PendingChange& change : changes)
+  {
+    if (change.param == "bitrate" || change.param == "gop_size")
+    {
+      this->jsonRecordConf_[change.param] = change.number;
+    }
+    else
+    {
+      this->jsonRecordConf_[change.param] = change.value;
+    }
+
+    if (change.param == "bitrate" && this->record_encoder_->supports_live_bitrate())
+    {
+      this->record_encoder_->set_bitrate((int64_t)change.number * 1024 * 1024);
+      continue;
+    }
+    this->config_version_++;
+  }
+
+  // Only one encoder is opened at a time, changes made meanwhile are picked
+  // up by the next one
+  if (this->config_version_ > this->encoder_version_ && !this->open_thread_.joinable())
+  {
+    Json::Value jsonNextConf = this->jsonRecordConf_;
+    jsonNextConf["segment"] = ++this->segment_;
+    this->opening_version_ = this->config_version_;
+    this->jsonOpeningConf_ = jsonNextConf;
+    this->open_thread_ = std::thread(&DualEncoding::open_next_encoder, this, jsonNextConf);
+  }
+
+  if (!this->next_encoder_ready_)
+  {
+    return;
+  }
+  this->open_thread_.join();
+  this->next_encoder_ready_ = false;
+
+  if (!this->next_encoder_)
+  {
+    // The running encoder carries on, changes that needed the new one are
+    // dropped with it, the live bitrate is kept
+    std::cerr << "Video session " << this->session_idx_ << " could not open encoder "
+              << this->jsonOpeningConf_["encoder"].asString() << " with preset "
+              << this->jsonOpeningConf_["preset"].asString() << ", keeps recording to "
+              << this->record_encoder_->get_output_file() << std::endl;
+    Json::Value bitrate = this->jsonRecordConf_["bitrate"];
+    this->jsonRecordConf_ = this->jsonActiveConf_;
+    this->jsonRecordConf_["bitrate"] = bitrate;
+    this->encoder_version_ = this->config_version_;
+    this->segment_--;
+    return;
+  }
+
+  // The old encoder still holds frames in flight, it drains and writes its
+  // trailer while the new one takes this frame
+  if (this->retire_thread_.joinable())
+  {
+    this->retire_thread_.join();
+  }
+  this->retired_encoder_ = std::move(this->record_encoder_);
+  this->retire_thread_ = std::thread([this]() {
+    this->retired_encoder_->finish_file();
+  });
+
+  this->record_encoder_ = std::move(this->next_encoder_);
+  this->encoder_version_ = this->opening_version_;
+  this->jsonActiveConf_ = this->jsonOpeningConf_;
+
+  // Bitrate changes applied in place since the new encoder was opened
+  int64_t bitrate = (int64_t)this->jsonRecordConf_["bitrate"].asInt() * 1024 * 1024;
+  if (this->record_encoder_->get_bitrate() != bitrate && this->record_encoder_->supports_live_bitrate())
+  {
+    this->record_encoder_->set_bitrate(bitrate);
+  }
+  this->record_encoder_->request_keyframe();
+
+  std::cout << "Video session " << this->session_idx_ << " switched to "
+            << this->record_encoder_->get_output_file() << " at frame " << frame_count << std::endl;
+}
+
+void DualEncoding::open_next_encoder(Json::Value jsonRecordConf) {
+  // Opening takes a while on hardware encoders, recording continues meanwhile
+  ScopedThreadPlacement placement("encode");
+  this->next_encoder_ = std::make_unique<VideoEncoding>(jsonRecordConf, "output", this->session_idx_, -1);
+  if (this->next_encoder_->is_open())
+  {
+    this->next_encoder_->warm_up();
+  }
+  else
+  {
+    // Reported by the record thread, which keeps the running encoder
+    this->next_encoder_.reset();
+  }
+  this->next_encoder_ready_ = true;
+}
+
+VideoEncoding* DualEncoding::get_record_encoder() {
+  return this->record_encoder_.get();
+}
+
+bool DualEncoding::embeds_metadata() {
+  return this->record_encoder_->embeds_metadata();
+}
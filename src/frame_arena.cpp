@@ -0,0 +1,158 @@
+#include "frame_arena.hpp"
+#include "thread_placement.hpp"
+
+extern "C" {
+  #include <libavutil/imgutils.h>
+}
+
+#include <sys/mman.h>
+
+#include <iostream>
+#include <vector>
+
+namespace {
+
+// Arena memory is released with the arena, not with the last reference
+void free_nothing(void* opaque, uint8_t* data) {
+}
+
+}
+
+FrameArena::FrameArena(size_t capacity,
+                       const std::string& name) {
+  this->name_ = name;
+  this->capacity_ = (capacity + kHugePageSize - 1) / kHugePageSize * kHugePageSize;
+
+  // Explicit huge pages are reserved up front, so this fails right away when
+  // the pool (vm.nr_hugepages) is too small
+  void* base = mmap(nullptr, this->capacity_, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  this->huge_pages_ = base != MAP_FAILED;
+  if (base == MAP_FAILED)
+  {
+    base = mmap(nullptr, this->capacity_, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+    {
+      std::cerr << "Frame arena " << name << ": could not map " << this->capacity_ << " bytes\n";
+      this->capacity_ = 0;
+      return;
+    }
+    madvise(base, this->capacity_, MADV_HUGEPAGE);
+  }
+  this->base_ = (uint8_t*)base;
+
+  touch_pages(this->base_, this->capacity_);
+
+  std::cout << "Frame arena " << name << ": " << this->capacity_ / (1024 * 1024) << " MB on "
+            << (this->huge_pages_ ? "huge pages" : "transparent huge pages") << std::endl;
+}
+
+FrameArena::~FrameArena() {
+  if (this->base_)
+  {
+    munmap(this->base_, this->capacity_);
+  }
+}
+
+uint8_t* FrameArena::allocate(size_t size, size_t alignment) {
+  std::lock_guard<std::mutex> lock(this->mutex_);
+
+  size_t offset = (this->used_ + alignment - 1) / alignment * alignment;
+  if (!this->base_ || offset + size > this->capacity_)
+  {
+    if (!this->exhausted_)
+    {
+      std::cerr << "Frame arena " << this->name_ << " exhausted, using the heap\n";
+      this->exhausted_ = true;
+    }
+    return nullptr;
+  }
+
+  this->used_ = offset + size;
+  return this->base_ + offset;
+}
+
+cv::Mat FrameArena::allocate_mat(int rows, int cols, int type) {
+  size_t step = (cols * CV_ELEM_SIZE(type) + kAlignment - 1) / kAlignment * kAlignment;
+  uint8_t* data = allocate(step * rows);
+  if (!data)
+  {
+    return cv::Mat(rows, cols, type);
+  }
+  return cv::Mat(rows, cols, type, data, step);
+}
+
+AVFrame* FrameArena::allocate_frame(enum AVPixelFormat format, int width, int height) {
+  AVFrame* frame = av_frame_alloc();
+  if (!frame)
+  {
+    return nullptr;
+  }
+  frame->format = format;
+  frame->width = width;
+  frame->height = height;
+
+  uint8_t* data = allocate(get_frame_size(format, width, height));
+  if (!data)
+  {
+    // Still usable, the frame then owns its buffer
+    if (av_frame_get_buffer(frame, kAlignment) < 0)
+    {
+      av_frame_free(&frame);
+    }
+    return frame;
+  }
+
+  av_image_fill_arrays(frame->data, frame->linesize, data, format, width, height, kAlignment);
+  return frame;
+}
+
+AVBufferRef* FrameArena::pool_alloc(void* opaque, size_t size) {
+  FrameArena* arena = (FrameArena*)opaque;
+
+  uint8_t* data = arena->allocate(size);
+  if (!data)
+  {
+    return av_buffer_alloc(size);
+  }
+  return av_buffer_create(data, size, free_nothing, nullptr, 0);
+}
+
+AVBufferPool* FrameArena::create_buffer_pool(size_t size, int preallocate) {
+  AVBufferPool* pool = av_buffer_pool_init2(size, this, &FrameArena::pool_alloc, nullptr);
+  if (!pool)
+  {
+    return nullptr;
+  }
+
+  // Buffers handed back go to the pool's free list, ready for reuse
+  std::vector<AVBufferRef*> buffers;
+  for (int i = 0; i < preallocate; i++)
+  {
+    buffers.push_back(av_buffer_pool_get(pool));
+  }
+  for (AVBufferRef*& buffer : buffers)
+  {
+    av_buffer_unref(&buffer);
+  }
+
+  return pool;
+}
+
+size_t FrameArena::get_capacity() {
+  return this->capacity_;
+}
+
+size_t FrameArena::get_used() {
+  return this->used_;
+}
+
+bool FrameArena::is_huge_page_backed() {
+  return this->huge_pages_;
+}
+
+size_t FrameArena::get_frame_size(enum AVPixelFormat format, int width, int height) {
+  int size = av_image_get_buffer_size(format, width, height, kAlignment);
+  return size > 0 ? size : 0;
+}
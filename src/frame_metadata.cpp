@@ -0,0 +1,215 @@
+#include "frame_metadata.hpp"
+
+#include <cstring>
+
+namespace {
+
+// Identifies the payload among other user data SEI, e.g. x264's settings
+const uint8_t kMetadataUuid[16] = {0x6a, 0x1f, 0x3c, 0x52, 0x9e, 0x47, 0x4b, 0x0d,
+                                   0xa8, 0x31, 0x5c, 0xe2, 0x07, 0x94, 0xb6, 0x13};
+const uint8_t kMetadataVersion = 1;
+
+const int kH264SeiNal = 6;
+const int kHevcPrefixSeiNal = 39;
+const int kUserDataUnregistered = 5;
+
+// Reads a NAL unit's payload without its emulation prevention bytes
+class RbspReader {
+public:
+  RbspReader(const uint8_t* data, size_t size) : data_(data), size_(size) {}
+
+  bool read(uint8_t* byte) {
+    if (this->pos_ < this->size_ && this->zeros_ >= 2 && this->data_[this->pos_] == 0x03)
+    {
+      this->pos_++;
+      this->zeros_ = 0;
+    }
+    if (this->pos_ >= this->size_)
+    {
+      return false;
+    }
+    *byte = this->data_[this->pos_++];
+    this->zeros_ = *byte == 0 ? this->zeros_ + 1 : 0;
+    return true;
+  }
+
+  // Whether anything but the stop bit is left
+  bool more_data() {
+    return this->pos_ + 1 < this->size_;
+  }
+
+private:
+  const uint8_t* data_;
+  size_t size_;
+  size_t pos_ = 0;
+  int zeros_ = 0;
+};
+
+bool read_sei_value(RbspReader* reader, uint32_t* value) {
+  *value = 0;
+  uint8_t byte = 0xFF;
+  while (byte == 0xFF)
+  {
+    if (!reader->read(&byte))
+    {
+      return false;
+    }
+    *value += byte;
+  }
+  return true;
+}
+
+bool parse_sei(const uint8_t* rbsp, size_t size, FrameMetadata* metadata) {
+  RbspReader reader(rbsp, size);
+  while (reader.more_data())
+  {
+    uint32_t payload_type = 0;
+    uint32_t payload_size = 0;
+    if (!read_sei_value(&reader, &payload_type) || !read_sei_value(&reader, &payload_size))
+    {
+      return false;
+    }
+
+    uint8_t payload[kFrameMetadataSize];
+    bool candidate = payload_type == kUserDataUnregistered && payload_size >= kFrameMetadataSize;
+    for (uint32_t idx = 0; idx < payload_size; idx++)
+    {
+      uint8_t byte = 0;
+      if (!reader.read(&byte))
+      {
+        return false;
+      }
+      if (candidate && idx < kFrameMetadataSize)
+      {
+        payload[idx] = byte;
+      }
+    }
+    if (candidate && read_frame_metadata(payload, kFrameMetadataSize, metadata))
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool parse_nal(AVCodecID codec_id, const uint8_t* nal, size_t size, FrameMetadata* metadata) {
+  if (codec_id == AV_CODEC_ID_H264 && size > 1 && (nal[0] & 0x1F) == kH264SeiNal)
+  {
+    return parse_sei(nal + 1, size - 1, metadata);
+  }
+  if (codec_id == AV_CODEC_ID_HEVC && size > 2 && ((nal[0] >> 1) & 0x3F) == kHevcPrefixSeiNal)
+  {
+    return parse_sei(nal + 2, size - 2, metadata);
+  }
+  return false;
+}
+
+template <typename T>
+void put(uint8_t* payload, size_t offset, T value) {
+  memcpy(payload + offset, &value, sizeof(value));
+}
+
+template <typename T>
+T get(const uint8_t* payload, size_t offset) {
+  T value;
+  memcpy(&value, payload + offset, sizeof(value));
+  return value;
+}
+
+}
+
+FrameMetadata make_frame_metadata(const CameraFrame& frame) {
+  FrameMetadata metadata;
+  metadata.camera_idx = frame.camera_idx;
+  metadata.frame_number = frame.frame_number;
+  metadata.sensor_timestamp_us = frame.sensor_timestamp_us;
+  metadata.host_timestamp_us = frame.host_timestamp_us;
+  metadata.aligned_timestamp_us = frame.aligned_timestamp_us;
+  metadata.exposure_us = frame.exposure_us;
+  metadata.gain_db = frame.gain_db;
+  return metadata;
+}
+
+bool codec_supports_frame_metadata(AVCodecID codec_id) {
+  return codec_id == AV_CODEC_ID_H264 || codec_id == AV_CODEC_ID_HEVC;
+}
+
+void write_frame_metadata(const FrameMetadata& metadata, uint8_t* payload) {
+  // Every supported host is little-endian, the fields are copied as they are
+  memset(payload, 0, kFrameMetadataSize);
+  memcpy(payload, kMetadataUuid, sizeof(kMetadataUuid));
+  payload[16] = kMetadataVersion;
+  put<int32_t>(payload, 20, metadata.camera_idx);
+  put<int64_t>(payload, 24, metadata.frame_number);
+  put<int64_t>(payload, 32, metadata.sensor_timestamp_us);
+  put<int64_t>(payload, 40, metadata.host_timestamp_us);
+  put<int64_t>(payload, 48, metadata.aligned_timestamp_us);
+  put<int32_t>(payload, 56, metadata.exposure_us);
+  put<float>(payload, 60, metadata.gain_db);
+}
+
+bool read_frame_metadata(const uint8_t* payload, size_t size, FrameMetadata* metadata) {
+  if (size < kFrameMetadataSize || memcmp(payload, kMetadataUuid, sizeof(kMetadataUuid)) != 0 ||
+      payload[16] != kMetadataVersion)
+  {
+    return false;
+  }
+  metadata->camera_idx = get<int32_t>(payload, 20);
+  metadata->frame_number = get<int64_t>(payload, 24);
+  metadata->sensor_timestamp_us = get<int64_t>(payload, 32);
+  metadata->host_timestamp_us = get<int64_t>(payload, 40);
+  metadata->aligned_timestamp_us = get<int64_t>(payload, 48);
+  metadata->exposure_us = get<int32_t>(payload, 56);
+  metadata->gain_db = get<float>(payload, 60);
+  return true;
+}
+
+bool find_packet_metadata(AVCodecID codec_id, const uint8_t* data, size_t size, FrameMetadata* metadata) {
+  if (!codec_supports_frame_metadata(codec_id) || !data)
+  {
+    return false;
+  }
+
+  bool annex_b = size >= 4 && data[0] == 0 && data[1] == 0 &&
+                 (data[2] == 1 || (data[2] == 0 && data[3] == 1));
+  if (!annex_b)
+  {
+    // MP4 and MKV store NAL units behind a 4 byte big-endian length
+    size_t pos = 0;
+    while (pos + 4 <= size)
+    {
+      size_t nal_size = ((size_t)data[pos] << 24) | ((size_t)data[pos + 1] << 16) |
+                        ((size_t)data[pos + 2] << 8) | data[pos + 3];
+      pos += 4;
+      if (nal_size > size - pos)
+      {
+        return false;
+      }
+      if (parse_nal(codec_id, data + pos, nal_size, metadata))
+      {
+        return true;
+      }
+      pos += nal_size;
+    }
+    return false;
+  }
+
+  // Start codes delimit the NAL units, zero bytes before a four byte start
+  // code end up behind the previous unit, after its stop bit
+  size_t nal_start = 0;
+  for (size_t pos = 0; pos + 3 <= size; pos++)
+  {
+    if (data[pos] != 0 || data[pos + 1] != 0 || data[pos + 2] != 1)
+    {
+      continue;
+    }
+    if (nal_start > 0 && parse_nal(codec_id, data + nal_start, pos - nal_start, metadata))
+    {
+      return true;
+    }
+    nal_start = pos + 3;
+    pos += 2;
+  }
+  return nal_start > 0 && nal_start < size &&
+         parse_nal(codec_id, data + nal_start, size - nal_start, metadata);
+}
@@ -0,0 +1,292 @@
+#include "frame_sync.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+
+ClockAligner::ClockAligner(int64_t window_us,
+                           size_t max_windows) {
+  this->window_us_ = window_us;
+  this->max_windows_ = std::max<size_t>(2, max_windows);
+}
+
+void ClockAligner::reset(int64_t sensor_us) {
+  this->base_sensor_us_ = sensor_us;
+  this->window_start_us_ = -1;
+  this->minima_.clear();
+  this->has_fit_ = false;
+}
+
+int64_t ClockAligner::align(int64_t sensor_us, int64_t host_us) {
+  int64_t offset_us = host_us - sensor_us;
+
+  // A sensor clock that went backwards was reset, start over
+  if (this->base_sensor_us_ < 0 || sensor_us < this->last_sensor_us_)
+  {
+    reset(sensor_us);
+    this->base_offset_us_ = offset_us;
+  }
+  this->last_sensor_us_ = sensor_us;
+
+  if (this->window_start_us_ >= 0 && sensor_us - this->window_start_us_ >= this->window_us_)
+  {
+    this->minima_.emplace_back((double)(this->window_min_sensor_us_ - this->base_sensor_us_),
+                               (double)(this->window_min_offset_us_ - this->base_offset_us_));
+    if (this->minima_.size() > this->max_windows_)
+    {
+      this->minima_.pop_front();
+    }
+    fit();
+    this->window_start_us_ = -1;
+  }
+
+  if (this->window_start_us_ < 0 || offset_us < this->window_min_offset_us_)
+  {
+    if (this->window_start_us_ < 0)
+    {
+      this->window_start_us_ = sensor_us;
+    }
+    this->window_min_offset_us_ = offset_us;
+    this->window_min_sensor_us_ = sensor_us;
+  }
+
+  double estimate_us;
+  if (this->has_fit_)
+  {
+    estimate_us = this->base_offset_us_ + this->intercept_us_ +
+                  this->slope_ * (sensor_us - this->base_sensor_us_);
+  }
+  else
+  {
+    estimate_us = this->window_min_offset_us_;
+    for (auto& minimum : this->minima_)
+    {
+      estimate_us = std::min(estimate_us, this->base_offset_us_ + minimum.second);
+    }
+  }
+
+  // The true offset can never exceed an observed one, the delay is not negative
+  this->offset_us_ = std::min(estimate_us, (double)offset_us);
+
+  return sensor_us + (int64_t)this->offset_us_;
+}
+
+void ClockAligner::fit() {
+  if (this->minima_.size() < 2)
+  {
+    return;
+  }
+
+  double n = this->minima_.size();
+  double mean_x = 0.0;
+  double mean_y = 0.0;
+  for (auto& minimum : this->minima_)
+  {
+    mean_x += minimum.first;
+    mean_y += minimum.second;
+  }
+  mean_x /= n;
+  mean_y /= n;
+
+  double sxx = 0.0;
+  double sxy = 0.0;
+  for (auto& minimum : this->minima_)
+  {
+    sxx += (minimum.first - mean_x) * (minimum.first - mean_x);
+    sxy += (minimum.first - mean_x) * (minimum.second - mean_y);
+  }
+  if (sxx <= 0.0)
+  {
+    return;
+  }
+
+  this->slope_ = sxy / sxx;
+  this->intercept_us_ = mean_y - this->slope_ * mean_x;
+  this->has_fit_ = true;
+}
+
+double ClockAligner::get_offset_us() {
+  return this->offset_us_;
+}
+
+double ClockAligner::get_drift_ppm() {
+  // The offset shrinks when the sensor clock runs fast
+  return -this->slope_ * 1e6;
+}
+
+FrameSynchronizer::FrameSynchronizer(Json::Value jsonSyncConf,
+                                     int num_cameras,
+                                     size_t frame_bytes) {
+  this->num_cameras_ = num_cameras;
+  this->frame_bytes_ = frame_bytes;
+  this->tolerance_us_ = jsonSyncConf.get("tolerance_us", 2000).asInt64();
+  this->max_wait_us_ = jsonSyncConf.get("max_wait_us", 20000).asInt64();
+  this->max_pending_ = std::max(1, jsonSyncConf.get("max_pending", 4).asInt());
+
+  this->pending_.resize(num_cameras);
+
+  // Every camera can have max_pending frames queued plus one in the emitted
+  // set. The arena is faulted in here, so its pages are local to the
+  // consumer and the page faults do not hit the first frames.
+  size_t pool_size = num_cameras * (this->max_pending_ + 1);
+  size_t slot_size = (frame_bytes + FrameArena::kAlignment - 1) / FrameArena::kAlignment * FrameArena::kAlignment;
+  this->arena_ = std::make_unique<FrameArena>(pool_size * slot_size, "sync");
+  for (size_t i = 0; i < pool_size; i++)
+  {
+    uint8_t* buffer = this->arena_->allocate(frame_bytes);
+    if (!buffer)
+    {
+      break;
+    }
+    this->free_buffers_.push_back(buffer);
+  }
+}
+
+void FrameSynchronizer::drop_oldest(int camera_idx) {
+  record_drop(this->pending_[camera_idx].front(), "sync_overflow");
+  this->free_buffers_.push_back((uint8_t*)this->pending_[camera_idx].front().data);
+  this->pending_[camera_idx].pop_front();
+}
+
+void FrameSynchronizer::record_drop(const CameraFrame& frame, const char* reason) {
+  this->dropped_frames_++;
+
+  DroppedFrame dropped;
+  dropped.camera_idx = frame.camera_idx;
+  dropped.frame_number = frame.frame_number;
+  dropped.reason = reason;
+  this->dropped_log_.push_back(dropped);
+}
+
+void FrameSynchronizer::push(const CameraFrame& frame) {
+  if (frame.camera_idx < 0 || frame.camera_idx >= this->num_cameras_)
+  {
+    return;
+  }
+
+  // Its set is gone already
+  if (frame.aligned_timestamp_us <= this->last_anchor_us_ + this->tolerance_us_)
+  {
+    record_drop(frame, "sync_late");
+    return;
+  }
+
+  std::deque<CameraFrame>& pending = this->pending_[frame.camera_idx];
+  if (pending.size() >= this->max_pending_)
+  {
+    drop_oldest(frame.camera_idx);
+  }
+
+  if (this->free_buffers_.empty())
+  {
+    record_drop(frame, "sync_no_buffer");
+    return;
+  }
+
+  CameraFrame copy = frame;
+  copy.data = this->free_buffers_.back();
+  this->free_buffers_.pop_back();
+  memcpy(copy.data, frame.data, this->frame_bytes_);
+
+  pending.push_back(copy);
+}
+
+int64_t FrameSynchronizer::get_wait_us(int64_t now_us) {
+  int64_t anchor_us = INT64_MAX;
+  for (auto& pending : this->pending_)
+  {
+    if (!pending.empty())
+    {
+      anchor_us = std::min(anchor_us, pending.front().aligned_timestamp_us);
+    }
+  }
+  if (anchor_us == INT64_MAX)
+  {
+    return -1;
+  }
+  return std::max<int64_t>(0, anchor_us + this->max_wait_us_ - now_us);
+}
+
+bool FrameSynchronizer::pop_set(FrameSet* set, int64_t now_us) {
+  int64_t anchor_us = INT64_MAX;
+  for (auto& pending : this->pending_)
+  {
+    if (!pending.empty())
+    {
+      anchor_us = std::min(anchor_us, pending.front().aligned_timestamp_us);
+    }
+  }
+  if (anchor_us == INT64_MAX)
+  {
+    return false;
+  }
+
+  int num_frames = 0;
+  for (auto& pending : this->pending_)
+  {
+    if (!pending.empty() && pending.front().aligned_timestamp_us <= anchor_us + this->tolerance_us_)
+    {
+      num_frames++;
+    }
+  }
+
+  if (num_frames < this->num_cameras_ && now_us - anchor_us < this->max_wait_us_)
+  {
+    return false;
+  }
+
+  set->set_number = this->sets_;
+  set->num_frames = num_frames;
+  set->frames.assign(this->num_cameras_, CameraFrame());
+
+  int64_t timestamp_sum_us = 0;
+  for (int idx = 0; idx < this->num_cameras_; idx++)
+  {
+    std::deque<CameraFrame>& pending = this->pending_[idx];
+    set->frames[idx].camera_idx = idx;
+    if (!pending.empty() && pending.front().aligned_timestamp_us <= anchor_us + this->tolerance_us_)
+    {
+      set->frames[idx] = pending.front();
+      timestamp_sum_us += pending.front().aligned_timestamp_us - anchor_us;
+      pending.pop_front();
+    }
+  }
+  set->timestamp_us = anchor_us + timestamp_sum_us / num_frames;
+
+  this->last_anchor_us_ = anchor_us;
+  this->sets_++;
+  if (num_frames < this->num_cameras_)
+  {
+    this->partial_sets_++;
+  }
+
+  return true;
+}
+
+void FrameSynchronizer::release_set(const FrameSet& set) {
+  for (auto& frame : set.frames)
+  {
+    if (frame.data)
+    {
+      this->free_buffers_.push_back((uint8_t*)frame.data);
+    }
+  }
+}
+
+int64_t FrameSynchronizer::get_sets() {
+  return this->sets_;
+}
+
+int64_t FrameSynchronizer::get_partial_sets() {
+  return this->partial_sets_;
+}
+
+int64_t FrameSynchronizer::get_dropped_frames() {
+  return this->dropped_frames_;
+}
+
+void FrameSynchronizer::take_dropped_frames(std::vector<DroppedFrame>* dropped) {
+  dropped->insert(dropped->end(), this->dropped_log_.begin(), this->dropped_log_.end());
+  this->dropped_log_.clear();
+}
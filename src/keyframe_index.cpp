@@ -0,0 +1,103 @@
+#include "keyframe_index.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+KeyframeIndexWriter::KeyframeIndexWriter(const std::string& index_file) {
+  this->index_log_.open(index_file, std::ios::binary | std::ios::trunc);
+  if (!this->index_log_)
+  {
+    std::cerr << "Could not open keyframe index " << index_file << std::endl;
+    return;
+  }
+
+  this->index_log_.write(KEYFRAME_INDEX_MAGIC, sizeof(KEYFRAME_INDEX_MAGIC));
+  this->index_log_.flush();
+}
+
+KeyframeIndexWriter::~KeyframeIndexWriter() {
+  this->index_log_.close();
+}
+
+bool KeyframeIndexWriter::is_open() {
+  return this->index_log_.is_open();
+}
+
+void KeyframeIndexWriter::add_entry(int64_t frame_number, int64_t timestamp_ms,
+                                    int64_t packet_size, bool keyframe) {
+  // Flush the previous GOP so the index stays usable if the recorder is killed
+  if (keyframe && this->last_keyframe_ >= 0)
+  {
+    this->index_log_.flush();
+  }
+  if (keyframe || this->last_keyframe_ < 0)
+  {
+    this->last_keyframe_ = frame_number;
+  }
+
+  KeyframeIndexEntry entry = {frame_number, timestamp_ms, packet_size, this->last_keyframe_};
+  this->index_log_.write((const char*)&entry, sizeof(entry));
+}
+
+KeyframeIndexReader::KeyframeIndexReader(const std::string& index_file) {
+  this->index_file_ = index_file;
+}
+
+bool KeyframeIndexReader::load() {
+  std::ifstream fs(this->index_file_, std::ios::binary | std::ios::ate);
+  if (!fs)
+  {
+    std::cerr << "Could not open keyframe index " << this->index_file_ << std::endl;
+    return false;
+  }
+
+  size_t file_size = fs.tellg();
+  fs.seekg(0);
+
+  char magic[sizeof(KEYFRAME_INDEX_MAGIC)];
+  if (file_size < sizeof(magic) || !fs.read(magic, sizeof(magic)) ||
+      memcmp(magic, KEYFRAME_INDEX_MAGIC, sizeof(magic)) != 0)
+  {
+    std::cerr << "Not a keyframe index: " << this->index_file_ << std::endl;
+    return false;
+  }
+
+  // A partially written trailing record is dropped
+  this->entries_.resize((file_size - sizeof(magic)) / sizeof(KeyframeIndexEntry));
+  fs.read((char*)this->entries_.data(), this->entries_.size() * sizeof(KeyframeIndexEntry));
+
+  return true;
+}
+
+size_t KeyframeIndexReader::get_size() const {
+  return this->entries_.size();
+}
+
+const KeyframeIndexEntry* KeyframeIndexReader::seek_timestamp(int64_t timestamp_ms) const {
+  auto it = std::lower_bound(this->entries_.begin(), this->entries_.end(), timestamp_ms,
+    [](const KeyframeIndexEntry& entry, int64_t ts) { return entry.timestamp_ms < ts; });
+  if (it == this->entries_.end())
+  {
+    return nullptr;
+  }
+  return &(*it);
+}
+
+const KeyframeIndexEntry* KeyframeIndexReader::seek_frame(int64_t frame_number) const {
+  auto it = std::lower_bound(this->entries_.begin(), this->entries_.end(), frame_number,
+    [](const KeyframeIndexEntry& entry, int64_t n) { return entry.frame_number < n; });
+  if (it == this->entries_.end() || it->frame_number != frame_number)
+  {
+    return nullptr;
+  }
+  return &(*it);
+}
+
+const KeyframeIndexEntry* KeyframeIndexReader::get_keyframe(const KeyframeIndexEntry* entry) const {
+  if (!entry)
+  {
+    return nullptr;
+  }
+  return seek_frame(entry->keyframe_number);
+}
@@ -0,0 +1,114 @@
+#include "latency_tracker.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+
+namespace {
+
+constexpr int kLinearBuckets = 64;
+constexpr int kSubBuckets = 16;
+// Powers of two from 64 us up to about 18 minutes
+constexpr int kMinExponent = 6;
+constexpr int kMaxExponent = 39;
+constexpr int kBuckets = kLinearBuckets + (kMaxExponent - kMinExponent + 1) * kSubBuckets;
+constexpr int kStages = (int)LatencyStage::Count;
+
+std::atomic<bool> tracking_enabled = false;
+std::atomic<uint64_t> histograms[kStages][kBuckets];
+
+int bucket_index(uint64_t latency_us) {
+  if (latency_us < kLinearBuckets)
+  {
+    return (int)latency_us;
+  }
+  int exponent = 63 - __builtin_clzll(latency_us);
+  if (exponent > kMaxExponent)
+  {
+    return kBuckets - 1;
+  }
+  int sub = (int)(latency_us >> (exponent - 4)) & (kSubBuckets - 1);
+  return kLinearBuckets + (exponent - kMinExponent) * kSubBuckets + sub;
+}
+
+int64_t bucket_upper_us(int index) {
+  if (index < kLinearBuckets)
+  {
+    return index;
+  }
+  int exponent = kMinExponent + (index - kLinearBuckets) / kSubBuckets;
+  int sub = (index - kLinearBuckets) % kSubBuckets;
+  int64_t lower = (int64_t)(kSubBuckets + sub) << (exponent - 4);
+  return lower + ((int64_t)1 << (exponent - 4)) - 1;
+}
+
+}
+
+const char* latency_stage_name(LatencyStage stage) {
+  switch (stage)
+  {
+    case LatencyStage::Queue: return "queue";
+    case LatencyStage::Consume: return "consume";
+    case LatencyStage::Encode: return "encode";
+    case LatencyStage::EndToEnd: return "end_to_end";
+    default: return "unknown";
+  }
+}
+
+void enable_latency_tracking() {
+  tracking_enabled.store(true, std::memory_order_relaxed);
+}
+
+bool latency_tracking_enabled() {
+  return tracking_enabled.load(std::memory_order_relaxed);
+}
+
+void record_latency(LatencyStage stage, int64_t latency_us) {
+  if (!tracking_enabled.load(std::memory_order_relaxed))
+  {
+    return;
+  }
+  // Clocks of different sources can put a frame slightly in the future
+  int index = bucket_index((uint64_t)std::max<int64_t>(latency_us, 0));
+  histograms[(int)stage][index].fetch_add(1, std::memory_order_relaxed);
+}
+
+void read_latency_counts(LatencyStage stage, LatencyCounts* counts) {
+  counts->buckets.resize(kBuckets);
+  counts->total = 0;
+  for (int index = 0; index < kBuckets; index++)
+  {
+    counts->buckets[index] = histograms[(int)stage][index].load(std::memory_order_relaxed);
+    counts->total += counts->buckets[index];
+  }
+}
+
+int64_t latency_percentile(const LatencyCounts& before, const LatencyCounts& after, double p) {
+  if (after.buckets.size() != kBuckets || after.total <= before.total)
+  {
+    return -1;
+  }
+  bool has_before = before.buckets.size() == kBuckets;
+
+  uint64_t samples = 0;
+  for (int index = 0; index < kBuckets; index++)
+  {
+    samples += after.buckets[index] - (has_before ? before.buckets[index] : 0);
+  }
+  if (samples == 0)
+  {
+    return -1;
+  }
+
+  uint64_t rank = std::max<uint64_t>(1, (uint64_t)std::ceil(samples * std::clamp(p, 0.0, 100.0) / 100.0));
+  uint64_t seen = 0;
+  for (int index = 0; index < kBuckets; index++)
+  {
+    seen += after.buckets[index] - (has_before ? before.buckets[index] : 0);
+    if (seen >= rank)
+    {
+      return bucket_upper_us(index);
+    }
+  }
+  return bucket_upper_us(kBuckets - 1);
+}
@@ -0,0 +1,345 @@
+#include "load_shedder.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+// Skipped frames listed per gap, longer gaps are only counted
+static const int64_t kMaxListedGap = 1000;
+
+LoadShedder::LoadShedder(Json::Value jsonSheddingConf,
+                         int num_cameras,
+                         size_t frame_bytes,
+                         bool keep_latest) {
+  this->frame_bytes_ = frame_bytes;
+  this->keep_latest_ = keep_latest;
+  this->queue_depth_ = std::max(1, jsonSheddingConf.get("queue_depth", 4).asInt());
+  this->policy_ = jsonSheddingConf.get("policy", "drop_oldest").asString();
+  this->keep_every_ = std::max(1, jsonSheddingConf.get("keep_every", 2).asInt());
+  this->protect_every_ = std::max(0, jsonSheddingConf.get("protect_every", 0).asInt());
+  this->max_backlog_ = std::max(0, jsonSheddingConf.get("max_backlog", 0).asInt());
+
+  if (this->policy_ != "drop_oldest" && this->policy_ != "drop_newest" && this->policy_ != "keep_every_nth")
+  {
+    std::cerr << "Unknown load shedding policy " << this->policy_ << ", using drop_oldest\n";
+    this->policy_ = "drop_oldest";
+  }
+
+  this->cameras_.resize(num_cameras);
+  Json::Value jsonPriorities = jsonSheddingConf["camera_priority"];
+  for (int idx = 0; idx < num_cameras; idx++)
+  {
+    this->cameras_[idx].priority = jsonPriorities.get(idx, 0).asInt();
+    this->service_order_.push_back(idx);
+  }
+  std::stable_sort(this->service_order_.begin(), this->service_order_.end(), [this](int a, int b) {
+    return this->cameras_[a].priority > this->cameras_[b].priority;
+  });
+
+  // Per camera: a full queue, the frame the consumer is working on and the
+  // one capture is copying into. Snapshots can hold three more: the latest
+  // slot, the frame being encoded and one handed back but not yet recycled.
+  size_t buffers_per_camera = this->queue_depth_ + 2 + (keep_latest ? 3 : 0);
+  size_t slot_size = (frame_bytes + FrameArena::kAlignment - 1) / FrameArena::kAlignment * FrameArena::kAlignment;
+  this->arena_ = std::make_unique<FrameArena>(num_cameras * buffers_per_camera * slot_size, "shedder");
+  for (CameraQueue& camera : this->cameras_)
+  {
+    for (size_t i = 0; i < buffers_per_camera; i++)
+    {
+      uint8_t* buffer = this->arena_->allocate(frame_bytes);
+      if (!buffer)
+      {
+        std::cerr << "Could not allocate load shedding buffers\n";
+        exit(1);
+      }
+      camera.free_buffers.push_back(buffer);
+      camera.buffers.push_back(buffer);
+    }
+    camera.buffer_frames.resize(buffers_per_camera);
+  }
+
+  this->latest_ = std::make_unique<std::atomic<int>[]>(num_cameras);
+  this->returned_ = std::make_unique<std::atomic<int>[]>(num_cameras);
+  for (int idx = 0; idx < num_cameras; idx++)
+  {
+    this->latest_[idx] = -1;
+    this->returned_[idx] = -1;
+  }
+
+  std::cout << "Load shedding: " << this->policy_ << ", " << this->queue_depth_
+            << " frames per camera" << std::endl;
+}
+
+bool LoadShedder::is_protected(const CameraFrame& frame) {
+  return this->protect_every_ > 0 && frame.frame_number % this->protect_every_ == 0;
+}
+
+void LoadShedder::record_drop(const CameraFrame& frame, const char* reason) {
+  this->cameras_[frame.camera_idx].dropped++;
+
+  DroppedFrame dropped;
+  dropped.camera_idx = frame.camera_idx;
+  dropped.frame_number = frame.frame_number;
+  dropped.reason = reason;
+  this->dropped_log_.push_back(dropped);
+}
+
+void LoadShedder::record_skipped(const CameraFrame& frame) {
+  CameraQueue& camera = this->cameras_[frame.camera_idx];
+  int64_t last = camera.last_frame_number;
+  int64_t elapsed_us = camera.last_timestamp_us >= 0 && frame.sensor_timestamp_us >= 0
+                         ? frame.sensor_timestamp_us - camera.last_timestamp_us : -1;
+  camera.last_frame_number = frame.frame_number;
+  camera.last_timestamp_us = frame.sensor_timestamp_us;
+  if (last >= 0 && frame.frame_number == last + 1 && elapsed_us > 0)
+  {
+    camera.frame_interval_us = elapsed_us;
+  }
+
+  // A number going backwards is a restarted acquisition, not a gap
+  if (last < 0 || frame.frame_number <= last + 1)
+  {
+    return;
+  }
+
+  // A counter that jumps while the sensor clock only moved on by a frame or
+  // so was reset. A stall moves the clock along with the counter.
+  int64_t gap = frame.frame_number - last - 1;
+  if (camera.frame_interval_us > 0 && elapsed_us >= 0 &&
+      elapsed_us < (gap + 1) * camera.frame_interval_us / 2)
+  {
+    std::cerr << "Camera " << frame.camera_idx << " frame number jumped from " << last << " to "
+              << frame.frame_number << " in " << elapsed_us << " us, treating it as a counter reset"
+              << std::endl;
+    return;
+  }
+  camera.skipped += gap;
+
+  DroppedFrame dropped;
+  dropped.camera_idx = frame.camera_idx;
+  dropped.reason = "skipped";
+  int64_t listed_end = std::min(frame.frame_number, last + 1 + kMaxListedGap);
+  for (int64_t frame_number = last + 1; frame_number < listed_end; frame_number++)
+  {
+    dropped.frame_number = frame_number;
+    this->dropped_log_.push_back(dropped);
+  }
+  if (listed_end < frame.frame_number)
+  {
+    std::cerr << "Camera " << frame.camera_idx << " skipped " << gap << " frames after frame " << last
+              << ", only the first " << kMaxListedGap << " are listed" << std::endl;
+  }
+}
+
+bool LoadShedder::evict(int idx, const char* reason) {
+  std::deque<CameraFrame>& queued = this->cameras_[idx].queued;
+  if (queued.empty())
+  {
+    return false;
+  }
+
+  auto victim = std::find_if(queued.begin(), queued.end(),
+                             [this](const CameraFrame& frame) { return !is_protected(frame); });
+  if (victim == queued.end())
+  {
+    victim = queued.begin();
+  }
+
+  record_drop(*victim, reason);
+  this->cameras_[idx].free_buffers.push_back((uint8_t*)victim->data);
+  queued.erase(victim);
+  this->total_queued_--;
+  return true;
+}
+
+int LoadShedder::find_victim(int max_priority) {
+  int victim = -1;
+  for (int idx = 0; idx < (int)this->cameras_.size(); idx++)
+  {
+    const CameraQueue& camera = this->cameras_[idx];
+    if (camera.queued.empty() || camera.priority > max_priority)
+    {
+      continue;
+    }
+    // Lowest priority first, then the longest queue
+    if (victim < 0 || camera.priority < this->cameras_[victim].priority ||
+        (camera.priority == this->cameras_[victim].priority &&
+         camera.queued.size() > this->cameras_[victim].queued.size()))
+    {
+      victim = idx;
+    }
+  }
+  return victim;
+}
+
+void LoadShedder::offer(const CameraFrame& frame) {
+  if (frame.camera_idx < 0 || frame.camera_idx >= (int)this->cameras_.size() || !frame.data)
+  {
+    return;
+  }
+
+  uint8_t* buffer = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(this->mutex_);
+    CameraQueue& camera = this->cameras_[frame.camera_idx];
+    camera.offered++;
+    record_skipped(frame);
+
+    // Thin out before the queue fills, so what is kept stays evenly spaced
+    if (this->policy_ == "keep_every_nth" && camera.queued.size() * 2 >= this->queue_depth_ &&
+        frame.frame_number % this->keep_every_ != 0 && !is_protected(frame))
+    {
+      record_drop(frame, "thinned");
+      return;
+    }
+
+    if (this->max_backlog_ > 0 && this->total_queued_ >= this->max_backlog_)
+    {
+      int victim = find_victim(camera.priority);
+      if (victim < 0)
+      {
+        record_drop(frame, "backlog");
+        return;
+      }
+      evict(victim, victim == frame.camera_idx ? "backlog" : "priority");
+    }
+
+    if (camera.queued.size() >= this->queue_depth_)
+    {
+      if (this->policy_ == "drop_newest")
+      {
+        record_drop(frame, "queue_full");
+        return;
+      }
+      evict(frame.camera_idx, "queue_full");
+    }
+
+    buffer = camera.free_buffers.back();
+    camera.free_buffers.pop_back();
+  }
+
+  // Only this camera's capture thread copies into its free buffers, so the
+  // copy needs no lock
+  memcpy(buffer, frame.data, this->frame_bytes_);
+
+  CameraFrame copy = frame;
+  copy.data = buffer;
+  {
+    std::lock_guard<std::mutex> lock(this->mutex_);
+    this->cameras_[frame.camera_idx].queued.push_back(copy);
+    this->total_queued_++;
+  }
+  this->cv_frames_.notify_one();
+}
+
+bool LoadShedder::pop(int idx, CameraFrame* frame) {
+  std::lock_guard<std::mutex> lock(this->mutex_);
+  CameraQueue& camera = this->cameras_[idx];
+
+  // The previous frame is done with once the consumer asks for the next
+  if (camera.popped)
+  {
+    if (this->keep_latest_)
+    {
+      publish_latest(idx);
+    }
+    else
+    {
+      camera.free_buffers.push_back(camera.popped);
+    }
+    camera.popped = nullptr;
+  }
+
+  if (camera.queued.empty())
+  {
+    return false;
+  }
+
+  *frame = camera.queued.front();
+  camera.queued.pop_front();
+  camera.popped = (uint8_t*)frame->data;
+  camera.popped_frame = *frame;
+  this->total_queued_--;
+  return true;
+}
+
+int LoadShedder::buffer_index(const CameraQueue& camera, const void* data) {
+  auto buffer = std::find(camera.buffers.begin(), camera.buffers.end(), data);
+  return buffer == camera.buffers.end() ? -1 : buffer - camera.buffers.begin();
+}
+
+void LoadShedder::publish_latest(int idx) {
+  CameraQueue& camera = this->cameras_[idx];
+
+  // Recycled before publishing: a take can only see the new frame once the
+  // returned slot is empty again
+  int returned = this->returned_[idx].exchange(-1);
+  if (returned >= 0)
+  {
+    camera.free_buffers.push_back(camera.buffers[returned]);
+  }
+
+  int index = buffer_index(camera, camera.popped);
+  camera.buffer_frames[index] = camera.popped_frame;
+  int previous = this->latest_[idx].exchange(index);
+  if (previous >= 0)
+  {
+    camera.free_buffers.push_back(camera.buffers[previous]);
+  }
+}
+
+bool LoadShedder::take_latest(int idx, CameraFrame* frame) {
+  int index = this->latest_[idx].exchange(-1);
+  if (index < 0)
+  {
+    return false;
+  }
+  *frame = this->cameras_[idx].buffer_frames[index];
+  return true;
+}
+
+void LoadShedder::return_latest(int idx, const CameraFrame& frame) {
+  int index = buffer_index(this->cameras_[idx], frame.data);
+  if (index < 0)
+  {
+    return;
+  }
+
+  // Back into the slot if nothing newer arrived, otherwise pop() recycles it
+  int empty = -1;
+  if (!this->latest_[idx].compare_exchange_strong(empty, index))
+  {
+    this->returned_[idx] = index;
+  }
+}
+
+void LoadShedder::wait_for_frames(std::chrono::microseconds timeout) {
+  std::unique_lock<std::mutex> lock(this->mutex_);
+  this->cv_frames_.wait_for(lock, timeout, [this] { return this->total_queued_ > 0; });
+}
+
+const std::vector<int>& LoadShedder::get_service_order() {
+  return this->service_order_;
+}
+
+void LoadShedder::take_dropped_frames(std::vector<DroppedFrame>* dropped) {
+  std::lock_guard<std::mutex> lock(this->mutex_);
+  dropped->insert(dropped->end(), this->dropped_log_.begin(), this->dropped_log_.end());
+  this->dropped_log_.clear();
+}
+
+int64_t LoadShedder::get_offered_frames(int idx) {
+  std::lock_guard<std::mutex> lock(this->mutex_);
+  return this->cameras_[idx].offered;
+}
+
+int64_t LoadShedder::get_dropped_frames(int idx) {
+  std::lock_guard<std::mutex> lock(this->mutex_);
+  return this->cameras_[idx].dropped;
+}
+
+int64_t LoadShedder::get_skipped_frames(int idx) {
+  std::lock_guard<std::mutex> lock(this->mutex_);
+  return this->cameras_[idx].skipped;
+}
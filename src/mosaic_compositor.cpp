@@ -0,0 +1,277 @@
+#include "mosaic_compositor.hpp"
+#include "startup_timeline.hpp"
+#include "thread_placement.hpp"
+
+#include <jsoncpp/json/json.h>
+#include <opencv2/opencv.hpp>
+#include <libyuv.h>
+
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+MosaicCompositor::MosaicCompositor(Json::Value jsonVideoConf,
+                                   int num_cameras,
+                                   int camera_width,
+                                   int camera_height) {
+  this->num_cameras_ = num_cameras;
+  this->camera_width_ = camera_width;
+  this->camera_height_ = camera_height;
+
+  Json::Value jsonMosaicConf = jsonVideoConf["mosaic"];
+  int canvas_width = jsonMosaicConf.get("width", 1280).asInt() & ~1;
+  int canvas_height = jsonMosaicConf.get("height", 1024).asInt() & ~1;
+  int columns = jsonMosaicConf.get("columns", 0).asInt();
+  if (columns <= 0)
+  {
+    columns = (int)std::ceil(std::sqrt((double)num_cameras));
+  }
+  int rows = (num_cameras + columns - 1) / columns;
+
+  // NV12 chroma is subsampled 2x2, so tiles start and end on even pixels
+  int tile_width = (canvas_width / columns) & ~1;
+  int tile_height = (canvas_height / rows) & ~1;
+
+  // Per-tile scratch images, allocated once from huge pages. The canvases
+  // come from the encoder's input pool.
+  bool scaled = tile_width != camera_width || tile_height != camera_height;
+  size_t tile_size = (size_t)tile_width * tile_height * 4 +
+                     (scaled ? (size_t)camera_width * camera_height * 4 : 0);
+  this->arena_ = std::make_unique<FrameArena>(
+    num_cameras * (tile_size + 2 * FrameArena::kAlignment), "mosaic");
+
+  this->tiles_.resize(num_cameras);
+  for (int idx = 0; idx < num_cameras; idx++)
+  {
+    Tile& tile = this->tiles_[idx];
+    tile.rect = {(idx % columns) * tile_width, (idx / columns) * tile_height, tile_width, tile_height};
+    tile.argb = this->arena_->allocate((size_t)tile_width * tile_height * 4);
+    if (scaled)
+    {
+      tile.camera_argb = this->arena_->allocate((size_t)camera_width * camera_height * 4);
+    }
+    if (!tile.argb || (scaled && !tile.camera_argb))
+    {
+      fprintf(stderr, "Could not allocate mosaic tile buffers\n");
+      exit(1);
+    }
+  }
+
+  for (int idx = num_cameras; idx < columns * rows; idx++)
+  {
+    this->blank_rects_.push_back({(idx % columns) * tile_width, (idx / columns) * tile_height,
+                                  tile_width, tile_height});
+  }
+  if (columns * tile_width < canvas_width)
+  {
+    this->blank_rects_.push_back({columns * tile_width, 0, canvas_width - columns * tile_width, canvas_height});
+  }
+  if (rows * tile_height < canvas_height)
+  {
+    this->blank_rects_.push_back({0, rows * tile_height, columns * tile_width, canvas_height - rows * tile_height});
+  }
+
+  // The mosaic is recorded like a camera session named "mosaic"
+  Json::Value jsonEncoderConf = jsonVideoConf;
+  jsonEncoderConf["stream_width"] = canvas_width;
+  jsonEncoderConf["stream_height"] = canvas_height;
+  jsonEncoderConf["output_video_path"] = jsonVideoConf["output_video_path"].asString() + "_mosaic";
+  jsonEncoderConf["lossless"]["enabled"] = false;
+  {
+    ScopedThreadPlacement placement("encode");
+    this->encoder_ = std::make_unique<VideoEncoding>(jsonEncoderConf, "mosaic", 0, -1);
+    if (!this->encoder_->is_open())
+    {
+      fprintf(stderr, "Could not open the mosaic encoder\n");
+      exit(1);
+    }
+    this->encoder_->warm_up();
+  }
+  mark_startup("mosaic encoder ready");
+
+  this->timestamp_log_.open(jsonVideoConf["output_timestamp_path"].asString() + "_mosaic.txt");
+
+  std::cout << "Mosaic: " << columns << "x" << rows << " tiles of " << tile_width << "x"
+            << tile_height << " on a " << canvas_width << "x" << canvas_height << " canvas\n";
+
+  this->encode_thread_ = std::thread(&MosaicCompositor::encode_loop, this);
+}
+
+MosaicCompositor::~MosaicCompositor() {
+  finish();
+
+  if (this->previous_)
+  {
+    av_frame_free(&this->previous_);
+  }
+}
+
+void MosaicCompositor::clear_rect(AVFrame* canvas, const Rect& rect) {
+  libyuv::SetPlane(canvas->data[0] + rect.y * canvas->linesize[0] + rect.x, canvas->linesize[0],
+                   rect.width, rect.height, 16);
+  libyuv::SetPlane(canvas->data[1] + (rect.y / 2) * canvas->linesize[1] + rect.x, canvas->linesize[1],
+                   rect.width, rect.height / 2, 128);
+}
+
+void MosaicCompositor::compose_tile(const CameraFrame& frame, AVFrame* canvas) {
+  Tile& tile = this->tiles_[frame.camera_idx];
+  const Rect& rect = tile.rect;
+
+  uint8_t* tile_y = canvas->data[0] + rect.y * canvas->linesize[0] + rect.x;
+  uint8_t* tile_uv = canvas->data[1] + (rect.y / 2) * canvas->linesize[1] + rect.x;
+
+  if (!frame.data)
+  {
+    // The previous canvas holds the last set, black before the first one
+    const AVFrame* previous = this->previous_;
+    if (!previous)
+    {
+      clear_rect(canvas, rect);
+      return;
+    }
+    const uint8_t* previous_y = previous->data[0] + rect.y * previous->linesize[0] + rect.x;
+    const uint8_t* previous_uv = previous->data[1] + (rect.y / 2) * previous->linesize[1] + rect.x;
+    libyuv::CopyPlane(previous_y, previous->linesize[0], tile_y, canvas->linesize[0],
+                      rect.width, rect.height);
+    libyuv::CopyPlane(previous_uv, previous->linesize[1], tile_uv, canvas->linesize[1],
+                      rect.width, rect.height / 2);
+    return;
+  }
+
+  // libyuv's RGB24 and ARGB are OpenCV's BGR and BGRA byte orders
+  int camera_stride = this->camera_width_ * 3;
+  int ret = 0;
+  if (!tile.camera_argb)
+  {
+    ret = libyuv::RGB24ToARGB((const uint8_t*)frame.data, camera_stride,
+                              tile.argb, rect.width * 4, rect.width, rect.height);
+  }
+  else
+  {
+    ret = libyuv::RGB24ToARGB((const uint8_t*)frame.data, camera_stride,
+                              tile.camera_argb, this->camera_width_ * 4,
+                              this->camera_width_, this->camera_height_);
+    ret = ret || libyuv::ARGBScale(tile.camera_argb, this->camera_width_ * 4,
+                                   this->camera_width_, this->camera_height_,
+                                   tile.argb, rect.width * 4, rect.width, rect.height,
+                                   libyuv::kFilterBox);
+  }
+
+  ret = ret || libyuv::ARGBToNV12(tile.argb, rect.width * 4,
+                                  tile_y, canvas->linesize[0],
+                                  tile_uv, canvas->linesize[1],
+                                  rect.width, rect.height);
+  if (ret != 0)
+  {
+    std::cerr << "libyuv failed to compose mosaic tile " << frame.camera_idx << std::endl;
+  }
+}
+
+void MosaicCompositor::encode_set(const FrameSet& frame_set) {
+  AVFrame* canvas = this->encoder_->allocate_input_frame();
+  for (const Rect& rect : this->blank_rects_)
+  {
+    clear_rect(canvas, rect);
+  }
+
+  // Tiles do not overlap, so they are written concurrently
+  cv::parallel_for_(cv::Range(0, this->num_cameras_), [&](const cv::Range& range) {
+    for (int idx = range.start; idx < range.end; idx++)
+    {
+      compose_tile(frame_set.frames[idx], canvas);
+    }
+  });
+
+  if (!this->previous_)
+  {
+    this->previous_ = av_frame_alloc();
+  }
+  av_frame_unref(this->previous_);
+  av_frame_ref(this->previous_, canvas);
+
+  int64_t timestamp_ms = frame_set.timestamp_us / 1000;
+  this->timestamp_log_ << "Frame " << this->frame_count_ << " timestamp: " << timestamp_ms
+                       << " set: " << frame_set.set_number
+                       << " cameras: " << frame_set.num_frames << "\n";
+  this->timestamp_log_.flush();
+
+  CanvasRef canvas_ref;
+  canvas_ref.canvas = canvas;
+  canvas_ref.frame_count = this->frame_count_++;
+  canvas_ref.timestamp_ms = timestamp_ms;
+  this->encode_pipe_.put(canvas_ref);
+}
+
+void MosaicCompositor::encode_loop() {
+  apply_thread_placement("encode");
+
+  while (true)
+  {
+    CanvasRef canvas_ref;
+    try
+    {
+      canvas_ref = this->encode_pipe_.fetch();
+    }
+    catch (const InTerminatedException&)
+    {
+      break;
+    }
+
+    int64_t bitrate = this->pending_bitrate_.exchange(0);
+    if (bitrate > 0)
+    {
+      this->encoder_->set_bitrate(bitrate);
+    }
+
+    this->encoder_->encode_input_frame_to_file(canvas_ref.canvas,
+                                               canvas_ref.frame_count,
+                                               canvas_ref.timestamp_ms);
+    av_frame_free(&canvas_ref.canvas);
+  }
+}
+
+bool MosaicCompositor::reconfigure(const std::string& param,
+                                   const std::string& value,
+                                   std::string* error) {
+  if (param != "bitrate")
+  {
+    *error = "only the bitrate of the mosaic can change while recording";
+    return false;
+  }
+  if (!this->encoder_->supports_live_bitrate())
+  {
+    *error = "the mosaic encoder cannot change its bitrate while running";
+    return false;
+  }
+
+  char* end = nullptr;
+  long bitrate = strtol(value.c_str(), &end, 10);
+  if (*end != '\0' || bitrate <= 0)
+  {
+    *error = "bitrate must be a positive integer";
+    return false;
+  }
+
+  this->pending_bitrate_ = (int64_t)bitrate * 1024 * 1024;
+  return true;
+}
+
+void MosaicCompositor::finish() {
+  if (this->finished_)
+  {
+    return;
+  }
+  this->finished_ = true;
+
+  this->encode_pipe_.terminate();
+  if (this->encode_thread_.joinable())
+  {
+    this->encode_thread_.join();
+  }
+  this->encoder_->finish_file();
+
+  this->timestamp_log_.close();
+
+  std::cout << "Mosaic session finished encoding.\n";
+}
@@ -0,0 +1,136 @@
+#include "motion_map.hpp"
+
+#include <opencv2/opencv.hpp>
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+MotionMap::MotionMap(Json::Value jsonMotionConf,
+                     int width,
+                     int height) {
+  this->width_ = width;
+  this->height_ = height;
+
+  this->block_size_ = std::max(16, jsonMotionConf.get("block_size", 32).asInt());
+  this->threshold_ = jsonMotionConf.get("threshold", 6).asDouble();
+  this->static_qoffset_ = jsonMotionConf.get("static_qoffset", 0.4).asDouble();
+  this->motion_qoffset_ = jsonMotionConf.get("motion_qoffset", -0.2).asDouble();
+  this->skip_fraction_ = jsonMotionConf.get("skip_fraction", 0.0).asDouble();
+  this->max_skipped_ = jsonMotionConf.get("max_skipped", 30).asInt();
+
+  this->grid_cols_ = (width + this->block_size_ - 1) / this->block_size_;
+  this->grid_rows_ = (height + this->block_size_ - 1) / this->block_size_;
+  this->moving_.assign(this->grid_cols_ * this->grid_rows_, 1);
+  this->moving_blocks_ = this->moving_.size();
+}
+
+void MotionMap::analyze(const AVFrame* nv12) {
+  if (!this->has_reference_)
+  {
+    std::fill(this->moving_.begin(), this->moving_.end(), 1);
+    this->moving_blocks_ = this->moving_.size();
+    return;
+  }
+
+  cv::Mat luma(this->height_, this->width_, CV_8UC1, nv12->data[0], nv12->linesize[0]);
+
+  // Both steps are vectorized in OpenCV: per-pixel |a - b|, then an area
+  // average that yields the mean difference of every block
+  cv::absdiff(luma, this->reference_luma_, this->diff_);
+  cv::resize(this->diff_, this->block_diff_, cv::Size(this->grid_cols_, this->grid_rows_),
+             0, 0, cv::INTER_AREA);
+
+  this->moving_blocks_ = 0;
+  for (int row = 0; row < this->grid_rows_; row++)
+  {
+    const uint8_t* block_row = this->block_diff_.ptr<uint8_t>(row);
+    for (int col = 0; col < this->grid_cols_; col++)
+    {
+      uint8_t moving = block_row[col] > this->threshold_;
+      this->moving_[row * this->grid_cols_ + col] = moving;
+      this->moving_blocks_ += moving;
+    }
+  }
+}
+
+bool MotionMap::should_skip() {
+  if (this->has_reference_ &&
+      get_moving_fraction() <= this->skip_fraction_ &&
+      this->consecutive_skipped_ < this->max_skipped_)
+  {
+    this->consecutive_skipped_++;
+    this->skipped_frames_++;
+    return true;
+  }
+
+  this->consecutive_skipped_ = 0;
+  return false;
+}
+
+void MotionMap::apply_roi(AVFrame* frame) {
+  av_frame_remove_side_data(frame, AV_FRAME_DATA_REGIONS_OF_INTEREST);
+
+  // Encoders give earlier regions precedence, so moving runs come first and
+  // the whole-frame background region last
+  std::vector<AVRegionOfInterest> regions;
+  for (int row = 0; row < this->grid_rows_; row++)
+  {
+    int col = 0;
+    while (col < this->grid_cols_)
+    {
+      if (!this->moving_[row * this->grid_cols_ + col])
+      {
+        col++;
+        continue;
+      }
+
+      int start = col;
+      while (col < this->grid_cols_ && this->moving_[row * this->grid_cols_ + col])
+      {
+        col++;
+      }
+
+      AVRegionOfInterest region;
+      region.self_size = sizeof(AVRegionOfInterest);
+      region.top = row * this->block_size_;
+      region.bottom = std::min(this->height_, (row + 1) * this->block_size_);
+      region.left = start * this->block_size_;
+      region.right = std::min(this->width_, col * this->block_size_);
+      region.qoffset = av_make_q((int)(this->motion_qoffset_ * 100), 100);
+      regions.push_back(region);
+    }
+  }
+
+  AVRegionOfInterest background;
+  background.self_size = sizeof(AVRegionOfInterest);
+  background.top = 0;
+  background.bottom = this->height_;
+  background.left = 0;
+  background.right = this->width_;
+  background.qoffset = av_make_q((int)(this->static_qoffset_ * 100), 100);
+  regions.push_back(background);
+
+  AVFrameSideData* side_data = av_frame_new_side_data(frame, AV_FRAME_DATA_REGIONS_OF_INTEREST,
+                                                      regions.size() * sizeof(AVRegionOfInterest));
+  if (!side_data)
+  {
+    std::cerr << "Could not allocate ROI side data" << std::endl;
+    return;
+  }
+  memcpy(side_data->data, regions.data(), regions.size() * sizeof(AVRegionOfInterest));
+}
+
+void MotionMap::commit(const AVFrame* nv12) {
+  cv::Mat luma(this->height_, this->width_, CV_8UC1, nv12->data[0], nv12->linesize[0]);
+  luma.copyTo(this->reference_luma_);
+  this->has_reference_ = true;
+}
+
+double MotionMap::get_moving_fraction() {
+  return (double)this->moving_blocks_ / this->moving_.size();
+}
+
+int64_t MotionMap::get_skipped_frames() {
+  return this->skipped_frames_;
+}
@@ -11,7 +11,7 @@
 #include <arpa/inet.h>
 #include <unistd.h>
 
-NetworkConnection::NetworkConnection(const std::string& ip_address, int port) {
+NetworkConnection::NetworkConnection(const std::string& ip_address, int port, bool auto_connect) {
   this->ip_address_ = ip_address;
   this->port_ = port;
 
@@ -27,7 +27,10 @@ NetworkConnection::NetworkConnection(const std::string& ip_address, int port) {
     this->client_addr_.sin_addr.s_addr = INADDR_ANY;
     this->client_addr_.sin_port = htons(this->port_);
 
-    accept_client();
+    if (auto_connect)
+    {
+      accept_client();
+    }
   }
   else
   {
@@ -35,7 +38,10 @@ NetworkConnection::NetworkConnection(const std::string& ip_address, int port) {
     this->server_addr_.sin_port = htons(this->port_);
     inet_pton(AF_INET, this->ip_address_.c_str(), &this->server_addr_.sin_addr);
 
-    connect_server();
+    if (auto_connect)
+    {
+      connect_server();
+    }
   }
 }
 
@@ -70,13 +76,17 @@ bool NetworkConnection::connect_server() {
 }
 
 bool NetworkConnection::accept_client() {
-  if (bind(this->socket_, (struct sockaddr*)&this->client_addr_, sizeof(this->client_addr_)) < 0) 
+  if (!this->listening_)
   {
-    perror("Bind failed");
-    return 1;
-  }
+    if (bind(this->socket_, (struct sockaddr*)&this->client_addr_, sizeof(this->client_addr_)) < 0) 
+    {
+      perror("Bind failed");
+      return false;
+    }
 
-  listen(this->socket_, 1);
+    listen(this->socket_, 1);
+    this->listening_ = true;
+  }
 
   std::cout << "Waiting for a connection...\n";
   this->client_socket_ = accept(this->socket_, NULL, NULL);
@@ -99,10 +109,21 @@ int NetworkConnection::get_client_socket() const {
   return this->client_socket_;
 }
 
+void NetworkConnection::shutdown_connection() {
+  if (this->socket_ >= 0)
+  {
+    shutdown(this->socket_, SHUT_RDWR);
+  }
+}
+
 ssize_t send_all(int socket, const void* buffer, size_t length) {
   size_t bytes_sent = 0;
   while (bytes_sent < length) {
-    ssize_t result = send(socket, (const char*)buffer + bytes_sent, length - bytes_sent, 0);
+    // A receiver that went away must not take the process down with SIGPIPE
+    ssize_t result = send(socket, (const char*)buffer + bytes_sent, length - bytes_sent, MSG_NOSIGNAL);
+    if (result == -1 && errno == EINTR) {
+      continue;
+    }
     if (result == -1) {
       fprintf(stderr, "Error sending data: %s\n", strerror(errno));
       return result;
@@ -117,11 +138,20 @@ ssize_t receive_all(int socket, char* buffer, size_t length) {
   while (bytes_received < length)
   {
     ssize_t result = recv(socket, buffer + bytes_received, length - bytes_received, 0);
+    if (result == -1 && errno == EINTR)
+    {
+      continue;
+    }
     if (result == -1)
     {
       fprintf(stderr, "Error receiving data: %s\n", strerror(errno));
       return result;
     }
+    if (result == 0)
+    {
+      fprintf(stderr, "Connection closed by peer\n");
+      return -1;
+    }
     bytes_received += result;
   }
   return bytes_received;
@@ -0,0 +1,677 @@
+#include "pixel_convert.hpp"
+
+extern "C" {
+  #include <libavutil/frame.h>
+  #include <libavutil/pixfmt.h>
+}
+
+#include <algorithm>
+#include <cstring>
+#include <type_traits>
+
+// Kernels are inlined into every instruction set variant below, so each
+// variant is vectorized for its own target
+#define PIXEL_INLINE inline __attribute__((always_inline))
+
+namespace {
+
+template <PixelFormat F>
+constexpr bool kIsPacked = F == PixelFormat::RGB24 || F == PixelFormat::BGR24 || F == PixelFormat::BGRA;
+
+template <PixelFormat F>
+constexpr bool kIsYuv420 = F == PixelFormat::NV12 || F == PixelFormat::I420 || F == PixelFormat::P010;
+
+template <PixelFormat F>
+constexpr bool kIsBayer = F == PixelFormat::RAW8 || F == PixelFormat::RAW16;
+
+// Byte offsets of the channels of a packed pixel, -1 for no alpha
+template <PixelFormat F>
+struct PackedLayout;
+
+template <>
+struct PackedLayout<PixelFormat::RGB24> {
+  static constexpr int kBytes = 3, kR = 0, kG = 1, kB = 2, kA = -1;
+};
+
+template <>
+struct PackedLayout<PixelFormat::BGR24> {
+  static constexpr int kBytes = 3, kR = 2, kG = 1, kB = 0, kA = -1;
+};
+
+template <>
+struct PackedLayout<PixelFormat::BGRA> {
+  static constexpr int kBytes = 4, kR = 2, kG = 1, kB = 0, kA = 3;
+};
+
+PIXEL_INLINE uint8_t clamp_byte(int value) {
+  return (uint8_t)std::min(255, std::max(0, value));
+}
+
+template <PixelFormat F>
+PIXEL_INLINE void store_rgb(uint8_t* pixel, int r, int g, int b) {
+  using Layout = PackedLayout<F>;
+  pixel[Layout::kR] = clamp_byte(r);
+  pixel[Layout::kG] = clamp_byte(g);
+  pixel[Layout::kB] = clamp_byte(b);
+  if constexpr (Layout::kA >= 0)
+  {
+    pixel[Layout::kA] = 255;
+  }
+}
+
+// 8 bit sample i of a YUV plane row, P010 keeps its top 8 bits
+template <PixelFormat F>
+PIXEL_INLINE int yuv_sample(const uint8_t* row, int i) {
+  if constexpr (F == PixelFormat::P010)
+  {
+    return ((const uint16_t*)row)[i] >> 8;
+  }
+  else
+  {
+    return row[i];
+  }
+}
+
+// Chroma shared by columns 2 * cx and 2 * cx + 1
+template <PixelFormat F>
+PIXEL_INLINE void chroma_at(const uint8_t* u_row, const uint8_t* v_row, int cx, int* u, int* v) {
+  if constexpr (F == PixelFormat::I420)
+  {
+    *u = u_row[cx];
+    *v = v_row[cx];
+  }
+  else
+  {
+    *u = yuv_sample<F>(u_row, 2 * cx);
+    *v = yuv_sample<F>(u_row, 2 * cx + 1);
+  }
+}
+
+// BT.601 limited range, the matrix libyuv and the encoders use
+template <PixelFormat F>
+PIXEL_INLINE void store_yuv(uint8_t* pixel, int y, int u, int v) {
+  int luma = (y - 16) * 298 + 128;
+  int d = u - 128;
+  int e = v - 128;
+  store_rgb<F>(pixel, (luma + 409 * e) >> 8, (luma - 100 * d - 208 * e) >> 8, (luma + 516 * d) >> 8);
+}
+
+template <PixelFormat Src, PixelFormat Dst>
+PIXEL_INLINE void packed_to_packed(const Image& src, const Image& dst, int first_row, int last_row) {
+  using In = PackedLayout<Src>;
+  using Out = PackedLayout<Dst>;
+  const int width = src.width;
+  for (int y = first_row; y < last_row; y++)
+  {
+    const uint8_t* in = src.planes[0] + (size_t)y * src.strides[0];
+    uint8_t* out = dst.planes[0] + (size_t)y * dst.strides[0];
+    for (int x = 0; x < width; x++)
+    {
+      // Read before writing, so converting in place works
+      int r = in[x * In::kBytes + In::kR];
+      int g = in[x * In::kBytes + In::kG];
+      int b = in[x * In::kBytes + In::kB];
+      store_rgb<Dst>(out + x * Out::kBytes, r, g, b);
+    }
+  }
+}
+
+template <PixelFormat Src, PixelFormat Dst>
+PIXEL_INLINE void yuv420_to_packed(const Image& src, const Image& dst, int first_row, int last_row) {
+  using Out = PackedLayout<Dst>;
+  const int width = src.width;
+  for (int y = first_row; y < last_row; y++)
+  {
+    const uint8_t* __restrict y_row = src.planes[0] + (size_t)y * src.strides[0];
+    const uint8_t* __restrict u_row = src.planes[1] + (size_t)(y / 2) * src.strides[1];
+    const uint8_t* __restrict v_row = Src == PixelFormat::I420 ? src.planes[2] + (size_t)(y / 2) * src.strides[2] : u_row;
+    uint8_t* __restrict out = dst.planes[0] + (size_t)y * dst.strides[0];
+
+    // Pixel pairs share their chroma, so there is no per-pixel division
+    for (int cx = 0; cx < width / 2; cx++)
+    {
+      int u, v;
+      chroma_at<Src>(u_row, v_row, cx, &u, &v);
+      store_yuv<Dst>(out + 2 * cx * Out::kBytes, yuv_sample<Src>(y_row, 2 * cx), u, v);
+      store_yuv<Dst>(out + (2 * cx + 1) * Out::kBytes, yuv_sample<Src>(y_row, 2 * cx + 1), u, v);
+    }
+    if (width % 2 != 0)
+    {
+      int u, v;
+      chroma_at<Src>(u_row, v_row, width / 2, &u, &v);
+      store_yuv<Dst>(out + (width - 1) * Out::kBytes, yuv_sample<Src>(y_row, width - 1), u, v);
+    }
+  }
+}
+
+// Chroma of a 2x2 block from the average of its pixels
+template <PixelFormat Src, PixelFormat Dst>
+PIXEL_INLINE void store_chroma(const uint8_t* p00, const uint8_t* p01, const uint8_t* p10, const uint8_t* p11,
+                               uint8_t* u_out, uint8_t* v_out, int cx) {
+  using In = PackedLayout<Src>;
+  int r = (p00[In::kR] + p01[In::kR] + p10[In::kR] + p11[In::kR] + 2) >> 2;
+  int g = (p00[In::kG] + p01[In::kG] + p10[In::kG] + p11[In::kG] + 2) >> 2;
+  int b = (p00[In::kB] + p01[In::kB] + p10[In::kB] + p11[In::kB] + 2) >> 2;
+  uint8_t u = (112 * b - 74 * g - 38 * r + 0x8080) >> 8;
+  uint8_t v = (112 * r - 94 * g - 18 * b + 0x8080) >> 8;
+  if constexpr (Dst == PixelFormat::I420)
+  {
+    u_out[cx] = u;
+    v_out[cx] = v;
+  }
+  else
+  {
+    u_out[2 * cx] = u;
+    u_out[2 * cx + 1] = v;
+  }
+}
+
+template <PixelFormat Src, PixelFormat Dst>
+PIXEL_INLINE void packed_to_yuv420(const Image& src, const Image& dst, int first_row, int last_row) {
+  using In = PackedLayout<Src>;
+  const int width = src.width;
+  for (int y = first_row; y < last_row; y += 2)
+  {
+    // An odd last row is its own pair
+    int y_next = std::min(y + 1, src.height - 1);
+    const uint8_t* __restrict in0 = src.planes[0] + (size_t)y * src.strides[0];
+    const uint8_t* __restrict in1 = src.planes[0] + (size_t)y_next * src.strides[0];
+    uint8_t* __restrict y_out0 = dst.planes[0] + (size_t)y * dst.strides[0];
+    uint8_t* __restrict y_out1 = dst.planes[0] + (size_t)y_next * dst.strides[0];
+    uint8_t* __restrict u_out = dst.planes[1] + (size_t)(y / 2) * dst.strides[1];
+    uint8_t* __restrict v_out = Dst == PixelFormat::I420 ? dst.planes[2] + (size_t)(y / 2) * dst.strides[2] : u_out;
+
+    for (int x = 0; x < width; x++)
+    {
+      const uint8_t* p0 = in0 + x * In::kBytes;
+      const uint8_t* p1 = in1 + x * In::kBytes;
+      y_out0[x] = (66 * p0[In::kR] + 129 * p0[In::kG] + 25 * p0[In::kB] + 0x1080) >> 8;
+      y_out1[x] = (66 * p1[In::kR] + 129 * p1[In::kG] + 25 * p1[In::kB] + 0x1080) >> 8;
+    }
+
+    for (int cx = 0; cx < width / 2; cx++)
+    {
+      const uint8_t* p0 = in0 + 2 * cx * In::kBytes;
+      const uint8_t* p1 = in1 + 2 * cx * In::kBytes;
+      store_chroma<Src, Dst>(p0, p0 + In::kBytes, p1, p1 + In::kBytes, u_out, v_out, cx);
+    }
+    if (width % 2 != 0)
+    {
+      const uint8_t* p0 = in0 + (width - 1) * In::kBytes;
+      const uint8_t* p1 = in1 + (width - 1) * In::kBytes;
+      store_chroma<Src, Dst>(p0, p0, p1, p1, u_out, v_out, width / 2);
+    }
+  }
+}
+
+template <PixelFormat Src, PixelFormat Dst>
+PIXEL_INLINE void yuv420_to_yuv420(const Image& src, const Image& dst, int first_row, int last_row) {
+  const int width = src.width;
+  const int chroma_width = (width + 1) / 2;
+  for (int y = first_row; y < last_row; y++)
+  {
+    const uint8_t* y_in = src.planes[0] + (size_t)y * src.strides[0];
+    uint8_t* y_out = dst.planes[0] + (size_t)y * dst.strides[0];
+    for (int x = 0; x < width; x++)
+    {
+      y_out[x] = yuv_sample<Src>(y_in, x);
+    }
+
+    if (y % 2 != 0)
+    {
+      continue;
+    }
+    const uint8_t* u_in = src.planes[1] + (size_t)(y / 2) * src.strides[1];
+    const uint8_t* v_in = Src == PixelFormat::I420 ? src.planes[2] + (size_t)(y / 2) * src.strides[2] : u_in;
+    uint8_t* u_out = dst.planes[1] + (size_t)(y / 2) * dst.strides[1];
+    uint8_t* v_out = Dst == PixelFormat::I420 ? dst.planes[2] + (size_t)(y / 2) * dst.strides[2] : u_out;
+    for (int cx = 0; cx < chroma_width; cx++)
+    {
+      int u, v;
+      chroma_at<Src>(u_in, v_in, cx, &u, &v);
+      if constexpr (Dst == PixelFormat::I420)
+      {
+        u_out[cx] = u;
+        v_out[cx] = v;
+      }
+      else
+      {
+        u_out[2 * cx] = u;
+        u_out[2 * cx + 1] = v;
+      }
+    }
+  }
+}
+
+// Bilinear demosaic of one pixel, the site's color is known at compile time.
+// xl and xr are the columns left and right, reflected at the borders.
+template <typename T, PixelFormat Dst, bool kRedRow, bool kRedCol>
+PIXEL_INLINE void demosaic_pixel(const T* above, const T* row, const T* below,
+                                 int x, int xl, int xr, int shift, uint8_t* out) {
+  int center = row[x];
+  int vertical = above[x] + below[x];
+  int horizontal = row[xl] + row[xr];
+  int cross = (vertical + horizontal + 2) >> 2;
+  int diagonal = (above[xl] + above[xr] + below[xl] + below[xr] + 2) >> 2;
+
+  int r, g, b;
+  if constexpr (kRedRow && kRedCol)
+  {
+    r = center;
+    g = cross;
+    b = diagonal;
+  }
+  else if constexpr (!kRedRow && !kRedCol)
+  {
+    r = diagonal;
+    g = cross;
+    b = center;
+  }
+  else if constexpr (kRedRow)
+  {
+    r = (horizontal + 1) >> 1;
+    g = center;
+    b = (vertical + 1) >> 1;
+  }
+  else
+  {
+    r = (vertical + 1) >> 1;
+    g = center;
+    b = (horizontal + 1) >> 1;
+  }
+  store_rgb<Dst>(out + x * PackedLayout<Dst>::kBytes, r >> shift, g >> shift, b >> shift);
+}
+
+// Interior pixels in pairs, so the color of both sites is fixed in the loop
+template <typename T, PixelFormat Dst, bool kRedRow, bool kFirstRed>
+PIXEL_INLINE void demosaic_row(const T* above, const T* row, const T* below,
+                               int width, int shift, uint8_t* out) {
+  int x = 1;
+  for (; x + 1 < width - 1; x += 2)
+  {
+    demosaic_pixel<T, Dst, kRedRow, kFirstRed>(above, row, below, x, x - 1, x + 1, shift, out);
+    demosaic_pixel<T, Dst, kRedRow, !kFirstRed>(above, row, below, x + 1, x, x + 2, shift, out);
+  }
+  if (x < width - 1)
+  {
+    demosaic_pixel<T, Dst, kRedRow, kFirstRed>(above, row, below, x, x - 1, x + 1, shift, out);
+  }
+
+  // Border columns reflect, which keeps the Bayer phase of the neighbors.
+  // Column 0 has the phase opposite to column 1.
+  demosaic_pixel<T, Dst, kRedRow, !kFirstRed>(above, row, below, 0, 1, 1, shift, out);
+  if (width > 1)
+  {
+    if ((width - 1) % 2 == 1)
+    {
+      demosaic_pixel<T, Dst, kRedRow, kFirstRed>(above, row, below, width - 1, width - 2, width - 2, shift, out);
+    }
+    else
+    {
+      demosaic_pixel<T, Dst, kRedRow, !kFirstRed>(above, row, below, width - 1, width - 2, width - 2, shift, out);
+    }
+  }
+}
+
+template <PixelFormat Src, PixelFormat Dst>
+PIXEL_INLINE void bayer_to_packed(const Image& src, const Image& dst, int first_row, int last_row) {
+  using T = std::conditional_t<Src == PixelFormat::RAW16, uint16_t, uint8_t>;
+  int shift = Src == PixelFormat::RAW16 ? std::max(0, src.bits - 8) : 0;
+  if (src.width < 2 || src.height < 2)
+  {
+    return;
+  }
+
+  for (int y = first_row; y < last_row; y++)
+  {
+    int y_above = y > 0 ? y - 1 : y + 1;
+    int y_below = y < src.height - 1 ? y + 1 : y - 1;
+    const T* above = (const T*)(src.planes[0] + (size_t)y_above * src.strides[0]);
+    const T* row = (const T*)(src.planes[0] + (size_t)y * src.strides[0]);
+    const T* below = (const T*)(src.planes[0] + (size_t)y_below * src.strides[0]);
+    uint8_t* out = dst.planes[0] + (size_t)y * dst.strides[0];
+
+    // Phase of column 1, where the paired interior loop starts
+    bool red_row = ((y + src.red_y) & 1) == 0;
+    bool first_red = ((1 + src.red_x) & 1) == 0;
+    if (red_row && first_red)
+    {
+      demosaic_row<T, Dst, true, true>(above, row, below, src.width, shift, out);
+    }
+    else if (red_row)
+    {
+      demosaic_row<T, Dst, true, false>(above, row, below, src.width, shift, out);
+    }
+    else if (first_red)
+    {
+      demosaic_row<T, Dst, false, true>(above, row, below, src.width, shift, out);
+    }
+    else
+    {
+      demosaic_row<T, Dst, false, false>(above, row, below, src.width, shift, out);
+    }
+  }
+}
+
+template <PixelFormat Src, PixelFormat Dst>
+PIXEL_INLINE void convert_rows(const Image& src, const Image& dst, int first_row, int last_row) {
+  constexpr bool kToYuv420 = Dst == PixelFormat::NV12 || Dst == PixelFormat::I420;
+  if constexpr (kIsPacked<Src> && kIsPacked<Dst>)
+  {
+    packed_to_packed<Src, Dst>(src, dst, first_row, last_row);
+  }
+  else if constexpr (kIsYuv420<Src> && kIsPacked<Dst>)
+  {
+    yuv420_to_packed<Src, Dst>(src, dst, first_row, last_row);
+  }
+  else if constexpr (kIsPacked<Src> && kToYuv420)
+  {
+    packed_to_yuv420<Src, Dst>(src, dst, first_row, last_row);
+  }
+  else if constexpr (kIsYuv420<Src> && kToYuv420)
+  {
+    yuv420_to_yuv420<Src, Dst>(src, dst, first_row, last_row);
+  }
+  else if constexpr (kIsBayer<Src> && kIsPacked<Dst>)
+  {
+    bayer_to_packed<Src, Dst>(src, dst, first_row, last_row);
+  }
+  else
+  {
+    static_assert(Src != Src, "no kernel for this pair of formats");
+  }
+}
+
+template <PixelFormat Src, PixelFormat Dst>
+void convert_baseline(const Image& src, const Image& dst, int first_row, int last_row) {
+  convert_rows<Src, Dst>(src, dst, first_row, last_row);
+}
+
+#if defined(__x86_64__)
+template <PixelFormat Src, PixelFormat Dst>
+__attribute__((target("sse4.2"))) void convert_sse4(const Image& src, const Image& dst, int first_row, int last_row) {
+  convert_rows<Src, Dst>(src, dst, first_row, last_row);
+}
+
+template <PixelFormat Src, PixelFormat Dst>
+__attribute__((target("avx2"))) void convert_avx2(const Image& src, const Image& dst, int first_row, int last_row) {
+  convert_rows<Src, Dst>(src, dst, first_row, last_row);
+}
+
+template <PixelFormat Src, PixelFormat Dst>
+__attribute__((target("avx512f,avx512bw,avx512vl"))) void convert_avx512(const Image& src, const Image& dst, int first_row, int last_row) {
+  convert_rows<Src, Dst>(src, dst, first_row, last_row);
+}
+#endif
+
+struct KernelEntry {
+  PixelFormat src;
+  PixelFormat dst;
+  // Indexed by SimdLevel
+  ConversionKernel::Function functions[4];
+};
+
+template <PixelFormat Src, PixelFormat Dst>
+constexpr KernelEntry kernel_entry() {
+#if defined(__x86_64__)
+  return {Src, Dst, {convert_baseline<Src, Dst>, convert_sse4<Src, Dst>,
+                     convert_avx2<Src, Dst>, convert_avx512<Src, Dst>}};
+#else
+  return {Src, Dst, {convert_baseline<Src, Dst>, nullptr, nullptr, nullptr}};
+#endif
+}
+
+using PF = PixelFormat;
+
+const KernelEntry kKernels[] = {
+  kernel_entry<PF::RGB24, PF::RGB24>(),
+  kernel_entry<PF::RGB24, PF::BGR24>(),
+  kernel_entry<PF::RGB24, PF::BGRA>(),
+  kernel_entry<PF::BGR24, PF::RGB24>(),
+  kernel_entry<PF::BGR24, PF::BGR24>(),
+  kernel_entry<PF::BGR24, PF::BGRA>(),
+  kernel_entry<PF::BGRA, PF::RGB24>(),
+  kernel_entry<PF::BGRA, PF::BGR24>(),
+  kernel_entry<PF::BGRA, PF::BGRA>(),
+
+  kernel_entry<PF::NV12, PF::RGB24>(),
+  kernel_entry<PF::NV12, PF::BGR24>(),
+  kernel_entry<PF::NV12, PF::BGRA>(),
+  kernel_entry<PF::I420, PF::RGB24>(),
+  kernel_entry<PF::I420, PF::BGR24>(),
+  kernel_entry<PF::I420, PF::BGRA>(),
+  kernel_entry<PF::P010, PF::RGB24>(),
+  kernel_entry<PF::P010, PF::BGR24>(),
+  kernel_entry<PF::P010, PF::BGRA>(),
+
+  kernel_entry<PF::RGB24, PF::NV12>(),
+  kernel_entry<PF::RGB24, PF::I420>(),
+  kernel_entry<PF::BGR24, PF::NV12>(),
+  kernel_entry<PF::BGR24, PF::I420>(),
+  kernel_entry<PF::BGRA, PF::NV12>(),
+  kernel_entry<PF::BGRA, PF::I420>(),
+
+  kernel_entry<PF::NV12, PF::I420>(),
+  kernel_entry<PF::I420, PF::NV12>(),
+  kernel_entry<PF::P010, PF::NV12>(),
+  kernel_entry<PF::P010, PF::I420>(),
+
+  kernel_entry<PF::RAW8, PF::RGB24>(),
+  kernel_entry<PF::RAW8, PF::BGR24>(),
+  kernel_entry<PF::RAW8, PF::BGRA>(),
+  kernel_entry<PF::RAW16, PF::RGB24>(),
+  kernel_entry<PF::RAW16, PF::BGR24>(),
+  kernel_entry<PF::RAW16, PF::BGRA>(),
+};
+
+// Bytes per sample of the first plane and whether chroma is subsampled 4:2:0
+void plane_layout(PixelFormat format, int* sample_bytes, bool* yuv420) {
+  *yuv420 = format == PF::NV12 || format == PF::I420 || format == PF::P010;
+  switch (format)
+  {
+    case PF::RGB24:
+    case PF::BGR24:
+      *sample_bytes = 3;
+      break;
+    case PF::BGRA:
+      *sample_bytes = 4;
+      break;
+    case PF::RAW16:
+    case PF::P010:
+      *sample_bytes = 2;
+      break;
+    default:
+      *sample_bytes = 1;
+  }
+}
+
+}  // namespace
+
+Image make_image(PixelFormat format, int width, int height, uint8_t* data, int stride) {
+  int sample_bytes;
+  bool yuv420;
+  plane_layout(format, &sample_bytes, &yuv420);
+
+  Image image;
+  image.format = format;
+  image.width = width;
+  image.height = height;
+  image.bits = format == PF::RAW16 ? 12 : (format == PF::P010 ? 10 : 8);
+  image.planes[0] = data;
+  image.strides[0] = stride > 0 ? stride : width * sample_bytes;
+  if (!yuv420)
+  {
+    return image;
+  }
+
+  int chroma_width = (width + 1) / 2;
+  int chroma_height = (height + 1) / 2;
+  image.planes[1] = data + (size_t)image.strides[0] * height;
+  if (format == PF::I420)
+  {
+    image.strides[1] = chroma_width;
+    image.strides[2] = chroma_width;
+    image.planes[2] = image.planes[1] + (size_t)chroma_width * chroma_height;
+  }
+  else
+  {
+    image.strides[1] = chroma_width * 2 * (format == PF::P010 ? 2 : 1);
+  }
+  return image;
+}
+
+size_t image_size(PixelFormat format, int width, int height) {
+  int sample_bytes;
+  bool yuv420;
+  plane_layout(format, &sample_bytes, &yuv420);
+
+  size_t size = (size_t)width * height * sample_bytes;
+  if (yuv420)
+  {
+    size += (size_t)((width + 1) / 2) * ((height + 1) / 2) * 2 * (format == PF::P010 ? 2 : 1);
+  }
+  return size;
+}
+
+bool pixel_format_from_av(int av_pix_fmt, PixelFormat* format) {
+  switch (av_pix_fmt)
+  {
+    case AV_PIX_FMT_RGB24:
+      *format = PF::RGB24;
+      return true;
+    case AV_PIX_FMT_BGR24:
+      *format = PF::BGR24;
+      return true;
+    case AV_PIX_FMT_BGRA:
+    case AV_PIX_FMT_BGR0:
+      *format = PF::BGRA;
+      return true;
+    case AV_PIX_FMT_NV12:
+      *format = PF::NV12;
+      return true;
+    case AV_PIX_FMT_YUV420P:
+    case AV_PIX_FMT_YUVJ420P:
+      *format = PF::I420;
+      return true;
+    case AV_PIX_FMT_P010LE:
+      *format = PF::P010;
+      return true;
+    default:
+      return false;
+  }
+}
+
+bool wrap_av_frame(const AVFrame* frame, Image* image) {
+  PixelFormat format;
+  if (!pixel_format_from_av(frame->format, &format))
+  {
+    return false;
+  }
+
+  *image = make_image(format, frame->width, frame->height, frame->data[0], frame->linesize[0]);
+  for (int plane = 1; plane < 3; plane++)
+  {
+    image->planes[plane] = frame->data[plane];
+    image->strides[plane] = frame->linesize[plane];
+  }
+  return true;
+}
+
+const char* pixel_format_name(PixelFormat format) {
+  switch (format)
+  {
+    case PF::RGB24: return "RGB24";
+    case PF::BGR24: return "BGR24";
+    case PF::BGRA: return "BGRA";
+    case PF::RAW8: return "RAW8";
+    case PF::RAW16: return "RAW16";
+    case PF::NV12: return "NV12";
+    case PF::I420: return "I420";
+    case PF::P010: return "P010";
+  }
+  return "unknown";
+}
+
+SimdLevel detect_simd_level() {
+#if defined(__x86_64__)
+  static const SimdLevel level = [] {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vl"))
+    {
+      return SimdLevel::AVX512;
+    }
+    if (__builtin_cpu_supports("avx2"))
+    {
+      return SimdLevel::AVX2;
+    }
+    if (__builtin_cpu_supports("sse4.2"))
+    {
+      return SimdLevel::SSE4;
+    }
+    return SimdLevel::Baseline;
+  }();
+  return level;
+#else
+  return SimdLevel::Baseline;
+#endif
+}
+
+const char* simd_level_name(SimdLevel level) {
+  switch (level)
+  {
+    case SimdLevel::SSE4: return "sse4";
+    case SimdLevel::AVX2: return "avx2";
+    case SimdLevel::AVX512: return "avx512";
+    default:
+#if defined(__x86_64__)
+      return "sse2";
+#elif defined(__aarch64__)
+      return "neon";
+#else
+      return "scalar";
+#endif
+  }
+}
+
+ConversionKernel::ConversionKernel(PixelFormat src, PixelFormat dst, SimdLevel max_level) {
+  this->src_ = src;
+  this->dst_ = dst;
+
+  int level = std::min((int)max_level, (int)detect_simd_level());
+  for (const KernelEntry& entry : kKernels)
+  {
+    if (entry.src != src || entry.dst != dst)
+    {
+      continue;
+    }
+    while (level > 0 && !entry.functions[level])
+    {
+      level--;
+    }
+    this->level_ = (SimdLevel)level;
+    this->function_ = entry.functions[level];
+    return;
+  }
+}
+
+bool ConversionKernel::is_valid() const {
+  return this->function_ != nullptr;
+}
+
+SimdLevel ConversionKernel::get_level() const {
+  return this->level_;
+}
+
+bool ConversionKernel::convert(const Image& src, const Image& dst) const {
+  if (!this->function_ || src.format != this->src_ || dst.format != this->dst_ ||
+      src.width != dst.width || src.height != dst.height)
+  {
+    return false;
+  }
+  this->function_(src, dst, 0, src.height);
+  return true;
+}
+
+void ConversionKernel::convert_rows(const Image& src, const Image& dst, int first_row, int last_row) const {
+  this->function_(src, dst, first_row, std::min(last_row, src.height));
+}
@@ -0,0 +1,345 @@
+#include "quality_monitor.hpp"
+#include "thread_placement.hpp"
+
+#include <libyuv.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+QualityMonitor::QualityMonitor(Json::Value jsonQualityConf,
+                               const AVCodecContext* codec_ctx,
+                               bool adjust_bitrate,
+                               const std::string& log_file,
+                               int session_idx) {
+  this->session_idx_ = session_idx;
+  this->width_ = codec_ctx->width;
+  this->height_ = codec_ctx->height;
+  this->frame_rate_ = std::max(1, codec_ctx->framerate.num / std::max(1, codec_ctx->framerate.den));
+  this->codec_id_ = codec_ctx->codec_id;
+  if (codec_ctx->extradata_size > 0)
+  {
+    this->extradata_.assign(codec_ctx->extradata, codec_ctx->extradata + codec_ctx->extradata_size);
+  }
+
+  this->use_ssim_ = jsonQualityConf.get("metric", "ssim").asString() != "psnr";
+  this->target_ = jsonQualityConf.get("target", this->use_ssim_ ? 0.96 : 40.0).asDouble();
+  this->tolerance_ = jsonQualityConf.get("tolerance", this->use_ssim_ ? 0.005 : 1.0).asDouble();
+  this->min_bitrate_ = jsonQualityConf.get("min_bitrate", 2).asDouble() * 1024 * 1024;
+  this->max_bitrate_ = jsonQualityConf.get("max_bitrate", 20).asDouble() * 1024 * 1024;
+  this->increase_factor_ = jsonQualityConf.get("increase_factor", 1.25).asDouble();
+  this->decrease_factor_ = jsonQualityConf.get("decrease_factor", 0.9).asDouble();
+  this->sample_interval_ = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(
+    std::max(1.0, jsonQualityConf.get("sample_interval_s", 10).asDouble())));
+  this->samples_ = std::max(1, jsonQualityConf.get("samples", 4).asInt());
+  this->sample_every_ = std::max(1, jsonQualityConf.get("sample_every", 8).asInt());
+  this->decoder_name_ = jsonQualityConf.get("decoder", "").asString();
+  this->adjust_bitrate_ = adjust_bitrate;
+  this->target_bitrate_ = codec_ctx->bit_rate;
+
+  // Sized once, the encode thread only copies into them
+  this->sources_.resize(this->samples_);
+  for (Source& source : this->sources_)
+  {
+    source.luma.resize((size_t)this->width_ * this->height_);
+  }
+
+  this->log_.open(log_file);
+  this->log_ << "frame,psnr_db,ssim,bitrate_mbps,actual_mbps,gb_per_hour,next_bitrate_mbps\n";
+
+  this->start_ = Clock::now();
+  this->last_measured_ = this->start_;
+  // The first measurement waits for the encoder to settle
+  this->next_start_ = this->start_ + this->sample_interval_;
+
+  this->monitor_thread_ = std::thread(&QualityMonitor::monitor_loop, this);
+}
+
+QualityMonitor::~QualityMonitor() {
+  {
+    std::lock_guard<std::mutex> lock(this->mutex_);
+    this->stopping_ = true;
+  }
+  this->cv_measure_.notify_all();
+  this->monitor_thread_.join();
+
+  double seconds = std::chrono::duration<double>(Clock::now() - this->start_).count();
+  if (this->measurements_ > 0 && seconds > 0)
+  {
+    double mbps = this->bytes_ * 8 / seconds / (1024 * 1024);
+    printf("Quality session %d: %d measurements, mean psnr %.2f dB, ssim %.4f, %.2f Mbit/s (%.2f GB per hour)\n",
+           this->session_idx_, this->measurements_, this->psnr_sum_ / this->measurements_,
+           this->ssim_sum_ / this->measurements_, mbps, this->bytes_ * 3600.0 / seconds / 1e9);
+  }
+
+  av_frame_free(&this->decoded_);
+  av_packet_free(&this->decode_pkt_);
+  avcodec_free_context(&this->decoder_ctx_);
+}
+
+bool QualityMonitor::take_keyframe_request() {
+  if (this->state_ != State::WaitingKeyframe || this->keyframe_requested_ ||
+      this->frames_waited_ < 2 * this->frame_rate_)
+  {
+    return false;
+  }
+  this->keyframe_requested_ = true;
+  return true;
+}
+
+void QualityMonitor::on_frame(const AVFrame* input_frame) {
+  if (this->measuring_.load(std::memory_order_acquire))
+  {
+    return;
+  }
+
+  if (this->state_ == State::Idle && Clock::now() >= this->next_start_)
+  {
+    this->state_ = State::WaitingKeyframe;
+    this->frames_waited_ = 0;
+    this->keyframe_requested_ = false;
+  }
+
+  if (this->state_ == State::WaitingKeyframe)
+  {
+    this->frames_waited_++;
+  }
+  else if (this->state_ == State::Capturing)
+  {
+    // Frames sent after the keyframe came out, so each one decodes
+    this->frames_since_keyframe_++;
+    if (this->sources_taken_ < this->samples_ && this->frames_since_keyframe_ % this->sample_every_ == 0)
+    {
+      Source& source = this->sources_[this->sources_taken_++];
+      source.pts = input_frame->pts;
+      libyuv::CopyPlane(input_frame->data[0], input_frame->linesize[0],
+                        source.luma.data(), this->width_, this->width_, this->height_);
+    }
+  }
+}
+
+void QualityMonitor::on_packet(const AVPacket* pkt) {
+  this->bytes_.fetch_add(pkt->size, std::memory_order_relaxed);
+
+  if (this->measuring_.load(std::memory_order_acquire))
+  {
+    return;
+  }
+
+  if (this->state_ == State::WaitingKeyframe && (pkt->flags & AV_PKT_FLAG_KEY))
+  {
+    this->state_ = State::Capturing;
+    this->frames_since_keyframe_ = 0;
+    this->sources_taken_ = 0;
+    this->packets_taken_ = 0;
+  }
+  if (this->state_ != State::Capturing)
+  {
+    return;
+  }
+
+  // An encoder that holds frames back longer than a second, or skipped
+  // frames, never deliver the last sample; the measurement is given up
+  if (this->packets_taken_ >= this->samples_ * this->sample_every_ + this->frame_rate_)
+  {
+    this->state_ = State::Idle;
+    this->next_start_ = Clock::now() + this->sample_interval_;
+    return;
+  }
+
+  if (this->packets_taken_ == (int)this->packets_.size())
+  {
+    this->packets_.emplace_back();
+  }
+  Packet& packet = this->packets_[this->packets_taken_++];
+  // Decoders read past the end, the padding must be zero
+  packet.data.resize(std::max(packet.data.size(), (size_t)pkt->size + AV_INPUT_BUFFER_PADDING_SIZE));
+  memcpy(packet.data.data(), pkt->data, pkt->size);
+  memset(packet.data.data() + pkt->size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+  packet.size = pkt->size;
+  packet.pts = pkt->pts;
+  packet.flags = pkt->flags;
+
+  if (this->sources_taken_ == this->samples_ && pkt->pts >= this->sources_[this->samples_ - 1].pts)
+  {
+    this->state_ = State::Idle;
+    this->next_start_ = Clock::now() + this->sample_interval_;
+    // Without the lock, a missed wakeup only delays the measurement by the
+    // monitor's poll interval
+    this->measuring_.store(true, std::memory_order_release);
+    this->cv_measure_.notify_one();
+  }
+}
+
+int64_t QualityMonitor::get_target_bitrate() {
+  return this->target_bitrate_.load(std::memory_order_relaxed);
+}
+
+void QualityMonitor::set_bitrate(int64_t bitrate) {
+  this->target_bitrate_.store(bitrate, std::memory_order_relaxed);
+}
+
+void QualityMonitor::monitor_loop() {
+  apply_thread_placement("quality");
+
+  std::unique_lock<std::mutex> lock(this->mutex_);
+  while (true)
+  {
+    this->cv_measure_.wait_for(lock, std::chrono::milliseconds(100), [this] {
+      return this->stopping_ || this->measuring_.load(std::memory_order_acquire);
+    });
+    if (this->stopping_)
+    {
+      break;
+    }
+    if (!this->measuring_.load(std::memory_order_acquire))
+    {
+      continue;
+    }
+
+    lock.unlock();
+    measure();
+    this->measuring_.store(false, std::memory_order_release);
+    lock.lock();
+  }
+}
+
+bool QualityMonitor::open_decoder() {
+  if (this->decoder_ctx_ || this->decoder_failed_)
+  {
+    return !this->decoder_failed_;
+  }
+  this->decoder_failed_ = true;
+
+  const AVCodec* decoder = this->decoder_name_.empty() ? avcodec_find_decoder(this->codec_id_)
+                                                       : avcodec_find_decoder_by_name(this->decoder_name_.c_str());
+  if (!decoder)
+  {
+    fprintf(stderr, "Quality session %d: no decoder, quality is not measured\n", this->session_idx_);
+    return false;
+  }
+
+  this->decoder_ctx_ = avcodec_alloc_context3(decoder);
+  this->decoder_ctx_->width = this->width_;
+  this->decoder_ctx_->height = this->height_;
+  this->decoder_ctx_->thread_count = 1;
+  if (!this->extradata_.empty())
+  {
+    this->decoder_ctx_->extradata = (uint8_t*)av_mallocz(this->extradata_.size() + AV_INPUT_BUFFER_PADDING_SIZE);
+    memcpy(this->decoder_ctx_->extradata, this->extradata_.data(), this->extradata_.size());
+    this->decoder_ctx_->extradata_size = (int)this->extradata_.size();
+  }
+  if (avcodec_open2(this->decoder_ctx_, decoder, NULL) < 0)
+  {
+    fprintf(stderr, "Quality session %d: could not open decoder %s\n", this->session_idx_, decoder->name);
+    return false;
+  }
+
+  this->decode_pkt_ = av_packet_alloc();
+  this->decoded_ = av_frame_alloc();
+  this->decoder_failed_ = false;
+  return true;
+}
+
+void QualityMonitor::measure() {
+  if (!open_decoder())
+  {
+    return;
+  }
+  avcodec_flush_buffers(this->decoder_ctx_);
+
+  double psnr_sum = 0.0;
+  double ssim_sum = 0.0;
+  int compared = 0;
+
+  auto compare_decoded = [&]() {
+    while (avcodec_receive_frame(this->decoder_ctx_, this->decoded_) == 0)
+    {
+      // Every 4:2:0 decoder output starts with a full resolution 8 bit luma plane
+      for (const Source& source : this->sources_)
+      {
+        if (source.pts != this->decoded_->pts || this->decoded_->width != this->width_ ||
+            this->decoded_->height != this->height_)
+        {
+          continue;
+        }
+        psnr_sum += libyuv::CalcFramePsnr(source.luma.data(), this->width_,
+                                          this->decoded_->data[0], this->decoded_->linesize[0],
+                                          this->width_, this->height_);
+        ssim_sum += libyuv::CalcFrameSsim(source.luma.data(), this->width_,
+                                          this->decoded_->data[0], this->decoded_->linesize[0],
+                                          this->width_, this->height_);
+        compared++;
+      }
+      av_frame_unref(this->decoded_);
+    }
+  };
+
+  for (int idx = 0; idx < this->packets_taken_; idx++)
+  {
+    const Packet& packet = this->packets_[idx];
+    this->decode_pkt_->data = const_cast<uint8_t*>(packet.data.data());
+    this->decode_pkt_->size = packet.size;
+    this->decode_pkt_->pts = packet.pts;
+    this->decode_pkt_->dts = packet.pts;
+    this->decode_pkt_->flags = packet.flags;
+    if (avcodec_send_packet(this->decoder_ctx_, this->decode_pkt_) < 0)
+    {
+      fprintf(stderr, "Quality session %d: error decoding frame %ld\n", this->session_idx_, (long)packet.pts);
+    }
+    compare_decoded();
+  }
+  this->decode_pkt_->data = nullptr;
+  this->decode_pkt_->size = 0;
+  avcodec_send_packet(this->decoder_ctx_, NULL);
+  compare_decoded();
+
+  if (compared == 0)
+  {
+    fprintf(stderr, "Quality session %d: no sampled frame could be decoded\n", this->session_idx_);
+    return;
+  }
+
+  double psnr = psnr_sum / compared;
+  double ssim = ssim_sum / compared;
+
+  auto now = Clock::now();
+  int64_t bytes = this->bytes_.load(std::memory_order_relaxed);
+  double seconds = std::chrono::duration<double>(now - this->last_measured_).count();
+  double actual_bps = seconds > 0 ? (bytes - this->last_bytes_) * 8 / seconds : 0.0;
+  this->last_measured_ = now;
+  this->last_bytes_ = bytes;
+
+  // Raised faster than lowered, a recording below target is worse than a
+  // few extra bytes
+  int64_t bitrate = this->target_bitrate_.load(std::memory_order_relaxed);
+  int64_t next_bitrate = bitrate;
+  double quality = this->use_ssim_ ? ssim : psnr;
+  if (this->adjust_bitrate_ && quality < this->target_ - this->tolerance_)
+  {
+    next_bitrate = std::min(this->max_bitrate_, (int64_t)(bitrate * this->increase_factor_));
+  }
+  else if (this->adjust_bitrate_ && quality > this->target_ + this->tolerance_)
+  {
+    next_bitrate = std::max(this->min_bitrate_, (int64_t)(bitrate * this->decrease_factor_));
+  }
+  this->target_bitrate_.store(next_bitrate, std::memory_order_relaxed);
+
+  double mbit = 1024 * 1024;
+  double gb_per_hour = actual_bps / 8 * 3600 / 1e9;
+  printf("Quality session %d: psnr %.2f dB, ssim %.4f at %.2f Mbit/s (%.2f actual, %.2f GB per hour)",
+         this->session_idx_, psnr, ssim, bitrate / mbit, actual_bps / mbit, gb_per_hour);
+  if (next_bitrate != bitrate)
+  {
+    printf(", bitrate to %.2f Mbit/s", next_bitrate / mbit);
+  }
+  printf("\n");
+
+  this->log_ << this->sources_[0].pts << "," << psnr << "," << ssim << "," << bitrate / mbit << ","
+             << actual_bps / mbit << "," << gb_per_hour << "," << next_bitrate / mbit << std::endl;
+
+  this->measurements_++;
+  this->psnr_sum_ += psnr;
+  this->ssim_sum_ += ssim;
+}
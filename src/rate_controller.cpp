@@ -0,0 +1,174 @@
+#include "rate_controller.hpp"
+
+#include <algorithm>
+#include <iostream>
+
+#include <linux/sockios.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+
+RateController::RateController(Json::Value jsonRateConf,
+                               int64_t initial_bitrate,
+                               int frame_rate,
+                               int socket) {
+  this->socket_ = socket;
+  this->frame_rate_ = frame_rate;
+
+  // Bitrates are configured in Mbit/s like video_encoding.bitrate
+  this->target_latency_ms_ = jsonRateConf.get("target_latency_ms", 100).asDouble();
+  this->min_bitrate_ = jsonRateConf.get("min_bitrate", 1).asDouble() * 1024 * 1024;
+  this->max_bitrate_ = jsonRateConf.get("max_bitrate", 20).asDouble() * 1024 * 1024;
+  this->decrease_factor_ = jsonRateConf.get("decrease_factor", 0.8).asDouble();
+  this->increase_step_ = jsonRateConf.get("increase_step", 0.5).asDouble() * 1024 * 1024;
+  this->increase_interval_ms_ = jsonRateConf.get("increase_interval_ms", 500).asDouble();
+  this->max_frame_interval_ = jsonRateConf.get("max_frame_interval", 4).asInt();
+
+  this->decision_.bitrate = std::clamp(initial_bitrate, this->min_bitrate_, this->max_bitrate_);
+  this->last_change_ = Clock::now();
+  this->last_congestion_ = this->last_change_;
+  this->delivery_start_ = this->last_change_;
+}
+
+int RateController::get_send_queue_bytes() {
+  int queued = 0;
+  if (this->socket_ < 0 || ioctl(this->socket_, SIOCOUTQ, &queued) < 0)
+  {
+    return 0;
+  }
+  return queued;
+}
+
+double RateController::get_queue_delay_ms() {
+  double queue_delay_ms = get_send_queue_bytes() * 8.0 * 1000.0 / this->decision_.bitrate;
+
+  // Half the smoothed RTT approximates the one-way delay once data leaves the host
+  struct tcp_info info;
+  socklen_t info_len = sizeof(info);
+  if (this->socket_ >= 0 && getsockopt(this->socket_, IPPROTO_TCP, TCP_INFO, &info, &info_len) == 0)
+  {
+    queue_delay_ms += info.tcpi_rtt / 2000.0;
+  }
+
+  return queue_delay_ms;
+}
+
+double RateController::get_ack_latency_ms() {
+  return this->ack_latency_ms_;
+}
+
+int64_t RateController::get_delivery_rate() {
+  return (int64_t)this->delivery_rate_;
+}
+
+RateDecision RateController::on_frame(int64_t frame_count) {
+  Clock::time_point now = Clock::now();
+
+  double queue_delay_ms = get_queue_delay_ms();
+  double latency_ms = queue_delay_ms;
+  if (!this->in_flight_.empty())
+  {
+    // Ack latency only matters while data is outstanding, once everything is
+    // acked the link is idle. A receiver that stopped acking is as bad as a slow one.
+    double oldest_ms = std::chrono::duration<double, std::milli>(now - this->in_flight_.front().sent).count();
+    latency_ms = std::max(latency_ms, oldest_ms);
+    if (this->has_ack_)
+    {
+      latency_ms = std::max(latency_ms, this->ack_latency_ms_);
+    }
+  }
+
+  double since_change_ms = std::chrono::duration<double, std::milli>(now - this->last_change_).count();
+  double since_congestion_ms = std::chrono::duration<double, std::milli>(now - this->last_congestion_).count();
+
+  if (latency_ms > this->target_latency_ms_)
+  {
+    this->last_congestion_ = now;
+
+    // Give the previous change one target latency to take effect
+    if (since_change_ms > this->target_latency_ms_)
+    {
+      if (this->decision_.bitrate > this->min_bitrate_)
+      {
+        // While congested the link is the bottleneck, so what it delivered is
+        // its capacity and the bitrate goes straight below it
+        int64_t bitrate = (int64_t)(this->decision_.bitrate * this->decrease_factor_);
+        if (this->delivery_rate_ > 0)
+        {
+          bitrate = std::min(bitrate, (int64_t)(this->delivery_rate_ * this->decrease_factor_));
+        }
+        this->decision_.bitrate = std::max(this->min_bitrate_, bitrate);
+      }
+      else if (this->decision_.frame_interval < this->max_frame_interval_)
+      {
+        this->decision_.frame_interval++;
+      }
+      this->last_change_ = now;
+
+      std::cout << "Rate control: latency " << latency_ms << " ms, bitrate "
+                << this->decision_.bitrate / (1024 * 1024.0) << " Mbit/s, 1/"
+                << this->decision_.frame_interval << " frames, delivered "
+                << this->delivery_rate_ / (1024 * 1024.0) << " Mbit/s\n";
+    }
+  }
+  else if (since_congestion_ms > this->increase_interval_ms_ &&
+           since_change_ms > this->increase_interval_ms_)
+  {
+    if (this->decision_.frame_interval > 1)
+    {
+      this->decision_.frame_interval--;
+    }
+    else
+    {
+      // Probe in small steps on slow links so recovery does not overshoot them
+      int64_t step = std::min<int64_t>(this->increase_step_, this->decision_.bitrate / 10);
+      this->decision_.bitrate = std::min(this->max_bitrate_, this->decision_.bitrate + step);
+    }
+    this->last_change_ = now;
+  }
+
+  RateDecision decision = this->decision_;
+
+  // Frames are dropped before encoding, so the bitstream stays decodable.
+  // A deep local send queue drops outright rather than blocking in send_all.
+  decision.drop_frame = (frame_count % decision.frame_interval != 0) ||
+                        queue_delay_ms > 2 * this->target_latency_ms_;
+  return decision;
+}
+
+void RateController::on_packet_sent(int64_t packet_seq, size_t bytes) {
+  this->in_flight_.push_back({packet_seq, Clock::now(), bytes});
+
+  // Bound the history if the receiver never acks
+  while (this->in_flight_.size() > (size_t)std::max(1, this->frame_rate_) * 10)
+  {
+    this->in_flight_.pop_front();
+  }
+}
+
+void RateController::on_ack(int64_t packet_seq) {
+  Clock::time_point now = Clock::now();
+
+  while (!this->in_flight_.empty() && this->in_flight_.front().packet_seq <= packet_seq)
+  {
+    if (this->in_flight_.front().packet_seq == packet_seq)
+    {
+      double sample_ms = std::chrono::duration<double, std::milli>(now - this->in_flight_.front().sent).count();
+      this->ack_latency_ms_ = this->has_ack_ ? 0.8 * this->ack_latency_ms_ + 0.2 * sample_ms : sample_ms;
+      this->has_ack_ = true;
+    }
+    this->delivered_bytes_ += this->in_flight_.front().bytes;
+    this->in_flight_.pop_front();
+  }
+
+  // Acks come in bursts, so the rate is measured over at least 100 ms
+  double interval_ms = std::chrono::duration<double, std::milli>(now - this->delivery_start_).count();
+  if (interval_ms >= std::max(100.0, this->target_latency_ms_))
+  {
+    double sample = this->delivered_bytes_ * 8.0 * 1000.0 / interval_ms;
+    this->delivery_rate_ = this->delivery_rate_ > 0 ? 0.7 * this->delivery_rate_ + 0.3 * sample : sample;
+    this->delivered_bytes_ = 0;
+    this->delivery_start_ = now;
+  }
+}
@@ -0,0 +1,274 @@
+#include "raw_frame_store.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static size_t align_to_page(size_t size) {
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  return (size + page_size - 1) / page_size * page_size;
+}
+
+static bool write_fully(int fd, const uint8_t* data, size_t length) {
+  size_t bytes_written = 0;
+  while (bytes_written < length)
+  {
+    ssize_t result = write(fd, data + bytes_written, length - bytes_written);
+    if (result < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      fprintf(stderr, "Error writing raw frames: %s\n", strerror(errno));
+      return false;
+    }
+    bytes_written += result;
+  }
+  return true;
+}
+
+RawFrameWriter::RawFrameWriter(const std::string& output_file,
+                               int width,
+                               int height,
+                               int channels,
+                               size_t write_buffer_size) {
+  this->output_file_ = output_file;
+
+  memcpy(this->header_.magic, RAW_FRAME_MAGIC, sizeof(RAW_FRAME_MAGIC));
+  this->header_.version = RAW_FRAME_VERSION;
+  this->header_.header_size = RAW_FRAME_HEADER_SIZE;
+  this->header_.width = width;
+  this->header_.height = height;
+  this->header_.channels = channels;
+  this->header_.stride = width * channels;
+  this->header_.frame_size = (uint64_t)this->header_.stride * height;
+  this->header_.info_offset = (this->header_.frame_size + 7) / 8 * 8;
+  this->header_.slot_size = align_to_page(this->header_.info_offset + sizeof(RawFrameIndexEntry));
+
+  // Stage a whole number of slots so every write() stays page aligned
+  size_t slots = std::max<size_t>(1, write_buffer_size / this->header_.slot_size);
+  this->write_buffer_size_ = slots * this->header_.slot_size;
+}
+
+RawFrameWriter::~RawFrameWriter() {
+  if (this->fd_ >= 0)
+  {
+    close();
+  }
+  free(this->write_buffer_);
+}
+
+bool RawFrameWriter::open() {
+  if (posix_memalign((void**)&this->write_buffer_, sysconf(_SC_PAGESIZE), this->write_buffer_size_) != 0)
+  {
+    std::cerr << "Could not allocate raw frame write buffer\n";
+    return false;
+  }
+  memset(this->write_buffer_, 0, this->write_buffer_size_);
+
+  this->fd_ = ::open(this->output_file_.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (this->fd_ < 0)
+  {
+    perror("Could not open raw frame file");
+    return false;
+  }
+
+  // Header is rewritten with the final frame count on close
+  std::vector<uint8_t> header_page(RAW_FRAME_HEADER_SIZE, 0);
+  memcpy(header_page.data(), &this->header_, sizeof(this->header_));
+  if (!write_fully(this->fd_, header_page.data(), header_page.size()))
+  {
+    return false;
+  }
+
+  std::cout << "Raw frame recording to " << this->output_file_ << std::endl;
+  return true;
+}
+
+bool RawFrameWriter::write_frame(const uint8_t* data, int stride,
+                                 uint64_t frame_number, int64_t timestamp_us) {
+  if (this->fd_ < 0)
+  {
+    return false;
+  }
+
+  uint8_t* slot = this->write_buffer_ + this->write_buffer_used_;
+  for (uint32_t y = 0; y < this->header_.height; y++)
+  {
+    memcpy(slot + y * this->header_.stride, data + y * stride, this->header_.stride);
+  }
+  RawFrameIndexEntry entry = {frame_number, timestamp_us};
+  memcpy(slot + this->header_.info_offset, &entry, sizeof(entry));
+  this->write_buffer_used_ += this->header_.slot_size;
+  this->header_.frame_count++;
+
+  if (this->write_buffer_used_ == this->write_buffer_size_)
+  {
+    return flush_buffer();
+  }
+  return true;
+}
+
+bool RawFrameWriter::flush_buffer() {
+  if (this->write_buffer_used_ == 0)
+  {
+    return true;
+  }
+
+  bool result = write_fully(this->fd_, this->write_buffer_, this->write_buffer_used_);
+  this->write_buffer_used_ = 0;
+  return result;
+}
+
+bool RawFrameWriter::close() {
+  if (this->fd_ < 0)
+  {
+    return false;
+  }
+
+  bool result = flush_buffer();
+  result = result && pwrite(this->fd_, &this->header_, sizeof(this->header_), 0) == sizeof(this->header_);
+
+  ::close(this->fd_);
+  this->fd_ = -1;
+
+  std::cout << "Raw frame recording closed with " << this->header_.frame_count << " frames\n";
+  return result;
+}
+
+uint64_t RawFrameWriter::get_frame_count() const {
+  return this->header_.frame_count;
+}
+
+RawFrameReader::RawFrameReader(const std::string& input_file) {
+  this->input_file_ = input_file;
+}
+
+RawFrameReader::~RawFrameReader() {
+  close();
+}
+
+bool RawFrameReader::open() {
+  this->fd_ = ::open(this->input_file_.c_str(), O_RDONLY);
+  if (this->fd_ < 0)
+  {
+    perror("Could not open raw frame file");
+    return false;
+  }
+
+  struct stat file_stat;
+  if (fstat(this->fd_, &file_stat) < 0 || (size_t)file_stat.st_size < RAW_FRAME_HEADER_SIZE)
+  {
+    std::cerr << "Raw frame file is truncated\n";
+    close();
+    return false;
+  }
+  this->mapped_size_ = file_stat.st_size;
+
+  void* mapped = mmap(nullptr, this->mapped_size_, PROT_READ, MAP_SHARED, this->fd_, 0);
+  if (mapped == MAP_FAILED)
+  {
+    perror("Could not map raw frame file");
+    close();
+    return false;
+  }
+  this->mapped_ = (uint8_t*)mapped;
+
+  // Access pattern is seek-driven, readahead would only waste page cache
+  madvise(this->mapped_, this->mapped_size_, MADV_RANDOM);
+
+  memcpy(&this->header_, this->mapped_, sizeof(this->header_));
+  if (memcmp(this->header_.magic, RAW_FRAME_MAGIC, sizeof(RAW_FRAME_MAGIC)) != 0 ||
+      this->header_.version != RAW_FRAME_VERSION ||
+      this->header_.slot_size < this->header_.info_offset + sizeof(RawFrameIndexEntry))
+  {
+    std::cerr << "Not a raw frame file: " << this->input_file_ << std::endl;
+    close();
+    return false;
+  }
+
+  // Writer did not finish, every complete slot still carries its timestamp
+  uint64_t complete_slots = (this->mapped_size_ - this->header_.header_size) / this->header_.slot_size;
+  if (this->header_.frame_count == 0 || this->header_.frame_count > complete_slots)
+  {
+    this->header_.frame_count = complete_slots;
+    std::cerr << "Raw frame file was not closed, recovered " << complete_slots << " frames\n";
+  }
+
+  return true;
+}
+
+void RawFrameReader::close() {
+  if (this->mapped_)
+  {
+    munmap(this->mapped_, this->mapped_size_);
+    this->mapped_ = nullptr;
+  }
+  if (this->fd_ >= 0)
+  {
+    ::close(this->fd_);
+    this->fd_ = -1;
+  }
+}
+
+uint64_t RawFrameReader::get_frame_count() const {
+  return this->header_.frame_count;
+}
+
+const RawFrameFileHeader& RawFrameReader::get_header() const {
+  return this->header_;
+}
+
+const uint8_t* RawFrameReader::get_frame(uint64_t idx) const {
+  if (idx >= this->header_.frame_count)
+  {
+    return nullptr;
+  }
+  return this->mapped_ + this->header_.header_size + idx * this->header_.slot_size;
+}
+
+const RawFrameIndexEntry& RawFrameReader::get_index_entry(uint64_t idx) const {
+  if (idx >= this->header_.frame_count)
+  {
+    throw std::out_of_range("Index out of range");
+  }
+  return *(const RawFrameIndexEntry*)(get_frame(idx) + this->header_.info_offset);
+}
+
+bool RawFrameReader::find_frame_by_timestamp(int64_t timestamp_us, uint64_t* idx) const {
+  // Frames without a timestamp (-1) would make every search end at the last frame
+  uint64_t count = this->header_.frame_count;
+  if (count == 0 || get_index_entry(0).timestamp_us < 0)
+  {
+    std::cerr << "Raw frame recording " << this->input_file_ << " has no capture timestamps\n";
+    return false;
+  }
+
+  // Binary search over the slots, touching one page per step
+  uint64_t low = 0;
+  uint64_t high = count;
+  while (low < high)
+  {
+    uint64_t mid = low + (high - low) / 2;
+    if (get_index_entry(mid).timestamp_us < timestamp_us)
+    {
+      low = mid + 1;
+    }
+    else
+    {
+      high = mid;
+    }
+  }
+  *idx = low;
+  return true;
+}
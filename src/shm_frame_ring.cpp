@@ -0,0 +1,296 @@
+#include "shm_frame_ring.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static size_t align_to_page(size_t size) {
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  return (size + page_size - 1) / page_size * page_size;
+}
+
+int64_t shm_monotonic_ns() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+ShmFrameWriter::ShmFrameWriter(const std::string& name,
+                               int camera_idx,
+                               int width,
+                               int height,
+                               int channels,
+                               int slot_count) {
+  this->name_ = name;
+  this->camera_idx_ = camera_idx;
+  this->width_ = width;
+  this->height_ = height;
+  this->channels_ = channels;
+  this->slot_count_ = std::max(2, slot_count);
+  this->frame_size_ = (size_t)width * height * channels;
+  this->slot_size_ = align_to_page(SHM_SLOT_HEADER_SIZE + this->frame_size_);
+}
+
+ShmFrameWriter::~ShmFrameWriter() {
+  if (!this->base_)
+  {
+    return;
+  }
+
+  // Readers still mapping the ring keep it until they unmap
+  this->header_->closed.store(1, std::memory_order_release);
+  munmap(this->base_, this->mapped_size_);
+  shm_unlink(this->name_.c_str());
+}
+
+bool ShmFrameWriter::open() {
+  // A ring left behind by a crashed run may have another size
+  shm_unlink(this->name_.c_str());
+  int fd = shm_open(this->name_.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+  if (fd < 0)
+  {
+    fprintf(stderr, "Could not create shared memory %s: %s\n", this->name_.c_str(), strerror(errno));
+    return false;
+  }
+
+  this->mapped_size_ = SHM_RING_HEADER_SIZE + this->slot_count_ * this->slot_size_;
+  if (ftruncate(fd, this->mapped_size_) < 0)
+  {
+    fprintf(stderr, "Could not size shared memory %s: %s\n", this->name_.c_str(), strerror(errno));
+    close(fd);
+    shm_unlink(this->name_.c_str());
+    return false;
+  }
+
+  void* base = mmap(nullptr, this->mapped_size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED)
+  {
+    fprintf(stderr, "Could not map shared memory %s: %s\n", this->name_.c_str(), strerror(errno));
+    shm_unlink(this->name_.c_str());
+    return false;
+  }
+  this->base_ = (uint8_t*)base;
+
+  // The new object is zero filled: every slot version is 0, nothing published.
+  // The magic goes last, readers opening the ring earlier wait for it.
+  this->header_ = (ShmRingHeader*)this->base_;
+  this->header_->version = SHM_RING_VERSION;
+  this->header_->header_size = SHM_RING_HEADER_SIZE;
+  this->header_->camera_idx = this->camera_idx_;
+  this->header_->width = this->width_;
+  this->header_->height = this->height_;
+  this->header_->channels = this->channels_;
+  this->header_->stride = this->width_ * this->channels_;
+  this->header_->slot_count = this->slot_count_;
+  this->header_->frame_size = this->frame_size_;
+  this->header_->slot_size = this->slot_size_;
+  this->header_->writer_pid = getpid();
+  std::atomic_thread_fence(std::memory_order_release);
+  memcpy(this->header_->magic, SHM_RING_MAGIC, sizeof(SHM_RING_MAGIC));
+
+  std::cout << "Camera " << this->camera_idx_ << " frames published to /dev/shm" << this->name_
+            << " (" << this->slot_count_ << " slots, "
+            << this->mapped_size_ / (1024 * 1024) << " MB)" << std::endl;
+  return true;
+}
+
+void ShmFrameWriter::publish(const uint8_t* data, const ShmFrameInfo& info) {
+  if (!this->base_)
+  {
+    return;
+  }
+
+  uint64_t sequence = ++this->sequence_;
+  uint8_t* slot_base = this->base_ + SHM_RING_HEADER_SIZE + ((sequence - 1) % this->slot_count_) * this->slot_size_;
+  ShmSlotHeader* slot = (ShmSlotHeader*)slot_base;
+
+  // Odd version first, so a reader that sees any of the new bytes also sees
+  // that the slot changed
+  slot->version.store(2 * sequence - 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  slot->frame_number = info.frame_number;
+  slot->sensor_timestamp_us = info.sensor_timestamp_us;
+  slot->aligned_timestamp_us = info.aligned_timestamp_us;
+  slot->exposure_us = info.exposure_us;
+  slot->gain_db = info.gain_db;
+  memcpy(slot_base + SHM_SLOT_HEADER_SIZE, data, this->frame_size_);
+  slot->publish_time_ns = shm_monotonic_ns();
+
+  slot->version.store(2 * sequence, std::memory_order_release);
+  this->header_->write_sequence.store(sequence, std::memory_order_release);
+}
+
+uint64_t ShmFrameWriter::get_sequence() {
+  return this->sequence_;
+}
+
+ShmFrameReader::ShmFrameReader(const std::string& name) {
+  this->name_ = name;
+}
+
+ShmFrameReader::~ShmFrameReader() {
+  if (this->base_)
+  {
+    munmap((void*)this->base_, this->mapped_size_);
+  }
+}
+
+bool ShmFrameReader::open() {
+  int fd = shm_open(this->name_.c_str(), O_RDONLY, 0);
+  if (fd < 0)
+  {
+    fprintf(stderr, "Could not open shared memory %s: %s\n", this->name_.c_str(), strerror(errno));
+    return false;
+  }
+
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) < 0 || (size_t)file_stat.st_size < SHM_RING_HEADER_SIZE)
+  {
+    std::cerr << "Shared memory " << this->name_ << " is not a frame ring\n";
+    close(fd);
+    return false;
+  }
+  this->mapped_size_ = file_stat.st_size;
+
+  void* base = mmap(nullptr, this->mapped_size_, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED)
+  {
+    fprintf(stderr, "Could not map shared memory %s: %s\n", this->name_.c_str(), strerror(errno));
+    return false;
+  }
+  this->base_ = (const uint8_t*)base;
+  this->header_ = (const ShmRingHeader*)base;
+
+  std::atomic_thread_fence(std::memory_order_acquire);
+  if (memcmp(this->header_->magic, SHM_RING_MAGIC, sizeof(SHM_RING_MAGIC)) != 0 ||
+      this->header_->version != SHM_RING_VERSION ||
+      SHM_RING_HEADER_SIZE + this->header_->slot_count * this->header_->slot_size > this->mapped_size_)
+  {
+    std::cerr << "Shared memory " << this->name_ << " is not a frame ring or not ready yet\n";
+    munmap(base, this->mapped_size_);
+    this->base_ = nullptr;
+    this->header_ = nullptr;
+    return false;
+  }
+
+  // Start with the oldest frame still in the ring
+  uint64_t latest = get_latest_sequence();
+  this->next_sequence_ = latest >= this->header_->slot_count ? latest - this->header_->slot_count + 1 : 1;
+  return true;
+}
+
+const ShmRingHeader* ShmFrameReader::get_header() {
+  return this->header_;
+}
+
+uint64_t ShmFrameReader::get_latest_sequence() {
+  return this->header_->write_sequence.load(std::memory_order_acquire);
+}
+
+bool ShmFrameReader::is_writer_closed() {
+  return this->header_->closed.load(std::memory_order_acquire) != 0;
+}
+
+const ShmSlotHeader* ShmFrameReader::get_slot(uint64_t sequence) {
+  return (const ShmSlotHeader*)(this->base_ + SHM_RING_HEADER_SIZE +
+                                ((sequence - 1) % this->header_->slot_count) * this->header_->slot_size);
+}
+
+bool ShmFrameReader::acquire(uint64_t sequence, ShmFrameView* view) {
+  if (sequence == 0)
+  {
+    return false;
+  }
+
+  const ShmSlotHeader* slot = get_slot(sequence);
+  if (slot->version.load(std::memory_order_acquire) != 2 * sequence)
+  {
+    return false;
+  }
+
+  view->sequence = sequence;
+  view->data = (const uint8_t*)slot + SHM_SLOT_HEADER_SIZE;
+  view->publish_time_ns = slot->publish_time_ns;
+  view->info.camera_idx = this->header_->camera_idx;
+  view->info.frame_number = slot->frame_number;
+  view->info.sensor_timestamp_us = slot->sensor_timestamp_us;
+  view->info.aligned_timestamp_us = slot->aligned_timestamp_us;
+  view->info.exposure_us = slot->exposure_us;
+  view->info.gain_db = slot->gain_db;
+
+  // The metadata read above must not have been torn either
+  return validate(*view);
+}
+
+bool ShmFrameReader::validate(const ShmFrameView& view) {
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return get_slot(view.sequence)->version.load(std::memory_order_relaxed) == 2 * view.sequence;
+}
+
+bool ShmFrameReader::read_next(ShmFrameView* view) {
+  uint64_t latest = get_latest_sequence();
+  uint32_t slot_count = this->header_->slot_count;
+  while (this->next_sequence_ <= latest)
+  {
+    // Frames more than a ring behind are gone, also when the slot is being
+    // rewritten right now
+    if (latest - this->next_sequence_ >= slot_count)
+    {
+      uint64_t oldest = latest - slot_count + 1;
+      this->lost_frames_ += oldest - this->next_sequence_;
+      this->next_sequence_ = oldest;
+    }
+
+    uint64_t sequence = this->next_sequence_++;
+    if (acquire(sequence, view))
+    {
+      return true;
+    }
+    this->lost_frames_++;
+    latest = get_latest_sequence();
+  }
+  return false;
+}
+
+void ShmFrameReader::skip_to_latest() {
+  this->next_sequence_ = std::max<uint64_t>(1, get_latest_sequence());
+}
+
+bool ShmFrameReader::copy_latest(std::vector<uint8_t>* data, ShmFrameView* view) {
+  data->resize(this->header_->frame_size);
+  while (true)
+  {
+    uint64_t latest = get_latest_sequence();
+    if (!acquire(latest, view))
+    {
+      // Nothing published yet, otherwise the writer moved on meanwhile
+      if (latest == 0)
+      {
+        return false;
+      }
+      continue;
+    }
+
+    memcpy(data->data(), view->data, data->size());
+    if (validate(*view))
+    {
+      view->data = data->data();
+      return true;
+    }
+  }
+}
+
+uint64_t ShmFrameReader::get_lost_frames() {
+  return this->lost_frames_;
+}
@@ -0,0 +1,135 @@
+#include "shutdown_coordinator.hpp"
+
+#include <poll.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+
+ShutdownCoordinator::ShutdownCoordinator() {
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGTERM);
+
+  // Threads inherit the mask, so the signals only ever reach the signalfd
+  pthread_sigmask(SIG_BLOCK, &mask, nullptr);
+
+  this->signal_fd_ = signalfd(-1, &mask, SFD_CLOEXEC);
+  if (this->signal_fd_ < 0)
+  {
+    perror("signalfd");
+  }
+
+  this->stop_fd_ = eventfd(0, EFD_CLOEXEC);
+  this->finished_fd_ = eventfd(0, EFD_CLOEXEC);
+}
+
+ShutdownCoordinator::~ShutdownCoordinator() {
+  finished();
+  if (this->watchdog_thread_.joinable())
+  {
+    this->watchdog_thread_.join();
+  }
+
+  for (int fd : {this->signal_fd_, this->stop_fd_, this->finished_fd_})
+  {
+    if (fd >= 0)
+    {
+      close(fd);
+    }
+  }
+}
+
+int ShutdownCoordinator::wait_for_stop() {
+  struct pollfd fds[2] = {{this->signal_fd_, POLLIN, 0}, {this->stop_fd_, POLLIN, 0}};
+
+  while (poll(fds, 2, -1) < 0)
+  {
+    if (errno != EINTR)
+    {
+      perror("poll");
+      break;
+    }
+  }
+
+  this->stop_requested_ = true;
+
+  if (fds[0].revents & POLLIN)
+  {
+    struct signalfd_siginfo info;
+    if (read(this->signal_fd_, &info, sizeof(info)) == sizeof(info))
+    {
+      return info.ssi_signo;
+    }
+  }
+  return 0;
+}
+
+void ShutdownCoordinator::request_stop() {
+  this->stop_requested_ = true;
+
+  uint64_t one = 1;
+  if (write(this->stop_fd_, &one, sizeof(one)) < 0)
+  {
+    perror("eventfd write");
+  }
+}
+
+bool ShutdownCoordinator::stop_requested() {
+  return this->stop_requested_;
+}
+
+void ShutdownCoordinator::start_deadline(std::chrono::milliseconds deadline) {
+  if (!this->watchdog_thread_.joinable())
+  {
+    this->watchdog_thread_ = std::thread(&ShutdownCoordinator::watchdog_loop, this, deadline);
+  }
+}
+
+void ShutdownCoordinator::finished() {
+  uint64_t one = 1;
+  if (this->finished_fd_ >= 0 && write(this->finished_fd_, &one, sizeof(one)) < 0)
+  {
+    perror("eventfd write");
+  }
+}
+
+void ShutdownCoordinator::watchdog_loop(std::chrono::milliseconds deadline) {
+  auto expiry = std::chrono::steady_clock::now() + deadline;
+  struct pollfd fds[2] = {{this->finished_fd_, POLLIN, 0}, {this->signal_fd_, POLLIN, 0}};
+
+  while (true)
+  {
+    auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+      expiry - std::chrono::steady_clock::now()).count();
+    if (remaining <= 0)
+    {
+      // Files that were not finalized are lost either way, stop now rather than hang
+      std::cerr << "Shutdown did not finish within " << deadline.count() << " ms, exiting\n";
+      _exit(1);
+    }
+
+    int ret = poll(fds, 2, remaining);
+    if (ret < 0 && errno != EINTR)
+    {
+      perror("poll");
+      return;
+    }
+    if (fds[0].revents & POLLIN)
+    {
+      return;
+    }
+    if (fds[1].revents & POLLIN)
+    {
+      std::cerr << "Second interrupt, exiting immediately\n";
+      _exit(130);
+    }
+  }
+}
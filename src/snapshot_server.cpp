@@ -0,0 +1,290 @@
+#include "snapshot_server.hpp"
+
+#include "load_shedder.hpp"
+#include "thread_placement.hpp"
+
+#include <opencv2/opencv.hpp>
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+
+// Requests are short, a longer line is a client that is not speaking the protocol
+static const size_t kMaxLineLength = 1024;
+
+SnapshotServer::SnapshotServer(Json::Value jsonSnapshotConf, LoadShedder* frames, int num_cameras) {
+  this->frames_ = frames;
+  this->snapshots_.resize(num_cameras);
+  this->socket_path_ = jsonSnapshotConf.get("socket_path", "/tmp/camera_snapshot.sock").asString();
+  this->max_width_ = jsonSnapshotConf.get("max_width", 640).asInt();
+
+  if (jsonSnapshotConf.get("format", "jpeg").asString() == "png")
+  {
+    this->extension_ = ".png";
+    this->encode_params_ = {cv::IMWRITE_PNG_COMPRESSION, 1};
+  }
+  else
+  {
+    this->encode_params_ = {cv::IMWRITE_JPEG_QUALITY, jsonSnapshotConf.get("jpeg_quality", 80).asInt()};
+  }
+
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (this->socket_path_.size() >= sizeof(address.sun_path))
+  {
+    std::cerr << "Snapshot socket path too long: " << this->socket_path_ << std::endl;
+    return;
+  }
+  strncpy(address.sun_path, this->socket_path_.c_str(), sizeof(address.sun_path) - 1);
+
+  this->listen_fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (this->listen_fd_ < 0)
+  {
+    perror("snapshot socket");
+    return;
+  }
+
+  // A socket file left behind by a previous run would make bind fail
+  unlink(this->socket_path_.c_str());
+  if (bind(this->listen_fd_, (struct sockaddr*)&address, sizeof(address)) < 0 ||
+      listen(this->listen_fd_, 4) < 0)
+  {
+    perror("snapshot socket bind");
+    close(this->listen_fd_);
+    this->listen_fd_ = -1;
+    return;
+  }
+
+  this->wake_fd_ = eventfd(0, EFD_CLOEXEC);
+  this->serve_thread_ = std::thread(&SnapshotServer::serve_loop, this);
+
+  std::cout << "Snapshots served on " << this->socket_path_ << std::endl;
+}
+
+SnapshotServer::~SnapshotServer() {
+  if (this->serve_thread_.joinable())
+  {
+    uint64_t one = 1;
+    if (write(this->wake_fd_, &one, sizeof(one)) < 0)
+    {
+      perror("eventfd write");
+    }
+    this->serve_thread_.join();
+  }
+
+  if (this->listen_fd_ >= 0)
+  {
+    close(this->listen_fd_);
+    unlink(this->socket_path_.c_str());
+  }
+  if (this->wake_fd_ >= 0)
+  {
+    close(this->wake_fd_);
+  }
+}
+
+bool SnapshotServer::is_open() {
+  return this->listen_fd_ >= 0;
+}
+
+// Writes everything or fails, images are larger than one socket buffer
+static bool send_all(int fd, const char* data, size_t size) {
+  while (size > 0)
+  {
+    // A client that went away must not take the process down with SIGPIPE
+    ssize_t sent = send(fd, data, size, MSG_NOSIGNAL);
+    if (sent < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    if (sent <= 0)
+    {
+      return false;
+    }
+    data += sent;
+    size -= sent;
+  }
+  return true;
+}
+
+void SnapshotServer::serve_loop() {
+  apply_thread_placement("snapshot");
+
+  struct Client {
+    int fd;
+    std::string buffer;
+  };
+  std::vector<Client> clients;
+
+  while (true)
+  {
+    std::vector<struct pollfd> fds = {{this->wake_fd_, POLLIN, 0}, {this->listen_fd_, POLLIN, 0}};
+    for (const Client& client : clients)
+    {
+      fds.push_back({client.fd, POLLIN, 0});
+    }
+
+    if (poll(fds.data(), fds.size(), -1) < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      perror("snapshot poll");
+      break;
+    }
+
+    if (fds[0].revents & POLLIN)
+    {
+      break;
+    }
+
+    if (fds[1].revents & POLLIN)
+    {
+      int client_fd = accept4(this->listen_fd_, NULL, NULL, SOCK_CLOEXEC);
+      if (client_fd >= 0)
+      {
+        // A client that stops reading must not stall the other cameras' requests
+        struct timeval timeout = {1, 0};
+        setsockopt(client_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        clients.push_back({client_fd, ""});
+      }
+    }
+
+    // Clients accepted above were not polled yet and are skipped this round
+    for (size_t i = 0; i + 2 < fds.size(); i++)
+    {
+      Client& client = clients[i];
+      if (!(fds[i + 2].revents & (POLLIN | POLLHUP | POLLERR)))
+      {
+        continue;
+      }
+
+      char buffer[256];
+      ssize_t received = recv(client.fd, buffer, sizeof(buffer), 0);
+      if (received <= 0)
+      {
+        close(client.fd);
+        client.fd = -1;
+        continue;
+      }
+      client.buffer.append(buffer, received);
+
+      size_t line_end;
+      while (client.fd >= 0 && (line_end = client.buffer.find('\n')) != std::string::npos)
+      {
+        std::string reply;
+        handle_request(client.buffer.substr(0, line_end), &reply);
+        client.buffer.erase(0, line_end + 1);
+
+        if (!send_all(client.fd, reply.data(), reply.size()))
+        {
+          close(client.fd);
+          client.fd = -1;
+        }
+      }
+
+      if (client.fd >= 0 && client.buffer.size() > kMaxLineLength)
+      {
+        close(client.fd);
+        client.fd = -1;
+      }
+    }
+
+    std::vector<Client> open_clients;
+    for (Client& client : clients)
+    {
+      if (client.fd >= 0)
+      {
+        open_clients.push_back(client);
+      }
+    }
+    clients.swap(open_clients);
+  }
+
+  for (const Client& client : clients)
+  {
+    close(client.fd);
+  }
+}
+
+void SnapshotServer::handle_request(const std::string& line, std::string* reply) {
+  std::istringstream tokens(line);
+  std::string command, index_token;
+  tokens >> command >> index_token;
+
+  if (command != "get" || index_token.empty())
+  {
+    *reply = "error usage: get <camera>\n";
+    return;
+  }
+
+  char* end = nullptr;
+  long idx = strtol(index_token.c_str(), &end, 10);
+  if (*end != '\0' || idx < 0 || idx >= (long)this->snapshots_.size())
+  {
+    *reply = "error no camera " + index_token + "\n";
+    return;
+  }
+
+  refresh(idx);
+
+  const Snapshot& snapshot = this->snapshots_[idx];
+  if (snapshot.encoded.empty())
+  {
+    *reply = "error no frame yet\n";
+    return;
+  }
+
+  *reply = "ok " + std::to_string(snapshot.encoded.size()) + " " + std::to_string(snapshot.frame_number) +
+           " " + std::to_string(snapshot.timestamp_us) + "\n";
+  reply->append((const char*)snapshot.encoded.data(), snapshot.encoded.size());
+}
+
+void SnapshotServer::refresh(int idx) {
+  CameraFrame frame;
+  if (!this->frames_->take_latest(idx, &frame))
+  {
+    return;
+  }
+
+  Snapshot& snapshot = this->snapshots_[idx];
+  if (frame.frame_number != snapshot.frame_number || snapshot.encoded.empty())
+  {
+    cv::Mat image(frame.height, frame.width, CV_8UC3, frame.data);
+    cv::Mat scaled;
+    if (this->max_width_ > 0 && frame.width > this->max_width_)
+    {
+      int height = std::max(1, (int)((int64_t)frame.height * this->max_width_ / frame.width));
+      cv::resize(image, scaled, cv::Size(this->max_width_, height), 0, 0, cv::INTER_AREA);
+    }
+    else
+    {
+      scaled = image;
+    }
+
+    if (cv::imencode(this->extension_, scaled, snapshot.encoded, this->encode_params_))
+    {
+      snapshot.frame_number = frame.frame_number;
+      snapshot.timestamp_us = frame.aligned_timestamp_us;
+    }
+    else
+    {
+      snapshot.encoded.clear();
+    }
+  }
+
+  // The frame stays in the slot for the next request unless a newer one took its place
+  this->frames_->return_latest(idx, frame);
+}
@@ -0,0 +1,271 @@
+#include "soak_monitor.hpp"
+
+#include <dirent.h>
+#include <malloc.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <iostream>
+
+namespace {
+
+constexpr int kStages = (int)LatencyStage::Count;
+
+int64_t count_entries(const char* path) {
+  DIR* dir = opendir(path);
+  if (!dir)
+  {
+    return -1;
+  }
+  int64_t entries = 0;
+  while (dirent* entry = readdir(dir))
+  {
+    entries += entry->d_name[0] != '.';
+  }
+  closedir(dir);
+  return entries;
+}
+
+int64_t read_rss_kb() {
+  FILE* file = fopen("/proc/self/statm", "r");
+  if (!file)
+  {
+    return -1;
+  }
+  long size_pages = 0;
+  long resident_pages = 0;
+  int fields = fscanf(file, "%ld %ld", &size_pages, &resident_pages);
+  fclose(file);
+  if (fields != 2)
+  {
+    return -1;
+  }
+  return (int64_t)resident_pages * sysconf(_SC_PAGESIZE) / 1024;
+}
+
+}
+
+SoakMonitor::SoakMonitor(Json::Value jsonSoakConf, std::function<void()> on_duration_reached)
+  : on_duration_reached_(std::move(on_duration_reached)) {
+  this->duration_s_ = jsonSoakConf.get("duration_s", 43200).asDouble();
+  this->sample_interval_s_ = std::max(1.0, jsonSoakConf.get("sample_interval_s", 10).asDouble());
+  this->warmup_s_ = jsonSoakConf.get("warmup_s", 120).asDouble();
+  this->drift_windows_ = std::max(1, jsonSoakConf.get("drift_windows", 6).asInt());
+  this->max_rss_growth_mb_ = jsonSoakConf.get("max_rss_growth_mb", 32).asDouble();
+  this->max_heap_growth_mb_ = jsonSoakConf.get("max_heap_growth_mb", 16).asDouble();
+  this->max_live_allocation_growth_ = jsonSoakConf.get("max_live_allocation_growth", 1000).asDouble();
+  this->max_fd_growth_ = jsonSoakConf.get("max_fd_growth", 0).asDouble();
+  this->max_thread_growth_ = jsonSoakConf.get("max_thread_growth", 0).asDouble();
+  this->max_latency_ratio_ = jsonSoakConf.get("max_latency_ratio", 1.5).asDouble();
+  this->latency_slack_us_ = jsonSoakConf.get("latency_slack_us", 500).asDouble();
+  this->min_throughput_ratio_ = jsonSoakConf.get("min_throughput_ratio", 0.95).asDouble();
+
+  std::string output_path = jsonSoakConf.get("output_path", "../soak.csv").asString();
+  this->csv_.open(output_path);
+  if (!this->csv_)
+  {
+    std::cerr << "Could not open soak output " << output_path << std::endl;
+  }
+  this->csv_ << "elapsed_s,rss_kb,heap_kb,live_allocations,allocations_per_s,allocations_per_frame,"
+             << "fds,threads,fps";
+  for (int stage = 0; stage < kStages; stage++)
+  {
+    const char* name = latency_stage_name((LatencyStage)stage);
+    this->csv_ << "," << name << "_p50_us," << name << "_p99_us," << name << "_max_us";
+  }
+  this->csv_ << "\n";
+
+  enable_latency_tracking();
+  this->start_ = std::chrono::steady_clock::now();
+  this->last_time_ = this->start_;
+  uint64_t deallocations = 0;
+  get_allocation_counts(&this->last_allocations_, &deallocations);
+  for (int stage = 0; stage < kStages; stage++)
+  {
+    read_latency_counts((LatencyStage)stage, &this->last_counts_[stage]);
+  }
+
+  this->sample_thread_ = std::thread(&SoakMonitor::sample_loop, this);
+}
+
+SoakMonitor::~SoakMonitor() {
+  stop();
+}
+
+void SoakMonitor::stop() {
+  {
+    std::lock_guard<std::mutex> lock(this->mutex_);
+    if (this->stopping_)
+    {
+      return;
+    }
+    this->stopping_ = true;
+  }
+  this->cv_stop_.notify_all();
+  this->sample_thread_.join();
+
+  // The last partial interval, unless it is too short to say anything
+  auto now = std::chrono::steady_clock::now();
+  if (now - this->last_time_ >= std::chrono::duration<double>(this->sample_interval_s_ / 2))
+  {
+    take_sample();
+  }
+  this->csv_.close();
+}
+
+void SoakMonitor::sample_loop() {
+  auto interval = std::chrono::duration<double>(this->sample_interval_s_);
+
+  std::unique_lock<std::mutex> lock(this->mutex_);
+  while (!this->cv_stop_.wait_for(lock, interval, [this] { return this->stopping_; }))
+  {
+    lock.unlock();
+    take_sample();
+    lock.lock();
+
+    if (!this->duration_reached_ && this->samples_.back().elapsed_s >= this->duration_s_)
+    {
+      this->duration_reached_ = true;
+      lock.unlock();
+      this->on_duration_reached_();
+      lock.lock();
+    }
+  }
+}
+
+void SoakMonitor::take_sample() {
+  auto now = std::chrono::steady_clock::now();
+  double interval_s = std::chrono::duration<double>(now - this->last_time_).count();
+  this->last_time_ = now;
+
+  Sample sample;
+  sample.elapsed_s = std::chrono::duration<double>(now - this->start_).count();
+  sample.rss_kb = read_rss_kb();
+  struct mallinfo2 info = mallinfo2();
+  sample.heap_kb = (int64_t)((info.uordblks + info.hblkhd) / 1024);
+
+  uint64_t allocations = 0;
+  uint64_t deallocations = 0;
+  get_allocation_counts(&allocations, &deallocations);
+  sample.live_allocations = (int64_t)(allocations - deallocations);
+  uint64_t new_allocations = allocations - this->last_allocations_;
+  this->last_allocations_ = allocations;
+
+  sample.fds = count_entries("/proc/self/fd");
+  sample.threads = count_entries("/proc/self/task");
+
+  for (int stage = 0; stage < kStages; stage++)
+  {
+    LatencyCounts counts;
+    read_latency_counts((LatencyStage)stage, &counts);
+    sample.p50_us[stage] = latency_percentile(this->last_counts_[stage], counts, 50.0);
+    sample.p99_us[stage] = latency_percentile(this->last_counts_[stage], counts, 99.0);
+    sample.max_us[stage] = latency_percentile(this->last_counts_[stage], counts, 100.0);
+
+    // Every written frame is consumed once
+    if (stage == (int)LatencyStage::Consume)
+    {
+      uint64_t frames = counts.total - this->last_counts_[stage].total;
+      sample.fps = interval_s > 0 ? frames / interval_s : 0.0;
+      sample.allocations_per_frame = frames > 0 ? (double)new_allocations / frames : 0.0;
+    }
+    this->last_counts_[stage] = std::move(counts);
+  }
+  sample.allocations_per_s = interval_s > 0 ? new_allocations / interval_s : 0.0;
+
+  this->csv_ << sample.elapsed_s << "," << sample.rss_kb << "," << sample.heap_kb << ","
+             << sample.live_allocations << "," << sample.allocations_per_s << ","
+             << sample.allocations_per_frame << "," << sample.fds << "," << sample.threads << ","
+             << sample.fps;
+  for (int stage = 0; stage < kStages; stage++)
+  {
+    this->csv_ << "," << sample.p50_us[stage] << "," << sample.p99_us[stage] << "," << sample.max_us[stage];
+  }
+  this->csv_ << std::endl;
+
+  std::lock_guard<std::mutex> lock(this->mutex_);
+  this->samples_.push_back(sample);
+}
+
+double SoakMonitor::median(size_t first, size_t last, const std::function<double(const Sample&)>& field) {
+  std::vector<double> values;
+  for (size_t idx = first; idx < last; idx++)
+  {
+    values.push_back(field(this->samples_[idx]));
+  }
+  std::sort(values.begin(), values.end());
+  size_t mid = values.size() / 2;
+  return values.size() % 2 ? values[mid] : (values[mid - 1] + values[mid]) / 2;
+}
+
+bool SoakMonitor::evaluate() {
+  stop();
+
+  // Judged from the end of the warmup on
+  size_t first = 0;
+  while (first < this->samples_.size() && this->samples_[first].elapsed_s < this->warmup_s_)
+  {
+    first++;
+  }
+  size_t windows = this->drift_windows_;
+  if (this->samples_.size() - first < 2 * windows)
+  {
+    printf("Soak: %zu samples after warmup, %zu needed to judge drift\n",
+           this->samples_.size() - first, 2 * windows);
+    return false;
+  }
+  size_t last = this->samples_.size() - windows;
+
+  bool passed = true;
+  auto check_growth = [&](const char* name,
+                          const std::function<double(const Sample&)>& field,
+                          double max_growth) {
+    double baseline = median(first, first + windows, field);
+    double final = median(last, this->samples_.size(), field);
+    bool ok = final - baseline <= max_growth;
+    printf("  %-20s baseline %12.1f  final %12.1f  growth %10.1f  (max %.1f)  %s\n",
+           name, baseline, final, final - baseline, max_growth, ok ? "ok" : "DRIFT");
+    passed &= ok;
+  };
+
+  printf("Soak: %.0f s, %zu samples, baseline from %.0f s, final from %.0f s\n",
+         this->samples_.back().elapsed_s, this->samples_.size(),
+         this->samples_[first].elapsed_s, this->samples_[last].elapsed_s);
+
+  check_growth("rss_kb", [](const Sample& s) { return (double)s.rss_kb; },
+               this->max_rss_growth_mb_ * 1024);
+  check_growth("heap_kb", [](const Sample& s) { return (double)s.heap_kb; },
+               this->max_heap_growth_mb_ * 1024);
+  check_growth("live_allocations", [](const Sample& s) { return (double)s.live_allocations; },
+               this->max_live_allocation_growth_);
+  check_growth("fds", [](const Sample& s) { return (double)s.fds; }, this->max_fd_growth_);
+  check_growth("threads", [](const Sample& s) { return (double)s.threads; }, this->max_thread_growth_);
+
+  for (int stage = 0; stage < kStages; stage++)
+  {
+    auto p99 = [stage](const Sample& s) { return (double)s.p99_us[stage]; };
+    double baseline = median(first, first + windows, p99);
+    double final = median(last, this->samples_.size(), p99);
+    // Stages that did not run, e.g. encode with the mosaic
+    if (baseline < 0 || final < 0)
+    {
+      continue;
+    }
+    bool ok = final <= baseline * this->max_latency_ratio_ || final - baseline <= this->latency_slack_us_;
+    printf("  %-20s baseline %12.0f  final %12.0f  p99 us  %s\n",
+           latency_stage_name((LatencyStage)stage), baseline, final, ok ? "ok" : "DRIFT");
+    passed &= ok;
+  }
+
+  double baseline_fps = median(first, first + windows, [](const Sample& s) { return s.fps; });
+  double final_fps = median(last, this->samples_.size(), [](const Sample& s) { return s.fps; });
+  bool fps_ok = final_fps >= baseline_fps * this->min_throughput_ratio_;
+  printf("  %-20s baseline %12.1f  final %12.1f  %s\n", "fps", baseline_fps, final_fps,
+         fps_ok ? "ok" : "DRIFT");
+  passed &= fps_ok;
+
+  printf("Soak %s\n", passed ? "passed" : "FAILED");
+  fflush(stdout);
+  return passed;
+}
@@ -0,0 +1,50 @@
+#include "startup_timeline.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace {
+
+// Initialized while the program loads, before main
+const std::chrono::steady_clock::time_point process_start = std::chrono::steady_clock::now();
+
+std::mutex timeline_mutex;
+std::vector<std::pair<double, std::string>> timeline_events;
+bool timeline_printed = false;
+
+}
+
+void mark_startup(const std::string& event) {
+  double elapsed_ms = std::chrono::duration<double, std::milli>(
+    std::chrono::steady_clock::now() - process_start).count();
+
+  std::lock_guard<std::mutex> lock(timeline_mutex);
+  if (!timeline_printed)
+  {
+    timeline_events.emplace_back(elapsed_ms, event);
+  }
+}
+
+void print_startup_timeline() {
+  std::lock_guard<std::mutex> lock(timeline_mutex);
+  if (timeline_printed)
+  {
+    return;
+  }
+  timeline_printed = true;
+
+  // Events from parallel threads arrive slightly out of order
+  std::stable_sort(timeline_events.begin(), timeline_events.end(),
+                   [](const auto& a, const auto& b) { return a.first < b.first; });
+
+  printf("Startup timeline (ms since start):\n");
+  for (const auto& [elapsed_ms, event] : timeline_events)
+  {
+    printf("  %9.1f  %s\n", elapsed_ms, event.c_str());
+  }
+  fflush(stdout);
+}
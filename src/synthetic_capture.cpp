@@ -0,0 +1,128 @@
+#include "synthetic_capture.hpp"
+#include "startup_timeline.hpp"
+#include "thread_placement.hpp"
+
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+
+SyntheticCapture::SyntheticCapture(LoadShedder* frame_queue,
+                                   Json::Value config) {
+  this->frame_queue_ = frame_queue;
+
+  this->img_width_ = config["image_width"].asInt();
+  this->img_height_ = config["image_height"].asInt();
+
+  Json::Value jsonSyntheticConf = config["synthetic_source"];
+  this->frame_rate_ = std::max(1, jsonSyntheticConf.get("frame_rate", 120).asInt());
+
+  this->cameras_.resize(config["number_cameras"].asInt());
+  for (size_t idx = 0; idx < this->cameras_.size(); idx++)
+  {
+    // Cameras without an entry get an ideal clock
+    Json::Value jsonCameraConf = jsonSyntheticConf["cameras"][(int)idx];
+    VirtualCamera& camera = this->cameras_[idx];
+
+    camera.clock_offset_us = jsonCameraConf.get("clock_offset_us", 0).asInt64();
+    camera.clock_drift_ppm = jsonCameraConf.get("clock_drift_ppm", 0.0).asDouble();
+    camera.phase_us = jsonCameraConf.get("phase_us", 0).asInt64();
+    camera.delivery_delay_us = jsonCameraConf.get("delivery_delay_us", 1000).asInt64();
+    camera.delivery_jitter_us = jsonCameraConf.get("delivery_jitter_us", 500).asInt64();
+    camera.drop_rate = jsonCameraConf.get("drop_rate", 0.0).asDouble();
+
+    std::cout << "Synthetic camera " << idx << ": offset " << camera.clock_offset_us
+              << " us, drift " << camera.clock_drift_ppm << " ppm, phase "
+              << camera.phase_us << " us\n";
+  }
+}
+
+void SyntheticCapture::start_capture() {
+  this->start_us_ = std::chrono::duration_cast<std::chrono::microseconds>(
+    std::chrono::system_clock::now().time_since_epoch()).count();
+
+  std::vector<std::thread> device_threads;
+  for (size_t idx = 0; idx < this->cameras_.size(); idx++)
+  {
+    device_threads.emplace_back(&SyntheticCapture::capture_device, this, idx);
+  }
+
+  for (auto& device_thread : device_threads)
+  {
+    device_thread.join();
+  }
+}
+
+void SyntheticCapture::capture_device(size_t idx) {
+  apply_thread_placement("capture");
+
+  // Allocated on the pinned thread so the pages are local to its node
+  VirtualCamera& camera = this->cameras_[idx];
+  // Rows stay packed like the camera's own buffers
+  size_t frame_bytes = (size_t)this->img_width_ * this->img_height_ * 3;
+  camera.arena = std::make_unique<FrameArena>(2 * (frame_bytes + FrameArena::kAlignment),
+                                              "camera " + std::to_string(idx));
+  for (cv::Mat& buffer : camera.buffers)
+  {
+    uint8_t* data = camera.arena->allocate(frame_bytes);
+    buffer = data ? cv::Mat(this->img_height_, this->img_width_, CV_8UC3, data)
+                  : cv::Mat(this->img_height_, this->img_width_, CV_8UC3);
+  }
+
+  std::mt19937 rng(idx + 1);
+  std::uniform_int_distribution<int64_t> jitter(0, camera.delivery_jitter_us);
+  std::uniform_real_distribution<double> drop(0.0, 1.0);
+
+  int64_t period_us = 1000000 / this->frame_rate_;
+  int64_t frame_number = 0;
+  bool first_frame = true;
+
+  while (this->keepRunning_)
+  {
+    // Exposure instant on the host clock
+    int64_t exposure_us = this->start_us_ + camera.phase_us + frame_number * period_us;
+    int64_t delivery_us = exposure_us + camera.delivery_delay_us + jitter(rng);
+
+    std::this_thread::sleep_until(std::chrono::system_clock::time_point(
+      std::chrono::microseconds(delivery_us)));
+
+    if (drop(rng) < camera.drop_rate)
+    {
+      frame_number++;
+      continue;
+    }
+
+    cv::Mat& image = camera.buffers[frame_number % 2];
+    image.setTo(cv::Scalar(32, 32, 32));
+    int bar_x = (int)((exposure_us - this->start_us_) / 4000) % this->img_width_;
+    cv::rectangle(image, cv::Rect(bar_x, 0, 8, this->img_height_), cv::Scalar(255, 255, 255), cv::FILLED);
+
+    CameraFrame frame;
+    frame.data = image.data;
+    frame.camera_idx = idx;
+    frame.width = this->img_width_;
+    frame.height = this->img_height_;
+    frame.frame_number = frame_number;
+    frame.sensor_timestamp_us = camera.clock_offset_us +
+      (int64_t)((exposure_us - this->start_us_) * (1.0 + camera.clock_drift_ppm * 1e-6));
+    frame.host_timestamp_us = delivery_us;
+    frame.exposure_us = period_us / 2;
+
+    this->frame_queue_->offer(frame);
+
+    if (first_frame)
+    {
+      mark_startup("camera " + std::to_string(idx) + " first frame captured");
+      first_frame = false;
+    }
+
+    frame_number++;
+  }
+}
+
+void SyntheticCapture::stop_capture() {
+  this->keepRunning_ = false;
+
+  std::cout << "Synthetic capture stopped\n";
+}
@@ -0,0 +1,148 @@
+#include "thread_placement.hpp"
+
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+
+namespace {
+
+std::mutex placement_mutex;
+Json::Value placement_conf;
+bool placement_enabled = false;
+
+}
+
+void configure_thread_placement(Json::Value jsonPlacementConf) {
+  std::lock_guard<std::mutex> lock(placement_mutex);
+
+  placement_enabled = jsonPlacementConf["enabled"].asBool();
+  placement_conf = jsonPlacementConf;
+}
+
+bool parse_cpu_list(const std::string& cpu_list, cpu_set_t* cpu_set) {
+  CPU_ZERO(cpu_set);
+
+  std::stringstream ss(cpu_list);
+  std::string range;
+  while (std::getline(ss, range, ','))
+  {
+    if (range.empty())
+    {
+      continue;
+    }
+
+    int first = -1;
+    int last = -1;
+    size_t dash = range.find('-');
+    try
+    {
+      first = std::stoi(range.substr(0, dash));
+      last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+    }
+    catch (const std::exception&)
+    {
+      return false;
+    }
+
+    if (first < 0 || last < first || last >= CPU_SETSIZE)
+    {
+      return false;
+    }
+    for (int cpu = first; cpu <= last; cpu++)
+    {
+      CPU_SET(cpu, cpu_set);
+    }
+  }
+
+  return CPU_COUNT(cpu_set) > 0;
+}
+
+bool apply_thread_placement(const std::string& stage) {
+  Json::Value jsonStageConf;
+  {
+    std::lock_guard<std::mutex> lock(placement_mutex);
+    if (!placement_enabled || !placement_conf.isMember(stage))
+    {
+      return false;
+    }
+    jsonStageConf = placement_conf[stage];
+  }
+
+  bool applied = true;
+  std::string cpu_list = jsonStageConf.get("cpus", "").asString();
+  if (!cpu_list.empty())
+  {
+    cpu_set_t cpu_set;
+    if (!parse_cpu_list(cpu_list, &cpu_set))
+    {
+      std::cerr << "Thread placement: invalid cpu list \"" << cpu_list << "\" for " << stage << std::endl;
+      applied = false;
+    }
+    else
+    {
+      int ret = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set);
+      if (ret != 0)
+      {
+        std::cerr << "Thread placement: could not pin " << stage << ": " << strerror(ret) << std::endl;
+        applied = false;
+      }
+    }
+  }
+
+  int priority = jsonStageConf.get("sched_fifo_priority", 0).asInt();
+  if (priority > 0)
+  {
+    struct sched_param param;
+    param.sched_priority = priority;
+    int ret = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (ret != 0)
+    {
+      // Needs CAP_SYS_NICE or an rtprio limit, the thread keeps running normally
+      std::cerr << "Thread placement: SCHED_FIFO for " << stage << " failed: " << strerror(ret) << std::endl;
+      applied = false;
+    }
+  }
+
+  std::cout << "Thread placement: " << stage << " on cpus " << (cpu_list.empty() ? "any" : cpu_list);
+  if (priority > 0)
+  {
+    std::cout << ", SCHED_FIFO " << priority;
+  }
+  std::cout << std::endl;
+
+  return applied;
+}
+
+void touch_pages(void* data, size_t size) {
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  volatile uint8_t* bytes = (volatile uint8_t*)data;
+  for (size_t offset = 0; offset < size; offset += page_size)
+  {
+    bytes[offset] = 0;
+  }
+}
+
+ScopedThreadPlacement::ScopedThreadPlacement(const std::string& stage) {
+  if (pthread_getaffinity_np(pthread_self(), sizeof(this->cpu_set_), &this->cpu_set_) != 0 ||
+      pthread_getschedparam(pthread_self(), &this->policy_, &this->param_) != 0)
+  {
+    return;
+  }
+  this->saved_ = true;
+
+  apply_thread_placement(stage);
+}
+
+ScopedThreadPlacement::~ScopedThreadPlacement() {
+  if (!this->saved_)
+  {
+    return;
+  }
+
+  pthread_setaffinity_np(pthread_self(), sizeof(this->cpu_set_), &this->cpu_set_);
+  pthread_setschedparam(pthread_self(), this->policy_, &this->param_);
+}
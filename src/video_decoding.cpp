@@ -1,10 +1,11 @@
 #include "video_decoding.hpp"
 #include "network_connection.hpp"
+#include "pixel_convert.hpp"
 
 #include <jsoncpp/json/json.h>
 #include <opencv2/opencv.hpp>
-#include <libyuv.h>
 
+#include <algorithm>
 #include <string>
 #include <thread>
 #include <vector>
@@ -15,6 +16,9 @@
 #include <arpa/inet.h>
 #include <unistd.h>
 
+// Packets decoded per turn on a pool worker before other sessions get it
+static const int kPacketsPerTurn = 4;
+
 VideoDecoding::VideoDecoding(Json::Value jsonVideoConf,
                               const std::string& output_file, 
                               int session_idx,
@@ -24,11 +28,9 @@ VideoDecoding::VideoDecoding(Json::Value jsonVideoConf,
   this->session_idx_ = session_idx;
 
   std::cout << "Using decoder: " << jsonVideoConf["decoder"].asString() << std::endl;
-  this->decoder_name_ = jsonVideoConf["decoder"].asString();
-  
-  this->width_ = jsonVideoConf["stream_width"].asInt();
-  this->height_ = jsonVideoConf["stream_height"].asInt();
-  this->frame_rate_ = jsonVideoConf["frame_rate"].asInt();
+  // Frame threading would delay every live frame by a frame per thread
+  load_config(jsonVideoConf, "slice");
+
   this->output_file_ = jsonVideoConf["output_video_path"].asString() + "_" + 
                         std::to_string(this->session_idx_) + ".mp4";
 
@@ -38,12 +40,9 @@ VideoDecoding::VideoDecoding(Json::Value jsonVideoConf,
   if (!this->frame_nv12_)
   {
     std::cerr << "Could not allocate AVFrame\n";
-    exit(1);
+    return;
   }
 
-  int buffer_size = jsonVideoConf["pre_allocated_buffer_size"].asInt();
-  this->buffer_ = new std::vector<uint8_t>(buffer_size);
-
   this->pkt_ = av_packet_alloc();
   if (!this->pkt_)
   {
@@ -51,37 +50,153 @@ VideoDecoding::VideoDecoding(Json::Value jsonVideoConf,
     return;
   }
 
-  initialize_ffmpeg_decoder();
+  if (!initialize_ffmpeg_decoder(nullptr))
+  {
+    return;
+  }
+
+  // A new viewer cannot decode until the next keyframe
+  request_keyframe();
+}
+
+VideoDecoding::VideoDecoding(Json::Value jsonVideoConf,
+                              const AVCodecParameters* codecpar,
+                              int session_idx,
+                              DecodePool* pool,
+                              FrameCallback on_frame) {
+  this->session_idx_ = session_idx;
+  this->pool_ = pool;
+  this->on_frame_ = on_frame;
+
+  load_config(jsonVideoConf, "frame+slice");
+  if (this->decoder_threads_ == 0 && pool)
+  {
+    this->decoder_threads_ = pool->get_codec_threads();
+  }
+
+  this->frame_nv12_ = av_frame_alloc();
+  if (!this->frame_nv12_)
+  {
+    std::cerr << "Could not allocate AVFrame\n";
+    return;
+  }
+
+  initialize_ffmpeg_decoder(codecpar);
 }
 
 VideoDecoding::~VideoDecoding() {
+  for (AVPacket* packet : this->queued_packets_)
+  {
+    av_packet_free(&packet);
+  }
   avcodec_free_context(&this->codec_ctx_);
   avformat_free_context(this->format_ctx_);
   av_packet_free(&this->pkt_);
+  av_frame_free(&this->frame_nv12_);
+}
+
+void VideoDecoding::load_config(Json::Value jsonVideoConf, const std::string& default_thread_type) {
+  this->decoder_name_ = jsonVideoConf["decoder"].asString();
+  for (const Json::Value& fallback : jsonVideoConf["decoder_fallbacks"])
+  {
+    this->decoder_fallbacks_.push_back(fallback.asString());
+  }
+  this->default_codec_ = jsonVideoConf.get("codec", "hevc").asString();
+
+  this->decoder_threads_ = std::max(0, jsonVideoConf.get("decoder_threads", 0).asInt());
+  std::string thread_type = jsonVideoConf.get("decoder_thread_type", default_thread_type).asString();
+  this->decoder_thread_type_ = (thread_type.find("frame") != std::string::npos ? FF_THREAD_FRAME : 0) |
+                               (thread_type.find("slice") != std::string::npos ? FF_THREAD_SLICE : 0);
+
+  this->width_ = jsonVideoConf["stream_width"].asInt();
+  this->height_ = jsonVideoConf["stream_height"].asInt();
+  this->frame_rate_ = jsonVideoConf["frame_rate"].asInt();
+
+  std::fill(this->pending_metadata_pts_, this->pending_metadata_pts_ + kPendingMetadata, AV_NOPTS_VALUE);
+}
+
+std::vector<const AVCodec*> VideoDecoding::find_decoders(AVCodecID codec_id) {
+  std::vector<const AVCodec*> decoders;
+  auto add_decoder = [&](const AVCodec* codec) {
+    if (codec && codec->id == codec_id &&
+        std::find(decoders.begin(), decoders.end(), codec) == decoders.end())
+    {
+      decoders.push_back(codec);
+    }
+  };
+
+  add_decoder(avcodec_find_decoder_by_name(this->decoder_name_.c_str()));
+  for (const std::string& fallback : this->decoder_fallbacks_)
+  {
+    add_decoder(avcodec_find_decoder_by_name(fallback.c_str()));
+  }
+  add_decoder(avcodec_find_decoder(codec_id));
+
+  return decoders;
 }
 
 // Initialize FFmpeg Decoder
-void VideoDecoding::initialize_ffmpeg_decoder() {
-  this->codec_ = avcodec_find_decoder_by_name(decoder_name_.c_str());
-  if (!this->codec_) 
+bool VideoDecoding::initialize_ffmpeg_decoder(const AVCodecParameters* codecpar) {
+  // A live stream carries no codec parameters, its codec is the configured
+  // decoder's, or "codec" when that decoder is not built in
+  AVCodecID codec_id = AV_CODEC_ID_NONE;
+  const AVCodec* configured = avcodec_find_decoder_by_name(this->decoder_name_.c_str());
+  const AVCodecDescriptor* descriptor = avcodec_descriptor_get_by_name(this->default_codec_.c_str());
+  if (codecpar)
+  {
+    codec_id = codecpar->codec_id;
+  }
+  else if (configured)
+  {
+    codec_id = configured->id;
+  }
+  else if (descriptor)
   {
-    std::cerr << "Requested codec not found!" << std::endl;
-    exit(1);
+    codec_id = descriptor->id;
   }
 
-  this->codec_ctx_ = avcodec_alloc_context3(this->codec_);
-  if (avcodec_open2(this->codec_ctx_, this->codec_, NULL) < 0)
+  for (const AVCodec* codec : find_decoders(codec_id))
   {
-    std::cerr << "Could not open codec." << std::endl;
-    avcodec_free_context(&(this->codec_ctx_));
-    exit(1);
+    AVCodecContext* codec_ctx = avcodec_alloc_context3(codec);
+    if (!codec_ctx)
+    {
+      continue;
+    }
+    if (codecpar)
+    {
+      avcodec_parameters_to_context(codec_ctx, codecpar);
+    }
+    if (this->frame_rate_ > 0)
+    {
+      codec_ctx->time_base = (AVRational){1, this->frame_rate_};
+      codec_ctx->framerate = (AVRational){this->frame_rate_, 1};
+    }
+
+    // Ignored by hardware decoders
+    codec_ctx->thread_count = this->decoder_threads_;
+    codec_ctx->thread_type = this->decoder_thread_type_;
+
+    if (avcodec_open2(codec_ctx, codec, NULL) < 0)
+    {
+      std::cerr << "Could not open decoder " << codec->name << ", trying the next one" << std::endl;
+      avcodec_free_context(&codec_ctx);
+      continue;
+    }
+
+    this->codec_ = codec;
+    this->codec_ctx_ = codec_ctx;
+    this->decoder_name_ = codec->name;
+    std::cout << "Decoder " << this->decoder_name_ << " initialized with "
+              << codec_ctx->thread_count << " threads." << std::endl;
+    return true;
   }
 
-  this->codec_ctx_->time_base = (AVRational){1, this->frame_rate_};
-  this->codec_ctx_->framerate = (AVRational){this->frame_rate_, 1};
-  this->codec_ctx_->pix_fmt = AV_PIX_FMT_NV12;
+  std::cerr << "No decoder available for " << avcodec_get_name(codec_id) << std::endl;
+  return false;
+}
 
-  std::cout << "Decoder " << this->decoder_name_<< " initialized." << std::endl;
+bool VideoDecoding::is_open() {
+  return this->codec_ctx_ != nullptr;
 }
 
 void VideoDecoding::swapRGBToBGR(cv::Mat* image) {
@@ -92,83 +207,231 @@ void VideoDecoding::swapRGBToBGR(cv::Mat* image) {
       return;
   }
 
-  // Iterate through each pixel and swap the R and B channels
-  int rows = image->rows;
-  int cols = image->cols * 3; // 3 channels per pixel
-
-  // Process row by row
-  for (int i = 0; i < rows; ++i) 
+  if (!this->swap_kernel_.is_valid())
   {
-    uint8_t* row = image->ptr<uint8_t>(i);
-    for (int j = 0; j < cols; j += 3) 
-    {
-      std::swap(row[j], row[j + 2]); // Swap R and B
-    }
+    this->swap_kernel_ = ConversionKernel(PixelFormat::RGB24, PixelFormat::BGR24);
   }
+
+  // In place, both formats have 3 byte pixels
+  Image rgb = make_image(PixelFormat::RGB24, image->cols, image->rows, image->data, image->step);
+  Image bgr = make_image(PixelFormat::BGR24, image->cols, image->rows, image->data, image->step);
+  this->swap_kernel_.convert(rgb, bgr);
 }
 
-void VideoDecoding::convertNV12ToBGR(const AVFrame* frame_nv12, cv::Mat* bgr) {
-  // Ensure the input format is NV12
-  if (frame_nv12->format != AV_PIX_FMT_NV12)
+bool VideoDecoding::convertToBGR(const AVFrame* frame, cv::Mat* bgr) {
+  Image decoded;
+  if (!wrap_av_frame(frame, &decoded))
   {
-    std::cerr << "Invalid format. Expected NV12!" << std::endl;
-    return;
+    std::cerr << "Unsupported decoded pixel format " << frame->format << std::endl;
+    return false;
   }
 
-  // Use libyuv to convert NV12 to BGR24 directly
-  int ret = libyuv::NV12ToRGB24(
-    frame_nv12->data[0], frame_nv12->linesize[0],      // Y plane and stride
-    frame_nv12->data[1], frame_nv12->linesize[1],      // UV plane and stride
-    bgr->data, frame_nv12->width * 3,                  // BGR buffer and stride
-    frame_nv12->width, frame_nv12->height              // Frame width and height
-  );
-
-  if (ret != 0) 
+  // Looked up again only if the decoder changes its output format
+  if (frame->format != this->to_bgr_format_)
   {
-    std::cerr << "libyuv NV12ToRGB24 failed with error: " << ret << std::endl;
+    this->to_bgr_kernel_ = ConversionKernel(decoded.format, PixelFormat::BGR24);
+    this->to_bgr_format_ = frame->format;
+    std::cout << "Converting " << pixel_format_name(decoded.format) << " to BGR24 with "
+              << simd_level_name(this->to_bgr_kernel_.get_level()) << std::endl;
   }
+
+  Image out = make_image(PixelFormat::BGR24, frame->width, frame->height, bgr->data, bgr->step);
+  return this->to_bgr_kernel_.convert(decoded, out);
 }
 
-void VideoDecoding::decode_frame(cv::Mat* decoded_frame) {  
+bool VideoDecoding::decode_frame(cv::Mat* decoded_frame) {  
+  if (!this->codec_ctx_ || !this->pkt_)
+  {
+    return false;
+  }
+
   // Receive packet size
   int pkt_size;
-  if (recv(this->socket_, &pkt_size, sizeof(int), 0) <= 0)
+  if (receive_all(this->socket_, reinterpret_cast<char*>(&pkt_size), sizeof(int)) <= 0)
   {
     std::cerr << "Failed to receive packet size." << std::endl;
+    return false;
   }
 
   // Allocate packet data
   if (av_new_packet(this->pkt_, pkt_size) != 0) 
   {
     std::cerr << "Could not allocate packet." << std::endl;
-    return;
+    return false;
   }
 
   // Receive packet data directly into the allocated packet buffer
-  if (!receive_all(this->socket_, reinterpret_cast<char*>(this->pkt_->data), pkt_size))
+  if (receive_all(this->socket_, reinterpret_cast<char*>(this->pkt_->data), pkt_size) <= 0)
   {
     std::cerr << "Failed to receive packet data." << std::endl;
     av_packet_unref(this->pkt_);
-    return;
+    return false;
+  }
+  // Stream packets have no timestamps, the sequence number ties the frame
+  // back to its packet's metadata
+  this->pkt_->pts = this->packets_received_;
+  store_packet_metadata(this->pkt_);
+
+  // Acks let the sender measure end-to-end latency for rate control
+  ControlMessage ack = {CONTROL_FRAME_ACK, 0, this->packets_received_++};
+  if (send_all(this->socket_, &ack, sizeof(ack)) < 0)
+  {
+    std::cerr << "Failed to send frame ack." << std::endl;
+    av_packet_unref(this->pkt_);
+    return false;
   }
 
   if (avcodec_send_packet(this->codec_ctx_, this->pkt_) < 0) 
   {
     std::cerr << "Error sending packet for decoding." << std::endl;
     av_packet_unref(this->pkt_);
-    return;
+    request_keyframe();
+    return false;
   }
 
-  if (avcodec_receive_frame(this->codec_ctx_, this->frame_nv12_) == 0) 
+  // A frame threaded decoder holds the first frames back, that is no error
+  bool decoded = false;
+  int ret = avcodec_receive_frame(this->codec_ctx_, this->frame_nv12_);
+  if (ret == 0) 
   {
-    convertNV12ToBGR(this->frame_nv12_, decoded_frame);
+    take_frame_metadata(this->frame_nv12_);
+    decoded = convertToBGR(this->frame_nv12_, decoded_frame);
+    this->frames_decoded_++;
   }
-  else 
+  else if (ret != AVERROR(EAGAIN))
   {
     std::cerr << "Error receiving frame." << std::endl;
+    request_keyframe();
   }
 
   av_packet_unref(this->pkt_);
+  return decoded;
+}
+
+bool VideoDecoding::decode_packet(const AVPacket* packet) {
+  store_packet_metadata(packet);
+  int ret = avcodec_send_packet(this->codec_ctx_, packet);
+  if (ret < 0 && ret != AVERROR_EOF)
+  {
+    std::cerr << "Session " << this->session_idx_ << ": error sending packet for decoding." << std::endl;
+    return false;
+  }
+
+  while ((ret = avcodec_receive_frame(this->codec_ctx_, this->frame_nv12_)) == 0)
+  {
+    this->frames_decoded_++;
+    take_frame_metadata(this->frame_nv12_);
+    if (this->on_frame_)
+    {
+      this->on_frame_(this->frame_nv12_);
+    }
+    av_frame_unref(this->frame_nv12_);
+  }
+  return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF;
+}
+
+bool VideoDecoding::submit_packet(const AVPacket* packet) {
+  if (!this->codec_ctx_)
+  {
+    return false;
+  }
+
+  // Without a pool the caller's thread decodes, for callers that are already
+  // one of many workers
+  if (!this->pool_)
+  {
+    return decode_packet(packet);
+  }
+
+  // Demuxed packets are reference counted, the clone shares their data
+  AVPacket* queued = nullptr;
+  if (packet && !(queued = av_packet_clone(packet)))
+  {
+    std::cerr << "Could not queue packet." << std::endl;
+    return false;
+  }
+
+  bool schedule = false;
+  {
+    std::unique_lock<std::mutex> lock(this->queue_mutex_);
+    this->cv_queue_.wait(lock, [this] {
+      return this->queued_packets_.size() < (size_t)this->pool_->get_max_queued_packets();
+    });
+    this->queued_packets_.push_back(queued);
+    schedule = !this->scheduled_;
+    this->scheduled_ = true;
+  }
+
+  if (schedule)
+  {
+    this->pool_->schedule([this] { run_queued_packets(); });
+  }
+  return true;
+}
+
+void VideoDecoding::run_queued_packets() {
+  for (int i = 0; i < kPacketsPerTurn; i++)
+  {
+    AVPacket* packet = nullptr;
+    {
+      std::lock_guard<std::mutex> lock(this->queue_mutex_);
+      if (this->queued_packets_.empty())
+      {
+        this->scheduled_ = false;
+        return;
+      }
+      packet = this->queued_packets_.front();
+      this->queued_packets_.pop_front();
+    }
+    this->cv_queue_.notify_all();
+
+    decode_packet(packet);
+
+    if (!packet)
+    {
+      // The owner may destroy the session as soon as it sees finished_
+      std::lock_guard<std::mutex> lock(this->queue_mutex_);
+      this->finished_ = true;
+      this->scheduled_ = false;
+      this->cv_queue_.notify_all();
+      return;
+    }
+    av_packet_free(&packet);
+  }
+
+  // Back of the line, so one busy stream does not starve the others
+  {
+    std::lock_guard<std::mutex> lock(this->queue_mutex_);
+    if (this->queued_packets_.empty())
+    {
+      this->scheduled_ = false;
+      return;
+    }
+  }
+  this->pool_->schedule([this] { run_queued_packets(); });
+}
+
+void VideoDecoding::wait_finished() {
+  if (!this->codec_ctx_ || !this->pool_)
+  {
+    return;
+  }
+
+  std::unique_lock<std::mutex> lock(this->queue_mutex_);
+  this->cv_queue_.wait(lock, [this] { return this->finished_; });
+}
+
+void VideoDecoding::request_keyframe() {
+  if (this->socket_ < 0)
+  {
+    return;
+  }
+
+  ControlMessage message = {CONTROL_KEYFRAME_REQUEST, 0, this->frames_decoded_};
+  if (send_all(this->socket_, &message, sizeof(message)) < 0)
+  {
+    std::cerr << "Failed to send keyframe request." << std::endl;
+  }
 }
 
 AVCodecContext* VideoDecoding::get_codec_ctx() {
@@ -178,3 +441,52 @@ AVCodecContext* VideoDecoding::get_codec_ctx() {
 AVFormatContext* VideoDecoding::get_format_ctx() {
   return this->format_ctx_;
 }
+
+const std::string& VideoDecoding::get_decoder_name() {
+  return this->decoder_name_;
+}
+
+void VideoDecoding::store_packet_metadata(const AVPacket* packet) {
+  if (!packet || packet->pts == AV_NOPTS_VALUE)
+  {
+    return;
+  }
+  int slot = (int)(((packet->pts % kPendingMetadata) + kPendingMetadata) % kPendingMetadata);
+  if (find_packet_metadata(this->codec_ctx_->codec_id, packet->data, packet->size,
+                           &this->pending_metadata_[slot]))
+  {
+    this->pending_metadata_pts_[slot] = packet->pts;
+  }
+  else
+  {
+    this->pending_metadata_pts_[slot] = AV_NOPTS_VALUE;
+  }
+}
+
+void VideoDecoding::take_frame_metadata(const AVFrame* frame) {
+  int64_t pts = frame->pts != AV_NOPTS_VALUE ? frame->pts : frame->best_effort_timestamp;
+  this->has_frame_metadata_ = false;
+  if (pts == AV_NOPTS_VALUE)
+  {
+    return;
+  }
+  int slot = (int)(((pts % kPendingMetadata) + kPendingMetadata) % kPendingMetadata);
+  if (this->pending_metadata_pts_[slot] == pts)
+  {
+    this->frame_metadata_ = this->pending_metadata_[slot];
+    this->has_frame_metadata_ = true;
+  }
+}
+
+bool VideoDecoding::get_frame_metadata(FrameMetadata* metadata) {
+  if (!this->has_frame_metadata_)
+  {
+    return false;
+  }
+  *metadata = this->frame_metadata_;
+  return true;
+}
+
+int64_t VideoDecoding::get_frames_decoded() {
+  return this->frames_decoded_;
+}
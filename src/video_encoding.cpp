@@ -10,6 +10,9 @@
 #include <vector>
 #include <iostream>
 #include <chrono>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
 
 // Socket streaming
 #include <sys/socket.h>
@@ -32,69 +35,176 @@ VideoEncoding::VideoEncoding(Json::Value jsonVideoConf,
   this->frame_rate_ = jsonVideoConf["frame_rate"].asInt();
   this->bitrate_ = jsonVideoConf["bitrate"].asInt();
   this->gop_size_ = jsonVideoConf["gop_size"].asInt();
-  this->output_file_ = jsonVideoConf["output_video_path"].asString() + "_" + 
-                        std::to_string(this->session_idx_) + ".mp4";
 
   this->preset_ = jsonVideoConf["preset"].asString();
   this->tune_ = jsonVideoConf["tune"].asString();
   this->split_encode_mode_ = jsonVideoConf["split_encode_mode"].asString();
+  this->encoder_threads_ = jsonVideoConf.get("encoder_threads", 0).asInt();
+
+  Json::Value jsonLosslessConf = jsonVideoConf["lossless"];
+  if (jsonLosslessConf["enabled"].asBool())
+  {
+    this->lossless_ = true;
+    this->encoder_name_ = jsonLosslessConf.get("encoder", "ffv1").asString();
+    this->encoder_threads_ = jsonLosslessConf.get("threads", 0).asInt();
+    this->slices_ = jsonLosslessConf.get("slices", 0).asInt();
+    this->gop_size_ = jsonLosslessConf.get("gop_size", 1).asInt();
+    this->container_ = jsonLosslessConf.get("container", "mkv").asString();
+    std::cout << "Lossless mode enabled, using encoder: " << this->encoder_name_ << std::endl;
+  }
+
+  // Periodic keyframes by time keep recordings seekable, "gop" uses gop_size as-is
+  Json::Value jsonKeyframeConf = jsonVideoConf["keyframe_policy"];
+  this->keyframe_mode_ = jsonKeyframeConf.get("mode", "gop").asString();
+  this->keyframe_interval_ms_ = jsonKeyframeConf.get("interval_ms", 0).asInt();
+  if (!this->lossless_ && this->keyframe_mode_ == "periodic" && this->keyframe_interval_ms_ > 0)
+  {
+    this->gop_size_ = std::max(1, this->frame_rate_ * this->keyframe_interval_ms_ / 1000);
+    std::cout << "Periodic keyframe every " << this->gop_size_ << " frames" << std::endl;
+  }
+  else if (!this->lossless_ && this->keyframe_mode_ == "intra_refresh" && this->keyframe_interval_ms_ > 0)
+  {
+    // The encoders take the refresh period from the GOP length
+    this->gop_size_ = std::max(1, this->frame_rate_ * this->keyframe_interval_ms_ / 1000);
+    std::cout << "Intra refresh over " << this->gop_size_ << " frames" << std::endl;
+  }
+  this->write_seek_index_ = jsonVideoConf["seek_index"].asBool();
+  if (this->write_seek_index_ && !this->lossless_ && this->keyframe_mode_ == "intra_refresh")
+  {
+    // Only the first frame is a keyframe, every seek would decode from the start
+    fprintf(stderr, "seek_index needs keyframe_policy.mode periodic or gop, intra_refresh "
+                    "recordings can only be seeked from their first frame\n");
+  }
+
+  Json::Value jsonMemoryConf = jsonVideoConf["memory"];
+  this->pool_input_frames_ = jsonMemoryConf.get("input_frames", 4).asInt();
+  this->pool_packets_ = jsonMemoryConf.get("packets", 8).asInt();
+
+  // Encoders switched in at runtime write the following segments of a session
+  int segment = jsonVideoConf.get("segment", 0).asInt();
+  this->output_file_ = jsonVideoConf["output_video_path"].asString() + "_" + 
+                        std::to_string(this->session_idx_) +
+                        (segment > 0 ? "_" + std::to_string(segment) : "") + "." + this->container_;
 
   this->socket_ = socket;
 
-  initialize_ffmpeg_encoder(true);
+  // Stream sessions only send packets over the socket
+  if (!initialize_ffmpeg_encoder(this->socket_ < 0))
+  {
+    return;
+  }
+
+  if (!this->lossless_ && jsonVideoConf["motion"]["enabled"].asBool())
+  {
+    this->motion_map_ = std::make_unique<MotionMap>(jsonVideoConf["motion"], this->width_, this->height_);
+  }
+
+  // Lossless codecs have no SEI, those recordings rely on the timestamp file
+  Json::Value jsonMetadataConf = jsonVideoConf["frame_metadata"];
+  if (!this->lossless_ && jsonMetadataConf["embed_sei"].asBool())
+  {
+    if (codec_supports_frame_metadata(this->codec_->id))
+    {
+      this->embed_metadata_ = true;
+      this->metadata_pool_ = av_buffer_pool_init(kFrameMetadataSize, NULL);
+    }
+    else
+    {
+      fprintf(stderr, "Encoder %s cannot embed frame metadata, only H.264 and HEVC carry it\n",
+              this->encoder_name_.c_str());
+    }
+  }
+
+  Json::Value jsonQualityConf = jsonVideoConf["quality"];
+  if (this->socket_ < 0 && !this->lossless_ && jsonQualityConf["enabled"].asBool())
+  {
+    bool adjust_bitrate = supports_live_bitrate();
+    if (!adjust_bitrate)
+    {
+      fprintf(stderr, "Encoder %s cannot change its bitrate while recording, quality is only measured\n",
+              this->encoder_name_.c_str());
+    }
+    this->quality_monitor_ = std::make_unique<QualityMonitor>(jsonQualityConf, this->codec_ctx_, adjust_bitrate,
+                                                              this->output_file_ + ".quality.csv",
+                                                              this->session_idx_);
+  }
+
+  if (this->socket_ >= 0 && jsonVideoConf["rate_control"]["enabled"].asBool())
+  {
+    this->rate_controller_ = std::make_unique<RateController>(jsonVideoConf["rate_control"],
+                                                              this->codec_ctx_->bit_rate,
+                                                              this->frame_rate_,
+                                                              this->socket_);
+  }
 
   this->pkt_ = av_packet_alloc();
   if (!this->pkt_) 
   {
     fprintf(stderr, "Could not allocate AVPacket\n");
-    exit(1);
+    return;
   }
 
-  this->frame_nv12 = av_frame_alloc();
+  this->frame_nv12 = this->arena_->allocate_frame(AV_PIX_FMT_NV12, this->width_, this->height_);
   if (!this->frame_nv12)
   {
     fprintf(stderr, "Could not allocate AVFrame for YUV\n");
-    exit(1);
+    return;
   }
-  this->frame_nv12->format = AV_PIX_FMT_NV12;
-  this->frame_nv12->width = this->width_;
-  this->frame_nv12->height = this->height_;
-  int result = av_image_alloc(this->frame_nv12->data, 
-                              this->frame_nv12->linesize, 
-                              this->frame_nv12->width, 
-                              this->frame_nv12->height, 
-                              AV_PIX_FMT_NV12, 
-                              32);
-  if (result < 0)
-  {
-    fprintf(stderr, "Could not allocate image for YUV\n");
-    exit(1);
+
+  // Holds the pooled buffer of the frame being encoded
+  this->frame_input_ = av_frame_alloc();
+  if (!this->frame_input_)
+  {
+    fprintf(stderr, "Could not allocate AVFrame for encoder input\n");
+    return;
   }
+
+  this->open_ = true;
+}
+
+bool VideoEncoding::is_open() {
+  return this->open_;
 }
 
 VideoEncoding::~VideoEncoding() {
-  av_freep(&this->frame_nv12->data[0]);
   av_frame_free(&this->frame_nv12);
+  av_frame_free(&this->frame_input_);
 
+  // The codec may still hold pooled frames and packets, pools are freed
+  // once their last buffer is returned and the arena goes last
   avcodec_free_context(&this->codec_ctx_);
   if (this->format_ctx_)
   {
+    // An encoder that failed to open leaves no file behind
+    if (!this->open_ && this->format_ctx_->pb)
+    {
+      avio_closep(&this->format_ctx_->pb);
+      std::remove(this->output_file_.c_str());
+    }
     avformat_free_context(this->format_ctx_);
   }
   av_packet_free(&this->pkt_);
+  av_buffer_pool_uninit(&this->input_pool_);
+  av_buffer_pool_uninit(&this->packet_pool_);
+  av_buffer_pool_uninit(&this->metadata_pool_);
 }
 
-void VideoEncoding::initialize_ffmpeg_encoder(bool write_to_file) {
+bool VideoEncoding::initialize_ffmpeg_encoder(bool write_to_file) {
   this->codec_ = avcodec_find_encoder_by_name(this->encoder_name_.c_str());
   if (!this->codec_) 
   {
     std::cerr << "Requested codec not found!" << std::endl;
-    exit(1);
+    return false;
   }
 
   this->codec_ctx_ = avcodec_alloc_context3(this->codec_);
+  if (!this->codec_ctx_)
+  {
+    fprintf(stderr, "Could not allocate codec context\n");
+    return false;
+  }
 
-  this->codec_ctx_->bit_rate = this->bitrate_ * 1024 * 1024;
+  this->codec_ctx_->bit_rate = (int64_t)this->bitrate_ * 1024 * 1024;
   this->codec_ctx_->width = this->width_;
   this->codec_ctx_->height = this->height_;
   this->codec_ctx_->time_base = (AVRational){1, this->frame_rate_};
@@ -104,10 +214,83 @@ void VideoEncoding::initialize_ffmpeg_encoder(bool write_to_file) {
   this->codec_ctx_->max_b_frames = 0;  // No B-frames
   this->codec_ctx_->pix_fmt = AV_PIX_FMT_NV12;
 
-  // Zero latency and delay options
-  av_opt_set(this->codec_ctx_->priv_data, "preset", this->preset_.c_str(), 0);
-  av_opt_set(this->codec_ctx_->priv_data, "tune", this->tune_.c_str(), 0);
-  av_opt_set(this->codec_ctx_->priv_data, "split_encode_mode", this->split_encode_mode_.c_str(), 0);
+  if (this->lossless_ && this->codec_->id == AV_CODEC_ID_FFV1)
+  {
+    // FFV1 codes the BGRA capture buffer directly (alpha ignored), which
+    // keeps the recording bit-exact with the sensor output
+    this->codec_ctx_->pix_fmt = AV_PIX_FMT_BGR0;
+
+    // Slices are compressed in parallel on the codec's thread pool
+    this->codec_ctx_->thread_count = this->encoder_threads_;
+    this->codec_ctx_->thread_type = FF_THREAD_SLICE;
+    if (this->slices_ > 0)
+    {
+      this->codec_ctx_->slices = this->slices_;
+    }
+
+    // Version 3 is required for slice threading, FFV1 takes it from the
+    // context's level. CRCs make damaged slices detectable.
+    this->codec_ctx_->level = 3;
+    if (av_opt_set(this->codec_ctx_->priv_data, "slicecrc", "1", 0) < 0)
+    {
+      fprintf(stderr, "Encoder %s has no slice CRCs, damaged slices will go unnoticed\n",
+              this->encoder_name_.c_str());
+    }
+  }
+  else if (this->lossless_)
+  {
+    // These encoders are only lossless in the YUV domain, the BGRA to NV12
+    // conversion still subsamples chroma
+    av_opt_set(this->codec_ctx_->priv_data, "preset", this->preset_.c_str(), 0);
+
+    // Each encoder has its own switch, an ignored one would record lossy video
+    int ret = AVERROR_OPTION_NOT_FOUND;
+    if (this->encoder_name_ == "libx264")
+    {
+      ret = av_opt_set(this->codec_ctx_->priv_data, "qp", "0", 0);
+    }
+    else if (this->encoder_name_ == "libx265")
+    {
+      ret = av_opt_set(this->codec_ctx_->priv_data, "x265-params", "lossless=1", 0);
+    }
+    else if (this->encoder_name_.find("_nvenc") != std::string::npos)
+    {
+      ret = av_opt_set(this->codec_ctx_->priv_data, "tune", "lossless", 0);
+    }
+    if (ret < 0)
+    {
+      fprintf(stderr, "Encoder %s cannot be made lossless, use ffv1, libx264, libx265 or NVENC\n",
+              this->encoder_name_.c_str());
+      return false;
+    }
+  }
+  else
+  {
+    // Zero latency and delay options
+    av_opt_set(this->codec_ctx_->priv_data, "preset", this->preset_.c_str(), 0);
+    av_opt_set(this->codec_ctx_->priv_data, "tune", this->tune_.c_str(), 0);
+    av_opt_set(this->codec_ctx_->priv_data, "split_encode_mode", this->split_encode_mode_.c_str(), 0);
+
+    // Spread intra coding over the GOP instead of sending one large IDR frame
+    if (this->keyframe_mode_ == "intra_refresh")
+    {
+      if (this->encoder_name_ == "libx265")
+      {
+        av_opt_set(this->codec_ctx_->priv_data, "x265-params", "intra-refresh=1", 0);
+      }
+      else if (av_opt_set_int(this->codec_ctx_->priv_data, "intra-refresh", 1, 0) < 0)
+      {
+        fprintf(stderr, "Encoder %s does not support intra refresh, using periodic keyframes\n",
+                this->encoder_name_.c_str());
+      }
+    }
+
+    // Keyframes requested through request_keyframe() must be decodable on their own
+    av_opt_set_int(this->codec_ctx_->priv_data, "forced-idr", 1, 0);
+
+    // Software encoders only, 0 lets the encoder pick
+    this->codec_ctx_->thread_count = this->encoder_threads_;
+  }
 
   // These parameters actually adds latency
   // av_opt_set(this->codec_ctx_->priv_data, "rc", "cbr", 0);
@@ -115,6 +298,27 @@ void VideoEncoding::initialize_ffmpeg_encoder(bool write_to_file) {
   // av_opt_set(this->codec_ctx_->priv_data, "zerolatency", "1", 0);
   // av_opt_set_int(this->codec_ctx_->priv_data, "delay", 0, 0);
 
+  // Sized from the final pixel format: the encoder input pool, the packet
+  // pool and frame_nv12. Packets rarely exceed a quarter of a raw frame
+  // unless lossless, larger ones fall back to FFmpeg's own allocation.
+  size_t input_frame_size = FrameArena::get_frame_size(this->codec_ctx_->pix_fmt, this->width_, this->height_);
+  this->packet_buffer_size_ = (this->lossless_ ? input_frame_size : input_frame_size / 4) +
+                              AV_INPUT_BUFFER_PADDING_SIZE;
+  this->arena_ = std::make_unique<FrameArena>(
+    FrameArena::get_frame_size(AV_PIX_FMT_NV12, this->width_, this->height_) +
+    this->pool_input_frames_ * (input_frame_size + FrameArena::kAlignment) +
+    this->pool_packets_ * (this->packet_buffer_size_ + FrameArena::kAlignment),
+    "encoder " + std::to_string(this->session_idx_));
+  this->input_pool_ = this->arena_->create_buffer_pool(input_frame_size, this->pool_input_frames_);
+
+  // Only encoders with direct rendering take packet buffers from the caller
+  if (this->codec_->capabilities & AV_CODEC_CAP_DR1)
+  {
+    this->packet_pool_ = this->arena_->create_buffer_pool(this->packet_buffer_size_, this->pool_packets_);
+    this->codec_ctx_->opaque = this;
+    this->codec_ctx_->get_encode_buffer = &VideoEncoding::get_packet_buffer;
+  }
+
   // Optional: Set AVDictionary options for lower buffering
   AVDictionary* options = nullptr;
   // if (av_dict_set(&options, "fflags", "nobuffer", 0) < 0)
@@ -123,34 +327,26 @@ void VideoEncoding::initialize_ffmpeg_encoder(bool write_to_file) {
   //   exit(1);
   // }
 
+  // Fails for unsupported options or sizes, or without a free hardware session
   if (avcodec_open2(this->codec_ctx_, this->codec_, NULL) < 0)
   {
     fprintf(stderr, "Could not open codec\n");
-    exit(1);
+    return false;
   }
 
-  // Setting for lossless encoding
-  // av_opt_set((this->codec_ctx_)->priv_data, "rc", "constqp", 0);  // Constant QP mode for lossless
-  // av_opt_set((this->codec_ctx_)->priv_data, "qp", "0", 0);  // Set QP to 0 for lossless encoding
-
   if (write_to_file)
   {
     avformat_alloc_output_context2(&(this->format_ctx_), NULL, NULL, this->output_file_.c_str());
     if (!this->format_ctx_)
     {
       fprintf(stderr, "Could not allocate output format context\n");
-      exit(1);
+      return false;
     }
 
     AVStream* stream = avformat_new_stream(this->format_ctx_, this->codec_);
     avcodec_parameters_from_context(stream->codecpar, this->codec_ctx_);
     stream->time_base = this->codec_ctx_->time_base;
 
-    if (!(stream->codecpar->codec_id == AV_CODEC_ID_HEVC))
-    {
-      fprintf(stderr, "Encoder does not support HEVC\n");
-    }
-
     if (!(stream->codecpar->codec_tag)) 
     {
       avcodec_parameters_from_context(stream->codecpar, this->codec_ctx_);
@@ -159,29 +355,218 @@ void VideoEncoding::initialize_ffmpeg_encoder(bool write_to_file) {
     if (avio_open(&(this->format_ctx_->pb), this->output_file_.c_str(), AVIO_FLAG_WRITE) < 0)
     {
       fprintf(stderr, "Could not open output file\n");
-      exit(1);
+      return false;
     }
 
-    int result = avformat_write_header(this->format_ctx_, NULL);
+    if (avformat_write_header(this->format_ctx_, NULL) < 0)
+    {
+      fprintf(stderr, "Could not write header to %s\n", this->output_file_.c_str());
+      return false;
+    }
+
+    if (this->write_seek_index_)
+    {
+      this->seek_index_ = std::make_unique<KeyframeIndexWriter>(this->output_file_ + ".idx");
+      if (!this->seek_index_->is_open())
+      {
+        this->seek_index_.reset();
+      }
+    }
   }
 
   std::cout << "Encoder " << this->encoder_name_<< " initialized." << std::endl;
+  return true;
+}
+
+int VideoEncoding::get_packet_buffer(AVCodecContext* codec_ctx, AVPacket* pkt, int flags) {
+  VideoEncoding* encoder = (VideoEncoding*)codec_ctx->opaque;
+
+  if (pkt->size + AV_INPUT_BUFFER_PADDING_SIZE > encoder->packet_buffer_size_)
+  {
+    return avcodec_default_get_encode_buffer(codec_ctx, pkt, flags);
+  }
+
+  pkt->buf = av_buffer_pool_get(encoder->packet_pool_);
+  if (!pkt->buf)
+  {
+    return AVERROR(ENOMEM);
+  }
+  pkt->data = pkt->buf->data;
+  memset(pkt->data + pkt->size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+  return 0;
+}
+
+AVFrame* VideoEncoding::get_input_frame() {
+  // Drops the reference to the previous input, the encoder keeps its own
+  av_frame_unref(this->frame_input_);
+
+  this->frame_input_->format = this->codec_ctx_->pix_fmt;
+  this->frame_input_->width = this->width_;
+  this->frame_input_->height = this->height_;
+  this->frame_input_->buf[0] = av_buffer_pool_get(this->input_pool_);
+  if (!this->frame_input_->buf[0])
+  {
+    fprintf(stderr, "Could not allocate encoder input frame\n");
+    exit(1);
+  }
+  av_image_fill_arrays(this->frame_input_->data, this->frame_input_->linesize,
+                       this->frame_input_->buf[0]->data, this->codec_ctx_->pix_fmt,
+                       this->width_, this->height_, FrameArena::kAlignment);
+  return this->frame_input_;
+}
+
+AVFrame* VideoEncoding::allocate_input_frame() {
+  AVFrame* input_frame = av_frame_alloc();
+  if (!input_frame)
+  {
+    fprintf(stderr, "Could not allocate AVFrame for encoder input\n");
+    exit(1);
+  }
+  input_frame->format = this->codec_ctx_->pix_fmt;
+  input_frame->width = this->width_;
+  input_frame->height = this->height_;
+  input_frame->buf[0] = av_buffer_pool_get(this->input_pool_);
+  if (!input_frame->buf[0])
+  {
+    fprintf(stderr, "Could not allocate encoder input frame\n");
+    exit(1);
+  }
+  av_image_fill_arrays(input_frame->data, input_frame->linesize,
+                       input_frame->buf[0]->data, this->codec_ctx_->pix_fmt,
+                       this->width_, this->height_, FrameArena::kAlignment);
+  return input_frame;
+}
+
+void VideoEncoding::encode_input_frame_to_file(const AVFrame* input_frame,
+                                                int64_t frame_count,
+                                                int64_t timestamp_ms) {
+  // A new reference, the encoder keeps the buffer while the caller frees its frame
+  av_frame_unref(this->frame_input_);
+  if (av_frame_ref(this->frame_input_, input_frame) < 0)
+  {
+    fprintf(stderr, "Could not reference encoder input frame\n");
+    return;
+  }
+  encode_input_to_file(this->frame_input_, frame_count, timestamp_ms, nullptr);
+}
+
+AVFrame* VideoEncoding::prepare_input_frame(const cv::Mat* bgra) {
+  AVFrame* input_frame = get_input_frame();
+
+  if (this->codec_ctx_->pix_fmt == AV_PIX_FMT_BGR0)
+  {
+    // Lossless mode codes the BGRA buffer without any colour conversion
+    av_image_copy_plane(input_frame->data[0], input_frame->linesize[0],
+                        bgra->data, bgra->step, bgra->cols * 4, bgra->rows);
+    return input_frame;
+  }
+
+  convert_bgra_to_nv12(bgra, input_frame);
+  return input_frame;
+}
+
+AVFrame* VideoEncoding::wrap_nv12_frame(const AVFrame* nv12) {
+  // The caller keeps converting into its own buffers, so the planes are
+  // copied once into a pooled frame the encoder can hold on to
+  AVFrame* input_frame = get_input_frame();
+  av_image_copy_plane(input_frame->data[0], input_frame->linesize[0],
+                      nv12->data[0], nv12->linesize[0], this->width_, this->height_);
+  av_image_copy_plane(input_frame->data[1], input_frame->linesize[1],
+                      nv12->data[1], nv12->linesize[1], this->width_, this->height_ / 2);
+  return input_frame;
 }
 
 void VideoEncoding::encode_frame_to_file(cv::Mat* frame,
-                                          int64_t frame_count) {
-  convertBGRAtoNV12(frame);
-  
+                                          int64_t frame_count,
+                                          int64_t timestamp_ms,
+                                          const FrameMetadata* metadata) {
+  encode_input_to_file(prepare_input_frame(frame), frame_count, timestamp_ms, metadata);
+}
+
+void VideoEncoding::encode_nv12_to_file(const AVFrame* nv12,
+                                         int64_t frame_count,
+                                         int64_t timestamp_ms,
+                                         const FrameMetadata* metadata) {
+  encode_input_to_file(wrap_nv12_frame(nv12), frame_count, timestamp_ms, metadata);
+}
+
+void VideoEncoding::encode_input_to_file(AVFrame* input_frame,
+                                          int64_t frame_count,
+                                          int64_t timestamp_ms,
+                                          const FrameMetadata* metadata) {
+  if (!apply_motion_map(input_frame))
+  {
+    return;
+  }
+
   // Set the PTS based on the frame count and codec time base
-  this->frame_nv12->pts = frame_count;
+  input_frame->pts = frame_count;
 
-  if (avcodec_send_frame(this->codec_ctx_, this->frame_nv12) < 0)
+  if (this->quality_monitor_)
+  {
+    int64_t bitrate = this->quality_monitor_->get_target_bitrate();
+    if (bitrate != this->codec_ctx_->bit_rate)
+    {
+      set_bitrate(bitrate);
+    }
+    if (this->quality_monitor_->take_keyframe_request())
+    {
+      request_keyframe();
+    }
+  }
+  apply_keyframe_request(input_frame);
+  attach_metadata(input_frame, metadata);
+
+  if (this->quality_monitor_)
+  {
+    this->quality_monitor_->on_frame(input_frame);
+  }
+
+  if (this->seek_index_)
+  {
+    this->pending_timestamps_.emplace_back(frame_count, timestamp_ms);
+  }
+
+  if (avcodec_send_frame(this->codec_ctx_, input_frame) < 0)
   {
     fprintf(stderr, "Error sending frame for encoding\n");
   }
 
+  write_packets_to_file();
+}
+
+void VideoEncoding::write_packets_to_file() {
   while (avcodec_receive_packet(this->codec_ctx_, this->pkt_) == 0)
   {
+    // The warm-up frame, encoders with lookahead return it late
+    if (this->pkt_->pts < 0)
+    {
+      av_packet_unref(this->pkt_);
+      continue;
+    }
+
+    if (this->quality_monitor_)
+    {
+      this->quality_monitor_->on_packet(this->pkt_);
+    }
+
+    if (this->seek_index_)
+    {
+      // Encoder output is in capture order (no B-frames), match it to its timestamp
+      int64_t packet_timestamp = -1;
+      while (!this->pending_timestamps_.empty() &&
+             this->pending_timestamps_.front().first <= this->pkt_->pts)
+      {
+        packet_timestamp = this->pending_timestamps_.front().second;
+        this->pending_timestamps_.pop_front();
+      }
+
+      this->seek_index_->add_entry(this->pkt_->pts,
+                                   packet_timestamp,
+                                   this->pkt_->size,
+                                   this->pkt_->flags & AV_PKT_FLAG_KEY);
+    }
+
     this->pkt_->stream_index = 0;
     this->pkt_->pts = av_rescale_q(this->pkt_->pts, 
                             this->codec_ctx_->time_base, 
@@ -198,9 +583,62 @@ void VideoEncoding::encode_frame_to_file(cv::Mat* frame,
   }
 }
 
+void VideoEncoding::warm_up() {
+  // Encoders allocate surfaces, lookahead buffers and threads lazily on the
+  // first frame. A black frame with a negative pts takes that cost before
+  // capture starts, its packet is never written.
+  AVFrame* input_frame = get_input_frame();
+  if (input_frame->format == AV_PIX_FMT_NV12)
+  {
+    memset(input_frame->data[0], 16, (size_t)input_frame->linesize[0] * this->height_);
+    memset(input_frame->data[1], 128, (size_t)input_frame->linesize[1] * this->height_ / 2);
+  }
+  else
+  {
+    memset(input_frame->data[0], 0, (size_t)input_frame->linesize[0] * this->height_);
+  }
+  input_frame->pts = -1;
+  input_frame->pict_type = AV_PICTURE_TYPE_I;
+
+  if (avcodec_send_frame(this->codec_ctx_, input_frame) < 0)
+  {
+    fprintf(stderr, "Error sending warm-up frame\n");
+  }
+  while (avcodec_receive_packet(this->codec_ctx_, this->pkt_) == 0)
+  {
+    av_packet_unref(this->pkt_);
+  }
+
+  // The recording must not start with a frame that refers to the black one
+  request_keyframe();
+}
+
+void VideoEncoding::finish_file() {
+  if (!this->open_ || !this->format_ctx_ || this->file_finished_)
+  {
+    return;
+  }
+  this->file_finished_ = true;
+
+  // Hardware encoders keep several frames in flight, a NULL frame makes
+  // them return everything still queued
+  if (avcodec_send_frame(this->codec_ctx_, NULL) < 0)
+  {
+    fprintf(stderr, "Error flushing encoder\n");
+  }
+  write_packets_to_file();
+
+  av_write_trailer(this->format_ctx_);
+  avio_closep(&this->format_ctx_->pb);
+}
+
 void VideoEncoding::convertBGRAtoNV12(const cv::Mat* bgra) {
+  convert_bgra_to_nv12(bgra, this->frame_nv12);
+}
+
+void VideoEncoding::convert_bgra_to_nv12(const cv::Mat* bgra, AVFrame* nv12) {
   // Ensure the input format is NV12
-  if (this->frame_nv12->format != AV_PIX_FMT_NV12)
+  if (nv12->format != AV_PIX_FMT_NV12)
   {
     std::cerr << "Invalid format. Expected NV12!" << std::endl;
     return;
@@ -208,9 +646,9 @@ void VideoEncoding::convertBGRAtoNV12(const cv::Mat* bgra) {
 
   int ret = libyuv::ARGBToNV12(
     bgra->data, bgra->step,                // Input BGRA buffer and its stride
-    this->frame_nv12->data[0], this->frame_nv12->linesize[0],  // Y plane and its stride
-    this->frame_nv12->data[1], this->frame_nv12->linesize[1],  // Interleaved UV plane and its stride
-    bgra->cols, bgra->rows                         // Image dimensions
+    nv12->data[0], nv12->linesize[0],      // Y plane and its stride
+    nv12->data[1], nv12->linesize[1],      // Interleaved UV plane and its stride
+    bgra->cols, bgra->rows                 // Image dimensions
   );
 
   if (ret != 0)
@@ -219,34 +657,206 @@ void VideoEncoding::convertBGRAtoNV12(const cv::Mat* bgra) {
   }
 }
 
-void VideoEncoding::encode_frame_to_stream(cv::Mat* frame, int64_t frame_count) {
-  convertBGRAtoNV12(frame);
+void VideoEncoding::encode_frame_to_stream(cv::Mat* frame, int64_t frame_count, const FrameMetadata* metadata) {
+  encode_input_to_stream(prepare_input_frame(frame), frame_count, metadata);
+}
+
+void VideoEncoding::encode_nv12_to_stream(const AVFrame* nv12, int64_t frame_count, const FrameMetadata* metadata) {
+  encode_input_to_stream(wrap_nv12_frame(nv12), frame_count, metadata);
+}
+
+void VideoEncoding::encode_input_to_stream(AVFrame* input_frame,
+                                            int64_t frame_count,
+                                            const FrameMetadata* metadata) {
+  if (this->stream_closed_)
+  {
+    return;
+  }
+  poll_control_messages();
+
+  if (this->rate_controller_)
+  {
+    RateDecision decision = this->rate_controller_->on_frame(frame_count);
+    if (decision.bitrate != this->codec_ctx_->bit_rate)
+    {
+      set_bitrate(decision.bitrate);
+    }
+    if (decision.drop_frame)
+    {
+      return;
+    }
+  }
+
+  if (!apply_motion_map(input_frame))
+  {
+    return;
+  }
 
-  this->frame_nv12->pts = frame_count;
+  input_frame->pts = frame_count;
+  apply_keyframe_request(input_frame);
+  attach_metadata(input_frame, metadata);
 
-  if (avcodec_send_frame(this->codec_ctx_, this->frame_nv12) < 0) 
+  if (avcodec_send_frame(this->codec_ctx_, input_frame) < 0) 
   {
     fprintf(stderr, "Error sending frame for encoding\n");
   }
 
-  if (avcodec_receive_packet(this->codec_ctx_, this->pkt_) != 0)
+  int result = avcodec_receive_packet(this->codec_ctx_, this->pkt_);
+  if (result == AVERROR(EAGAIN))
+  {
+    // Encoder is still buffering, nothing to send for this frame
+    return;
+  }
+  else if (result != 0)
   {
     fprintf(stderr, "Error receiving packet\n");
+    return;
   }
 
-  // Send packet size
-  if (send_all(this->socket_, &(this->pkt_->size), sizeof(int)) < 0) {
-    fprintf(stderr, "Error sending complete packet size\n");
+  // Size, then data. After a failed send the receiver is gone or out of
+  // step, so the session stops instead of failing on every frame.
+  if (send_all(this->socket_, &(this->pkt_->size), sizeof(int)) < 0 ||
+      send_all(this->socket_, this->pkt_->data, this->pkt_->size) < 0)
+  {
+    fprintf(stderr, "Stream session %d: receiver gone, stopping the stream\n", this->session_idx_);
+    this->stream_closed_ = true;
+    av_packet_unref(this->pkt_);
+    return;
   }
 
-  // Send packet data
-  if (send_all(this->socket_, this->pkt_->data, this->pkt_->size) < 0) {
-    fprintf(stderr, "Error sending packet data\n");
+  if (this->rate_controller_)
+  {
+    this->rate_controller_->on_packet_sent(this->packets_sent_, this->pkt_->size);
   }
+  this->packets_sent_++;
 
   av_packet_unref(this->pkt_);
 }
 
+void VideoEncoding::request_keyframe() {
+  this->keyframe_requested_ = true;
+}
+
+void VideoEncoding::set_bitrate(int64_t bitrate) {
+  // NVENC and libx264 reconfigure rate control when bit_rate changes between frames
+  this->codec_ctx_->bit_rate = bitrate;
+  if (this->codec_ctx_->rc_max_rate > 0)
+  {
+    this->codec_ctx_->rc_max_rate = bitrate;
+  }
+
+  // Changes from the control channel become the monitor's starting point
+  if (this->quality_monitor_)
+  {
+    this->quality_monitor_->set_bitrate(bitrate);
+  }
+}
+
+bool VideoEncoding::supports_live_bitrate() {
+  return !this->lossless_ &&
+         (this->encoder_name_ == "libx264" || this->encoder_name_.find("_nvenc") != std::string::npos);
+}
+
+int64_t VideoEncoding::get_bitrate() {
+  return this->codec_ctx_->bit_rate;
+}
+
+bool VideoEncoding::apply_motion_map(AVFrame* input_frame) {
+  if (!this->motion_map_ || input_frame->format != AV_PIX_FMT_NV12)
+  {
+    return true;
+  }
+
+  this->motion_map_->analyze(input_frame);
+
+  // A pending keyframe request always gets encoded
+  if (!this->keyframe_requested_ && this->motion_map_->should_skip())
+  {
+    return false;
+  }
+
+  this->motion_map_->apply_roi(input_frame);
+  this->motion_map_->commit(input_frame);
+  return true;
+}
+
+void VideoEncoding::apply_keyframe_request(AVFrame* input_frame) {
+  if (this->keyframe_requested_.exchange(false))
+  {
+    input_frame->pict_type = AV_PICTURE_TYPE_I;
+    std::cout << "Forcing keyframe at frame " << input_frame->pts << std::endl;
+  }
+  else
+  {
+    input_frame->pict_type = AV_PICTURE_TYPE_NONE;
+  }
+}
+
+void VideoEncoding::attach_metadata(AVFrame* input_frame, const FrameMetadata* metadata) {
+  if (!this->embed_metadata_)
+  {
+    return;
+  }
+  // Input frames are reused, drop the payload of the last frame
+  av_frame_remove_side_data(input_frame, AV_FRAME_DATA_SEI_UNREGISTERED);
+  if (!metadata)
+  {
+    return;
+  }
+
+  AVBufferRef* payload = av_buffer_pool_get(this->metadata_pool_);
+  if (!payload)
+  {
+    return;
+  }
+  write_frame_metadata(*metadata, payload->data);
+  // libx264, libx265 and NVENC write it as a user data unregistered SEI
+  if (!av_frame_new_side_data_from_buf(input_frame, AV_FRAME_DATA_SEI_UNREGISTERED, payload))
+  {
+    av_buffer_unref(&payload);
+  }
+}
+
+void VideoEncoding::poll_control_messages() {
+  if (this->socket_ < 0)
+  {
+    return;
+  }
+
+  // Never block the encoder waiting for the receiver
+  uint8_t buffer[256];
+  ssize_t received;
+  while ((received = recv(this->socket_, buffer, sizeof(buffer), MSG_DONTWAIT)) > 0)
+  {
+    this->control_buffer_.insert(this->control_buffer_.end(), buffer, buffer + received);
+  }
+  if (received == 0)
+  {
+    fprintf(stderr, "Stream session %d: receiver disconnected, stopping the stream\n", this->session_idx_);
+    this->stream_closed_ = true;
+    return;
+  }
+
+  size_t num_messages = this->control_buffer_.size() / sizeof(ControlMessage);
+  for (size_t i = 0; i < num_messages; i++)
+  {
+    ControlMessage message;
+    memcpy(&message, this->control_buffer_.data() + i * sizeof(ControlMessage), sizeof(message));
+
+    if (message.type == CONTROL_KEYFRAME_REQUEST)
+    {
+      std::cout << "Receiver requested keyframe after frame " << message.frame_count << std::endl;
+      request_keyframe();
+    }
+    else if (message.type == CONTROL_FRAME_ACK && this->rate_controller_)
+    {
+      this->rate_controller_->on_ack(message.frame_count);
+    }
+  }
+  this->control_buffer_.erase(this->control_buffer_.begin(),
+                              this->control_buffer_.begin() + num_messages * sizeof(ControlMessage));
+}
+
 AVCodecContext* VideoEncoding::get_codec_ctx() {
   return this->codec_ctx_;
 }
@@ -262,3 +872,19 @@ int VideoEncoding::get_width() {
 int VideoEncoding::get_height() {
   return this->height_;
 }
+
+const std::string& VideoEncoding::get_output_file() {
+  return this->output_file_;
+}
+
+bool VideoEncoding::is_stream_closed() {
+  return this->stream_closed_;
+}
+
+bool VideoEncoding::is_lossless() {
+  return this->lossless_;
+}
+
+bool VideoEncoding::embeds_metadata() {
+  return this->embed_metadata_;
+}